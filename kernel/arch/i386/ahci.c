@@ -4,15 +4,24 @@
 
 #include <kernel/display.h>
 #include <kernel/interrupt.h>
+#include <kernel/timer.h>
+#include <kernel/vir_mem.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "dma.h"
 #include "irq.h"
+#include "lapic.h"
 #include "mmio.h"
 #include "pci.h"
+#include "port.h"
 
 MODULE("AHCI");
 
+#define AHCI_CAP_NCS_SHIFT 8
+#define AHCI_CAP_NCS_MASK 0x1Fu
+#define AHCI_CAP_SNCQ (1u << 30)
+
 #define AHCI_GHC_HR (1u << 0)
 #define AHCI_GHC_IE (1u << 1)
 #define AHCI_GHC_AE (1u << 31)
@@ -31,31 +40,84 @@ MODULE("AHCI");
 #define AHCI_PORT_SSTS_IPM_MASK 0x0F00
 #define AHCI_PORT_SSTS_IPM_ACTIVE 0x0100
 
+#define AHCI_PORT_SCTL_DET_MASK 0x0Fu
+#define AHCI_PORT_SCTL_DET_INIT 0x01u
+
 #define AHCI_PORT_IRQ_TFES (1u << 30)
 
+#define AHCI_IDENTIFY_QUEUE_DEPTH 75
+#define AHCI_IDENTIFY_SATA_CAP 76
+#define AHCI_IDENTIFY_SATA_CAP_NCQ (1u << 8)
+
+// NCQ Command Error log, its first byte holds the tag of the failed command
+#define AHCI_LOG_NCQ_ERROR 0x10
+#define AHCI_LOG_NCQ_ERROR_NQ (1u << 7)
+#define AHCI_LOG_NCQ_ERROR_TAG_MASK 0x1Fu
+
+// Recovery runs from the interrupt handler, nothing there may wait forever
+#define AHCI_RECOVER_SPIN_LIMIT 10000000u
+// COMRESET holds DET at 1 for at least 1 ms, an io_wait takes about 1 us
+#define AHCI_COMRESET_IO_WAITS 2000u
+// A request still outstanding after this many polls, or about 5 s of PIT
+// ticks, is aborted
+#define AHCI_WAIT_SPIN_LIMIT 10000000u
+#define AHCI_WAIT_TIMEOUT_TICKS 91u
+
 #define AHCI_PRDT_MAX_BYTES (4u * 1024u * 1024u)
 #define AHCI_MMIO_WINDOW (0x2000u)
 
+// Two pages per command table leave room for 504 PRDT entries, enough to
+// scatter a 2 MiB transfer over unrelated physical pages
+#define AHCI_CMD_TABLE_SIZE (2u * PAGE_SIZE)
+#define AHCI_PRDT_MAX_ENTRIES ((AHCI_CMD_TABLE_SIZE - offsetof(struct hba_cmd_table, prdt_entry)) / sizeof(struct hba_prdt_entry))
+
+#define AHCI_SECTOR_SIZE 512u
+#define AHCI_MAX_LBA (1ull << 48)
+// Bounce buffers are physically contiguous, keep them small
+#define AHCI_MAX_BOUNCE_SECTORS 2048u
+
+struct ahci_slot {
+	struct ahci_request *req;
+	// Freed from process context, the IRQ handler only copies out of it
+	struct dma_buffer bounce;
+};
+
+struct ahci_controller;
+
 struct ahci_port_state {
 	bool active;
-	uint8_t port_index;
+	uint8_t port_index; // global index
+	struct ahci_controller *controller;
 	volatile struct hba_port *port;
 	struct dma_buffer cmd_list;
 	struct dma_buffer fis;
 	struct dma_buffer cmd_tables[AHCI_CMD_SLOT_COUNT];
-	volatile bool irq_fired;
+	struct ahci_slot slots[AHCI_CMD_SLOT_COUNT];
+	volatile uint32_t outstanding; // slots handed to the HBA and not completed yet
+	uint32_t slot_mask;	       // usable slots, the submission path never reads sact/ci
+	uint32_t bounce_slots;	       // slots still holding a bounce buffer
+	uint8_t queue_depth;	       // usable slots
+	bool ncq;
+	struct dma_buffer ncq_log;     // NCQ error log page, allocated up front for the interrupt handler
 };
 
-static struct {
+struct ahci_controller {
 	bool present;
+	uint8_t index;
 	struct pci_device pci;
 	struct mmio_region mmio;
 	volatile struct hba_mem *hba;
 	struct ahci_port_state ports[AHCI_MAX_PORTS];
 	uint8_t irq_line;
-} ahci_state;
+	uint8_t msi_vector; // 0 while on the legacy line
+	bool irq_registered;
+};
+
+static struct ahci_controller ahci_controllers[AHCI_MAX_HBAS];
+static size_t ahci_controller_count = 0;
 
 bool is_ahci_probed = false;
+bool ahci_zero_copy = true;
 
 static void ahci_port_stop(volatile struct hba_port *port)
 {
@@ -80,14 +142,16 @@ static bool ahci_port_present(volatile struct hba_port *port)
 	return det == AHCI_PORT_SSTS_DET_PRESENT && ipm == AHCI_PORT_SSTS_IPM_ACTIVE;
 }
 
-static int ahci_find_free_slot(volatile struct hba_port *port)
+// A slot only leaves outstanding once both sact and ci dropped it, so the
+// software bitmap alone tells which slots are free
+static int ahci_find_free_slot(struct ahci_port_state *state)
 {
-	uint32_t slots = port->sact | port->ci;
-	for (int i = 0; i < AHCI_CMD_SLOT_COUNT; i++) {
-		if ((slots & (1u << i)) == 0)
-			return i;
-	}
-	return -1;
+	uint32_t free = state->slot_mask & ~state->outstanding;
+	if (free == 0)
+		return -1;
+
+	// Compiles down to a single bsf
+	return __builtin_ctz(free);
 }
 
 static bool ahci_port_rebase(struct ahci_port_state *state)
@@ -111,11 +175,11 @@ static bool ahci_port_rebase(struct ahci_port_state *state)
 
 	struct hba_cmd_header *cmd_header = (struct hba_cmd_header *)state->cmd_list.virt;
 	for (int i = 0; i < AHCI_CMD_SLOT_COUNT; i++) {
-		state->cmd_tables[i] = dma_alloc(4096);
+		state->cmd_tables[i] = dma_alloc(AHCI_CMD_TABLE_SIZE);
 		if (state->cmd_tables[i].virt == nullptr)
 			return false;
 
-		memset(state->cmd_tables[i].virt, 0, 4096);
+		memset(state->cmd_tables[i].virt, 0, AHCI_CMD_TABLE_SIZE);
 		cmd_header[i].cfl = sizeof(struct fis_reg_h2d) / 4;
 		cmd_header[i].prdtl = 0;
 		cmd_header[i].ctba = (uint32_t)(uintptr_t)state->cmd_tables[i].phys.ptr;
@@ -129,88 +193,455 @@ static bool ahci_port_rebase(struct ahci_port_state *state)
 	return true;
 }
 
-static void ahci_irq_handler(uint8_t irq_line, void *context)
+/**
+ * Fill the PRDT straight from a kernel buffer, one page at a time through
+ * vmm_phy_addr, merging physically contiguous pages into entries of up to
+ * 4 MiB. Stops early at an unmapped page or when the table is full, and
+ * trims what it covered to whole sectors, stored back in byte_count.
+ * Returns the entry count, 0 when not even one sector could be mapped.
+ **/
+static uint32_t ahci_build_prdt(struct hba_cmd_table *cmd_table, const void *buffer, size_t *byte_count)
+{
+	if ((uintptr_t)buffer & 1)
+		return 0;
+
+	const uint8_t *virt = buffer;
+	size_t remaining = *byte_count;
+	uint32_t entries = 0;
+
+	while (remaining > 0) {
+		size_t page_left = PAGE_SIZE - ((uintptr_t)virt & (PAGE_SIZE - 1));
+		size_t chunk = remaining < page_left ? remaining : page_left;
+
+		uintptr_t phys = (uintptr_t)vmm_phy_addr(virt);
+		if (phys == 0)
+			break;
+
+		struct hba_prdt_entry *last = entries > 0 ? &cmd_table->prdt_entry[entries - 1] : nullptr;
+		if (last != nullptr && last->dba + last->dbc + 1 == phys && last->dbc + 1 + chunk <= AHCI_PRDT_MAX_BYTES) {
+			last->dbc += chunk;
+		} else {
+			if (entries == AHCI_PRDT_MAX_ENTRIES)
+				break;
+
+			cmd_table->prdt_entry[entries++] = (struct hba_prdt_entry){
+				.dba = (uint32_t)phys,
+				.dbau = 0,
+				.dbc = chunk - 1,
+			};
+		}
+
+		virt += chunk;
+		remaining -= chunk;
+	}
+
+	// Drop the tail of a sector the table could not finish
+	size_t covered = *byte_count - remaining;
+	size_t excess = covered % AHCI_SECTOR_SIZE;
+	covered -= excess;
+	while (excess > 0) {
+		struct hba_prdt_entry *last = &cmd_table->prdt_entry[entries - 1];
+		size_t len = last->dbc + 1;
+		if (len > excess) {
+			last->dbc -= excess;
+			excess = 0;
+		} else {
+			excess -= len;
+			entries--;
+		}
+	}
+
+	if (entries == 0)
+		return 0;
+
+	cmd_table->prdt_entry[entries - 1].i = 1;
+	*byte_count = covered;
+	return entries;
+}
+
+static void ahci_finish_slot(struct ahci_port_state *state, uint8_t slot, bool ok)
+{
+	struct ahci_slot *entry = &state->slots[slot];
+	struct ahci_request *req = entry->req;
+
+	state->outstanding &= ~(1u << slot);
+	entry->req = nullptr;
+	if (req == nullptr)
+		return;
+
+	if (ok && !req->write && entry->bounce.virt != nullptr)
+		memcpy(req->buffer, entry->bounce.virt, (size_t)req->sector_count * 512u);
+
+	req->ok = ok;
+	req->done = true;
+	if (req->done_cb != nullptr)
+		req->done_cb(req, req->ctx);
+}
+
+/**
+ * Fill the per slot parts of every command that never change: the header
+ * FIS length and the constant FIS fields, plus the queue tag with NCQ.
+ * ahci_start then only patches the LBA, count, command and PRDT.
+ **/
+static void ahci_init_cmd_template(struct ahci_port_state *state, uint8_t slot)
+{
+	struct hba_cmd_header *cmd_header = (struct hba_cmd_header *)state->cmd_list.virt;
+	cmd_header[slot].cfl = sizeof(struct fis_reg_h2d) / 4;
+
+	struct hba_cmd_table *cmd_table = (struct hba_cmd_table *)state->cmd_tables[slot].virt;
+	memset(cmd_table, 0, offsetof(struct hba_cmd_table, prdt_entry));
+	*(struct fis_reg_h2d *)cmd_table->cfis = (struct fis_reg_h2d){
+		.fis_type = AHCI_FIS_TYPE_REG_H2D,
+		.c = 1,
+		.device = 1 << 6,
+		.countl = state->ncq ? (uint8_t)(slot << 3) : 0,
+	};
+}
+
+// Issue the command built in slot and poll for it, bounded by AHCI_RECOVER_SPIN_LIMIT
+static bool ahci_exec_polled(struct ahci_port_state *state, uint8_t slot)
+{
+	volatile struct hba_port *port = state->port;
+	port->is = 0xFFFFFFFFu;
+	port->ci = 1u << slot;
+
+	bool done = false;
+	for (uint32_t spin = 0; spin < AHCI_RECOVER_SPIN_LIMIT && !done; spin++) {
+		if (port->is & AHCI_PORT_IRQ_TFES)
+			break;
+		done = (port->ci & (1u << slot)) == 0;
+	}
+
+	bool ok = done && (port->is & AHCI_PORT_IRQ_TFES) == 0;
+	port->is = 0xFFFFFFFFu;
+	return ok;
+}
+
+/**
+ * READ LOG EXT of the NCQ error log on a non-queued slot. The device
+ * refuses queued commands after an error until the log was read. Sets
+ * out_tag to the slot of the failed command, -1 when the log blames a
+ * non-queued one. The slot gets its template back, whatever it held is lost.
+ **/
+static bool ahci_read_ncq_log(struct ahci_port_state *state, uint8_t slot, int *out_tag)
+{
+	if (state->ncq_log.virt == nullptr)
+		return false;
+
+	struct hba_cmd_table *cmd_table = (struct hba_cmd_table *)state->cmd_tables[slot].virt;
+	memset(cmd_table, 0, offsetof(struct hba_cmd_table, prdt_entry));
+
+	struct hba_cmd_header *header = &((struct hba_cmd_header *)state->cmd_list.virt)[slot];
+	header->cfl = sizeof(struct fis_reg_h2d) / 4;
+	header->w = 0;
+	size_t log_bytes = AHCI_SECTOR_SIZE;
+	header->prdtl = ahci_build_prdt(cmd_table, state->ncq_log.virt, &log_bytes);
+	header->prdbc = 0;
+
+	struct fis_reg_h2d *fis = (struct fis_reg_h2d *)cmd_table->cfis;
+	*fis = (struct fis_reg_h2d){
+		.fis_type = AHCI_FIS_TYPE_REG_H2D,
+		.c = 1,
+		.command = AHCI_CMD_READ_LOG_EXT,
+		.lba0 = AHCI_LOG_NCQ_ERROR,
+		.countl = 1,
+	};
+
+	bool ok = header->prdtl > 0 && ahci_exec_polled(state, slot);
+	ahci_init_cmd_template(state, slot);
+	if (!ok)
+		return false;
+
+	const uint8_t first = ((const uint8_t *)state->ncq_log.virt)[0];
+	*out_tag = (first & AHCI_LOG_NCQ_ERROR_NQ) ? -1 : (int)(first & AHCI_LOG_NCQ_ERROR_TAG_MASK);
+	return true;
+}
+
+// Reset the link, the device drops every queued command and its error state
+static bool ahci_port_comreset(volatile struct hba_port *port)
+{
+	ahci_port_stop(port);
+	port->sctl = (port->sctl & ~AHCI_PORT_SCTL_DET_MASK) | AHCI_PORT_SCTL_DET_INIT;
+	for (uint32_t i = 0; i < AHCI_COMRESET_IO_WAITS; i++)
+		io_wait();
+	port->sctl &= ~AHCI_PORT_SCTL_DET_MASK;
+
+	bool present = false;
+	for (uint32_t spin = 0; spin < AHCI_RECOVER_SPIN_LIMIT && !present; spin++)
+		present = (port->ssts & AHCI_PORT_SSTS_DET_MASK) == AHCI_PORT_SSTS_DET_PRESENT;
+	// The device reports its signature with BSY set, ST must wait for it
+	for (uint32_t spin = 0; spin < AHCI_RECOVER_SPIN_LIMIT && present; spin++) {
+		if ((port->tfd & (AHCI_PORT_TFD_BSY | AHCI_PORT_TFD_DRQ)) == 0)
+			break;
+	}
+
+	port->serr = port->serr;
+	port->is = 0xFFFFFFFFu;
+	ahci_port_start(port);
+	return present && (port->tfd & (AHCI_PORT_TFD_BSY | AHCI_PORT_TFD_DRQ)) == 0;
+}
+
+/**
+ * A task file error aborts every command in flight. Without NCQ they all
+ * fail. With NCQ the error log names the one that failed, it fails and
+ * the others are issued again. When the log cannot be read the link is
+ * reset and every outstanding command fails.
+ **/
+static void ahci_port_recover(struct ahci_port_state *state)
+{
+	volatile struct hba_port *port = state->port;
+
+	ahci_port_stop(port);
+	port->serr = port->serr;
+	port->is = 0xFFFFFFFFu;
+	ahci_port_start(port);
+
+	uint32_t failed = state->outstanding;
+	uint32_t retry = 0;
+	if (state->ncq && failed != 0) {
+		// A free slot if there is one, otherwise an outstanding one is given up for the log
+		const uint32_t free = state->slot_mask & ~state->outstanding;
+		const uint8_t log_slot = (uint8_t)__builtin_ctz(free != 0 ? free : state->outstanding);
+
+		int tag = -1;
+		if (ahci_read_ncq_log(state, log_slot, &tag)) {
+			if (tag >= 0 && (failed & (1u << tag)))
+				retry = failed & ~(1u << tag) & ~(1u << log_slot);
+		} else {
+			mprint("port %u: NCQ error log unreadable, resetting the link\n", state->port_index);
+			if (!ahci_port_comreset(port))
+				mprint("port %u: COMRESET failed\n", state->port_index);
+		}
+	}
+
+	failed &= ~retry;
+	while (failed != 0) {
+		uint8_t slot = (uint8_t)__builtin_ctz(failed);
+		failed &= failed - 1;
+		ahci_finish_slot(state, slot, false);
+	}
+
+	if (retry != 0) {
+		struct hba_cmd_header *cmd_header = (struct hba_cmd_header *)state->cmd_list.virt;
+		for (uint32_t left = retry; left != 0; left &= left - 1)
+			cmd_header[__builtin_ctz(left)].prdbc = 0;
+		port->sact = retry;
+		port->ci = retry;
+	}
+}
+
+/**
+ * Reap the finished commands of a port. A slot is done once the HBA
+ * cleared its ci bit and, for queued commands, the device cleared its
+ * sact bit. Must run with interrupts disabled.
+ **/
+static void ahci_port_complete(struct ahci_port_state *state)
+{
+	volatile struct hba_port *port = state->port;
+	uint32_t is = port->is;
+	port->is = is;
+
+	uint32_t done = state->outstanding & ~(port->sact | port->ci);
+	while (done != 0) {
+		uint8_t slot = (uint8_t)__builtin_ctz(done);
+		done &= done - 1;
+		ahci_finish_slot(state, slot, true);
+	}
+
+	if (is & AHCI_PORT_IRQ_TFES)
+		ahci_port_recover(state);
+}
+
+// Drop the bounce buffers of completed slots, process context only
+static void ahci_release_bounces(struct ahci_port_state *state)
+{
+	uint32_t done = state->bounce_slots & ~state->outstanding;
+	state->bounce_slots &= ~done;
+	while (done != 0) {
+		uint8_t slot = (uint8_t)__builtin_ctz(done);
+		done &= done - 1;
+		dma_free(&state->slots[slot].bounce);
+	}
+}
+
+// Runs for the legacy line or the controller's MSI vector, irq is either
+static void ahci_irq_handler(uint8_t irq, void *context)
 {
-	(void)irq_line;
-	struct hba_mem *hba = context;
-	if (hba == nullptr)
+	(void)irq;
+	struct ahci_controller *controller = context;
+	if (controller == nullptr || controller->hba == nullptr)
 		return;
 
+	volatile struct hba_mem *hba = controller->hba;
 	uint32_t is = hba->is;
 	if (is == 0)
 		return;
 
-	for (uint8_t i = 0; i < AHCI_MAX_PORTS; i++) {
-		if ((is & (1u << i)) == 0)
-			continue;
-
-		struct ahci_port_state *state = &ahci_state.ports[i];
-		if (!state->active)
-			continue;
+	uint32_t pending = is;
+	while (pending != 0) {
+		uint8_t i = (uint8_t)__builtin_ctz(pending);
+		pending &= pending - 1;
 
-		volatile struct hba_port *port = state->port;
-		port->is = port->is;
-		state->irq_fired = true;
+		struct ahci_port_state *state = &controller->ports[i];
+		if (state->active)
+			ahci_port_complete(state);
 	}
 
 	hba->is = is;
 }
 
-bool ahci_probe(void)
+// IDENTIFY DEVICE on slot 0, polled, only used while the port is idle
+static bool ahci_identify(struct ahci_port_state *state, uint16_t *identify)
 {
-	struct pci_device dev = { 0 };
-	if (!pci_find_class(PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_SATA, PCI_PROG_IF_AHCI, &dev))
+	struct dma_buffer data = dma_alloc(512);
+	if (data.virt == nullptr)
 		return false;
 
-	ahci_state.present = true;
-	ahci_state.pci = dev;
-	ahci_state.irq_line = dev.irq_line;
-	return true;
+	struct hba_cmd_table *cmd_table = (struct hba_cmd_table *)state->cmd_tables[0].virt;
+	memset(cmd_table, 0, offsetof(struct hba_cmd_table, prdt_entry));
+
+	struct hba_cmd_header *header = &((struct hba_cmd_header *)state->cmd_list.virt)[0];
+	header->cfl = sizeof(struct fis_reg_h2d) / 4;
+	header->w = 0;
+	size_t identify_bytes = 512;
+	header->prdtl = ahci_build_prdt(cmd_table, data.virt, &identify_bytes);
+	header->prdbc = 0;
+
+	struct fis_reg_h2d *fis = (struct fis_reg_h2d *)cmd_table->cfis;
+	*fis = (struct fis_reg_h2d){
+		.fis_type = AHCI_FIS_TYPE_REG_H2D,
+		.c = 1,
+		.command = AHCI_CMD_IDENTIFY,
+	};
+
+	volatile struct hba_port *port = state->port;
+	port->is = 0xFFFFFFFFu;
+	port->ci = 1u;
+	while ((port->ci & 1u) && (port->is & AHCI_PORT_IRQ_TFES) == 0)
+		;
+
+	bool ok = (port->is & AHCI_PORT_IRQ_TFES) == 0;
+	port->is = 0xFFFFFFFFu;
+	if (ok)
+		memcpy(identify, data.virt, 512);
+
+	dma_free(&data);
+	return ok;
 }
 
-void ahci_init(void)
+// Every slot gets its template, only the first queue_depth are handed out
+static void ahci_init_cmd_templates(struct ahci_port_state *state)
+{
+	for (uint8_t slot = 0; slot < AHCI_CMD_SLOT_COUNT; slot++)
+		ahci_init_cmd_template(state, slot);
+
+	state->slot_mask = state->queue_depth >= 32 ? 0xFFFFFFFFu : (1u << state->queue_depth) - 1;
+}
+
+// Queue commands with NCQ when both the HBA and the drive support it
+static void ahci_port_setup_ncq(struct ahci_port_state *state, bool hba_ncq)
 {
-	if (!is_ahci_probed)
-		ahci_probe();
+	uint16_t identify[256] = { 0 };
+	if (!hba_ncq || !ahci_identify(state, identify))
+		return;
 
-	if (!ahci_state.present)
+	if ((identify[AHCI_IDENTIFY_SATA_CAP] & AHCI_IDENTIFY_SATA_CAP_NCQ) == 0)
 		return;
 
-	uint32_t bar5 = ahci_state.pci.bar[5] & ~0xFu;
+	const uint8_t drive_depth = (uint8_t)((identify[AHCI_IDENTIFY_QUEUE_DEPTH] & 0x1F) + 1);
+	// Without it a queued command error can only be recovered with a COMRESET
+	state->ncq_log = dma_alloc(AHCI_SECTOR_SIZE);
+	state->ncq = true;
+	if (drive_depth < state->queue_depth)
+		state->queue_depth = drive_depth;
+}
+
+bool ahci_probe(void)
+{
+	if (is_ahci_probed)
+		return ahci_controller_count > 0;
+
+	struct pci_device devs[AHCI_MAX_HBAS] = { 0 };
+	ahci_controller_count = pci_find_class_all(PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_SATA, PCI_PROG_IF_AHCI, devs, AHCI_MAX_HBAS);
+	for (size_t i = 0; i < ahci_controller_count; i++) {
+		ahci_controllers[i] = (struct ahci_controller){
+			.present = true,
+			.index = (uint8_t)i,
+			.pci = devs[i],
+			.irq_line = devs[i].irq_line,
+		};
+	}
+
+	is_ahci_probed = true;
+	return ahci_controller_count > 0;
+}
+
+/**
+ * Prefer a dedicated MSI vector aimed at the current CPU, it skips the
+ * IOAPIC and the shared line walk. MSI writes go to the LAPIC, until
+ * lapic_enable() ran they are dropped and the controller stays on its
+ * legacy line.
+ **/
+static void ahci_setup_irq(struct ahci_controller *controller)
+{
+	if (lapic_enabled() && pci_has_msi(&controller->pci)) {
+		uint8_t vector = irq_alloc_msi_vector(ahci_irq_handler, controller);
+		if (vector != 0 && pci_enable_msi(&controller->pci, vector, lapic_get_id())) {
+			controller->msi_vector = vector;
+			controller->irq_registered = true;
+			mprint("HBA %u on MSI vector %u\n", controller->index, vector);
+			return;
+		}
+		irq_free_msi_vector(vector);
+	}
+
+	if (controller->irq_line < 16)
+		controller->irq_registered = irq_register_handler(controller->irq_line, ahci_irq_handler, controller);
+}
+
+static void ahci_init_controller(struct ahci_controller *controller)
+{
+	uint32_t bar5 = controller->pci.bar[5] & ~0xFu;
 	if (bar5 == 0)
 		return;
 
-	pci_enable_bus_mastering(&ahci_state.pci);
+	pci_enable_bus_mastering(&controller->pci);
 
-	ahci_state.mmio = mmio_map(bar5, AHCI_MMIO_WINDOW);
-	if (ahci_state.mmio.virt == nullptr)
+	controller->mmio = mmio_map(bar5, AHCI_MMIO_WINDOW);
+	if (controller->mmio.virt == nullptr)
 		return;
 
-	ahci_state.hba = (volatile struct hba_mem *)ahci_state.mmio.virt;
+	volatile struct hba_mem *hba = (volatile struct hba_mem *)controller->mmio.virt;
+	controller->hba = hba;
 
-	ahci_state.hba->ghc |= AHCI_GHC_HR;
-	while (ahci_state.hba->ghc & AHCI_GHC_HR)
+	hba->ghc |= AHCI_GHC_HR;
+	while (hba->ghc & AHCI_GHC_HR)
 		;
 
-	ahci_state.hba->ghc |= AHCI_GHC_AE;
-	ahci_state.hba->ghc |= AHCI_GHC_IE;
-	ahci_state.hba->is = 0xFFFFFFFFu;
+	hba->ghc |= AHCI_GHC_AE;
+	hba->ghc |= AHCI_GHC_IE;
+	hba->is = 0xFFFFFFFFu;
+
+	const uint32_t cap = hba->cap;
+	const uint8_t hba_slots = (uint8_t)(((cap >> AHCI_CAP_NCS_SHIFT) & AHCI_CAP_NCS_MASK) + 1);
+	const bool hba_ncq = (cap & AHCI_CAP_SNCQ) != 0;
 
-	uint32_t implemented = ahci_state.hba->pi;
+	uint32_t implemented = hba->pi;
 	for (uint8_t i = 0; i < AHCI_MAX_PORTS; i++) {
 		if ((implemented & (1u << i)) == 0)
 			continue;
 
-		volatile struct hba_port *port = &ahci_state.hba->ports[i];
+		volatile struct hba_port *port = &hba->ports[i];
 		if (!ahci_port_present(port))
 			continue;
 
-		struct ahci_port_state *state = &ahci_state.ports[i];
+		struct ahci_port_state *state = &controller->ports[i];
 		*state = (struct ahci_port_state){
 			.active = true,
-			.port_index = i,
+			.port_index = (uint8_t)(controller->index * AHCI_MAX_PORTS + i),
+			.controller = controller,
 			.port = port,
-			.irq_fired = false,
+			.queue_depth = hba_slots,
 		};
 
 		if (!ahci_port_rebase(state)) {
@@ -218,19 +649,33 @@ void ahci_init(void)
 			continue;
 		}
 
-		mprint("Port %u active\n", i);
+		ahci_port_setup_ncq(state, hba_ncq);
+		ahci_init_cmd_templates(state);
+		mprint("HBA %u port %u active, %s queue depth %u\n", controller->index, i, state->ncq ? "NCQ" : "no NCQ", state->queue_depth);
 	}
 
-	if (ahci_state.irq_line < 16)
-		irq_register_handler(ahci_state.irq_line, ahci_irq_handler, (void *)ahci_state.hba);
+	ahci_setup_irq(controller);
+}
+
+void ahci_init(void)
+{
+	if (!ahci_probe())
+		return;
+
+	for (size_t i = 0; i < ahci_controller_count; i++)
+		ahci_init_controller(&ahci_controllers[i]);
 }
 
 static struct ahci_port_state *ahci_get_port(uint8_t port_index)
 {
-	if (port_index >= AHCI_MAX_PORTS)
+	if (port_index >= AHCI_MAX_PORT_INDEX)
 		return nullptr;
 
-	struct ahci_port_state *state = &ahci_state.ports[port_index];
+	struct ahci_controller *controller = &ahci_controllers[port_index / AHCI_MAX_PORTS];
+	if (!controller->present)
+		return nullptr;
+
+	struct ahci_port_state *state = &controller->ports[port_index % AHCI_MAX_PORTS];
 	if (!state->active)
 		return nullptr;
 
@@ -242,93 +687,278 @@ bool ahci_port_is_active(uint8_t port_index)
 	return ahci_get_port(port_index) != nullptr;
 }
 
-static bool ahci_exec_dma(struct ahci_port_state *state, uint32_t lba_addr, uint16_t sector_count, void *buffer, bool write)
+bool ahci_set_irq_affinity(uint8_t port_index, uint8_t apic_id)
 {
-	if (state == nullptr || sector_count == 0)
+	struct ahci_port_state *state = ahci_get_port(port_index);
+	if (state == nullptr || state->controller->msi_vector == 0)
 		return false;
 
-	volatile struct hba_port *port = state->port;
-	while (port->tfd & (AHCI_PORT_TFD_BSY | AHCI_PORT_TFD_DRQ))
-		;
+	// A completion raised while the message is rewritten can be dropped,
+	// reap the ports once afterwards so no request waits on it
+	uint32_t flags = irq_save();
+	bool ok = pci_enable_msi(&state->controller->pci, state->controller->msi_vector, apic_id);
+	ahci_irq_handler(state->controller->msi_vector, state->controller);
+	irq_restore(flags);
+	return ok;
+}
 
-	int slot = ahci_find_free_slot(port);
-	if (slot < 0)
+/**
+ * Issue req on a free slot. With may_shorten the command may cover only
+ * the leading sectors the PRDT could map, req->sector_count is updated;
+ * without it a buffer the HBA cannot fully reach goes through a bounce
+ * buffer instead.
+ **/
+static bool ahci_start(struct ahci_port_state *state, struct ahci_request *req, bool may_shorten)
+{
+	if (req->lba + req->sector_count > AHCI_MAX_LBA)
 		return false;
 
-	size_t byte_count = (size_t)sector_count * 512u;
-	struct dma_buffer data = dma_alloc(byte_count);
-	if (data.virt == nullptr)
+	int slot = ahci_find_free_slot(state);
+	if (slot < 0)
 		return false;
 
-	if (write)
-		memcpy(data.virt, buffer, byte_count);
+	if (state->bounce_slots & (1u << slot))
+		ahci_release_bounces(state);
+
+	size_t byte_count = (size_t)req->sector_count * AHCI_SECTOR_SIZE;
+	struct hba_cmd_table *cmd_table = (struct hba_cmd_table *)state->cmd_tables[slot].virt;
+
+	size_t mapped = byte_count;
+	uint32_t prdt_count = ahci_zero_copy ? ahci_build_prdt(cmd_table, req->buffer, &mapped) : 0;
+	if (prdt_count > 0 && mapped < byte_count) {
+		if (may_shorten)
+			req->sector_count = (uint16_t)(mapped / AHCI_SECTOR_SIZE);
+		else
+			prdt_count = 0;
+	}
+
+	// Fall back to a bounce buffer when the HBA cannot reach the caller's memory
+	struct dma_buffer bounce = { 0 };
+	if (prdt_count == 0) {
+		if (may_shorten && req->sector_count > AHCI_MAX_BOUNCE_SECTORS)
+			req->sector_count = AHCI_MAX_BOUNCE_SECTORS;
+		byte_count = (size_t)req->sector_count * AHCI_SECTOR_SIZE;
+
+		bounce = dma_alloc(byte_count);
+		if (bounce.virt == nullptr)
+			return false;
+
+		if (req->write)
+			memcpy(bounce.virt, req->buffer, byte_count);
+
+		mapped = byte_count;
+		prdt_count = ahci_build_prdt(cmd_table, bounce.virt, &mapped);
+		if (prdt_count == 0 || mapped < byte_count) {
+			dma_free(&bounce);
+			return false;
+		}
+	}
 
-	uint32_t prdt_count = (uint32_t)((byte_count + AHCI_PRDT_MAX_BYTES - 1) / AHCI_PRDT_MAX_BYTES);
 	struct hba_cmd_header *cmd_header = (struct hba_cmd_header *)state->cmd_list.virt;
 	struct hba_cmd_header *header = &cmd_header[slot];
-	header->cfl = sizeof(struct fis_reg_h2d) / 4;
-	header->w = write ? 1 : 0;
+	header->w = req->write ? 1 : 0;
 	header->prdtl = prdt_count;
 	header->prdbc = 0;
 
-	struct hba_cmd_table *cmd_table = (struct hba_cmd_table *)state->cmd_tables[slot].virt;
-	memset(cmd_table, 0, 4096);
-
-	uintptr_t data_phys = (uintptr_t)data.phys.ptr;
-	size_t remaining = byte_count;
-	for (uint32_t i = 0; i < prdt_count; i++) {
-		uint32_t chunk = remaining > AHCI_PRDT_MAX_BYTES ? AHCI_PRDT_MAX_BYTES : (uint32_t)remaining;
-		cmd_table->prdt_entry[i].dba = (uint32_t)data_phys;
-		cmd_table->prdt_entry[i].dbau = 0;
-		cmd_table->prdt_entry[i].dbc = chunk - 1;
-		cmd_table->prdt_entry[i].i = (i == prdt_count - 1) ? 1 : 0;
-
-		data_phys += chunk;
-		remaining -= chunk;
+	// Everything else in the FIS comes from ahci_init_cmd_templates
+	struct fis_reg_h2d *fis = (struct fis_reg_h2d *)cmd_table->cfis;
+	fis->lba0 = (uint8_t)(req->lba & 0xFF);
+	fis->lba1 = (uint8_t)((req->lba >> 8) & 0xFF);
+	fis->lba2 = (uint8_t)((req->lba >> 16) & 0xFF);
+	fis->lba3 = (uint8_t)((req->lba >> 24) & 0xFF);
+	fis->lba4 = (uint8_t)((req->lba >> 32) & 0xFF);
+	fis->lba5 = (uint8_t)((req->lba >> 40) & 0xFF);
+
+	if (state->ncq) {
+		// FPDMA QUEUED moves the sector count to the feature register, the
+		// tag in countl is the slot and already in the template
+		fis->command = req->write ? AHCI_CMD_WRITE_FPDMA_QUEUED : AHCI_CMD_READ_FPDMA_QUEUED;
+		fis->featurel = (uint8_t)(req->sector_count & 0xFF);
+		fis->featureh = (uint8_t)((req->sector_count >> 8) & 0xFF);
+	} else {
+		fis->command = req->write ? AHCI_CMD_WRITE_DMA_EXT : AHCI_CMD_READ_DMA_EXT;
+		fis->countl = (uint8_t)(req->sector_count & 0xFF);
+		fis->counth = (uint8_t)((req->sector_count >> 8) & 0xFF);
 	}
 
-	struct fis_reg_h2d *fis = (struct fis_reg_h2d *)cmd_table->cfis;
-	*fis = (struct fis_reg_h2d){
-		.fis_type = AHCI_FIS_TYPE_REG_H2D,
-		.c = 1,
-		.command = write ? AHCI_CMD_WRITE_DMA_EXT : AHCI_CMD_READ_DMA_EXT,
-		.lba0 = (uint8_t)(lba_addr & 0xFF),
-		.lba1 = (uint8_t)((lba_addr >> 8) & 0xFF),
-		.lba2 = (uint8_t)((lba_addr >> 16) & 0xFF),
-		.lba3 = (uint8_t)((lba_addr >> 24) & 0xFF),
-		.device = 1 << 6,
-		.countl = (uint8_t)(sector_count & 0xFF),
-		.counth = (uint8_t)((sector_count >> 8) & 0xFF),
-	};
+	req->done = false;
+	req->ok = false;
+	state->slots[slot] = (struct ahci_slot){ .req = req, .bounce = bounce };
+	if (bounce.virt != nullptr)
+		state->bounce_slots |= 1u << slot;
 
-	port->is = 0xFFFFFFFFu;
-	state->irq_fired = false;
-	port->ci |= 1u << slot;
+	uint32_t flags = irq_save();
+	state->outstanding |= 1u << slot;
+	if (state->ncq)
+		state->port->sact = 1u << slot;
+	state->port->ci = 1u << slot;
+	irq_restore(flags);
 
-	while (true) {
-		if ((port->ci & (1u << slot)) == 0)
-			break;
-		if (state->irq_fired)
-			break;
-		if (port->is & AHCI_PORT_IRQ_TFES)
+	return true;
+}
+
+static void ahci_port_poll(struct ahci_port_state *state)
+{
+	uint32_t flags = irq_save();
+	ahci_port_complete(state);
+	irq_restore(flags);
+}
+
+bool ahci_submit(uint8_t port_index, struct ahci_request *req)
+{
+	struct ahci_port_state *state = ahci_get_port(port_index);
+	if (state == nullptr || req == nullptr || req->buffer == nullptr || req->sector_count == 0)
+		return false;
+
+	return ahci_start(state, req, false);
+}
+
+void ahci_poll(uint8_t port_index)
+{
+	struct ahci_port_state *state = ahci_get_port(port_index);
+	if (state == nullptr)
+		return;
+
+	ahci_port_poll(state);
+	ahci_release_bounces(state);
+}
+
+// Stop the port, which drops every command in flight, and fail them all
+static void ahci_port_abort(struct ahci_port_state *state)
+{
+	uint32_t flags = irq_save();
+	ahci_port_stop(state->port);
+	state->port->serr = state->port->serr;
+	state->port->is = 0xFFFFFFFFu;
+	ahci_port_start(state->port);
+
+	uint32_t failed = state->outstanding;
+	while (failed != 0) {
+		uint8_t slot = (uint8_t)__builtin_ctz(failed);
+		failed &= failed - 1;
+		ahci_finish_slot(state, slot, false);
+	}
+	irq_restore(flags);
+}
+
+bool ahci_wait(uint8_t port_index, struct ahci_request *req)
+{
+	struct ahci_port_state *state = ahci_get_port(port_index);
+	if (state == nullptr || req == nullptr)
+		return false;
+
+	// The interrupt handler completes the request, sleep until it does.
+	// Every wake polls the port too, so a lost or misrouted completion is
+	// reaped on the next interrupt, the PIT tick at the latest. Without a
+	// handler or with interrupts off only polling is left.
+	const bool sleep = state->controller->irq_registered && irq_enabled();
+	const size_t start = GLOBAL_TICK;
+	for (uint32_t spin = 0; !req->done && spin < AHCI_WAIT_SPIN_LIMIT; spin++) {
+		if (GLOBAL_TICK - start > AHCI_WAIT_TIMEOUT_TICKS)
 			break;
+		if (sleep)
+			irq_halt_unless(&req->done);
+		ahci_port_poll(state);
 	}
 
-	bool ok = (port->ci & (1u << slot)) == 0 && (port->is & AHCI_PORT_IRQ_TFES) == 0;
+	if (!req->done) {
+		mprint("port %u: request at lba %u timed out, aborting the port\n", state->port_index, (uint32_t)req->lba);
+		ahci_port_abort(state);
+	}
 
-	if (ok && !write)
-		memcpy(buffer, data.virt, byte_count);
+	ahci_release_bounces(state);
+	return req->ok;
+}
+
+uint8_t ahci_queue_depth(uint8_t port_index)
+{
+	struct ahci_port_state *state = ahci_get_port(port_index);
+	return state == nullptr ? 0 : state->queue_depth;
+}
+
+// Bounded like ahci_wait, a port that never frees a slot is aborted
+static void ahci_wait_for_slot(struct ahci_port_state *state)
+{
+	const bool sleep = state->controller->irq_registered && irq_enabled();
+	const size_t start = GLOBAL_TICK;
+	for (uint32_t spin = 0; ahci_find_free_slot(state) < 0; spin++) {
+		if (spin >= AHCI_WAIT_SPIN_LIMIT || GLOBAL_TICK - start > AHCI_WAIT_TIMEOUT_TICKS) {
+			mprint("port %u: no slot freed up, aborting the port\n", state->port_index);
+			ahci_port_abort(state);
+			return;
+		}
+
+		if (sleep) {
+			// Check and sleep with interrupts off so a completion cannot slip in between
+			uint32_t flags = irq_save();
+			if (ahci_find_free_slot(state) < 0)
+				__asm__ volatile("sti\n\t"
+						 "hlt"
+						 :
+						 :
+						 : "memory");
+			irq_restore(flags);
+		}
+		ahci_port_poll(state);
+	}
+}
+
+/**
+ * Split a transfer into commands along the command and PRDT limits and
+ * keep up to the port queue depth of them in flight.
+ **/
+static bool ahci_exec_dma(struct ahci_port_state *state, uint64_t lba, size_t sector_count, uint8_t *buffer, bool write)
+{
+	if (state == nullptr || sector_count == 0 || lba + sector_count > AHCI_MAX_LBA)
+		return false;
+
+	struct ahci_request reqs[AHCI_CMD_SLOT_COUNT] = { 0 };
+	const size_t depth = state->queue_depth;
+	size_t submitted = 0;
+	size_t reaped = 0;
+	bool ok = true;
+
+	while (sector_count > 0) {
+		if (submitted - reaped == depth) {
+			bool req_ok = ahci_wait(state->port_index, &reqs[reaped++ % depth]);
+			ok = ok && req_ok;
+			continue;
+		}
+
+		ahci_wait_for_slot(state);
+
+		struct ahci_request *req = &reqs[submitted % depth];
+		*req = (struct ahci_request){
+			.lba = lba,
+			.sector_count = (uint16_t)(sector_count < AHCI_MAX_CMD_SECTORS ? sector_count : AHCI_MAX_CMD_SECTORS),
+			.buffer = buffer,
+			.write = write,
+		};
+		if (!ahci_start(state, req, true)) {
+			ok = false;
+			break;
+		}
+		submitted++;
+
+		lba += req->sector_count;
+		buffer += (size_t)req->sector_count * AHCI_SECTOR_SIZE;
+		sector_count -= req->sector_count;
+	}
+
+	while (reaped < submitted) {
+		bool req_ok = ahci_wait(state->port_index, &reqs[reaped++ % depth]);
+		ok = ok && req_ok;
+	}
 
-	dma_free(&data);
 	return ok;
 }
 
-bool ahci_read28_port(uint8_t port_index, uint32_t lba_addr, uint16_t sector_count, void *dest)
+bool ahci_read_port(uint8_t port_index, uint64_t lba, size_t sector_count, void *dest)
 {
-	return ahci_exec_dma(ahci_get_port(port_index), lba_addr, sector_count, dest, false);
+	return ahci_exec_dma(ahci_get_port(port_index), lba, sector_count, dest, false);
 }
 
-bool ahci_write28_port(uint8_t port_index, uint32_t lba_addr, uint16_t sector_count, const void *src)
+bool ahci_write_port(uint8_t port_index, uint64_t lba, size_t sector_count, const void *src)
 {
-	return ahci_exec_dma(ahci_get_port(port_index), lba_addr, sector_count, (void *)src, true);
+	return ahci_exec_dma(ahci_get_port(port_index), lba, sector_count, (void *)src, true);
 }
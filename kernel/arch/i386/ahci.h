@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -14,10 +15,13 @@ enum ahci_command {
 	AHCI_CMD_READ_PIO_EXT = 0x24,	  // Read sectors using PIO (48-bit LBA).
 	AHCI_CMD_READ_DMA = 0xC8,	  // Read sectors using DMA (28-bit LBA).
 	AHCI_CMD_READ_DMA_EXT = 0x25,	  // Read sectors using DMA (48-bit LBA).
+	AHCI_CMD_READ_LOG_EXT = 0x2F,	  // Read a log page (48-bit).
 	AHCI_CMD_WRITE_PIO = 0x30,	  // Write sectors using PIO (28-bit LBA).
 	AHCI_CMD_WRITE_PIO_EXT = 0x34,	  // Write sectors using PIO (48-bit LBA).
 	AHCI_CMD_WRITE_DMA = 0xCA,	  // Write sectors using DMA (28-bit LBA).
 	AHCI_CMD_WRITE_DMA_EXT = 0x35,	  // Write sectors using DMA (48-bit LBA).
+	AHCI_CMD_READ_FPDMA_QUEUED = 0x60,  // Queued (NCQ) DMA read (48-bit LBA).
+	AHCI_CMD_WRITE_FPDMA_QUEUED = 0x61, // Queued (NCQ) DMA write (48-bit LBA).
 	AHCI_CMD_CACHE_FLUSH = 0xE7,	  // Flush device write cache.
 	AHCI_CMD_CACHE_FLUSH_EXT = 0xEA,  // Flush device write cache (48-bit).
 	AHCI_CMD_IDENTIFY = 0xEC,	  // Identify ATA device.
@@ -41,7 +45,13 @@ enum ahci_command {
 };
 
 #define AHCI_MAX_PORTS 32
+#define AHCI_MAX_HBAS 4
+// Port indices are global, hba * AHCI_MAX_PORTS + port
+#define AHCI_MAX_PORT_INDEX (AHCI_MAX_HBAS * AHCI_MAX_PORTS)
 #define AHCI_CMD_SLOT_COUNT 32
+// Large transfers are split into commands of at most 16 MiB, four full
+// PRDT entries when the buffer is physically contiguous
+#define AHCI_MAX_CMD_SECTORS 32768u
 
 enum ahci_fis_type {
 	AHCI_FIS_TYPE_REG_H2D = 0x27, // Register FIS - host to device.
@@ -168,8 +178,43 @@ struct fis_reg_h2d {
 	uint8_t reserved1[4];
 } __attribute__((packed));
 
+// DMA straight into caller buffers, clear to force every transfer through a bounce buffer
+extern bool ahci_zero_copy;
+
 bool ahci_probe(void);
 void ahci_init(void);
 bool ahci_port_is_active(uint8_t port_index);
-bool ahci_read28_port(uint8_t port_index, uint32_t lba_addr, uint16_t sector_count, void *dest);
-bool ahci_write28_port(uint8_t port_index, uint32_t lba_addr, uint16_t sector_count, const void *src);
+// Steer the completions of the port's controller to the CPU with LAPIC apic_id.
+// Only controllers running on MSI can be moved, false otherwise.
+bool ahci_set_irq_affinity(uint8_t port_index, uint8_t apic_id);
+struct ahci_request;
+typedef void (*ahci_done_fn)(struct ahci_request *req, void *ctx);
+
+/**
+ * Asynchronous request, owned by the caller until done is set.
+ * ahci_submit() returns false when the request is invalid or every
+ * usable slot is busy, ahci_poll() reaps finished commands and
+ * ahci_wait() sleeps until the request is done, returning its status.
+ * The optional done_cb runs from the AHCI interrupt once the request
+ * completes, it must not allocate memory or submit new requests.
+ */
+struct ahci_request {
+	uint64_t lba; // 48-bit
+	uint16_t sector_count;
+	void *buffer;
+	bool write;
+	ahci_done_fn done_cb;
+	void *ctx;
+	volatile bool done;
+	bool ok;
+};
+
+bool ahci_submit(uint8_t port_index, struct ahci_request *req);
+void ahci_poll(uint8_t port_index);
+bool ahci_wait(uint8_t port_index, struct ahci_request *req);
+// Number of requests a port keeps in flight, 0 for inactive ports
+uint8_t ahci_queue_depth(uint8_t port_index);
+
+// Synchronous transfers of any size, split into queued commands internally
+bool ahci_read_port(uint8_t port_index, uint64_t lba, size_t sector_count, void *dest);
+bool ahci_write_port(uint8_t port_index, uint64_t lba, size_t sector_count, const void *src);
@@ -0,0 +1,423 @@
+#include "ata_dma.h"
+
+#include <kernel/display.h>
+#include <kernel/timer.h>
+#include <kernel/vir_mem.h>
+#include <string.h>
+
+#include "ata_pio.h"
+#include "dma.h"
+#include "irq.h"
+#include "port.h"
+
+MODULE("ATA DMA");
+
+#define ATA_DMA_CHANNELS 2u
+#define ATA_SECTOR_SIZE 512u
+#define ATA_LBA28_MAX (1ull << 28)
+#define ATA_LBA48_MAX (1ull << 48)
+// Same bound as the PIO path, a dead or missing drive fails the request
+#define ATA_DMA_SPIN_LIMIT 10000000u
+// About 5 s at the default 18.2 Hz PIT, for waits that sleep between polls
+#define ATA_DMA_TIMEOUT_TICKS 91u
+
+// Bus master registers, relative to the channel's bmide base
+#define BM_REG_CMD 0
+#define BM_REG_STATUS 2
+#define BM_REG_PRDT 4
+
+#define BM_CMD_START (1u << 0)
+#define BM_CMD_READ (1u << 3) // the engine writes to memory
+
+#define BM_STATUS_ACTIVE (1u << 0)
+#define BM_STATUS_ERR (1u << 1)
+#define BM_STATUS_IRQ (1u << 2)
+
+#define PCI_IDE_PROG_IF_PRIMARY_NATIVE (1u << 0)
+#define PCI_IDE_PROG_IF_SECONDARY_NATIVE (1u << 2)
+#define PCI_IDE_PROG_IF_BUS_MASTER (1u << 7)
+
+#define ATA_LEGACY_IRQ_PRIMARY 14
+#define ATA_LEGACY_IRQ_SECONDARY 15
+
+// A PRD entry moves up to 64 KiB and may not cross a 64 KiB boundary
+#define ATA_PRD_WINDOW 0x10000u
+#define ATA_PRD_EOT (1u << 15)
+#define ATA_PRDT_MAX_ENTRIES (PAGE_SIZE / sizeof(struct ata_prd))
+
+struct ata_prd {
+	uint32_t phys;
+	uint16_t byte_count; // 0 means 64 KiB
+	uint16_t flags;
+} __attribute__((packed));
+
+struct ata_dma_channel {
+	bool available;
+	bool irq_registered;
+	uint8_t irq_line;
+	struct dma_buffer prdt;
+	struct dma_buffer bounce;
+	// Latched by whoever saw the completion first, the IRQ handler or a poll
+	volatile bool irq_fired;
+	volatile uint8_t bm_status;
+	volatile uint8_t ata_status;
+	// Command in flight
+	bool busy;
+	bool write;
+	bool bounced;
+	void *buffer;
+	size_t bytes;
+};
+
+static struct ata_dma_channel ata_dma_channels[ATA_DMA_CHANNELS];
+
+static void ata_dma_wait_device(uint8_t channel)
+{
+	for (int i = 0; i < 4; i++)
+		inb(channels[channel].ctrl);
+}
+
+/**
+ * Fill the PRDT straight from a kernel buffer through vmm_phy_addr,
+ * merging physically contiguous pages as long as an entry stays inside
+ * one 64 KiB window. Returns the entry count, 0 when the buffer has a
+ * page the engine cannot reach or needs more entries than a page holds.
+ **/
+static uint32_t ata_dma_build_prdt(struct ata_dma_channel *state, const void *buffer, size_t bytes)
+{
+	if ((uintptr_t)buffer & 1)
+		return 0;
+
+	struct ata_prd *prdt = state->prdt.virt;
+	const uint8_t *virt = buffer;
+	uint32_t entries = 0;
+	size_t last_len = 0;
+
+	while (bytes > 0) {
+		size_t page_left = PAGE_SIZE - ((uintptr_t)virt & (PAGE_SIZE - 1));
+		size_t chunk = bytes < page_left ? bytes : page_left;
+
+		uintptr_t phys = (uintptr_t)vmm_phy_addr(virt);
+		if (phys == 0)
+			return 0;
+
+		struct ata_prd *last = entries > 0 ? &prdt[entries - 1] : nullptr;
+		if (last != nullptr && last->phys + last_len == phys && (phys + chunk - 1) / ATA_PRD_WINDOW == last->phys / ATA_PRD_WINDOW) {
+			last_len += chunk;
+		} else {
+			if (entries == ATA_PRDT_MAX_ENTRIES)
+				return 0;
+
+			prdt[entries++] = (struct ata_prd){ .phys = (uint32_t)phys };
+			last_len = chunk;
+		}
+
+		// A full 64 KiB window wraps to 0, which is what the engine expects
+		prdt[entries - 1].byte_count = (uint16_t)last_len;
+		virt += chunk;
+		bytes -= chunk;
+	}
+
+	if (entries == 0)
+		return 0;
+
+	prdt[entries - 1].flags = ATA_PRD_EOT;
+	return entries;
+}
+
+static bool ata_dma_ensure_bounce(struct ata_dma_channel *state)
+{
+	if (state->bounce.virt == nullptr)
+		state->bounce = dma_alloc(ATA_DMA_MAX_SECTORS * ATA_SECTOR_SIZE);
+
+	return state->bounce.virt != nullptr;
+}
+
+// Caller keeps interrupts off so the handler and a poll cannot both latch
+static void ata_dma_latch(uint8_t channel, uint8_t bm_status)
+{
+	struct ata_dma_channel *state = &ata_dma_channels[channel];
+
+	// Reading the status register also acknowledges the drive interrupt
+	state->ata_status = inb(channels[channel].base + 7);
+	state->bm_status = bm_status;
+	outb(channels[channel].bmide + BM_REG_STATUS, BM_STATUS_IRQ | BM_STATUS_ERR);
+	state->irq_fired = true;
+}
+
+// Returns the status once BSY clears, false if it never does
+static bool ata_dma_wait_idle(uint8_t channel, uint8_t *status)
+{
+	uint16_t base = channels[channel].base;
+
+	for (uint32_t spin = 0; spin < ATA_DMA_SPIN_LIMIT; spin++) {
+		uint8_t value = inb(base + 7);
+		if ((value & ATA_SR_BSY) == 0) {
+			*status = value;
+			return true;
+		}
+	}
+
+	mprint("Channel %u timed out waiting for the drive\n", channel);
+	return false;
+}
+
+static void ata_dma_irq_handler(uint8_t irq_line, void *context)
+{
+	(void)irq_line;
+
+	uint8_t channel = (uint8_t)(uintptr_t)context;
+	uint8_t status = inb(channels[channel].bmide + BM_REG_STATUS);
+
+	// The line may be shared with the other channel
+	if ((status & BM_STATUS_IRQ) == 0)
+		return;
+
+	if (!ata_dma_channels[channel].busy) {
+		inb(channels[channel].base + 7);
+		outb(channels[channel].bmide + BM_REG_STATUS, BM_STATUS_IRQ);
+		return;
+	}
+
+	ata_dma_latch(channel, status);
+}
+
+bool ata_dma_init(const struct pci_device *ide)
+{
+	if (ide == nullptr || (ide->prog_if & PCI_IDE_PROG_IF_BUS_MASTER) == 0) {
+		mprint("Controller has no bus master support\n");
+		return false;
+	}
+
+	bool any = false;
+	for (uint8_t channel = 0; channel < ATA_DMA_CHANNELS; channel++) {
+		struct ata_dma_channel *state = &ata_dma_channels[channel];
+		if (state->available) {
+			any = true;
+			continue;
+		}
+		if (channels[channel].bmide == 0)
+			continue;
+
+		// One page keeps the table dword aligned and inside a 64 KiB window
+		state->prdt = dma_alloc(PAGE_SIZE);
+		if (state->prdt.virt == nullptr)
+			continue;
+
+		uint8_t native = channel == 0 ? PCI_IDE_PROG_IF_PRIMARY_NATIVE : PCI_IDE_PROG_IF_SECONDARY_NATIVE;
+		if (ide->prog_if & native)
+			state->irq_line = ide->irq_line;
+		else
+			state->irq_line = channel == 0 ? ATA_LEGACY_IRQ_PRIMARY : ATA_LEGACY_IRQ_SECONDARY;
+
+		if (state->irq_line < 16)
+			state->irq_registered = irq_register_handler(state->irq_line, ata_dma_irq_handler, (void *)(uintptr_t)channel);
+
+		state->available = true;
+		any = true;
+		mprint("Channel %u bus master at %x, irq %u%s\n", channel, channels[channel].bmide, state->irq_line,
+		       state->irq_registered ? "" : " (polling)");
+	}
+
+	return any;
+}
+
+bool ata_dma_available(uint8_t channel)
+{
+	return channel < ATA_DMA_CHANNELS && ata_dma_channels[channel].available;
+}
+
+bool ata_dma_submit(uint8_t channel, uint8_t drive, uint64_t lba, uint16_t sector_count, void *buffer, bool write)
+{
+	if (!ata_dma_available(channel) || sector_count == 0 || sector_count > ATA_DMA_MAX_SECTORS)
+		return false;
+	if (lba + sector_count > ATA_LBA48_MAX)
+		return false;
+
+	struct ata_dma_channel *state = &ata_dma_channels[channel];
+	if (state->busy)
+		return false;
+
+	size_t bytes = (size_t)sector_count * ATA_SECTOR_SIZE;
+	state->bounced = false;
+	if (ata_dma_build_prdt(state, buffer, bytes) == 0) {
+		if (!ata_dma_ensure_bounce(state))
+			return false;
+		if (write)
+			memcpy(state->bounce.virt, buffer, bytes);
+		if (ata_dma_build_prdt(state, state->bounce.virt, bytes) == 0)
+			return false;
+		state->bounced = true;
+	}
+
+	state->write = write;
+	state->buffer = buffer;
+	state->bytes = bytes;
+	state->irq_fired = false;
+	state->busy = true;
+
+	uint16_t base = channels[channel].base;
+	uint16_t bmide = channels[channel].bmide;
+
+	outb(bmide + BM_REG_CMD, write ? 0 : BM_CMD_READ);
+	outd(bmide + BM_REG_PRDT, (uint32_t)(uintptr_t)state->prdt.phys.ptr);
+	outb(bmide + BM_REG_STATUS, BM_STATUS_IRQ | BM_STATUS_ERR);
+
+	// Interrupts on, the PIO path masks them while it polls
+	outb(channels[channel].ctrl, 0);
+	uint8_t status;
+	if (!ata_dma_wait_idle(channel, &status)) {
+		state->busy = false;
+		return false;
+	}
+
+	uint8_t cmd;
+	if (lba + sector_count > ATA_LBA28_MAX) {
+		outb(base + 6, 0x40 | (drive << 4));
+		ata_dma_wait_device(channel);
+		// High order bytes first, the drive keeps the previous write of each register
+		outb(base + 2, (uint8_t)(sector_count >> 8));
+		outb(base + 3, (uint8_t)(lba >> 24));
+		outb(base + 4, (uint8_t)(lba >> 32));
+		outb(base + 5, (uint8_t)(lba >> 40));
+		outb(base + 2, (uint8_t)sector_count);
+		outb(base + 3, (uint8_t)lba);
+		outb(base + 4, (uint8_t)(lba >> 8));
+		outb(base + 5, (uint8_t)(lba >> 16));
+		cmd = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+	} else {
+		outb(base + 6, 0xE0 | (drive << 4) | ((lba >> 24) & 0x0f));
+		ata_dma_wait_device(channel);
+		// 256 sectors wrap to 0, which the drive reads as 256
+		outb(base + 2, (uint8_t)sector_count);
+		outb(base + 3, (uint8_t)lba);
+		outb(base + 4, (uint8_t)(lba >> 8));
+		outb(base + 5, (uint8_t)(lba >> 16));
+		cmd = write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+	}
+
+	outb(base + 7, cmd);
+	outb(bmide + BM_REG_CMD, (write ? 0 : BM_CMD_READ) | BM_CMD_START);
+	return true;
+}
+
+bool ata_dma_poll(uint8_t channel)
+{
+	if (channel >= ATA_DMA_CHANNELS)
+		return true;
+
+	struct ata_dma_channel *state = &ata_dma_channels[channel];
+	if (!state->busy || state->irq_fired)
+		return true;
+
+	uint32_t flags = irq_save();
+	if (!state->irq_fired) {
+		uint8_t status = inb(channels[channel].bmide + BM_REG_STATUS);
+		if ((status & BM_STATUS_IRQ) || (status & (BM_STATUS_ACTIVE | BM_STATUS_ERR)) == BM_STATUS_ERR)
+			ata_dma_latch(channel, status);
+	}
+	irq_restore(flags);
+
+	return state->irq_fired;
+}
+
+void ata_dma_halt(uint8_t channel)
+{
+	if (channel >= ATA_DMA_CHANNELS)
+		return;
+
+	struct ata_dma_channel *state = &ata_dma_channels[channel];
+	if (state->irq_registered && irq_enabled())
+		irq_halt_unless(&state->irq_fired);
+}
+
+// Polls until the command finishes, sleeping between polls when the
+// channel interrupt can wake us. Bounded by ATA_DMA_SPIN_LIMIT polls, and
+// by ATA_DMA_TIMEOUT_TICKS once the PIT is ticking.
+static bool ata_dma_wait_done(uint8_t channel)
+{
+	const size_t start = GLOBAL_TICK;
+	for (uint32_t spin = 0; spin < ATA_DMA_SPIN_LIMIT; spin++) {
+		if (ata_dma_poll(channel))
+			return true;
+		if (GLOBAL_TICK - start > ATA_DMA_TIMEOUT_TICKS)
+			break;
+		ata_dma_halt(channel);
+	}
+
+	return false;
+}
+
+bool ata_dma_complete(uint8_t channel)
+{
+	if (channel >= ATA_DMA_CHANNELS)
+		return false;
+
+	struct ata_dma_channel *state = &ata_dma_channels[channel];
+	if (!state->busy)
+		return false;
+
+	const bool done = ata_dma_wait_done(channel);
+	outb(channels[channel].bmide + BM_REG_CMD, 0);
+	state->busy = false;
+	if (!done) {
+		mprint("Channel %u timed out waiting for the transfer\n", channel);
+		return false;
+	}
+
+	bool ok = (state->bm_status & BM_STATUS_ERR) == 0 && (state->ata_status & (ATA_SR_ERR | ATA_SR_DF)) == 0;
+	if (!ok) {
+		mprint("Channel %u transfer failed, bus master status %x, drive status %x\n", channel, state->bm_status,
+		       state->ata_status);
+		return false;
+	}
+
+	if (state->bounced && !state->write)
+		memcpy(state->buffer, state->bounce.virt, state->bytes);
+	return true;
+}
+
+static bool ata_dma_flush(uint8_t channel, uint8_t drive)
+{
+	uint16_t base = channels[channel].base;
+
+	// Polled, no need to wake the handler for it
+	outb(channels[channel].ctrl, 2);
+	outb(base + 6, 0xE0 | (drive << 4));
+	ata_dma_wait_device(channel);
+	outb(base + 7, ATA_CMD_CACHE_FLUSH);
+	ata_dma_wait_device(channel);
+
+	uint8_t status = 0;
+	const bool idle = ata_dma_wait_idle(channel, &status);
+	outb(channels[channel].ctrl, 0);
+
+	return idle && (status & (ATA_SR_ERR | ATA_SR_DF)) == 0;
+}
+
+static bool ata_dma_transfer(uint8_t channel, uint8_t drive, uint64_t lba, size_t sector_count, uint8_t *buffer, bool write)
+{
+	while (sector_count > 0) {
+		uint16_t count = sector_count < ATA_DMA_MAX_SECTORS ? (uint16_t)sector_count : ATA_DMA_MAX_SECTORS;
+		if (!ata_dma_submit(channel, drive, lba, count, buffer, write))
+			return false;
+		if (!ata_dma_complete(channel))
+			return false;
+
+		lba += count;
+		buffer += (size_t)count * ATA_SECTOR_SIZE;
+		sector_count -= count;
+	}
+
+	return !write || ata_dma_flush(channel, drive);
+}
+
+bool ata_dma_read(uint8_t channel, uint8_t drive, uint64_t lba, size_t sector_count, void *dest)
+{
+	return ata_dma_transfer(channel, drive, lba, sector_count, dest, false);
+}
+
+bool ata_dma_write(uint8_t channel, uint8_t drive, uint64_t lba, size_t sector_count, const void *src)
+{
+	return ata_dma_transfer(channel, drive, lba, sector_count, (uint8_t *)src, true);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pci.h"
+
+// One command moves at most 256 sectors, the 28-bit sector count limit
+#define ATA_DMA_MAX_SECTORS 256u
+
+// Set up the bus master engine of both channels, ide_initialize must have run
+bool ata_dma_init(const struct pci_device *ide);
+bool ata_dma_available(uint8_t channel);
+
+// Start one command on channel, buffers that cannot be handed to the engine
+// go through a bounce buffer
+bool ata_dma_submit(uint8_t channel, uint8_t drive, uint64_t lba, uint16_t sector_count, void *buffer, bool write);
+// True once the command in flight on channel finished
+bool ata_dma_poll(uint8_t channel);
+// Halt until the channel interrupt, returns right away when it is not wired
+void ata_dma_halt(uint8_t channel);
+// Stop the engine and report how the command went
+bool ata_dma_complete(uint8_t channel);
+
+// Transfers of any size, split in ATA_DMA_MAX_SECTORS commands
+bool ata_dma_read(uint8_t channel, uint8_t drive, uint64_t lba, size_t sector_count, void *dest);
+bool ata_dma_write(uint8_t channel, uint8_t drive, uint64_t lba, size_t sector_count, const void *src);
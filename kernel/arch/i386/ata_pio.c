@@ -3,16 +3,7 @@
 #include "port.h"
 #include "ata_pio.h"
 
-enum ATA_SR {
-	ATA_SR_BSY = 0x80,  // Busy
-	ATA_SR_DRDY = 0x40, // Drive ready
-	ATA_SR_DF = 0x20,   // Drive write fault
-	ATA_SR_DSC = 0x10,  // Drive seek complete
-	ATA_SR_DRQ = 0x08,  // Data request ready
-	ATA_SR_CORR = 0x04, // Corrected data
-	ATA_SR_IDX = 0x02,  // Index
-	ATA_SR_ERR = 0x01,  // Error
-};
+MODULE("ATA PIO");
 
 enum ATA_ER {
 	ATA_ER_BBK = 0x80,   // Bad block
@@ -25,22 +16,6 @@ enum ATA_ER {
 	ATA_ER_AMNF = 0x01,  // No address mark
 };
 
-enum ATA_CMD {
-	ATA_CMD_READ_PIO = 0x20,
-	ATA_CMD_READ_PIO_EXT = 0x24,
-	ATA_CMD_READ_DMA = 0xC8,
-	ATA_CMD_READ_DMA_EXT = 0x25,
-	ATA_CMD_WRITE_PIO = 0x30,
-	ATA_CMD_WRITE_PIO_EXT = 0x34,
-	ATA_CMD_WRITE_DMA = 0xCA,
-	ATA_CMD_WRITE_DMA_EXT = 0x35,
-	ATA_CMD_CACHE_FLUSH = 0xE7,
-	ATA_CMD_CACHE_FLUSH_EXT = 0xEA,
-	ATA_CMD_PACKET = 0xA0,
-	ATA_CMD_IDENTIFY_PACKET = 0xA1,
-	ATA_CMD_IDENTIFY = 0xEC,
-};
-
 enum ATA_IDENT {
 	ATA_IDENT_DEVICETYPE = 0,
 	ATA_IDENT_CYLINDERS = 2,
@@ -73,12 +48,7 @@ enum ata_channel {
 #define ATA_SECONDARY_IO 0x170
 #define ATA_SECONDARY_CTRL 0x376
 
-struct IDEChannelRegisters {
-	unsigned short base;  // I/O Base.
-	unsigned short ctrl;  // Control Base
-	unsigned short bmide; // Bus Master IDE
-	unsigned char nIEN;   // nIEN (No Interrupt);
-} channels[2] = {
+struct IDEChannelRegisters channels[2] = {
 	{ .base = ATA_PRIMARY_IO, .ctrl = ATA_PRIMARY_CTRL, .bmide = 0, .nIEN = 0 },
 	{ .base = ATA_SECONDARY_IO, .ctrl = ATA_SECONDARY_CTRL, .bmide = 0, .nIEN = 0 },
 };
@@ -137,61 +107,185 @@ uint32_t ata_pio_detect_devtype(uint8_t channel, uint8_t drive)
 	return ATADEV_UNKNOWN;
 }
 
+#define ATA_PIO_MAX_SECTORS 256u
+#define ATA_PIO_MAX_LBA (1u << 28)
+#define ATA_PIO_SPIN_LIMIT 10000000u
+
+// IDENTIFY words
+#define ATA_IDENT_WORD_MULTIPLE_MAX 47
+#define ATA_IDENT_WORD_MULTIPLE_CUR 59
+#define ATA_IDENT_MULTIPLE_CUR_VALID 0x0100 // low byte of word 59 holds the setting
+
+// Sectors per DRQ block for READ/WRITE MULTIPLE, 0 when not set up
+static uint8_t ata_pio_multiple[2][2] = { 0 };
+bool ata_pio_multiple_enabled = true;
+
+// Returns the status once BSY clears, false if it never does
+static bool ata_pio_wait_idle(uint8_t channel, uint8_t *status)
+{
+	uint16_t base = channels[channel].base;
+
+	wait_device(channel);
+	for (uint32_t spin = 0; spin < ATA_PIO_SPIN_LIMIT; spin++) {
+		uint8_t value = inb(base + 7);
+		if ((value & ATA_SR_BSY) == 0) {
+			*status = value;
+			return true;
+		}
+	}
+
+	mprint("Channel %u timed out waiting for the drive\n", channel);
+	return false;
+}
+
+static bool ata_pio_wait_ok(uint8_t channel, bool want_data)
+{
+	uint8_t status = 0;
+	if (!ata_pio_wait_idle(channel, &status))
+		return false;
+
+	if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+		mprint("Channel %u drive error, status %x error %x\n", channel, status, inb(channels[channel].base + 1));
+		return false;
+	}
+	if (want_data && (status & ATA_SR_DRQ) == 0) {
+		mprint("Channel %u drive has no data ready, status %x\n", channel, status);
+		return false;
+	}
+
+	return true;
+}
+
+static bool ata_pio_identify(uint8_t channel, uint8_t drive, uint16_t *ident)
+{
+	uint16_t base = channels[channel].base;
+
+	outb(channels[channel].ctrl, 2);
+	outb(base + 6, 0xA0 | (drive << 4));
+	wait_device(channel);
+	outb(base + 2, 0);
+	outb(base + 3, 0);
+	outb(base + 4, 0);
+	outb(base + 5, 0);
+	outb(base + 7, ATA_CMD_IDENTIFY);
+
+	bool ok = inb(base + 7) != 0 && ata_pio_wait_ok(channel, true);
+	if (ok)
+		insw(base, ident, 256);
+
+	outb(channels[channel].ctrl, 0);
+	return ok;
+}
+
+uint8_t ata_pio_setup_multiple(uint8_t channel, uint8_t drive)
+{
+	if (channel > ATA_SECONDARY || drive > ATA_SLAVE)
+		return 1;
+
+	uint16_t ident[256];
+	if (!ata_pio_identify(channel, drive, ident))
+		return 1;
+
+	uint8_t max = (uint8_t)ident[ATA_IDENT_WORD_MULTIPLE_MAX];
+	if (max <= 1)
+		return 1;
+
+	uint16_t base = channels[channel].base;
+	outb(channels[channel].ctrl, 2);
+	outb(base + 6, 0xE0 | (drive << 4));
+	wait_device(channel);
+	outb(base + 2, max);
+	outb(base + 7, ATA_CMD_SET_MULTIPLE);
+	bool ok = ata_pio_wait_ok(channel, false);
+	outb(channels[channel].ctrl, 0);
+
+	if (!ok)
+		return 1;
+
+	// Some drives accept SET MULTIPLE and keep their old block size, only
+	// trust what word 59 reports back
+	if (!ata_pio_identify(channel, drive, ident))
+		return 1;
+
+	uint16_t cur = ident[ATA_IDENT_WORD_MULTIPLE_CUR];
+	if ((cur & ATA_IDENT_MULTIPLE_CUR_VALID) == 0 || (uint8_t)cur != max) {
+		mprint("Channel %u drive %u ignored SET MULTIPLE %u, word 59 is %x\n", channel, drive, max, cur);
+		return 1;
+	}
+
+	ata_pio_multiple[channel][drive] = max;
+	return max;
+}
+
 /*
   Send 0xE0 for the "master" or 0xF0 for the "slave", ORed with the highest 4 bits of the LBA to port 0x1F6: outb(0x1F6, 0xE0 | (slavebit << 4) | ((LBA >> 24) & 0x0F))
-  Send a NULL byte to port 0x1F1, if you like (it is ignored and wastes lots of CPU time): outb(0x1F1, 0x00)
   Send the sectorcount to port 0x1F2: outb(0x1F2, (unsigned char) count)
   Send the low 8 bits of the LBA to port 0x1F3: outb(0x1F3, (unsigned char) LBA))
   Send the next 8 bits of the LBA to port 0x1F4: outb(0x1F4, (unsigned char)(LBA >> 8))
   Send the next 8 bits of the LBA to port 0x1F5: outb(0x1F5, (unsigned char)(LBA >> 16))
-  Send the "READ SECTORS" command (0x20) to port 0x1F7: outb(0x1F7, 0x20)
-  Wait for an IRQ or poll.
-  Transfer 256 16-bit values, a uint16_t at a time, into your buffer from I/O port 0x1F0. (In assembler, REP INSW works well for this.)
-  Then loop back to waiting for the next IRQ (or poll again -- see next note) for each successive sector.
+  Send READ SECTORS (0x20) or READ MULTIPLE (0xC4) to port 0x1F7
+  Poll the status once per DRQ block, a single sector or a whole multiple
+  block, and move the block with REP INSW. Interrupts stay masked (nIEN).
 */
-bool ata_pio_28_read(uint8_t channel, uint8_t drive, uint32_t lba_addr, uint16_t sector_count, void *dest)
+static bool ata_pio_28_transfer(uint8_t channel, uint8_t drive, uint32_t lba_addr, uint16_t sector_count, uint8_t *buffer, bool write)
 {
-	if (channel > ATA_SECONDARY)
+	if (channel > ATA_SECONDARY || drive > ATA_SLAVE)
+		return false;
+	if (sector_count == 0 || sector_count > ATA_PIO_MAX_SECTORS || lba_addr + sector_count > ATA_PIO_MAX_LBA)
 		return false;
 
-	outb(channels[channel].ctrl, 2);
-
-	if (sector_count >= 256)
-		panic("Trying to read more then 256 sector from ata_pio_28");
-	// soft_reset(dev_ctl); /* waits until master drive is ready again */
+	uint8_t block = ata_pio_multiple_enabled ? ata_pio_multiple[channel][drive] : 0;
+	uint8_t cmd;
+	if (block > 1)
+		cmd = write ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_READ_MULTIPLE;
+	else
+		cmd = write ? ATA_CMD_WRITE_PIO : ATA_CMD_READ_PIO;
+	if (block == 0)
+		block = 1;
 
 	uint16_t base = channels[channel].base;
+	outb(channels[channel].ctrl, 2);
 	outb(base + 6, 0xE0 | (drive << 4) | ((lba_addr >> 24) & 0x0f));
-	outb(base + 2, sector_count);
+	wait_device(channel);
+	// 256 sectors wrap to 0, which the drive reads as 256
+	outb(base + 2, (uint8_t)sector_count);
 	outb(base + 3, (uint8_t)lba_addr);
 	outb(base + 4, (uint8_t)(lba_addr >> 8));
 	outb(base + 5, (uint8_t)(lba_addr >> 16));
-	outb(base + 7, 0x20);
-
-	if (sector_count == 0)
-		sector_count = 256;
-
-	size_t dest_idx = 0;
-	while (sector_count--) {
-		while (inb(base + 7) & 0x80)
-			;
-		if (inb(base + 7) & 0x21)
-			panic("ERR or DF set, error reg is %x", inb(base + 1));
-
-		/* in al, dx		; grab a status byte */
-		/* test al, 0x80	; BSY flag set? */
-		/* jne short .pior_l	; (all other flags are meaningless if BSY is set) */
-		/* test al, 0x21	; ERR or DF set? */
-		/* jne short .fail */
-		uint16_t word_to_trans = 256;
-		while (word_to_trans--) {
-			uint16_t data = inw(base);
-			((uint8_t *)dest)[dest_idx++] = (uint8_t)data;
-			((uint8_t *)dest)[dest_idx++] = (uint8_t)(data >> 8);
+	outb(base + 7, cmd);
+
+	bool ok = true;
+	while (sector_count > 0) {
+		uint16_t count = sector_count < block ? sector_count : block;
+		if (!ata_pio_wait_ok(channel, true)) {
+			ok = false;
+			break;
 		}
+
+		if (write)
+			outsw(base, buffer, (size_t)count * 256);
+		else
+			insw(base, buffer, (size_t)count * 256);
+
+		buffer += (size_t)count * 512;
+		sector_count -= count;
 	}
+
+	if (ok && write) {
+		ok = ata_pio_wait_ok(channel, false);
+		if (ok) {
+			outb(base + 7, ATA_CMD_CACHE_FLUSH);
+			ok = ata_pio_wait_ok(channel, false);
+		}
+	}
+
 	outb(channels[channel].ctrl, 0);
-	return true;
+	return ok;
+}
+
+bool ata_pio_28_read(uint8_t channel, uint8_t drive, uint32_t lba_addr, uint16_t sector_count, void *dest)
+{
+	return ata_pio_28_transfer(channel, drive, lba_addr, sector_count, dest, false);
 }
 
 char *ata_pio_debug_devtype(enum ATADEV dev_type)
@@ -214,46 +308,7 @@ char *ata_pio_debug_devtype(enum ATADEV dev_type)
 
 bool ata_pio_28_write(uint8_t channel, uint8_t drive, uint32_t lba_addr, uint16_t sector_count, const void *src)
 {
-	if (channel > ATA_SECONDARY)
-		return false;
-
-	outb(channels[channel].ctrl, 2);
-
-	if (sector_count >= 256)
-		panic("Trying to write more then 256 sector from ata_pio_28");
-
-	uint16_t base = channels[channel].base;
-	outb(base + 6, 0xE0 | (drive << 4) | ((lba_addr >> 24) & 0x0f));
-	outb(base + 2, sector_count);
-	outb(base + 3, (uint8_t)lba_addr);
-	outb(base + 4, (uint8_t)(lba_addr >> 8));
-	outb(base + 5, (uint8_t)(lba_addr >> 16));
-	outb(base + 7, 0x30);
-
-	if (sector_count == 0)
-		sector_count = 256;
-
-	size_t src_idx = 0;
-	while (sector_count--) {
-		while (inb(base + 7) & 0x80)
-			;
-		if (inb(base + 7) & 0x21)
-			panic("ERR or DF set, error reg is %x", inb(base + 1));
-
-		uint16_t word_to_trans = 256;
-		while (word_to_trans--) {
-			uint16_t data = ((const uint8_t *)src)[src_idx++];
-			data |= ((uint16_t)((const uint8_t *)src)[src_idx++]) << 8;
-			outw(base, data);
-		}
-	}
-
-	outb(base + 7, ATA_CMD_CACHE_FLUSH);
-	while (inb(base + 7) & ATA_SR_BSY)
-		;
-
-	outb(channels[channel].ctrl, 0);
-	return true;
+	return ata_pio_28_transfer(channel, drive, lba_addr, sector_count, (uint8_t *)src, true);
 }
 
 void ide_initialize(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2, unsigned int BAR3, unsigned int BAR4)
@@ -11,10 +11,56 @@ enum ATADEV {
 	ATADEV_UNKNOWN = 4,
 };
 
+enum ATA_SR {
+	ATA_SR_BSY = 0x80,  // Busy
+	ATA_SR_DRDY = 0x40, // Drive ready
+	ATA_SR_DF = 0x20,   // Drive write fault
+	ATA_SR_DSC = 0x10,  // Drive seek complete
+	ATA_SR_DRQ = 0x08,  // Data request ready
+	ATA_SR_CORR = 0x04, // Corrected data
+	ATA_SR_IDX = 0x02,  // Index
+	ATA_SR_ERR = 0x01,  // Error
+};
+
+enum ATA_CMD {
+	ATA_CMD_READ_PIO = 0x20,
+	ATA_CMD_READ_PIO_EXT = 0x24,
+	ATA_CMD_READ_DMA = 0xC8,
+	ATA_CMD_READ_DMA_EXT = 0x25,
+	ATA_CMD_WRITE_PIO = 0x30,
+	ATA_CMD_WRITE_PIO_EXT = 0x34,
+	ATA_CMD_WRITE_DMA = 0xCA,
+	ATA_CMD_WRITE_DMA_EXT = 0x35,
+	ATA_CMD_CACHE_FLUSH = 0xE7,
+	ATA_CMD_CACHE_FLUSH_EXT = 0xEA,
+	ATA_CMD_PACKET = 0xA0,
+	ATA_CMD_IDENTIFY_PACKET = 0xA1,
+	ATA_CMD_IDENTIFY = 0xEC,
+	ATA_CMD_READ_MULTIPLE = 0xC4,
+	ATA_CMD_WRITE_MULTIPLE = 0xC5,
+	ATA_CMD_SET_MULTIPLE = 0xC6,
+};
+
+struct IDEChannelRegisters {
+	unsigned short base;  // I/O Base.
+	unsigned short ctrl;  // Control Base
+	unsigned short bmide; // Bus Master IDE
+	unsigned char nIEN;   // nIEN (No Interrupt);
+};
+
+extern struct IDEChannelRegisters channels[2];
+
 char *ata_pio_debug_devtype(enum ATADEV dev_type);
 
 uint32_t ata_pio_detect_devtype(uint8_t channel, uint8_t drive);
 
+// Use READ/WRITE MULTIPLE on drives set up by ata_pio_setup_multiple
+extern bool ata_pio_multiple_enabled;
+
+// IDENTIFY the drive and enable its largest multiple block, returns the sectors per block
+uint8_t ata_pio_setup_multiple(uint8_t channel, uint8_t drive);
+
+// 1 to 256 sectors, returns false on a drive error or timeout
 bool ata_pio_28_read(uint8_t channel, uint8_t drive, uint32_t lba_addr, uint16_t sector_count, void *dest);
 bool ata_pio_28_write(uint8_t channel, uint8_t drive, uint32_t lba_addr, uint16_t sector_count, const void *src);
 
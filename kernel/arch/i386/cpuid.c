@@ -35,3 +35,22 @@ uint8_t cpuid_apic_id()
 			 : "eax", "ebx", "ecx", "edx", "memory");
 	return (ebx >> 24) & 0xFF;
 }
+
+size_t cpuid_cache_line_size()
+{
+	struct feature_info feat = cpuid_get_feature_info();
+	if (!feat.CLFSH)
+		return CPUID_DEFAULT_CACHE_LINE;
+
+	uint32_t ebx;
+	__asm__ volatile("mov $1, %%eax\n\t"
+			 "cpuid\n\t"
+			 "mov %%ebx, %0"
+			 : "=r"(ebx)
+			 :
+			 : "eax", "ebx", "ecx", "edx", "memory");
+
+	// CLFLUSH line size is reported in 8 byte units
+	size_t line = ((ebx >> 8) & 0xFF) * 8;
+	return line == 0 ? CPUID_DEFAULT_CACHE_LINE : line;
+}
@@ -1,7 +1,10 @@
 #pragma once
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#define CPUID_DEFAULT_CACHE_LINE 64
+
 struct ext_feature_info {
 	bool SSE3 : 1; //Streaming SIMD Extensions 3 (SSE3). A value of 1 indicates the processor supports this technology.
 	uint8_t reserved_1 : 2;
@@ -170,3 +173,5 @@ struct feature_info cpuid_get_feature_info();
 
 bool cpuid_has_apic();
 uint8_t cpuid_apic_id();
+// Cache line size in bytes, CPUID_DEFAULT_CACHE_LINE when not reported
+size_t cpuid_cache_line_size();
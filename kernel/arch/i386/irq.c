@@ -1,5 +1,7 @@
 #include "irq.h"
 
+#include "lapic.h"
+
 #include <kernel/interrupt.h>
 #include <stddef.h>
 
@@ -15,6 +17,8 @@ struct irq_handler_entry {
 
 static struct irq_handler_entry irq_handler_pool[IRQ_HANDLER_SLOTS] = { 0 };
 static struct irq_handler_entry *irq_handlers[IRQ_LINE_COUNT] = { 0 };
+// MSI vectors are never shared, one entry per vector
+static struct irq_handler_entry irq_msi_handlers[IRQ_MSI_COUNT] = { 0 };
 
 static struct irq_handler_entry *irq_handler_alloc(void)
 {
@@ -119,6 +123,46 @@ static void irq_dispatch(uint8_t vector)
 		it->handler(irq_line, it->context);
 }
 
+uint8_t irq_alloc_msi_vector(irq_handler_t handler, void *context)
+{
+	if (handler == nullptr)
+		return 0;
+
+	for (uint8_t i = 0; i < IRQ_MSI_COUNT; i++) {
+		struct irq_handler_entry *entry = &irq_msi_handlers[i];
+		if (entry->in_use)
+			continue;
+
+		entry->context = context;
+		entry->handler = handler;
+		entry->in_use = true;
+		return (uint8_t)(IRQ_MSI_FIRST + i);
+	}
+
+	return 0;
+}
+
+void irq_free_msi_vector(uint8_t vector)
+{
+	if (vector < IRQ_MSI_FIRST || vector >= IRQ_MSI_FIRST + IRQ_MSI_COUNT)
+		return;
+
+	irq_handler_free(&irq_msi_handlers[vector - IRQ_MSI_FIRST]);
+}
+
+// Called from the MSI stubs. The message goes straight to the LAPIC so the
+// only acknowledgement needed is its EOI, there is no line to mask.
+void irq_msi_dispatch(uint32_t vector)
+{
+	if (vector >= IRQ_MSI_FIRST && vector < IRQ_MSI_FIRST + IRQ_MSI_COUNT) {
+		struct irq_handler_entry *entry = &irq_msi_handlers[vector - IRQ_MSI_FIRST];
+		if (entry->in_use && entry->handler != nullptr)
+			entry->handler((uint8_t)vector, entry->context);
+	}
+
+	lapic_eoi();
+}
+
 #define DEFINE_IRQ_DISPATCH(vector)       \
 	void isr_##vector##_handler(void) \
 	{                                 \
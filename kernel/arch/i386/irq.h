@@ -7,3 +7,53 @@ typedef void (*irq_handler_t)(uint8_t irq_line, void *context);
 
 bool irq_register_handler(uint8_t irq_line, irq_handler_t handler, void *context);
 bool irq_unregister_handler(uint8_t irq_line, irq_handler_t handler, void *context);
+
+// Reserve an MSI vector, the handler receives the vector instead of a line.
+// Returns 0 when every vector is taken.
+uint8_t irq_alloc_msi_vector(irq_handler_t handler, void *context);
+void irq_free_msi_vector(uint8_t vector);
+
+// Disable interrupts, returns the previous EFLAGS to hand to irq_restore
+static inline uint32_t irq_save(void)
+{
+	uint32_t flags;
+	__asm__ volatile("pushf\n\t"
+			 "pop %0\n\t"
+			 "cli"
+			 : "=r"(flags)
+			 :
+			 : "memory");
+	return flags;
+}
+
+static inline void irq_restore(uint32_t flags)
+{
+	if (flags & (1u << 9))
+		__asm__ volatile("sti" : : : "memory");
+}
+
+static inline bool irq_enabled(void)
+{
+	uint32_t flags;
+	__asm__ volatile("pushf\n\t"
+			 "pop %0"
+			 : "=r"(flags)
+			 :
+			 : "memory");
+	return (flags & (1u << 9)) != 0;
+}
+
+// Halt until the next interrupt unless cond is already set, the check and
+// the halt cannot race since sti only takes effect after hlt is reached
+static inline void irq_halt_unless(volatile bool *cond)
+{
+	__asm__ volatile("cli" : : : "memory");
+	if (*cond)
+		__asm__ volatile("sti" : : : "memory");
+	else
+		__asm__ volatile("sti\n\t"
+				 "hlt"
+				 :
+				 :
+				 : "memory");
+}
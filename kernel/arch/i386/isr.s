@@ -77,6 +77,27 @@ isr_stub_%+%1:
 	iret
 %endmacro
 
+;; The page fault handler gets CR2 and the error code as arguments
+%macro isr_page_fault_stub 1
+extern isr_%+%1_handler:function
+
+global isr_stub_%+%1:function
+isr_stub_%+%1:
+	pusha
+
+	get_GOT
+
+	push	dword [esp + 32]	; error code, right above the pusha frame
+	mov	eax, cr2
+	push	eax
+	call	[ebx + isr_%+%1_handler wrt ..got]
+	add	esp, 8
+
+	popa
+	add	esp, 4			; drop the error code
+	iret
+%endmacro
+
 %macro isr_irq_master_stub 1
 global isr_%+%1_handler:function weak
 extern isr_%+%1_handler:function strong
@@ -149,6 +170,23 @@ isr_stub_%+%1:
 	iret
 %endmacro
 
+%macro isr_msi_stub 1
+extern irq_msi_dispatch:function
+
+global isr_stub_%+%1:function
+isr_stub_%+%1:
+	pusha
+
+	get_GOT
+
+	push	dword %1
+	call	[ebx + irq_msi_dispatch wrt ..got]
+	add	esp, 4
+
+	popa
+	iret
+%endmacro
+
 
 isr_no_err_stub 0
 isr_no_err_stub 1
@@ -164,7 +202,7 @@ isr_err_stub    10
 isr_err_stub    11
 isr_err_stub    12
 isr_err_stub    13
-isr_err_stub    14
+isr_page_fault_stub 14
 isr_no_err_stub 15
 isr_no_err_stub 16
 isr_err_stub    17
@@ -201,22 +239,22 @@ isr_irq_slave_stub  45
 isr_irq_slave_stub  46
 isr_irq_slave_stub  47
 
-isr_no_err_stub 48
-isr_no_err_stub 49
-isr_no_err_stub 50
-isr_no_err_stub 51
-isr_no_err_stub 52
-isr_no_err_stub 53
-isr_no_err_stub 54
-isr_no_err_stub 55
-isr_no_err_stub 56
-isr_no_err_stub 57
-isr_no_err_stub 58
-isr_no_err_stub 59
-isr_no_err_stub 60
-isr_no_err_stub 61
-isr_no_err_stub 62
-isr_no_err_stub 63
+isr_msi_stub    48
+isr_msi_stub    49
+isr_msi_stub    50
+isr_msi_stub    51
+isr_msi_stub    52
+isr_msi_stub    53
+isr_msi_stub    54
+isr_msi_stub    55
+isr_msi_stub    56
+isr_msi_stub    57
+isr_msi_stub    58
+isr_msi_stub    59
+isr_msi_stub    60
+isr_msi_stub    61
+isr_msi_stub    62
+isr_msi_stub    63
 isr_no_err_stub 64
 isr_no_err_stub 65
 isr_no_err_stub 66
@@ -22,6 +22,7 @@ MODULE("LAPIC");
 
 static volatile uint32_t *lapic_base = nullptr;
 static uintptr_t lapic_phys_base = LAPIC_MMIO_BASE;
+static bool lapic_on = false;
 
 void lapic_set_base(uintptr_t phys)
 {
@@ -63,9 +64,15 @@ void lapic_enable(void)
 
 	uint32_t svr = 0xFF | LAPIC_SVR_ENABLE;
 	lapic_write(LAPIC_REG_SVR, svr, (~0));
+	lapic_on = true;
 	mprint("LAPIC enabled with SVR=0x%x\n", svr);
 }
 
+bool lapic_enabled(void)
+{
+	return lapic_on;
+}
+
 void lapic_eoi(void)
 {
 	if (lapic_base == nullptr)
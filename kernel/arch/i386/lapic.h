@@ -4,6 +4,8 @@
 #include <stdbool.h>
 
 void lapic_enable(void);
+// Set once lapic_enable() software enabled the LAPIC, cpuid only says one exists
+bool lapic_enabled(void);
 void lapic_eoi(void);
 void lapic_send_ipi(uint8_t apic_id, uint8_t vector, uint8_t delivery_mode);
 uint8_t lapic_get_id(void);
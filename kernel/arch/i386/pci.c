@@ -7,6 +7,27 @@
 
 #define PCI_CONFIG_ENABLE (1u << 31)
 
+#define PCI_REG_COMMAND 0x04
+#define PCI_REG_STATUS 0x06
+#define PCI_REG_CAP_PTR 0x34
+
+#define PCI_COMMAND_INTX_DISABLE (1u << 10)
+#define PCI_STATUS_CAP_LIST (1u << 4)
+
+// Offsets inside the MSI capability
+#define PCI_MSI_CONTROL 0x02
+#define PCI_MSI_ADDRESS 0x04
+#define PCI_MSI_DATA_32 0x08
+#define PCI_MSI_DATA_64 0x0C
+
+#define PCI_MSI_CONTROL_ENABLE (1u << 0)
+#define PCI_MSI_CONTROL_MME_MASK (7u << 4)
+#define PCI_MSI_CONTROL_64BIT (1u << 7)
+
+// Fixed delivery, physical destination, edge triggered
+#define PCI_MSI_ADDRESS_BASE 0xFEE00000u
+#define PCI_MSI_ADDRESS_DEST_SHIFT 12
+
 static uint32_t pci_make_address(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset)
 {
 	return PCI_CONFIG_ENABLE | ((uint32_t)bus << 16) | ((uint32_t)device << 11) | ((uint32_t)function << 8) |
@@ -84,37 +105,43 @@ static bool pci_match_class(const struct pci_device *dev, uint8_t class_id, uint
 	return true;
 }
 
-bool pci_find_class(uint8_t class_id, uint8_t subclass, uint8_t prog_if, struct pci_device *out)
+size_t pci_find_class_all(uint8_t class_id, uint8_t subclass, uint8_t prog_if, struct pci_device *out, size_t max)
 {
+	size_t found = 0;
+
 	for (uint16_t bus = 0; bus < 256; bus++) {
 		for (uint8_t device = 0; device < 32; device++) {
 			struct pci_device dev = { 0 };
 			if (!pci_read_device((uint8_t)bus, device, 0, &dev))
 				continue;
 
-			if (pci_match_class(&dev, class_id, subclass, prog_if)) {
-				if (out != nullptr)
-					*out = dev;
-				return true;
-			}
-
-			if ((dev.header_type & 0x80) == 0)
-				continue;
-
-			for (uint8_t function = 1; function < 8; function++) {
-				if (!pci_read_device((uint8_t)bus, device, function, &dev))
+			uint8_t functions = (dev.header_type & 0x80) ? 8 : 1;
+			for (uint8_t function = 0; function < functions; function++) {
+				if (function > 0 && !pci_read_device((uint8_t)bus, device, function, &dev))
+					continue;
+				if (!pci_match_class(&dev, class_id, subclass, prog_if))
 					continue;
 
-				if (pci_match_class(&dev, class_id, subclass, prog_if)) {
-					if (out != nullptr)
-						*out = dev;
-					return true;
-				}
+				if (out != nullptr)
+					out[found] = dev;
+				if (++found == max)
+					return found;
 			}
 		}
 	}
 
-	return false;
+	return found;
+}
+
+bool pci_find_class(uint8_t class_id, uint8_t subclass, uint8_t prog_if, struct pci_device *out)
+{
+	struct pci_device dev = { 0 };
+	if (pci_find_class_all(class_id, subclass, prog_if, &dev, 1) == 0)
+		return false;
+
+	if (out != nullptr)
+		*out = dev;
+	return true;
 }
 
 bool pci_find_storage_device(uint8_t subclass, struct pci_device *out)
@@ -132,3 +159,69 @@ void pci_enable_bus_mastering(const struct pci_device *device)
 	uint32_t new_value = (uint32_t)command | ((uint32_t)pci_read_config_word(device->bus, device->device, device->function, 0x06) << 16);
 	pci_write_config_dword(device->bus, device->device, device->function, 0x04, new_value);
 }
+
+static void pci_write_config_word(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint16_t value)
+{
+	uint32_t dword = pci_read_config_dword(bus, device, function, offset);
+	uint8_t shift = (offset & 2) * 8;
+
+	dword &= ~(0xFFFFu << shift);
+	dword |= (uint32_t)value << shift;
+	pci_write_config_dword(bus, device, function, offset, dword);
+}
+
+uint8_t pci_find_capability(const struct pci_device *device, uint8_t cap_id)
+{
+	if (device == nullptr)
+		return 0;
+
+	uint16_t status = pci_read_config_word(device->bus, device->device, device->function, PCI_REG_STATUS);
+	if ((status & PCI_STATUS_CAP_LIST) == 0)
+		return 0;
+
+	uint8_t offset = pci_read_config_byte(device->bus, device->device, device->function, PCI_REG_CAP_PTR) & 0xFC;
+	// The list lives in the 192 bytes after the header, bound the walk in case it loops
+	for (int hops = 0; offset != 0 && hops < 48; hops++) {
+		uint16_t header = pci_read_config_word(device->bus, device->device, device->function, offset);
+		if ((header & 0xFF) == cap_id)
+			return offset;
+		offset = (uint8_t)(header >> 8) & 0xFC;
+	}
+
+	return 0;
+}
+
+bool pci_has_msi(const struct pci_device *device)
+{
+	return pci_find_capability(device, PCI_CAP_ID_MSI) != 0;
+}
+
+bool pci_enable_msi(const struct pci_device *device, uint8_t vector, uint8_t apic_id)
+{
+	uint8_t cap = pci_find_capability(device, PCI_CAP_ID_MSI);
+	if (cap == 0)
+		return false;
+
+	uint8_t bus = device->bus, dev = device->device, function = device->function;
+	uint16_t control = pci_read_config_word(bus, dev, function, cap + PCI_MSI_CONTROL);
+
+	// Disable while the address and data are inconsistent
+	pci_write_config_word(bus, dev, function, cap + PCI_MSI_CONTROL, control & ~PCI_MSI_CONTROL_ENABLE);
+
+	pci_write_config_dword(bus, dev, function, cap + PCI_MSI_ADDRESS,
+			       PCI_MSI_ADDRESS_BASE | ((uint32_t)apic_id << PCI_MSI_ADDRESS_DEST_SHIFT));
+	if (control & PCI_MSI_CONTROL_64BIT) {
+		pci_write_config_dword(bus, dev, function, cap + PCI_MSI_ADDRESS + 4, 0);
+		pci_write_config_word(bus, dev, function, cap + PCI_MSI_DATA_64, vector);
+	} else {
+		pci_write_config_word(bus, dev, function, cap + PCI_MSI_DATA_32, vector);
+	}
+
+	// A single message, every interrupt source of the function shares it
+	control &= ~PCI_MSI_CONTROL_MME_MASK;
+	pci_write_config_word(bus, dev, function, cap + PCI_MSI_CONTROL, control | PCI_MSI_CONTROL_ENABLE);
+
+	uint16_t command = pci_read_config_word(bus, dev, function, PCI_REG_COMMAND);
+	pci_write_config_word(bus, dev, function, PCI_REG_COMMAND, command | PCI_COMMAND_INTX_DISABLE);
+	return true;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define PCI_CLASS_MASS_STORAGE 0x01
@@ -32,6 +33,17 @@ void pci_write_config_dword(uint8_t bus, uint8_t device, uint8_t function, uint8
 
 bool pci_read_device(uint8_t bus, uint8_t device, uint8_t function, struct pci_device *out);
 bool pci_find_class(uint8_t class_id, uint8_t subclass, uint8_t prog_if, struct pci_device *out);
+// Fills out with up to max matching functions, returns how many were found
+size_t pci_find_class_all(uint8_t class_id, uint8_t subclass, uint8_t prog_if, struct pci_device *out, size_t max);
 bool pci_find_storage_device(uint8_t subclass, struct pci_device *out);
 
 void pci_enable_bus_mastering(const struct pci_device *device);
+
+#define PCI_CAP_ID_MSI 0x05
+
+// Offset of the capability cap_id in config space, 0 when absent
+uint8_t pci_find_capability(const struct pci_device *device, uint8_t cap_id);
+bool pci_has_msi(const struct pci_device *device);
+// Deliver the function's interrupt as a single MSI vector to the LAPIC apic_id
+// and mask its INTx pin. Calling it again only moves the interrupt.
+bool pci_enable_msi(const struct pci_device *device, uint8_t vector, uint8_t apic_id);
@@ -14,6 +14,9 @@ static_assert(MAX_BLOCKS == 0x100000);
 static_assert(BITMAP_WORDS > 0, "Bitmap words must be positive");
 #define BITMAP_CHUNK_CAPACITY (BITMAP_WORDS * BIT(sizeof(uint32_t)))
 
+// Free blocks an allocation should leave behind before shrinkers are asked for memory
+#define PHY_MEM_LOW_WATERMARK 64
+
 /**
  * Memory book keeping will be keept using a linked list of block all
  * the element of each block will be a fat pointer (address and size)
@@ -58,6 +61,10 @@ static struct phy_slab_cache bitmap_slab = { 0 };
 static struct phy_slab_cache booking_block_slab = { 0 };
 static LIST_HEAD(booking_block_list);
 static LIST_HEAD(bitmap_chunk_list);
+static LIST_HEAD(shrinker_list);
+static bool shrinking = false;
+// Kept by bitmap_set_block(), the allocation path reads it instead of walking the chunks
+static size_t free_block_count = 0;
 
 static void *metadata_alloc(size_t size)
 {
@@ -176,9 +183,11 @@ static void bitmap_set_block(struct bitmap_chunk *chunk, size_t block_idx, bool
 	if (set) {
 		chunk->bits[word] |= mask;
 		chunk->used_blocks += 1;
+		free_block_count -= 1;
 	} else {
 		chunk->bits[word] &= ~mask;
 		chunk->used_blocks -= 1;
+		free_block_count += 1;
 	}
 }
 
@@ -194,12 +203,7 @@ static size_t bitmap_total_blocks(void)
 
 static size_t bitmap_free_blocks(void)
 {
-	size_t free = 0;
-	list_for_each(&bitmap_chunk_list) {
-		struct bitmap_chunk *chunk = list_entry(it, struct bitmap_chunk, list);
-		free += chunk->capacity - chunk->used_blocks;
-	}
-	return free;
+	return free_block_count;
 }
 
 static bool init_bitmap_chunks(void)
@@ -236,6 +240,8 @@ void phy_mem_reset()
 
 	RESET_LIST_ITEM(&booking_block_list);
 	RESET_LIST_ITEM(&bitmap_chunk_list);
+	// Every block starts used, phy_mem_add_region() frees them
+	free_block_count = 0;
 
 	if (!init_bitmap_chunks())
 		return;
@@ -292,19 +298,60 @@ void phy_mem_add_region(size_t addr, size_t len)
 	phy_mem_set_region(addr, len, false);
 }
 
-__attribute__((hot)) fatptr_t phy_mem_alloc(size_t size)
+void phy_mem_register_shrinker(struct phy_mem_shrinker *shrinker)
 {
-	const size_t req_block = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	const size_t req_size = req_block * BLOCK_SIZE;
-	size_t start_block = 0;
-	bool found = false;
-	size_t run = 0;
+	if (shrinker == nullptr || shrinker->shrink == nullptr)
+		return;
 
-	if (req_block == 0)
-		return (fatptr_t){ .ptr = 0, .len = 0 };
+	// A zeroed list item means the shrinker is not registered yet
+	if (shrinker->list.next != nullptr)
+		return;
 
-	if (bitmap_free_blocks() < req_block)
-		return (fatptr_t){ .ptr = 0, .len = 0 };
+	list_add(&shrinker->list, shrinker_list.prev);
+}
+
+void phy_mem_unregister_shrinker(struct phy_mem_shrinker *shrinker)
+{
+	if (shrinker == nullptr || shrinker->list.next == nullptr)
+		return;
+
+	list_rm(&shrinker->list);
+	shrinker->list.next = nullptr;
+	shrinker->list.prev = nullptr;
+}
+
+size_t phy_mem_shrink(size_t nr_pages)
+{
+	// Shrinkers free through phy_mem_free but may allocate too, do not recurse
+	if (shrinking || nr_pages == 0)
+		return 0;
+
+	shrinking = true;
+	size_t freed = 0;
+	list_for_each(&shrinker_list) {
+		struct phy_mem_shrinker *shrinker = list_entry(it, struct phy_mem_shrinker, list);
+		freed += shrinker->shrink(nr_pages - freed, shrinker->ctx);
+		if (freed >= nr_pages)
+			break;
+	}
+	shrinking = false;
+
+	return freed;
+}
+
+static void phy_mem_balance(size_t req_block)
+{
+	const size_t free = bitmap_free_blocks();
+	if (free >= req_block + PHY_MEM_LOW_WATERMARK)
+		return;
+
+	phy_mem_shrink(req_block + PHY_MEM_LOW_WATERMARK - free);
+}
+
+// Highest run of req_block free blocks
+static bool phy_mem_find_run(size_t req_block, size_t *out_start)
+{
+	size_t run = 0;
 
 	list_rev_for_each(&bitmap_chunk_list) {
 		struct bitmap_chunk *chunk = list_entry(it, struct bitmap_chunk, list);
@@ -312,14 +359,11 @@ __attribute__((hot)) fatptr_t phy_mem_alloc(size_t size)
 			const size_t block_idx = chunk->base_block + (i - 1);
 
 			if (!bitmap_block_used(chunk, block_idx)) {
-				if (run == 0)
-					start_block = block_idx;
-
 				run += 1;
 
 				if (run >= req_block) {
-					found = true;
-					goto found_blocks;
+					*out_start = block_idx;
+					return true;
 				}
 			} else {
 				run = 0;
@@ -327,65 +371,22 @@ __attribute__((hot)) fatptr_t phy_mem_alloc(size_t size)
 		}
 	}
 
-found_blocks:
-	if (!found)
-		return (fatptr_t){ .ptr = 0, .len = 0 };
-
-	struct booking_block *target_block = nullptr;
-	size_t slot_idx = 0;
-
-	list_for_each(&booking_block_list) {
-		struct booking_block *cur_block = list_entry(it, struct booking_block, list);
-		for (size_t i = 0; i < BOOKING_COUNT; i++) {
-			if (cur_block->allocs[i].ptr == nullptr) {
-				target_block = cur_block;
-				slot_idx = i;
-				goto slot_found;
-			}
-		}
-	}
-
-	target_block = alloc_booking_block();
-	slot_idx = 0;
-
-slot_found:
-	if (target_block == nullptr)
-		return (fatptr_t){ .ptr = 0, .len = 0 };
-
-	target_block->allocs[slot_idx].ptr = (void *)(start_block * BLOCK_SIZE);
-	target_block->allocs[slot_idx].len = req_size;
-
-	for (size_t i = 0; i < req_block; i++) {
-		const size_t block_idx = start_block + i;
-		struct bitmap_chunk *chunk = find_chunk(block_idx);
-		if (chunk != nullptr)
-			bitmap_set_block(chunk, block_idx, true);
-	}
-
-	return (fatptr_t){ .ptr = (void *)(start_block * BLOCK_SIZE), .len = req_size };
+	return false;
 }
 
-__attribute__((hot)) fatptr_t phy_mem_alloc_below(size_t size, size_t max_addr)
+// Lowest run of req_block free blocks ending at or below max_block
+static bool phy_mem_find_run_below(size_t req_block, size_t max_block, size_t *out_start)
 {
-	const size_t req_block = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	const size_t req_size = req_block * BLOCK_SIZE;
-	const size_t max_block = max_addr / BLOCK_SIZE;
 	size_t start_block = 0;
-	bool found = false;
 	size_t run = 0;
 
-	if (req_block == 0 || max_block == 0 || req_block > max_block)
-		return (fatptr_t){ .ptr = 0, .len = 0 };
-	if (bitmap_free_blocks() < req_block)
-		return (fatptr_t){ .ptr = 0, .len = 0 };
-
 	list_for_each(&bitmap_chunk_list) {
 		struct bitmap_chunk *chunk = list_entry(it, struct bitmap_chunk, list);
 		for (size_t i = 0; i < chunk->capacity; i++) {
 			const size_t block_idx = chunk->base_block + i;
 
 			if (block_idx + req_block > max_block)
-				goto end_search;
+				return false;
 
 			if (!bitmap_block_used(chunk, block_idx)) {
 				if (run == 0)
@@ -394,8 +395,8 @@ __attribute__((hot)) fatptr_t phy_mem_alloc_below(size_t size, size_t max_addr)
 				run += 1;
 
 				if (run >= req_block) {
-					found = true;
-					goto found_blocks;
+					*out_start = start_block;
+					return true;
 				}
 			} else {
 				run = 0;
@@ -403,11 +404,13 @@ __attribute__((hot)) fatptr_t phy_mem_alloc_below(size_t size, size_t max_addr)
 		}
 	}
 
-end_search:
-	if (!found)
-		return (fatptr_t){ .ptr = 0, .len = 0 };
+	return false;
+}
 
-found_blocks:
+// Record the allocation in a booking block and mark its blocks used
+static fatptr_t phy_mem_book(size_t start_block, size_t req_block)
+{
+	const size_t req_size = req_block * BLOCK_SIZE;
 	struct booking_block *target_block = nullptr;
 	size_t slot_idx = 0;
 
@@ -442,6 +445,50 @@ slot_found:
 	return (fatptr_t){ .ptr = (void *)(start_block * BLOCK_SIZE), .len = req_size };
 }
 
+__attribute__((hot)) fatptr_t phy_mem_alloc(size_t size)
+{
+	const size_t req_block = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t start_block = 0;
+
+	if (req_block == 0)
+		return (fatptr_t){ .ptr = 0, .len = 0 };
+
+	phy_mem_balance(req_block);
+	if (bitmap_free_blocks() < req_block)
+		return (fatptr_t){ .ptr = 0, .len = 0 };
+
+	bool found = phy_mem_find_run(req_block, &start_block);
+	// Enough free blocks but no run long enough, what the shrinkers free may close a gap
+	if (!found && phy_mem_shrink(req_block) > 0)
+		found = phy_mem_find_run(req_block, &start_block);
+	if (!found)
+		return (fatptr_t){ .ptr = 0, .len = 0 };
+
+	return phy_mem_book(start_block, req_block);
+}
+
+__attribute__((hot)) fatptr_t phy_mem_alloc_below(size_t size, size_t max_addr)
+{
+	const size_t req_block = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	const size_t max_block = max_addr / BLOCK_SIZE;
+	size_t start_block = 0;
+
+	if (req_block == 0 || max_block == 0 || req_block > max_block)
+		return (fatptr_t){ .ptr = 0, .len = 0 };
+
+	phy_mem_balance(req_block);
+	if (bitmap_free_blocks() < req_block)
+		return (fatptr_t){ .ptr = 0, .len = 0 };
+
+	bool found = phy_mem_find_run_below(req_block, max_block, &start_block);
+	if (!found && phy_mem_shrink(req_block) > 0)
+		found = phy_mem_find_run_below(req_block, max_block, &start_block);
+	if (!found)
+		return (fatptr_t){ .ptr = 0, .len = 0 };
+
+	return phy_mem_book(start_block, req_block);
+}
+
 __attribute__((hot)) void phy_mem_free(const fatptr_t addr_ptr)
 {
 	list_for_each(&booking_block_list) {
@@ -1,4 +1,5 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 
 static inline void outb(uint16_t port, uint8_t val)
@@ -37,6 +38,17 @@ static inline uint32_t ind(uint16_t port)
 	return ret;
 }
 
+// Move count words between a port and memory in one string instruction
+static inline void insw(uint16_t port, void *buf, size_t count)
+{
+	__asm__ volatile("rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void *buf, size_t count)
+{
+	__asm__ volatile("rep outsw" : "+S"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
 static inline void io_wait(void)
 {
 	outb(0x80, 0);
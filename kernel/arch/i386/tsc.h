@@ -0,0 +1,10 @@
+#pragma once
+#include <stdint.h>
+
+// Read the time stamp counter, callers should check cpuid feature_info.TSC
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+	return ((uint64_t)hi << 32) | lo;
+}
@@ -82,6 +82,8 @@ void map_page(const void *phy_addr, const void *virt_addr, uint16_t virt_flags)
 	if ((pd[pd_idx] & VMM_ENTRY_PRESENT_BIT) == 0) {
 		pd[pd_idx] = (size_t)phy_mem_alloc(PAGE_SIZE).ptr;
 		pd[pd_idx] |= VMM_ENTRY_READ_WRITE_BIT | VMM_ENTRY_PRESENT_BIT;
+		// The recursive mapping may still point at a table freed by unmap_page
+		invalidate(pt);
 		memset(pt, 0, PAGE_SIZE);
 	}
 
@@ -121,31 +123,31 @@ static bool is_page_table_empty(size_t *pt)
 
 void unmap_page(const void* phy_mem, const void *virt_addr)
 {
-	if (phy_mem != nullptr)
-		phy_mem_free((const fatptr_t){.ptr = phy_mem, .len = PAGE_SIZE});
-
 	size_t pd_idx = (size_t)virt_addr >> 22;
 	size_t pt_idx = (size_t)virt_addr >> 12 & 0x03FF;
 
 	size_t *pd = (size_t *)page_directory_addr;
 	size_t *pt = ((size_t *)page_table_addr) + (0x400 * pd_idx);
 
-	if ((pd[pd_idx] & VMM_ENTRY_PRESENT_BIT) == 0)
-		return;
-
-	pt[pt_idx] = 0;
+	if (pd[pd_idx] & VMM_ENTRY_PRESENT_BIT) {
+		pt[pt_idx] = 0;
+		invalidate(virt_addr);
 
-	if (is_page_table_empty(pt)) {
-		fatptr_t table_frame = {
-			.ptr = (void *)(pd[pd_idx] & VMM_ENTRY_LOCATION_4K_BITS),
-			.len = PAGE_SIZE,
-		};
+		if (is_page_table_empty(pt)) {
+			fatptr_t table_frame = {
+				.ptr = (void *)(pd[pd_idx] & VMM_ENTRY_LOCATION_4K_BITS),
+				.len = PAGE_SIZE,
+			};
 
-		pd[pd_idx] = 0;
-		phy_mem_free(table_frame);
+			pd[pd_idx] = 0;
+			invalidate(pt);
+			phy_mem_free(table_frame);
+		}
 	}
 
-	invalidate(virt_addr);
+	// Only once the TLB forgot the page, nothing may reach the frame after it is freed
+	if (phy_mem != nullptr)
+		phy_mem_free((const fatptr_t){ .ptr = (void *)phy_mem, .len = PAGE_SIZE });
 }
 
 void unmap_pages(const fatptr_t *phy_mem, const struct vmm_entry *virt_mem)
@@ -165,6 +167,37 @@ void unmap_pages(const fatptr_t *phy_mem, const struct vmm_entry *virt_mem)
 	}
 }
 
+static LIST_HEAD(vmm_fault_handlers);
+
+void vmm_register_fault_handler(struct vmm_fault_handler *handler)
+{
+	if (handler != nullptr && handler->fault != nullptr)
+		list_add(&handler->list, &vmm_fault_handlers);
+}
+
+void vmm_unregister_fault_handler(struct vmm_fault_handler *handler)
+{
+	if (handler != nullptr)
+		list_rm(&handler->list);
+}
+
+// Called by the vector 14 stub of isr.s with CR2 and the error code
+void isr_14_handler(uint32_t fault_addr, uint32_t error)
+{
+	uint8_t *addr = (uint8_t *)fault_addr;
+	list_for_each(&vmm_fault_handlers) {
+		struct vmm_fault_handler *handler = list_entry(it, struct vmm_fault_handler, list);
+		if (addr < (uint8_t *)handler->start || addr >= (uint8_t *)handler->start + handler->size)
+			continue;
+
+		if (handler->fault(addr, error, handler->ctx))
+			return;
+		break;
+	}
+
+	panic("Page fault at %x, error %x\n", fault_addr, error);
+}
+
 static void invalidate_low_range(void)
 {
 	size_t *pd = (size_t *)page_directory_addr;
@@ -424,38 +457,78 @@ static struct list_head *vir_mem_find_prev_used_chunk(struct vmm_entry *to_alloc
 }
 
 struct vmm_entry *vmm_alloc(size_t req_size, uint8_t flags)
+{
+	return vmm_alloc_aligned(req_size, PAGE_SIZE, flags);
+}
+
+struct vmm_entry *vmm_alloc_aligned(size_t req_size, size_t align, uint8_t flags)
 {
 	if (req_size > 0 && req_size & 0xfff)
 		BUG("Virtual Memory allocation must be page aligned: %d", req_size & 0xfff);
+	if (align < PAGE_SIZE || (align & (align - 1)) != 0)
+		BUG("Virtual Memory alignment must be a power of two multiple of a page: %x", align);
+
+	// Take both entries up front, growing their cache may carve the free list
+	struct vmm_entry *tag = vmm_entry_alloc();
+	if (tag == nullptr)
+		return nullptr;
+	struct vmm_entry *rest = align > PAGE_SIZE ? vmm_entry_alloc() : nullptr;
+	if (align > PAGE_SIZE && rest == nullptr) {
+		vmm_entry_free(tag);
+		return nullptr;
+	}
 
 	struct vmm_entry *free_chunk = nullptr;
+	size_t free_chunk_gap = 0;
 
 	list_for_each(&vmm_free_list) {
 		struct vmm_entry *cur = list_entry(it, struct vmm_entry, list);
 
-		size_t cur_free = cur->size;
-		bool update_chunk_sel = cur_free >= req_size && (free_chunk == nullptr || (cur_free < free_chunk->size));
+		size_t gap = (align - ((uintptr_t)cur->ptr & (align - 1))) & (align - 1);
+		if (cur->size < gap || cur->size - gap < req_size)
+			continue;
 
-		if (update_chunk_sel) {
+		size_t cur_free = cur->size - gap;
+		if (free_chunk == nullptr || cur_free < free_chunk->size - free_chunk_gap) {
 			free_chunk = cur;
+			free_chunk_gap = gap;
 		}
 	}
 
-	if (free_chunk == nullptr)
-		return nullptr;
-
-	struct vmm_entry *tag = vmm_entry_alloc();
-	if (tag == nullptr)
+	if (free_chunk == nullptr) {
+		vmm_entry_free(tag);
+		if (rest != nullptr)
+			vmm_entry_free(rest);
 		return nullptr;
+	}
 
 	*tag = (struct vmm_entry){
-		.ptr = free_chunk->ptr,
+		.ptr = free_chunk->ptr + free_chunk_gap,
 		.size = req_size,
 		.flags = flags,
 	};
 
-	free_chunk->ptr += req_size;
-	free_chunk->size -= req_size;
+	if (free_chunk_gap == 0) {
+		free_chunk->ptr += req_size;
+		free_chunk->size -= req_size;
+	} else {
+		// The aligned block sits inside the chunk, keep the head in place
+		// and hand the tail to a new free entry right after it
+		size_t tail = free_chunk->size - free_chunk_gap - req_size;
+		free_chunk->size = free_chunk_gap;
+		if (tail > 0) {
+			*rest = (struct vmm_entry){
+				.ptr = tag->ptr + req_size,
+				.size = tail,
+				.flags = free_chunk->flags,
+			};
+			list_add(&rest->list, &free_chunk->list);
+			rest = nullptr;
+		}
+	}
+
+	if (rest != nullptr)
+		vmm_entry_free(rest);
 
 	list_add(&tag->list, vir_mem_find_prev_used_chunk(tag)->prev);
 
@@ -519,7 +592,7 @@ static void migrate_tags_to_slab(void)
 		return;
 
 	if (vmm_entry_cache == nullptr)
-		vmm_entry_cache = slab_create("vmm_entry", sizeof(struct vmm_entry), alignof(struct vmm_entry), nullptr, nullptr);
+		vmm_entry_cache = slab_create("vmm_entry", sizeof(struct vmm_entry), alignof(struct vmm_entry), 0, nullptr, nullptr);
 
 	if (vmm_entry_cache == nullptr)
 		panic("Failed to create slab cache for vmm entries\n");
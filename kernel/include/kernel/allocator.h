@@ -16,11 +16,17 @@ typedef void (*slab_dtor_t)(void *obj);
 
 typedef struct slab_cache slab_cache_t;
 
-slab_cache_t *slab_create(const char *name, size_t obj_size, size_t align, slab_ctor_t ctor, slab_dtor_t dtor);
+// slab_create() flags
+#define SLAB_HWCACHE_ALIGN (1u << 0) // pad objects to whole cache lines, no two objects share a line
+#define SLAB_NO_COLOR (1u << 1)	     // start every slab at the same offset
+
+slab_cache_t *slab_create(const char *name, size_t obj_size, size_t align, unsigned int flags, slab_ctor_t ctor, slab_dtor_t dtor);
 fatptr_t slab_alloc_obj(slab_cache_t *cache);
 bool slab_free_obj(slab_cache_t *cache, fatptr_t obj);
 void slab_destroy(slab_cache_t *cache);
 void slab_set_cache_reserve(slab_cache_t *cache, size_t reserve_free);
+// Release the empty slabs the reserve does not need, returns the pages freed
+size_t slab_shrink_cache(slab_cache_t *cache);
 
 struct mem_malloc_tag;
 struct mem_phy_mem_link;
@@ -34,3 +40,5 @@ slab_cache_t *slab_get_phy_mem_link_cache(void);
 
 void init_slab_allocator(void);
 allocator_t get_slab_allocator(void);
+// Log the internal fragmentation of each general purpose size class
+void slab_report_fragmentation(void);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kernel/storage.h>
+#include <list.h>
+
+#define BCACHE_BLOCK_SIZE 512u
+
+struct buffer_head {
+	struct storage_device device;
+	uint64_t lba;
+	uint8_t *data;
+	size_t refcount;
+	bool uptodate;
+	bool dirty;
+	// Used to read or write the block back through the device queue
+	struct storage_request req;
+	struct list_head hash;
+	struct list_head lru; // most recently used first
+};
+
+struct bcache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t writebacks;
+};
+
+void bcache_init(void);
+
+// Returns the referenced block at lba with valid data, nullptr on I/O error
+struct buffer_head *bcache_get(const struct storage_device *device, uint64_t lba);
+void bcache_put(struct buffer_head *bh);
+// The block is written back on bcache_sync() or when it is evicted
+void bcache_mark_dirty(struct buffer_head *bh);
+
+// Copy a sector range through the cache, the missing blocks are read in merged commands
+bool bcache_read(const struct storage_device *device, uint64_t lba, size_t sector_count, void *dest);
+bool bcache_write(const struct storage_device *device, uint64_t lba, size_t sector_count, const void *src);
+// Write the range straight to the device, cached blocks of it are refreshed instead of dirtied
+bool bcache_write_through(const struct storage_device *device, uint64_t lba, size_t sector_count, const void *src);
+// Write back every dirty block of device
+bool bcache_sync(const struct storage_device *device);
+bool bcache_sync_all(void);
+
+void bcache_get_stats(struct bcache_stats *out);
+void bcache_reset_stats(void);
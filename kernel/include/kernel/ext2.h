@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <kernel/storage.h>
+
+#define EXT2_SUPER_MAGIC 0xEF53
+#define EXT2_SUPERBLOCK_OFFSET 1024 // bytes from the start of the device
+#define EXT2_ROOT_INO 2
+#define EXT2_GOOD_OLD_INODE_SIZE 128
+#define EXT2_NAME_LEN 255
+
+// i_block layout: 12 direct blocks, then single, double and triple indirect
+#define EXT2_N_BLOCKS 15
+#define EXT2_NDIR_BLOCKS 12
+#define EXT2_IND_BLOCK 12
+
+// The only incompatible feature a read only mount needs to understand
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+
+#define EXT2_S_IFMT 0xF000
+#define EXT2_S_IFDIR 0x4000
+#define EXT2_S_IFREG 0x8000
+
+typedef struct ext2_superblock{
+	uint32_t inodes_count;
+	uint32_t blocks_count;
+	uint32_t r_blocks_count;
+	uint32_t free_blocks_count;
+	uint32_t free_inodes_count;
+	uint32_t first_data_block; // block holding the superblock, 1 with 1 KiB blocks, 0 otherwise
+	uint32_t log_block_size; // block size is 1024 << log_block_size
+	uint32_t log_frag_size;
+	uint32_t blocks_per_group;
+	uint32_t frags_per_group;
+	uint32_t inodes_per_group;
+	uint32_t mtime;
+	uint32_t wtime;
+	uint16_t mnt_count;
+	uint16_t max_mnt_count;
+	uint16_t magic;
+	uint16_t state;
+	uint16_t errors;
+	uint16_t minor_rev_level;
+	uint32_t lastcheck;
+	uint32_t checkinterval;
+	uint32_t creator_os;
+	uint32_t rev_level; // 0 has fixed 128 byte inodes and none of the fields below
+	uint16_t def_resuid;
+	uint16_t def_resgid;
+
+	uint32_t first_ino;
+	uint16_t inode_size;
+	uint16_t block_group_nr;
+	uint32_t feature_compat;
+	uint32_t feature_incompat;
+	uint32_t feature_ro_compat;
+	uint8_t uuid[16];
+	char volume_name[16];
+	char last_mounted[64];
+	uint32_t algo_bitmap;
+	uint8_t reserved[820];
+}__attribute__((packed)) ext2_superblock_t;
+
+static_assert(sizeof(ext2_superblock_t) == 1024);
+
+typedef struct ext2_group_desc{
+	uint32_t block_bitmap;
+	uint32_t inode_bitmap;
+	uint32_t inode_table; // first block of the inode table of the group
+	uint16_t free_blocks_count;
+	uint16_t free_inodes_count;
+	uint16_t used_dirs_count;
+	uint16_t pad;
+	uint8_t reserved[12];
+}__attribute__((packed)) ext2_group_desc_t;
+
+static_assert(sizeof(ext2_group_desc_t) == 32);
+
+typedef struct ext2_inode{
+	uint16_t mode;
+	uint16_t uid;
+	uint32_t size;
+	uint32_t atime;
+	uint32_t ctime;
+	uint32_t mtime;
+	uint32_t dtime;
+	uint16_t gid;
+	uint16_t links_count;
+	uint32_t blocks; // 512 byte units
+	uint32_t flags;
+	uint32_t osd1;
+	uint32_t block[EXT2_N_BLOCKS];
+	uint32_t generation;
+	uint32_t file_acl;
+	uint32_t dir_acl; // upper 32 bits of the size of a regular file
+	uint32_t faddr;
+	uint8_t osd2[12];
+}__attribute__((packed)) ext2_inode_t;
+
+static_assert(sizeof(ext2_inode_t) == EXT2_GOOD_OLD_INODE_SIZE);
+
+typedef struct ext2_dir_entry{
+	uint32_t inode; // 0 for an unused record
+	uint16_t rec_len; // bytes to the next record
+	uint8_t name_len;
+	uint8_t file_type;
+	char name[];
+}__attribute__((packed)) ext2_dir_entry_t;
+
+#define EXT2_MAX_VOLUMES 4
+
+// A mounted, read only ext2 file system. The superblock and the group
+// descriptor table are read once; inodes go through a global inode cache
+// and indirect blocks through the buffer cache.
+typedef struct ext2_volume {
+	struct storage_device device;
+	ext2_superblock_t sb;
+	ext2_group_desc_t *groups;
+	uint32_t group_count;
+	uint32_t block_size;
+	uint32_t sectors_per_block;
+	uint32_t addr_per_block; // block numbers one indirect block holds
+	uint32_t inode_size;
+	size_t refcount;
+} ext2_volume_t;
+
+// Returns the volume of device, mounting it on first use, nullptr if it is not ext2
+ext2_volume_t *ext2_mount(const struct storage_device *device);
+void ext2_unmount(ext2_volume_t *volume);
+bool ext2_read_inode(ext2_volume_t *volume, uint32_t ino, ext2_inode_t *out);
+// Resolve a path like "/a/b/c.txt" from the root directory
+bool ext2_volume_lookup(ext2_volume_t *volume, const char *path, uint32_t *out_ino);
+// Device block holding block file_block of the file, 0 for a hole
+bool ext2_volume_bmap(ext2_volume_t *volume, const ext2_inode_t *inode, uint32_t file_block, uint32_t *out_block);
+// Read up to len bytes from offset on, holes read as zeros. Physically
+// contiguous blocks are fetched with one request.
+bool ext2_volume_read(ext2_volume_t *volume, const ext2_inode_t *inode, size_t offset, void *buffer, size_t len,
+		      size_t *out_bytes);
+size_t ext2_inode_size(const ext2_inode_t *inode);
+bool ext2_inode_is_dir(const ext2_inode_t *inode);
+
+struct vfs_fs_type;
+extern const struct vfs_fs_type ext2_vfs_type;
@@ -23,9 +23,11 @@ typedef struct fat_BS{
 
 	// this will be cast to it's specific type once the driver
 	// actually knows what type of FAT this is.
-	uint8_t	extended_section[0x1FF-0x024];
+	uint8_t	extended_section[0x200-0x024];
 }__attribute__((packed)) fat_BS_t;
 
+static_assert(sizeof(fat_BS_t) == 512);
+
 typedef struct fat1_EBR{
 	uint8_t drive_num;
 	uint8_t win_nt_flags;
@@ -37,15 +39,62 @@ typedef struct fat1_EBR{
 	uint16_t boot_partition_sig;
 }__attribute__((packed)) fat1_EBR_t;
 
+typedef struct fat32_EBR{
+	uint32_t sectors_per_FAT;
+	uint16_t flags; // bit 7 set: only FAT number (bits 0-3) is used, no mirroring
+	uint16_t version;
+	uint32_t root_cluster; // first cluster of the root directory
+	uint16_t fsinfo_sector;
+	uint16_t backup_boot_sector;
+	uint8_t reserved[12];
+	uint8_t drive_num;
+	uint8_t win_nt_flags;
+	uint8_t signature;
+	uint32_t volume_id;
+	char volume_label[11];
+	char system_id[8];
+	uint8_t code[420];
+	uint16_t boot_partition_sig;
+}__attribute__((packed)) fat32_EBR_t;
+
+static_assert(sizeof(fat32_EBR_t) == sizeof(((fat_BS_t *)nullptr)->extended_section));
+
+#define FAT32_FSINFO_LEAD_SIG 0x41615252u
+#define FAT32_FSINFO_STRUCT_SIG 0x61417272u
+#define FAT32_FSINFO_TRAIL_SIG 0xAA550000u
+#define FAT32_FSINFO_UNKNOWN 0xFFFFFFFFu
+
+typedef struct fat32_fsinfo{
+	uint32_t lead_sig;
+	uint8_t reserved[480];
+	uint32_t struct_sig;
+	uint32_t free_count; // last known free cluster count, FAT32_FSINFO_UNKNOWN if not
+	uint32_t next_free; // where to start looking for a free cluster, a hint only
+	uint8_t reserved2[12];
+	uint32_t trail_sig;
+}__attribute__((packed)) fat32_fsinfo_t;
+
+static_assert(sizeof(fat32_fsinfo_t) == 512);
+
 typedef struct fat16_layout{
 	uint32_t fat_start_lba;
+	uint32_t sectors_per_fat;
 	uint32_t root_dir_lba;
-	uint32_t root_dir_sectors;
+	uint32_t root_dir_sectors; // 0 on FAT32, the root is a cluster chain there
+	uint32_t root_cluster;	   // FAT32 only
 	uint32_t data_start_lba;
 	uint32_t sectors_per_cluster;
 	uint16_t sector_size;
 } fat16_layout_t;
 
+#define FAT_ATTR_READ_ONLY 0x01
+#define FAT_ATTR_HIDDEN 0x02
+#define FAT_ATTR_SYSTEM 0x04
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_ARCHIVE 0x20
+#define FAT_ATTR_LFN 0x0F // long file name fragment
+
 typedef struct fat_dir_entry {
 	char name[8];
 	char ext[3];
@@ -62,12 +111,107 @@ typedef struct fat_dir_entry {
 	uint32_t file_size;
 } __attribute__((packed)) fat_dir_entry_t;
 
+#define FAT16_MAX_VOLUMES 4
+// fat16_next_cluster() past the last cluster of a chain, FAT16 and FAT32 alike
+#define FAT_CHAIN_END 0xFFFFFFFFu
+#define FAT16_DIR_HASH_BITS 9
+#define FAT16_NAME_LEN 11 // 8.3 name without the dot, space padded
+// FAT16 sectors that can hold an entry in use, 65536 entries of 2 bytes
+#define FAT16_FAT_SECTORS_MAX 256
+
+struct fat16_dir_node {
+	char key[FAT16_NAME_LEN]; // upper cased
+	uint16_t next;		  // index + 1 of the next node of the bucket, 0 ends it
+	uint16_t slot;		  // entry index in the root directory
+	fat_dir_entry_t entry;
+};
+
+enum fat_type {
+	FAT_TYPE_16 = 16,
+	FAT_TYPE_32 = 32,
+};
+
+// A mounted FAT16 or FAT32 file system, the type comes from the data
+// cluster count of the boot sector and FAT12 volumes are refused. The
+// boot sector is parsed once. A FAT16 FAT, at most 128 KiB, stays
+// resident so walking a cluster chain needs no I/O; a FAT32 one can be
+// megabytes and is read through the buffer cache instead, nothing of it
+// is read at mount.
+typedef struct fat16_volume {
+	struct storage_device device;
+	fat_BS_t bpb;
+	fat16_layout_t layout;
+	enum fat_type type;
+	uint16_t *fat; // FAT16 only
+	size_t fat_entries;
+	uint32_t fat_lba; // the FAT read from, FAT32 can pick one
+	bool fat_mirrored; // changes go to every FAT copy
+	size_t refcount;
+
+	// Root directory hashed by name, built on the first lookup and
+	// dropped by fat16_volume_invalidate_dir()
+	struct fat16_dir_node *dir_nodes;
+	size_t dir_count;
+	size_t dir_capacity; // entries the root directory has room for
+	uint16_t dir_buckets[1u << FAT16_DIR_HASH_BITS]; // node index + 1, 0 when empty
+	bool dir_indexed;
+
+	// Allocation state. FAT16 builds a free map from the resident FAT on
+	// the first change, FAT32 starts from the FSInfo hints and searches
+	// the FAT itself.
+	uint32_t *free_map; // FAT16, bit set for every free cluster
+	uint32_t max_cluster;
+	uint32_t alloc_hint;
+	uint32_t free_count; // FAT32_FSINFO_UNKNOWN until known
+	uint32_t fsinfo_lba; // 0 without a valid FSInfo sector
+	bool fsinfo_dirty;
+	uint32_t fat_dirty[FAT16_FAT_SECTORS_MAX / 32]; // FAT16 sectors changed since the last flush
+
+	// Told the vnode id of a root directory file after it was created,
+	// written, truncated or removed, the VFS drops what it cached of it
+	void (*change_cb)(uint64_t id, void *ctx);
+	void *change_ctx;
+} fat16_volume_t;
+
+// Returns the volume of device, mounting it on first use, nullptr if it is not FAT16 or FAT32
+fat16_volume_t *fat16_mount(const struct storage_device *device);
+void fat16_unmount(fat16_volume_t *volume);
+// Next cluster of the chain, FAT_CHAIN_END after the last one, 0 when
+// cluster is outside the FAT or its FAT sector cannot be read
+uint32_t fat16_next_cluster(const fat16_volume_t *volume, uint32_t cluster);
+// First cluster of the file, the high half only counts on FAT32
+uint32_t fat16_entry_cluster(const fat16_volume_t *volume, const fat_dir_entry_t *entry);
+// Free clusters, FAT32_FSINFO_UNKNOWN when FSInfo had no count and nothing was allocated yet
+uint32_t fat16_volume_free_count(fat16_volume_t *volume);
+// Resolve a path like "/a/b/c.txt" from the root, "." and ".." included.
+// Subdirectory results, misses too, are remembered in a dentry cache.
+bool fat16_volume_lookup(fat16_volume_t *volume, const char *path, fat_dir_entry_t *out_entry);
+// Same as fat16_volume_lookup, a bare name is looked up in the root directory
+bool fat16_volume_find_entry(fat16_volume_t *volume, const char *name, fat_dir_entry_t *out_entry);
+// Must follow every change to the root directory
+void fat16_volume_invalidate_dir(fat16_volume_t *volume);
+bool fat16_volume_read_file(const fat16_volume_t *volume, const fat_dir_entry_t *entry,
+			    void *buffer, size_t buffer_size, size_t *out_bytes);
+
+// Changes go to the root directory. Each call writes the FAT sectors it
+// touched to every FAT copy and syncs the blocks it dirtied once, at its end.
+bool fat16_volume_create(fat16_volume_t *volume, const char *name);
+// offset cannot be past the end of the file, the file grows to fit
+bool fat16_volume_write(fat16_volume_t *volume, const char *name, size_t offset, const void *src, size_t len);
+// Shrink the file to size, the clusters past it are freed
+bool fat16_volume_truncate(fat16_volume_t *volume, const char *name, size_t size);
+bool fat16_volume_remove(fat16_volume_t *volume, const char *name);
+bool fat16_volume_sync(fat16_volume_t *volume);
+
 fat_BS_t *read_fat_boot_section(struct storage_device dev);
+// Handles both FAT16 and FAT32 boot sectors
 void fat16_compute_layout(const fat_BS_t *bpb, fat16_layout_t *out);
+// FAT16 only, like fat16_read_root_dir
 uint16_t fat16_read_fat_entry(const struct storage_device *device, const fat16_layout_t *layout, uint16_t cluster);
 bool fat16_is_end_of_chain(uint16_t entry);
 bool fat16_read_root_dir(const struct storage_device *device, const fat16_layout_t *layout,
 			 fat_dir_entry_t *entries, size_t max_entries);
+// The device based calls mount the volume on first use and keep it mounted
 bool fat16_find_entry_by_name(const struct storage_device *device, const char *name,
 			      fat_dir_entry_t *out_entry);
 bool fat16_read_file(const struct storage_device *device, const fat_dir_entry_t *entry,
@@ -75,3 +219,7 @@ bool fat16_read_file(const struct storage_device *device, const fat_dir_entry_t
 bool fat16_dir_entry_is_unused(const fat_dir_entry_t *entry);
 bool fat16_dir_entry_is_deleted(const fat_dir_entry_t *entry);
 bool fat16_decode_83_name(const fat_dir_entry_t *entry, char *out, size_t out_size);
+
+struct vfs_fs_type;
+// Serves both FAT16 and FAT32 volumes to the VFS
+extern const struct vfs_fs_type fat16_vfs_type;
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define INITRAMFS_MAX_MODULES 8
+#define INITRAMFS_CMDLINE_MAX 64
+#define INITRAMFS_HASH_BITS 8
+
+struct vfs_fs_type;
+
+// A GRUB module, a cpio (newc) or ustar archive or a single file named
+// after the first word of its command line
+struct initramfs_module {
+	uint32_t phys_start;
+	uint32_t phys_end;
+	char cmdline[INITRAMFS_CMDLINE_MAX];
+	const uint8_t *data; // mapping of the module, nullptr until initramfs_init()
+};
+
+// An archive member. The name and the data point into the module mapping,
+// nothing is copied.
+struct initramfs_node {
+	const char *name; // no leading "./" or "/" and no trailing "/"
+	size_t name_len;
+	const uint8_t *data;
+	size_t size;
+	bool is_dir;
+	uint32_t next; // node index + 1 of the next one in the bucket, 0 ends it
+};
+
+// Remember a module while the multiboot information is still reachable,
+// its command line is copied
+void initramfs_add_module(uint32_t phys_start, uint32_t phys_end, const char *cmdline);
+// Take the modules out of the physical allocator, call right after phy_mem_init()
+void initramfs_reserve(void);
+// Map every module once and index its members, needs the virtual memory
+// manager and the general purpose allocator. Runs once.
+bool initramfs_init(void);
+// Contents of the file at path, nullptr when missing or a directory
+const void *initramfs_find(const char *path, size_t *out_size);
+
+// Memory resident, its files are read and mapped straight from the modules
+extern const struct vfs_fs_type initramfs_vfs_type;
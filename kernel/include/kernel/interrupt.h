@@ -78,6 +78,10 @@
 #define IRQ_15 46
 #define IRQ_16 47
 
+// Vectors handed out to message signaled interrupts, they bypass the PIC and IOAPIC
+#define IRQ_MSI_FIRST 48
+#define IRQ_MSI_COUNT 16
+
 #define DEFINE_IRQ(num) void isr_##num##_handler(void)
 
 void irq_mask(uint8_t irq);
@@ -85,3 +89,4 @@ void irq_unmask(uint8_t irq);
 void irq_ack(uint8_t irq);
 void irq_prepare(uint8_t irq);
 void irq_set_shared(uint8_t irq, bool shared);
+void irq_msi_dispatch(uint32_t vector);
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kernel/bcache.h>
+#include <kernel/vir_mem.h>
+#include <list.h>
+
+#define PCACHE_SECTORS_PER_PAGE (PAGE_SIZE / BCACHE_BLOCK_SIZE)
+
+struct vnode;
+
+// One page of a file, keyed by its vnode and page index. The data is a
+// page aligned kernel page the requests read straight into.
+struct pcache_page {
+	struct vnode *vnode;
+	size_t index;
+	uint8_t *data;
+	size_t refcount;
+	bool uptodate;
+	bool error;
+	bool readahead; // brought in ahead of use and not read since
+	// Requests filling the page, one per physically contiguous extent
+	size_t pending;
+	size_t req_count;
+	struct storage_request reqs[PCACHE_SECTORS_PER_PAGE];
+	struct list_head hash;
+	struct list_head lru; // most recently used first
+	struct list_head vnode_list;
+};
+
+struct pcache_stats {
+	size_t hits;
+	size_t misses;
+	size_t readahead_pages; // pages submitted ahead of use
+	size_t readahead_hits;	// of which were read later
+	size_t evictions;
+};
+
+bool pcache_init(void);
+
+// Returns the referenced, up to date page at index, reading it if it is
+// missing and waiting for it if it is in flight. nullptr on I/O error.
+struct pcache_page *pcache_get(struct vnode *vnode, size_t index);
+void pcache_put(struct pcache_page *page);
+// Whether the page is cached, in flight or not, without touching it
+bool pcache_contains(const struct vnode *vnode, size_t index);
+// Queue reads for the missing pages of [index, index + count) without
+// waiting for them, returns how many were submitted
+size_t pcache_readahead(struct vnode *vnode, size_t index, size_t count);
+// Wait for and free every page of vnode, none may be referenced
+void pcache_drop_vnode(struct vnode *vnode);
+
+void pcache_get_stats(struct pcache_stats *out);
+void pcache_reset_stats(void);
@@ -2,6 +2,7 @@
 
 #include <stddef.h>
 #include <stdlib.h>
+#include <list.h>
 #include <kernel/multiboot.h>
 #include <kernel/elf32.h>
 
@@ -53,4 +54,36 @@ void phy_mem_free(fatptr_t addr_ptr);
 __attribute__((hot)) fatptr_t phy_mem_alloc(size_t len);
 __attribute__((hot)) fatptr_t phy_mem_alloc_below(size_t len, size_t max_addr);
 
+/** Memory pressure callback, asked to give back up to nr_pages pages of
+ * cached memory, returns how many pages it actually freed
+ **/
+typedef size_t (*phy_mem_shrink_fn)(size_t nr_pages, void *ctx);
+
+struct phy_mem_shrinker {
+	const char *name;
+	phy_mem_shrink_fn shrink;
+	void *ctx;
+	struct list_head list;
+};
+
+/** Shrinkers run when an allocation would leave fewer free blocks than
+ * the low watermark or finds no run long enough. The struct is owned by
+ * the caller and must stay alive while registered, a callback must not
+ * unregister itself.
+ *
+ * They run synchronously inside phy_mem_alloc(), that is from whatever
+ * allocation the kernel happens to be doing, including one made by the
+ * subsystem being shrunk. A shrinker may only free objects no caller can
+ * be holding: nothing with a reference, nothing dirty or with I/O in
+ * flight. A subsystem that allocates while its lists are mid-update sets
+ * a busy flag around that section and has its shrinker return 0 while it
+ * is set, as bcache, pcache and the slab allocator do.
+ **/
+void phy_mem_register_shrinker(struct phy_mem_shrinker *shrinker);
+void phy_mem_unregister_shrinker(struct phy_mem_shrinker *shrinker);
+
+/** Run the shrinkers until nr_pages pages are freed, returns the count
+ **/
+size_t phy_mem_shrink(size_t nr_pages);
+
 void phy_mem_init(const struct multiboot_tag_mmap *mmap_tag, const struct multiboot_tag_elf_sections *elf_tag);
@@ -4,20 +4,65 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <list.h>
+
 enum storage_backend {
 	STORAGE_BACKEND_AHCI,
 	STORAGE_BACKEND_ATA_PIO,
+	STORAGE_BACKEND_ATA_DMA,
 };
 
+struct storage_queue;
+
 struct storage_device {
 	enum storage_backend backend;
 	uint8_t ahci_port;
 	uint8_t channel;
 	uint8_t drive;
+	// Request queue of a registered device, nullptr dispatches straight to the backend
+	struct storage_queue *queue;
+};
+
+struct storage_request;
+// Runs in the context that dispatched the queue, may submit new requests
+typedef void (*storage_done_fn)(struct storage_request *req, void *ctx);
+
+struct storage_request {
+	uint64_t lba;
+	size_t sector_count;
+	void *buffer;
+	bool write;
+	storage_done_fn done_cb;
+	void *ctx;
+	// Set by the block layer once the request left the queue
+	bool done;
+	bool ok;
+	struct list_head list;
+};
+
+struct storage_stats {
+	size_t requests; // requests submitted
+	size_t merges;	 // requests served by another request's command
+	size_t commands; // transfers handed to the backend
 };
 
 void storage_init(void);
 size_t storage_device_count(void);
 bool storage_get_device(size_t device_index, struct storage_device *out_device);
-bool storage_read_device(const struct storage_device *device, uint32_t lba_addr, uint16_t sector_count, void *dest);
-bool storage_write_device(const struct storage_device *device, uint32_t lba_addr, uint16_t sector_count, const void *src);
+// Whether a and b name the same drive, whatever queue they point at
+bool storage_same_device(const struct storage_device *a, const struct storage_device *b);
+// Largest transfer the backend issues as a single command
+size_t storage_max_sectors(const struct storage_device *device);
+// Transfers of any size, the backend splits them along its own limits
+bool storage_read_device(const struct storage_device *device, uint64_t lba, size_t sector_count, void *dest);
+bool storage_write_device(const struct storage_device *device, uint64_t lba, size_t sector_count, const void *src);
+
+// Queue a request, it is dispatched right away unless the device is plugged
+void storage_submit(const struct storage_device *device, struct storage_request *req);
+// Dispatches the queue if req is still pending, returns req->ok
+bool storage_wait(const struct storage_device *device, struct storage_request *req);
+// Hold submissions in the queue so they can be sorted and merged, nests
+void storage_plug(const struct storage_device *device);
+void storage_unplug(const struct storage_device *device);
+void storage_get_stats(const struct storage_device *device, struct storage_stats *out);
+void storage_reset_stats(const struct storage_device *device);
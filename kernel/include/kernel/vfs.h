@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kernel/storage.h>
+#include <list.h>
+
+#define VFS_MAX_MOUNTS 8
+#define VFS_MAX_FILES 64
+#define VFS_MOUNT_PATH_MAX 32
+// Past this many vnodes of a mount the least recently used closed one is dropped
+#define VFS_MAX_VNODES 128u
+// bmap result for a file range with no blocks, it reads as zeros
+#define VFS_HOLE UINT64_MAX
+
+struct vnode;
+struct vfs_mount;
+
+struct vnode_ops {
+	// Device sector holding byte offset of the file, offset rounded down to
+	// its sector, and how many bytes from that sector on follow each other
+	// on disk. len is how far the caller wants to go, mapping past it is
+	// wasted work. Holes map to VFS_HOLE.
+	bool (*bmap)(struct vnode *vnode, uint64_t offset, size_t len, uint64_t *out_lba, size_t *out_bytes);
+	// Frees fs_data, the vnode is going away
+	void (*release)(struct vnode *vnode);
+};
+
+struct vfs_fs_type {
+	const char *name;
+	// Attach to mount->device and set mount->fs_data, false if the device
+	// does not hold this file system
+	bool (*mount)(struct vfs_mount *mount);
+	void (*unmount)(struct vfs_mount *mount);
+	// Resolve path from the root of the file system, fills the id, size,
+	// is_dir, ops and fs_data of out
+	bool (*lookup)(struct vfs_mount *mount, const char *path, struct vnode *out);
+};
+
+struct vfs_mount {
+	char path[VFS_MOUNT_PATH_MAX]; // no trailing slash, "" for the root
+	size_t path_len;
+	struct storage_device device; // zeroed for memory resident file systems
+	const struct vfs_fs_type *type;
+	void *fs_data;
+	struct list_head vnodes; // most recently opened first
+	size_t vnode_count;
+	bool used;
+};
+
+// A file of a mount. Vnodes stay around after their last close so the
+// page cache keeps serving them, opening the same file again finds them.
+struct vnode {
+	struct vfs_mount *mount;
+	const struct vnode_ops *ops;
+	uint64_t id; // the file system's name for the file, first cluster or inode number
+	size_t size;
+	bool is_dir;
+	size_t refcount; // open files and mappings
+	// The file changed under it, new opens get a fresh vnode and this one
+	// goes with its last close
+	bool stale;
+	void *fs_data;
+	// Contents of a memory resident file, nullptr for files on a device.
+	// Reads copy straight from it and mappings are it, the page cache is
+	// left out.
+	const uint8_t *data;
+	struct list_head pages; // cached pages
+	struct list_head list;
+};
+
+// Sequential readahead state of an open file, in pages
+struct vfs_readahead {
+	size_t start; // first page of the last window
+	size_t size;  // pages in it, 0 before the access looks sequential
+	size_t async_page; // reading it queues the next window
+	size_t prev_page;
+};
+
+enum vfs_whence {
+	VFS_SEEK_SET,
+	VFS_SEEK_CUR,
+	VFS_SEEK_END,
+};
+
+void vfs_init(void);
+// Attach device at path, the first file system type that recognises it wins
+bool vfs_mount(const char *path, const struct storage_device *device);
+// Attach a file system of the given type, device is nullptr for memory
+// resident ones like initramfs_vfs_type
+bool vfs_mount_type(const char *path, const struct vfs_fs_type *type, const struct storage_device *device);
+// Fails while a file of the mount is open
+bool vfs_unmount(const char *path);
+// For file systems, the file with id changed on disk: its cached vnode and
+// pages are dropped, or once it is closed if it is open. Files open across
+// the change keep the size they were opened with.
+void vfs_invalidate(struct vfs_mount *mount, uint64_t id);
+
+// Returns a file descriptor, -1 on failure. Files are read only.
+int vfs_open(const char *path);
+bool vfs_close(int fd);
+// Reads up to len bytes at the file position and advances it, *out_bytes
+// is 0 at the end of the file
+bool vfs_read(int fd, void *buffer, size_t len, size_t *out_bytes);
+bool vfs_seek(int fd, int64_t offset, enum vfs_whence whence, size_t *out_pos);
+bool vfs_file_size(int fd, size_t *out_size);
+
+// Map len bytes of the file from offset on, a multiple of PAGE_SIZE, read
+// only. Nothing is read up front: pages fault in from the page cache on
+// first touch and are the cache's own pages, nothing is copied. Past the
+// end of the file the last page reads as zeros, further pages fault.
+// Mapped pages stay referenced in the cache until vfs_munmap().
+// A memory resident file is returned in place, the range must stay inside it.
+void *vfs_mmap(int fd, size_t offset, size_t len);
+bool vfs_munmap(void *addr);
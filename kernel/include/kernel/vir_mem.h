@@ -1,6 +1,7 @@
 #pragma once
 #include <kernel/multiboot.h>
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -61,4 +62,28 @@ void unmap_page(const void* phy_mem, const void *virt_addr);
 void unmap_pages(const fatptr_t *phy_mem, const struct vmm_entry *virt_mem);
 
 struct vmm_entry *vmm_alloc(size_t req_size, uint8_t flags);
+// Like vmm_alloc, the returned range starts on an align boundary (power of two, at least PAGE_SIZE)
+struct vmm_entry *vmm_alloc_aligned(size_t req_size, size_t align, uint8_t flags);
 void vmm_free(const void *ptr);
+
+// Page fault error code bits
+#define VMM_FAULT_PRESENT (1u << 0) // protection violation, clear when the page was not present
+#define VMM_FAULT_WRITE (1u << 1)
+#define VMM_FAULT_USER (1u << 2)
+
+/** Resolves page faults inside [start, start + size), returns true once
+ * the access can be retried. The struct is owned by the caller and must
+ * stay alive while registered.
+ **/
+typedef bool (*vmm_fault_fn)(void *addr, uint32_t error, void *ctx);
+
+struct vmm_fault_handler {
+	void *start;
+	size_t size;
+	vmm_fault_fn fault;
+	void *ctx;
+	struct list_head list;
+};
+
+void vmm_register_fault_handler(struct vmm_fault_handler *handler);
+void vmm_unregister_fault_handler(struct vmm_fault_handler *handler);
@@ -0,0 +1,381 @@
+#include <kernel/bcache.h>
+
+#include <kernel/allocator.h>
+#include <kernel/display.h>
+#include <kernel/phy_mem.h>
+#include <kernel/vir_mem.h>
+
+#include <list.h>
+#include <string.h>
+
+MODULE("bcache")
+
+#define BCACHE_HASH_BITS 8
+#define BCACHE_HASH_SIZE (1u << BCACHE_HASH_BITS)
+// Past this many blocks the least recently used idle block is reused
+#define BCACHE_MAX_BUFFERS 1024u
+// Blocks a bcache_read() keeps referenced while its misses are in flight
+#define BCACHE_READ_BATCH 32u
+
+static slab_cache_t *bcache_head_cache = nullptr;
+static slab_cache_t *bcache_data_cache = nullptr;
+static struct list_head bcache_hash[BCACHE_HASH_SIZE];
+static LIST_HEAD(bcache_lru);
+static size_t bcache_count = 0;
+static struct bcache_stats bcache_stats = { 0 };
+// Set while the lists are walked around I/O, the shrinker leaves them alone
+static bool bcache_busy = false;
+
+static size_t bcache_bucket(const struct storage_device *device, uint64_t lba)
+{
+	uint32_t key = (uint32_t)lba ^ (uint32_t)(lba >> 32);
+	key ^= ((uint32_t)device->backend << 24) | ((uint32_t)device->ahci_port << 16) | ((uint32_t)device->channel << 8) | device->drive;
+
+	// Fibonacci hashing, the top bits are the best mixed
+	return (key * 0x9E3779B1u) >> (32 - BCACHE_HASH_BITS);
+}
+
+static struct buffer_head *bcache_lookup(const struct storage_device *device, uint64_t lba)
+{
+	list_for_each(&bcache_hash[bcache_bucket(device, lba)]) {
+		struct buffer_head *bh = list_entry(it, struct buffer_head, hash);
+		if (bh->lba == lba && storage_same_device(&bh->device, device))
+			return bh;
+	}
+
+	return nullptr;
+}
+
+static void bcache_free_buffer(struct buffer_head *bh)
+{
+	list_rm(&bh->hash);
+	list_rm(&bh->lru);
+	bcache_count--;
+
+	slab_free_obj(bcache_data_cache, (fatptr_t){ .ptr = bh->data, .len = BCACHE_BLOCK_SIZE });
+	slab_free_obj(bcache_head_cache, (fatptr_t){ .ptr = bh, .len = sizeof(*bh) });
+}
+
+static bool bcache_write_back(struct buffer_head *bh)
+{
+	if (!storage_write_device(&bh->device, bh->lba, 1, bh->data))
+		return false;
+
+	bh->dirty = false;
+	bcache_stats.writebacks++;
+	return true;
+}
+
+// Drop the least recently used idle block, a dirty one is written back first
+static void bcache_evict_one(void)
+{
+	bcache_busy = true;
+
+	list_rev_for_each(&bcache_lru) {
+		struct buffer_head *bh = list_entry(it, struct buffer_head, lru);
+		if (bh->refcount > 0)
+			continue;
+		if (bh->dirty && !bcache_write_back(bh))
+			continue;
+
+		bcache_free_buffer(bh);
+		bcache_stats.evictions++;
+		break;
+	}
+
+	bcache_busy = false;
+}
+
+// Find or create the block without reading it, the caller owns a reference
+static struct buffer_head *bcache_getblk(const struct storage_device *device, uint64_t lba)
+{
+	struct buffer_head *bh = bcache_lookup(device, lba);
+	if (bh != nullptr) {
+		bh->refcount++;
+		list_mv(&bh->lru, &bcache_lru);
+		return bh;
+	}
+
+	if (bcache_count >= BCACHE_MAX_BUFFERS)
+		bcache_evict_one();
+
+	fatptr_t head = slab_alloc_obj(bcache_head_cache);
+	if (head.ptr == nullptr)
+		return nullptr;
+
+	fatptr_t data = slab_alloc_obj(bcache_data_cache);
+	if (data.ptr == nullptr) {
+		slab_free_obj(bcache_head_cache, head);
+		return nullptr;
+	}
+
+	bh = head.ptr;
+	*bh = (struct buffer_head){ .device = *device, .lba = lba, .data = data.ptr, .refcount = 1 };
+	list_add(&bh->hash, &bcache_hash[bcache_bucket(device, lba)]);
+	list_add(&bh->lru, &bcache_lru);
+	bcache_count++;
+	return bh;
+}
+
+static size_t bcache_shrink(size_t nr_pages, void *ctx)
+{
+	(void)ctx;
+
+	if (bcache_busy)
+		return 0;
+
+	size_t wanted = nr_pages * (PAGE_SIZE / BCACHE_BLOCK_SIZE);
+	struct list_head *pos = bcache_lru.prev;
+	while (pos != &bcache_lru && wanted > 0) {
+		struct buffer_head *bh = list_entry(pos, struct buffer_head, lru);
+		pos = pos->prev;
+		if (bh->refcount > 0 || bh->dirty)
+			continue;
+
+		bcache_free_buffer(bh);
+		bcache_stats.evictions++;
+		wanted--;
+	}
+
+	return slab_shrink_cache(bcache_data_cache) + slab_shrink_cache(bcache_head_cache);
+}
+
+static struct phy_mem_shrinker bcache_shrinker = { .name = "bcache", .shrink = bcache_shrink };
+
+void bcache_init(void)
+{
+	if (bcache_head_cache != nullptr)
+		return;
+
+	bcache_head_cache = slab_create("buffer_head", sizeof(struct buffer_head), alignof(struct buffer_head), 0, nullptr, nullptr);
+	bcache_data_cache = slab_create("buffer_data", BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE, SLAB_NO_COLOR, nullptr, nullptr);
+	if (bcache_head_cache == nullptr || bcache_data_cache == nullptr) {
+		mprint("failed to create the buffer caches\n");
+		return;
+	}
+
+	for (size_t i = 0; i < BCACHE_HASH_SIZE; i++)
+		RESET_LIST_ITEM(&bcache_hash[i]);
+
+	phy_mem_register_shrinker(&bcache_shrinker);
+}
+
+static bool bcache_ready(void)
+{
+	return bcache_head_cache != nullptr && bcache_data_cache != nullptr;
+}
+
+struct buffer_head *bcache_get(const struct storage_device *device, uint64_t lba)
+{
+	if (device == nullptr || !bcache_ready())
+		return nullptr;
+
+	struct buffer_head *bh = bcache_getblk(device, lba);
+	if (bh == nullptr)
+		return nullptr;
+
+	if (bh->uptodate) {
+		bcache_stats.hits++;
+		return bh;
+	}
+
+	bcache_stats.misses++;
+	bh->uptodate = storage_read_device(&bh->device, lba, 1, bh->data);
+	if (!bh->uptodate) {
+		bcache_put(bh);
+		return nullptr;
+	}
+
+	return bh;
+}
+
+void bcache_put(struct buffer_head *bh)
+{
+	if (bh == nullptr)
+		return;
+	if (bh->refcount == 0) {
+		mprint("put of unreferenced block %u\n", (uint32_t)bh->lba);
+		return;
+	}
+
+	// A block that failed to read is not worth keeping around
+	if (--bh->refcount == 0 && !bh->uptodate)
+		bcache_free_buffer(bh);
+}
+
+void bcache_mark_dirty(struct buffer_head *bh)
+{
+	if (bh != nullptr && bh->uptodate)
+		bh->dirty = true;
+}
+
+static bool bcache_read_batch(const struct storage_device *device, uint64_t lba, size_t count, uint8_t *dest)
+{
+	struct buffer_head *bhs[BCACHE_READ_BATCH];
+	size_t got = 0;
+	bool ok = true;
+
+	// Misses are queued plugged so neighbouring ones go out as one command
+	storage_plug(device);
+	for (; got < count; got++) {
+		struct buffer_head *bh = bcache_getblk(device, lba + got);
+		if (bh == nullptr) {
+			ok = false;
+			break;
+		}
+
+		bhs[got] = bh;
+		if (bh->uptodate) {
+			bcache_stats.hits++;
+			continue;
+		}
+
+		bcache_stats.misses++;
+		bh->req = (struct storage_request){ .lba = bh->lba, .sector_count = 1, .buffer = bh->data };
+		storage_submit(&bh->device, &bh->req);
+	}
+	storage_unplug(device);
+
+	for (size_t i = 0; i < got; i++) {
+		struct buffer_head *bh = bhs[i];
+		if (!bh->uptodate)
+			bh->uptodate = storage_wait(&bh->device, &bh->req);
+
+		if (bh->uptodate)
+			memcpy(dest + i * BCACHE_BLOCK_SIZE, bh->data, BCACHE_BLOCK_SIZE);
+		else
+			ok = false;
+		bcache_put(bh);
+	}
+
+	return ok;
+}
+
+bool bcache_read(const struct storage_device *device, uint64_t lba, size_t sector_count, void *dest)
+{
+	if (device == nullptr || dest == nullptr)
+		return false;
+	if (!bcache_ready())
+		return storage_read_device(device, lba, sector_count, dest);
+
+	uint8_t *out = dest;
+	while (sector_count > 0) {
+		size_t count = sector_count < BCACHE_READ_BATCH ? sector_count : BCACHE_READ_BATCH;
+		if (!bcache_read_batch(device, lba, count, out))
+			return false;
+
+		lba += count;
+		out += count * BCACHE_BLOCK_SIZE;
+		sector_count -= count;
+	}
+
+	return true;
+}
+
+bool bcache_write(const struct storage_device *device, uint64_t lba, size_t sector_count, const void *src)
+{
+	if (device == nullptr || src == nullptr)
+		return false;
+	if (!bcache_ready())
+		return storage_write_device(device, lba, sector_count, src);
+
+	const uint8_t *in = src;
+	for (size_t i = 0; i < sector_count; i++) {
+		struct buffer_head *bh = bcache_getblk(device, lba + i);
+		if (bh == nullptr)
+			return false;
+
+		memcpy(bh->data, in + i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+		bh->uptodate = true;
+		bh->dirty = true;
+		bcache_put(bh);
+	}
+
+	return true;
+}
+
+bool bcache_write_through(const struct storage_device *device, uint64_t lba, size_t sector_count, const void *src)
+{
+	if (device == nullptr || src == nullptr)
+		return false;
+	if (!storage_write_device(device, lba, sector_count, src))
+		return false;
+	if (!bcache_ready())
+		return true;
+
+	const uint8_t *in = src;
+	for (size_t i = 0; i < sector_count; i++) {
+		struct buffer_head *bh = bcache_lookup(device, lba + i);
+		if (bh == nullptr)
+			continue;
+
+		// The disk now holds the newest data, a pending write back would only undo it
+		memcpy(bh->data, in + i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+		bh->uptodate = true;
+		bh->dirty = false;
+	}
+
+	return true;
+}
+
+bool bcache_sync(const struct storage_device *device)
+{
+	if (device == nullptr || !bcache_ready())
+		return false;
+
+	bcache_busy = true;
+
+	// Submit every dirty block plugged, the queue merges the adjacent ones
+	storage_plug(device);
+	list_for_each(&bcache_lru) {
+		struct buffer_head *bh = list_entry(it, struct buffer_head, lru);
+		if (!bh->dirty || !storage_same_device(&bh->device, device))
+			continue;
+
+		bh->refcount++;
+		bh->req = (struct storage_request){ .lba = bh->lba, .sector_count = 1, .buffer = bh->data, .write = true };
+		storage_submit(&bh->device, &bh->req);
+	}
+	storage_unplug(device);
+
+	bool ok = true;
+	list_for_each(&bcache_lru) {
+		struct buffer_head *bh = list_entry(it, struct buffer_head, lru);
+		if (!bh->dirty || !storage_same_device(&bh->device, device))
+			continue;
+
+		if (storage_wait(&bh->device, &bh->req)) {
+			bh->dirty = false;
+			bcache_stats.writebacks++;
+		} else {
+			ok = false;
+		}
+		bh->refcount--;
+	}
+
+	bcache_busy = false;
+	return ok;
+}
+
+bool bcache_sync_all(void)
+{
+	bool ok = true;
+	for (size_t i = 0; i < storage_device_count(); i++) {
+		struct storage_device device;
+		if (storage_get_device(i, &device))
+			ok = bcache_sync(&device) && ok;
+	}
+
+	return ok;
+}
+
+void bcache_get_stats(struct bcache_stats *out)
+{
+	if (out != nullptr)
+		*out = bcache_stats;
+}
+
+void bcache_reset_stats(void)
+{
+	bcache_stats = (struct bcache_stats){ 0 };
+}
@@ -0,0 +1,604 @@
+#include <string.h>
+
+#include <kernel/allocator.h>
+#include <kernel/bcache.h>
+#include <kernel/display.h>
+#include <kernel/ext2.h>
+#include <kernel/vfs.h>
+
+#include <list.h>
+
+MODULE("ext2")
+
+static ext2_volume_t ext2_volumes[EXT2_MAX_VOLUMES];
+
+static uint64_t ext2_block_to_lba(const ext2_volume_t *volume, uint32_t block)
+{
+	return (uint64_t)block * volume->sectors_per_block;
+}
+
+static size_t ext2_group_table_bytes(const ext2_volume_t *volume)
+{
+	size_t bytes = (size_t)volume->group_count * sizeof(ext2_group_desc_t);
+	return (bytes + BCACHE_BLOCK_SIZE - 1) / BCACHE_BLOCK_SIZE * BCACHE_BLOCK_SIZE;
+}
+
+// Copy len bytes at byte pos of the sectors from lba on. Whole sectors are
+// read straight into out, a partial head or tail out of its cached block.
+static bool ext2_read_bytes(const struct storage_device *device, uint64_t lba, size_t pos, uint8_t *out, size_t len)
+{
+	lba += pos / BCACHE_BLOCK_SIZE;
+	pos %= BCACHE_BLOCK_SIZE;
+
+	while (len > 0) {
+		if (pos == 0 && len >= BCACHE_BLOCK_SIZE) {
+			size_t full = len / BCACHE_BLOCK_SIZE;
+			if (!storage_read_device(device, lba, full, out))
+				return false;
+
+			lba += full;
+			out += full * BCACHE_BLOCK_SIZE;
+			len -= full * BCACHE_BLOCK_SIZE;
+			continue;
+		}
+
+		size_t chunk = BCACHE_BLOCK_SIZE - pos < len ? BCACHE_BLOCK_SIZE - pos : len;
+		struct buffer_head *bh = bcache_get(device, lba);
+		if (bh == nullptr)
+			return false;
+
+		memcpy(out, bh->data + pos, chunk);
+		bcache_put(bh);
+
+		lba++;
+		out += chunk;
+		len -= chunk;
+		pos = 0;
+	}
+
+	return true;
+}
+
+/**
+ * Inodes are cached by (volume, inode number) across every mounted
+ * volume, the least recently used one goes once the cache is full.
+ **/
+#define EXT2_ICACHE_HASH_BITS 8
+#define EXT2_ICACHE_HASH_SIZE (1u << EXT2_ICACHE_HASH_BITS)
+#define EXT2_ICACHE_MAX 512u
+
+struct ext2_icache_entry {
+	const ext2_volume_t *volume;
+	uint32_t ino;
+	ext2_inode_t inode;
+	struct list_head hash;
+	struct list_head lru; // most recently used first
+};
+
+static slab_cache_t *ext2_inode_cache = nullptr;
+static struct list_head ext2_icache_hash[EXT2_ICACHE_HASH_SIZE];
+static LIST_HEAD(ext2_icache_lru);
+static size_t ext2_icache_count = 0;
+
+static bool ext2_icache_init(void)
+{
+	if (ext2_inode_cache != nullptr)
+		return true;
+
+	ext2_inode_cache = slab_create("ext2_inode", sizeof(struct ext2_icache_entry), alignof(struct ext2_icache_entry), 0, nullptr, nullptr);
+	if (ext2_inode_cache == nullptr)
+		return false;
+
+	for (size_t i = 0; i < EXT2_ICACHE_HASH_SIZE; i++)
+		RESET_LIST_ITEM(&ext2_icache_hash[i]);
+	return true;
+}
+
+static size_t ext2_icache_bucket(uint32_t ino)
+{
+	return (ino * 0x9E3779B1u) >> (32 - EXT2_ICACHE_HASH_BITS);
+}
+
+static void ext2_icache_free(struct ext2_icache_entry *cached)
+{
+	list_rm(&cached->hash);
+	list_rm(&cached->lru);
+	ext2_icache_count--;
+	slab_free_obj(ext2_inode_cache, (fatptr_t){ .ptr = cached, .len = sizeof(*cached) });
+}
+
+static void ext2_icache_drop(const ext2_volume_t *volume)
+{
+	if (ext2_inode_cache == nullptr)
+		return;
+
+	struct list_head *pos = ext2_icache_lru.next;
+	while (pos != &ext2_icache_lru) {
+		struct ext2_icache_entry *cached = list_entry(pos, struct ext2_icache_entry, lru);
+		pos = pos->next;
+		if (cached->volume == volume)
+			ext2_icache_free(cached);
+	}
+}
+
+static const struct ext2_icache_entry *ext2_icache_lookup(const ext2_volume_t *volume, uint32_t ino)
+{
+	if (ext2_inode_cache == nullptr)
+		return nullptr;
+
+	list_for_each(&ext2_icache_hash[ext2_icache_bucket(ino)]) {
+		struct ext2_icache_entry *cached = list_entry(it, struct ext2_icache_entry, hash);
+		if (cached->volume == volume && cached->ino == ino) {
+			list_mv(&cached->lru, &ext2_icache_lru);
+			return cached;
+		}
+	}
+
+	return nullptr;
+}
+
+// Failing to cache is not an error, the inode is read again next time
+static void ext2_icache_add(const ext2_volume_t *volume, uint32_t ino, const ext2_inode_t *inode)
+{
+	if (!ext2_icache_init())
+		return;
+	if (ext2_icache_count >= EXT2_ICACHE_MAX)
+		ext2_icache_free(list_entry(ext2_icache_lru.prev, struct ext2_icache_entry, lru));
+
+	fatptr_t obj = slab_alloc_obj(ext2_inode_cache);
+	if (obj.ptr == nullptr)
+		return;
+
+	struct ext2_icache_entry *cached = obj.ptr;
+	*cached = (struct ext2_icache_entry){ .volume = volume, .ino = ino, .inode = *inode };
+	list_add(&cached->hash, &ext2_icache_hash[ext2_icache_bucket(ino)]);
+	list_add(&cached->lru, &ext2_icache_lru);
+	ext2_icache_count++;
+}
+
+static ext2_volume_t *ext2_find_volume(const struct storage_device *device)
+{
+	for (size_t i = 0; i < EXT2_MAX_VOLUMES; i++) {
+		ext2_volume_t *volume = &ext2_volumes[i];
+		if (volume->refcount > 0 && storage_same_device(&volume->device, device))
+			return volume;
+	}
+
+	return nullptr;
+}
+
+// Read the superblock and the whole group descriptor table
+static bool ext2_load_volume(const struct storage_device *device, ext2_volume_t *volume)
+{
+	*volume = (ext2_volume_t){ .device = *device };
+	if (!bcache_read(device, EXT2_SUPERBLOCK_OFFSET / BCACHE_BLOCK_SIZE, sizeof(ext2_superblock_t) / BCACHE_BLOCK_SIZE, &volume->sb))
+		return false;
+
+	const ext2_superblock_t *sb = &volume->sb;
+	if (sb->magic != EXT2_SUPER_MAGIC)
+		return false;
+	if (sb->log_block_size > 6 || sb->blocks_per_group == 0 || sb->inodes_per_group == 0 || sb->blocks_count <= sb->first_data_block) {
+		mprint("bad superblock\n");
+		return false;
+	}
+	if (sb->rev_level > 0 && (sb->feature_incompat & ~EXT2_FEATURE_INCOMPAT_FILETYPE)) {
+		mprint("unsupported incompatible features %x\n", sb->feature_incompat);
+		return false;
+	}
+
+	volume->block_size = 1024u << sb->log_block_size;
+	volume->sectors_per_block = volume->block_size / BCACHE_BLOCK_SIZE;
+	volume->addr_per_block = volume->block_size / sizeof(uint32_t);
+	volume->inode_size = sb->rev_level == 0 ? EXT2_GOOD_OLD_INODE_SIZE : sb->inode_size;
+	// A power of two, so an inode never straddles a sector
+	if (volume->inode_size < EXT2_GOOD_OLD_INODE_SIZE || volume->inode_size > volume->block_size ||
+	    (volume->inode_size & (volume->inode_size - 1)) != 0)
+		return false;
+
+	volume->group_count = (sb->blocks_count - sb->first_data_block + sb->blocks_per_group - 1) / sb->blocks_per_group;
+
+	// The descriptor table starts in the block after the superblock
+	size_t table_bytes = ext2_group_table_bytes(volume);
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t table = gpa_alloc.alloc(table_bytes);
+	if (table.ptr == nullptr)
+		return false;
+
+	if (!bcache_read(device, ext2_block_to_lba(volume, sb->first_data_block + 1), table_bytes / BCACHE_BLOCK_SIZE, table.ptr)) {
+		gpa_alloc.free(table);
+		return false;
+	}
+
+	volume->groups = table.ptr;
+	return true;
+}
+
+ext2_volume_t *ext2_mount(const struct storage_device *device)
+{
+	if (device == nullptr)
+		return nullptr;
+
+	ext2_volume_t *volume = ext2_find_volume(device);
+	if (volume != nullptr) {
+		volume->refcount++;
+		return volume;
+	}
+
+	for (size_t i = 0; i < EXT2_MAX_VOLUMES; i++) {
+		if (ext2_volumes[i].refcount > 0)
+			continue;
+
+		volume = &ext2_volumes[i];
+		if (!ext2_load_volume(device, volume))
+			return nullptr;
+
+		volume->refcount = 1;
+		return volume;
+	}
+
+	return nullptr;
+}
+
+void ext2_unmount(ext2_volume_t *volume)
+{
+	if (volume == nullptr || volume->refcount == 0 || --volume->refcount > 0)
+		return;
+
+	ext2_icache_drop(volume);
+	get_gpa_allocator().free((fatptr_t){ .ptr = volume->groups, .len = ext2_group_table_bytes(volume) });
+	volume->groups = nullptr;
+	volume->group_count = 0;
+}
+
+size_t ext2_inode_size(const ext2_inode_t *inode)
+{
+	uint64_t size = inode->size;
+	if ((inode->mode & EXT2_S_IFMT) == EXT2_S_IFREG)
+		size |= (uint64_t)inode->dir_acl << 32;
+
+	return size < SIZE_MAX ? (size_t)size : SIZE_MAX;
+}
+
+bool ext2_inode_is_dir(const ext2_inode_t *inode)
+{
+	return (inode->mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+}
+
+bool ext2_read_inode(ext2_volume_t *volume, uint32_t ino, ext2_inode_t *out)
+{
+	if (volume == nullptr || out == nullptr || ino == 0 || ino > volume->sb.inodes_count)
+		return false;
+
+	const struct ext2_icache_entry *cached = ext2_icache_lookup(volume, ino);
+	if (cached != nullptr) {
+		*out = cached->inode;
+		return true;
+	}
+
+	uint32_t group = (ino - 1) / volume->sb.inodes_per_group;
+	uint32_t index = (ino - 1) % volume->sb.inodes_per_group;
+	if (group >= volume->group_count)
+		return false;
+
+	uint64_t byte = (uint64_t)index * volume->inode_size;
+	struct buffer_head *bh = bcache_get(&volume->device, ext2_block_to_lba(volume, volume->groups[group].inode_table) + byte / BCACHE_BLOCK_SIZE);
+	if (bh == nullptr)
+		return false;
+
+	memcpy(out, bh->data + byte % BCACHE_BLOCK_SIZE, sizeof(*out));
+	bcache_put(bh);
+
+	ext2_icache_add(volume, ino, out);
+	return true;
+}
+
+// Indirect blocks the last mapping went through, one per level. Mapping
+// consecutive file blocks reads each indirect block once, in one request.
+struct ext2_map_cursor {
+	uint32_t block[3];
+	uint32_t *table[3];
+};
+
+static void ext2_cursor_release(const ext2_volume_t *volume, struct ext2_map_cursor *cursor)
+{
+	for (size_t level = 0; level < 3; level++) {
+		if (cursor->table[level] != nullptr)
+			get_gpa_allocator().free((fatptr_t){ .ptr = cursor->table[level], .len = volume->block_size });
+		cursor->table[level] = nullptr;
+	}
+}
+
+static const uint32_t *ext2_cursor_table(const ext2_volume_t *volume, struct ext2_map_cursor *cursor, size_t level, uint32_t block)
+{
+	if (cursor->table[level] == nullptr) {
+		fatptr_t table = get_gpa_allocator().alloc(volume->block_size);
+		if (table.ptr == nullptr)
+			return nullptr;
+
+		cursor->table[level] = table.ptr;
+		cursor->block[level] = 0;
+	}
+
+	if (cursor->block[level] != block) {
+		if (block >= volume->sb.blocks_count ||
+		    !bcache_read(&volume->device, ext2_block_to_lba(volume, block), volume->sectors_per_block, cursor->table[level])) {
+			cursor->block[level] = 0;
+			return nullptr;
+		}
+		cursor->block[level] = block;
+	}
+
+	return cursor->table[level];
+}
+
+static bool ext2_bmap(const ext2_volume_t *volume, const ext2_inode_t *inode, struct ext2_map_cursor *cursor, uint32_t file_block,
+		      uint32_t *out_block)
+{
+	if (file_block < EXT2_NDIR_BLOCKS) {
+		*out_block = inode->block[file_block];
+		return true;
+	}
+
+	// Depth of the indirection, and the block index relative to its tree
+	const uint32_t per_block = volume->addr_per_block;
+	uint64_t rel = file_block - EXT2_NDIR_BLOCKS;
+	uint64_t span = per_block;
+	size_t depth = 1;
+	while (rel >= span) {
+		rel -= span;
+		if (++depth > 3)
+			return false;
+		span *= per_block;
+	}
+
+	uint32_t block = inode->block[EXT2_IND_BLOCK + depth - 1];
+	for (size_t level = 0; level < depth && block != 0; level++) {
+		span /= per_block;
+		const uint32_t *table = ext2_cursor_table(volume, cursor, level, block);
+		if (table == nullptr)
+			return false;
+		block = table[(rel / span) % per_block];
+	}
+
+	*out_block = block;
+	return true;
+}
+
+bool ext2_volume_bmap(ext2_volume_t *volume, const ext2_inode_t *inode, uint32_t file_block, uint32_t *out_block)
+{
+	if (volume == nullptr || inode == nullptr || out_block == nullptr)
+		return false;
+
+	struct ext2_map_cursor cursor = { 0 };
+	bool ok = ext2_bmap(volume, inode, &cursor, file_block, out_block);
+	ext2_cursor_release(volume, &cursor);
+	return ok;
+}
+
+bool ext2_volume_read(ext2_volume_t *volume, const ext2_inode_t *inode, size_t offset, void *buffer, size_t len,
+		      size_t *out_bytes)
+{
+	if (volume == nullptr || inode == nullptr || (buffer == nullptr && len > 0))
+		return false;
+
+	if (out_bytes)
+		*out_bytes = 0;
+
+	size_t size = ext2_inode_size(inode);
+	if (offset >= size || len == 0)
+		return true;
+
+	const size_t block_size = volume->block_size;
+	const size_t to_read = len < size - offset ? len : size - offset;
+	size_t max_blocks = storage_max_sectors(&volume->device) / volume->sectors_per_block;
+	if (max_blocks == 0)
+		max_blocks = 1;
+
+	struct ext2_map_cursor cursor = { 0 };
+	uint8_t *out = buffer;
+	uint32_t file_block = (uint32_t)(offset / block_size);
+	size_t pos = offset % block_size;
+	size_t done = 0;
+	uint32_t block = 0;
+	bool ok = ext2_bmap(volume, inode, &cursor, file_block, &block);
+	while (ok && done < to_read) {
+		// Map ahead while the blocks follow each other on disk, the run is
+		// one request. Holes only run on into more holes.
+		const size_t wanted = to_read - done;
+		const uint32_t first = block;
+		size_t blocks = 1;
+		bool mapped_next = false;
+		while (blocks * block_size - pos < wanted) {
+			ok = ext2_bmap(volume, inode, &cursor, file_block + (uint32_t)blocks, &block);
+			mapped_next = ok;
+			if (!ok || blocks >= max_blocks || block != (first == 0 ? 0 : first + (uint32_t)blocks))
+				break;
+			blocks++;
+			mapped_next = false;
+		}
+		if (!ok || (first != 0 && (first >= volume->sb.blocks_count || volume->sb.blocks_count - first < blocks))) {
+			ok = false;
+			break;
+		}
+
+		size_t chunk = blocks * block_size - pos < wanted ? blocks * block_size - pos : wanted;
+		if (first == 0)
+			memset(out + done, 0, chunk);
+		else
+			ok = ext2_read_bytes(&volume->device, ext2_block_to_lba(volume, first), pos, out + done, chunk);
+
+		done += chunk;
+		pos = 0;
+		file_block += (uint32_t)blocks;
+		if (ok && !mapped_next && done < to_read)
+			ok = ext2_bmap(volume, inode, &cursor, file_block, &block);
+	}
+
+	ext2_cursor_release(volume, &cursor);
+	if (out_bytes)
+		*out_bytes = done;
+	return ok && done == to_read;
+}
+
+// Look name, len bytes of it, up in directory dir. Directory blocks go
+// through the buffer cache, lookups mostly hit the same ones again.
+static bool ext2_find_in_dir(ext2_volume_t *volume, const ext2_inode_t *dir, const char *name, size_t len, uint32_t *out_ino)
+{
+	const size_t size = ext2_inode_size(dir);
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t buf = gpa_alloc.alloc(volume->block_size);
+	if (buf.ptr == nullptr)
+		return false;
+
+	struct ext2_map_cursor cursor = { 0 };
+	const uint8_t *data = buf.ptr;
+	bool found = false;
+	for (size_t offset = 0; offset < size && !found; offset += volume->block_size) {
+		uint32_t block = 0;
+		if (!ext2_bmap(volume, dir, &cursor, (uint32_t)(offset / volume->block_size), &block) || block == 0 ||
+		    block >= volume->sb.blocks_count)
+			break;
+		if (!bcache_read(&volume->device, ext2_block_to_lba(volume, block), volume->sectors_per_block, buf.ptr))
+			break;
+
+		const size_t bytes = size - offset < volume->block_size ? size - offset : volume->block_size;
+		for (size_t pos = 0; pos + sizeof(ext2_dir_entry_t) <= bytes;) {
+			const ext2_dir_entry_t *entry = (const ext2_dir_entry_t *)(data + pos);
+			// A record never crosses a block, anything else is corruption
+			if (entry->rec_len < sizeof(ext2_dir_entry_t) || entry->rec_len > bytes - pos)
+				break;
+
+			if (entry->inode != 0 && entry->name_len == len && memcmp(entry->name, name, len) == 0) {
+				*out_ino = entry->inode;
+				found = true;
+				break;
+			}
+			pos += entry->rec_len;
+		}
+	}
+
+	ext2_cursor_release(volume, &cursor);
+	gpa_alloc.free(buf);
+	return found;
+}
+
+bool ext2_volume_lookup(ext2_volume_t *volume, const char *path, uint32_t *out_ino)
+{
+	if (volume == nullptr || path == nullptr || out_ino == nullptr)
+		return false;
+
+	// "." and ".." are real entries of every directory
+	uint32_t ino = EXT2_ROOT_INO;
+	while (*path != '\0') {
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			break;
+
+		const char *end = path;
+		while (*end != '\0' && *end != '/')
+			end++;
+
+		size_t len = (size_t)(end - path);
+		ext2_inode_t dir;
+		if (len > EXT2_NAME_LEN || !ext2_read_inode(volume, ino, &dir) || !ext2_inode_is_dir(&dir))
+			return false;
+		if (!ext2_find_in_dir(volume, &dir, path, len, &ino))
+			return false;
+		path = end;
+	}
+
+	*out_ino = ino;
+	return true;
+}
+
+// VFS glue. A vnode keeps its inode and a map cursor, a sequential read
+// reads each indirect block once.
+struct ext2_vnode {
+	ext2_inode_t inode;
+	struct ext2_map_cursor cursor;
+};
+
+static bool ext2_vfs_bmap(struct vnode *vnode, uint64_t offset, size_t len, uint64_t *out_lba, size_t *out_bytes)
+{
+	const ext2_volume_t *volume = vnode->mount->fs_data;
+	struct ext2_vnode *file = vnode->fs_data;
+	const uint32_t file_block = (uint32_t)(offset / volume->block_size);
+	const size_t skip = (size_t)(offset % volume->block_size) / BCACHE_BLOCK_SIZE;
+
+	uint32_t first = 0;
+	if (!ext2_bmap(volume, &file->inode, &file->cursor, file_block, &first))
+		return false;
+	if (first != 0 && first >= volume->sb.blocks_count)
+		return false;
+
+	// Holes run on into holes, blocks into the blocks right after them
+	size_t blocks = 1;
+	size_t bytes = volume->block_size - skip * BCACHE_BLOCK_SIZE;
+	while (bytes < len) {
+		uint32_t block = 0;
+		if (!ext2_bmap(volume, &file->inode, &file->cursor, file_block + (uint32_t)blocks, &block))
+			break;
+		if (block != (first == 0 ? 0 : first + (uint32_t)blocks) || (block != 0 && block >= volume->sb.blocks_count))
+			break;
+		blocks++;
+		bytes += volume->block_size;
+	}
+
+	*out_lba = first == 0 ? VFS_HOLE : ext2_block_to_lba(volume, first) + skip;
+	*out_bytes = bytes;
+	return true;
+}
+
+static void ext2_vfs_release(struct vnode *vnode)
+{
+	struct ext2_vnode *file = vnode->fs_data;
+	ext2_cursor_release(vnode->mount->fs_data, &file->cursor);
+	get_gpa_allocator().free((fatptr_t){ .ptr = file, .len = sizeof(*file) });
+	vnode->fs_data = nullptr;
+}
+
+static const struct vnode_ops ext2_vnode_ops = {
+	.bmap = ext2_vfs_bmap,
+	.release = ext2_vfs_release,
+};
+
+static bool ext2_vfs_mount(struct vfs_mount *mount)
+{
+	mount->fs_data = ext2_mount(&mount->device);
+	return mount->fs_data != nullptr;
+}
+
+static void ext2_vfs_unmount(struct vfs_mount *mount)
+{
+	ext2_unmount(mount->fs_data);
+	mount->fs_data = nullptr;
+}
+
+static bool ext2_vfs_lookup(struct vfs_mount *mount, const char *path, struct vnode *out)
+{
+	ext2_volume_t *volume = mount->fs_data;
+	uint32_t ino = 0;
+	ext2_inode_t inode;
+	if (!ext2_volume_lookup(volume, path, &ino) || !ext2_read_inode(volume, ino, &inode))
+		return false;
+
+	fatptr_t obj = get_gpa_allocator().alloc(sizeof(struct ext2_vnode));
+	if (obj.ptr == nullptr)
+		return false;
+
+	*(struct ext2_vnode *)obj.ptr = (struct ext2_vnode){ .inode = inode };
+	out->ops = &ext2_vnode_ops;
+	out->fs_data = obj.ptr;
+	out->id = ino;
+	out->size = ext2_inode_size(&inode);
+	out->is_dir = ext2_inode_is_dir(&inode);
+	return true;
+}
+
+const struct vfs_fs_type ext2_vfs_type = {
+	.name = "ext2",
+	.mount = ext2_vfs_mount,
+	.unmount = ext2_vfs_unmount,
+	.lookup = ext2_vfs_lookup,
+};
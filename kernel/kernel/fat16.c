@@ -3,7 +3,11 @@
 #include <string.h>
 
 #include <kernel/allocator.h>
+#include <kernel/bcache.h>
 #include <kernel/fat16.h>
+#include <kernel/vfs.h>
+
+#include <list.h>
 
 static char toupper(char c){
 	if(c >= 'a' && c <= 'z'){
@@ -18,14 +22,28 @@ static bool fat16_read_root_dir_sectors(const struct storage_device *device, con
 	if (layout->root_dir_sectors == 0 || layout->root_dir_sectors > UINT16_MAX)
 		return false;
 
-	return storage_read_device(device, layout->root_dir_lba,
-				   (uint16_t)layout->root_dir_sectors, out);
+	return bcache_read(device, layout->root_dir_lba, layout->root_dir_sectors, out);
 }
 
-static bool fat16_read_sectors(const struct storage_device *device, uint32_t lba,
-			       uint16_t count, void *out)
+// Read byte_count bytes from lba straight into out, only a partial last
+// sector is copied, out of its cached block
+static bool fat16_read_bytes(const struct storage_device *device, uint32_t lba, size_t byte_count, uint8_t *out)
 {
-	return storage_read_device(device, lba, count, out);
+	size_t full = byte_count / BCACHE_BLOCK_SIZE;
+	size_t tail = byte_count % BCACHE_BLOCK_SIZE;
+
+	if (full > 0 && !storage_read_device(device, lba, full, out))
+		return false;
+	if (tail == 0)
+		return true;
+
+	struct buffer_head *bh = bcache_get(device, lba + full);
+	if (bh == nullptr)
+		return false;
+
+	memcpy(out + full * BCACHE_BLOCK_SIZE, bh->data, tail);
+	bcache_put(bh);
+	return true;
 }
 
 static size_t fat16_copy_root_dir_entries(const uint8_t *raw, size_t raw_entries,
@@ -55,26 +73,6 @@ static void fat16_free_boot_sector(fat_BS_t *boot_sector)
 	gpa_alloc.free((fatptr_t){ .ptr = boot_sector, .len = 512 });
 }
 
-static bool fat16_load_layout(const struct storage_device *device, fat16_layout_t *layout,
-			      fat_BS_t **out_bpb)
-{
-	if (device == nullptr || layout == nullptr || out_bpb == nullptr)
-		return false;
-
-	*out_bpb = read_fat_boot_section(*device);
-	if (*out_bpb == nullptr)
-		return false;
-
-	fat16_compute_layout(*out_bpb, layout);
-	if (layout->sector_size == 0 || layout->sectors_per_cluster == 0) {
-		fat16_free_boot_sector(*out_bpb);
-		*out_bpb = nullptr;
-		return false;
-	}
-
-	return true;
-}
-
 static size_t fat16_trim_spaces(const char *input, size_t max_len)
 {
 	size_t len = max_len;
@@ -85,6 +83,22 @@ static size_t fat16_trim_spaces(const char *input, size_t max_len)
 	return len;
 }
 
+static const fat32_EBR_t *fat32_ebr(const fat_BS_t *bpb)
+{
+	return (const fat32_EBR_t *)bpb->extended_section;
+}
+
+static uint32_t fat16_total_sectors(const fat_BS_t *bpb)
+{
+	return bpb->sector_count != 0 ? bpb->sector_count : bpb->large_sector_count;
+}
+
+// A FAT32 boot sector leaves the 16 bit FAT size at 0
+static uint32_t fat16_sectors_per_fat(const fat_BS_t *bpb)
+{
+	return bpb->sectors_per_FAT != 0 ? bpb->sectors_per_FAT : fat32_ebr(bpb)->sectors_per_FAT;
+}
+
 static uint32_t fat16_root_dir_sectors(const fat_BS_t *bpb)
 {
 	uint32_t entries_bytes = (uint32_t)bpb->root_dir_count * 32;
@@ -98,9 +112,9 @@ static uint32_t fat16_fat_start_lba(const fat_BS_t *bpb)
 	return bpb->reserved_sectors;
 }
 
-static uint32_t fat16_root_dir_lba(const fat_BS_t *bpb, uint32_t fat_start_lba)
+static uint32_t fat16_root_dir_lba(const fat_BS_t *bpb, uint32_t fat_start_lba, uint32_t sectors_per_fat)
 {
-	return fat_start_lba + ((uint32_t)bpb->FAT_count * bpb->sectors_per_FAT);
+	return fat_start_lba + ((uint32_t)bpb->FAT_count * sectors_per_fat);
 }
 
 static uint32_t fat16_data_start_lba(uint32_t root_dir_lba, uint32_t root_dir_sectors)
@@ -108,16 +122,18 @@ static uint32_t fat16_data_start_lba(uint32_t root_dir_lba, uint32_t root_dir_se
 	return root_dir_lba + root_dir_sectors;
 }
 
-static uint32_t fat16_cluster_to_lba(const fat16_layout_t *layout, uint16_t cluster)
+static uint32_t fat16_cluster_to_lba(const fat16_layout_t *layout, uint32_t cluster)
 {
-	return layout->data_start_lba + ((uint32_t)(cluster - 2) * layout->sectors_per_cluster);
+	return layout->data_start_lba + ((cluster - 2) * layout->sectors_per_cluster);
 }
 
 void fat16_compute_layout(const fat_BS_t *bpb, fat16_layout_t *out)
 {
 	out->fat_start_lba = fat16_fat_start_lba(bpb);
+	out->sectors_per_fat = fat16_sectors_per_fat(bpb);
 	out->root_dir_sectors = fat16_root_dir_sectors(bpb);
-	out->root_dir_lba = fat16_root_dir_lba(bpb, out->fat_start_lba);
+	out->root_dir_lba = fat16_root_dir_lba(bpb, out->fat_start_lba, out->sectors_per_fat);
+	out->root_cluster = bpb->sectors_per_FAT == 0 ? fat32_ebr(bpb)->root_cluster : 0;
 
 	out->data_start_lba = fat16_data_start_lba(out->root_dir_lba, out->root_dir_sectors);
 	out->sectors_per_cluster = bpb->sectors_per_cluster;
@@ -131,19 +147,14 @@ fat_BS_t *read_fat_boot_section(struct storage_device dev){
 	fat_BS_t *boot_sector_p = boot_sector.ptr;
 	memset(boot_sector_p, 0, 512);
 
-	storage_read_device(&dev, 0, 1, boot_sector_p);
+	if (!bcache_read(&dev, 0, 1, boot_sector_p)) {
+		gpa_alloc.free(boot_sector);
+		return nullptr;
+	}
 
 	return boot_sector_p;
 }
 
-static bool fat16_read_fat_sector(const struct storage_device *device, const fat16_layout_t *layout,
-				  uint32_t sector_index, uint8_t *out_sector)
-{
-	uint32_t lba = layout->fat_start_lba + sector_index;
-
-	return fat16_read_sectors(device, lba, 1, out_sector);
-}
-
 static uint16_t fat16_extract_entry(const uint8_t *sector, uint32_t offset)
 {
 	return (uint16_t)(sector[offset] | ((uint16_t)sector[offset + 1] << 8));
@@ -151,25 +162,20 @@ static uint16_t fat16_extract_entry(const uint8_t *sector, uint32_t offset)
 
 uint16_t fat16_read_fat_entry(const struct storage_device *device, const fat16_layout_t *layout, uint16_t cluster)
 {
-	if (device == nullptr || layout == nullptr || layout->sector_size == 0)
+	if (device == nullptr || layout == nullptr || layout->sector_size != BCACHE_BLOCK_SIZE)
 		return 0;
 
 	uint32_t fat_offset = (uint32_t)cluster * 2;
 	uint32_t sector_index = fat_offset / layout->sector_size;
 	uint32_t entry_offset = fat_offset % layout->sector_size;
 
-	allocator_t gpa_alloc = get_gpa_allocator();
-	fatptr_t sector_buf = gpa_alloc.alloc(layout->sector_size);
-	if (sector_buf.ptr == nullptr)
+	// Cluster hops mostly stay inside the same FAT sector, keep it in the buffer cache
+	struct buffer_head *bh = bcache_get(device, layout->fat_start_lba + sector_index);
+	if (bh == nullptr)
 		return 0;
 
-	uint16_t entry = 0;
-	if (fat16_read_fat_sector(device, layout, sector_index, sector_buf.ptr)
-	    && entry_offset + 1 < layout->sector_size) {
-		entry = fat16_extract_entry(sector_buf.ptr, entry_offset);
-	}
-
-	gpa_alloc.free(sector_buf);
+	uint16_t entry = fat16_extract_entry(bh->data, entry_offset);
+	bcache_put(bh);
 
 	return entry;
 }
@@ -179,38 +185,396 @@ bool fat16_is_end_of_chain(uint16_t entry)
 	return entry >= 0xFFF8;
 }
 
-static bool fat16_name_matches(const fat_dir_entry_t *entry, const char *name)
+static fat16_volume_t fat16_volumes[FAT16_MAX_VOLUMES];
+
+static fat16_volume_t *fat16_find_volume(const struct storage_device *device)
+{
+	for (size_t i = 0; i < FAT16_MAX_VOLUMES; i++) {
+		fat16_volume_t *volume = &fat16_volumes[i];
+		if (volume->refcount > 0 && storage_same_device(&volume->device, device))
+			return volume;
+	}
+
+	return nullptr;
+}
+
+#define FAT16_ENTRIES_PER_SECTOR (BCACHE_BLOCK_SIZE / sizeof(uint16_t))
+#define FAT32_ENTRIES_PER_SECTOR (BCACHE_BLOCK_SIZE / sizeof(uint32_t))
+#define FAT32_ENTRY_MASK 0x0FFFFFFFu // the top 4 bits are reserved
+#define FAT16_LAST_CLUSTER_MIN 0xFFF8
+#define FAT32_LAST_CLUSTER_MIN 0x0FFFFFF8u
+// 0xFFF7 and 0x0FFFFFF7 mark bad clusters, anything above ends a chain
+#define FAT16_MAX_CLUSTER 0xFFF6
+static_assert(FAT16_MAX_CLUSTER / FAT16_ENTRIES_PER_SECTOR < FAT16_FAT_SECTORS_MAX, "fat_dirty must cover every cluster");
+#define FAT32_MAX_CLUSTER 0x0FFFFFF6u
+#define FAT32_FLAG_SINGLE_FAT 0x80
+#define FAT32_FLAG_ACTIVE_FAT 0x0F
+// The FAT type is set by the data cluster count alone, fewer than 4085 is FAT12
+#define FAT16_MIN_CLUSTERS 4085u
+#define FAT32_MIN_CLUSTERS 65525u
+
+// Highest cluster number in use, bounded by what the FAT has entries for
+static uint32_t fat16_max_cluster(uint32_t clusters, size_t fat_entries, uint32_t limit)
+{
+	uint32_t max = clusters + 1;
+	if (max >= fat_entries)
+		max = (uint32_t)fat_entries - 1;
+	return max < limit ? max : limit;
+}
+
+// Pull the whole first FAT in with one read
+static bool fat16_load_fat(fat16_volume_t *volume, uint32_t clusters)
+{
+	const fat16_layout_t *layout = &volume->layout;
+	size_t fat_bytes = (size_t)layout->sectors_per_fat * layout->sector_size;
+	volume->max_cluster = fat16_max_cluster(clusters, fat_bytes / sizeof(uint16_t), FAT16_MAX_CLUSTER);
+	if (volume->bpb.root_dir_count == 0 || volume->max_cluster < 2)
+		return false;
+
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t fat = gpa_alloc.alloc(fat_bytes);
+	if (fat.ptr == nullptr)
+		return false;
+
+	if (!storage_read_device(&volume->device, layout->fat_start_lba, layout->sectors_per_fat, fat.ptr)) {
+		gpa_alloc.free(fat);
+		return false;
+	}
+
+	volume->fat = fat.ptr;
+	volume->fat_entries = fat_bytes / sizeof(uint16_t);
+	return true;
+}
+
+// Nothing of the FAT is read, the FSInfo sector has the free cluster
+// count and where the last allocation stopped. Both are hints, a bad or
+// missing FSInfo only costs a search on the first allocation.
+static bool fat32_load_volume(fat16_volume_t *volume, uint32_t clusters)
 {
-	char entry_name[13] = { 0 };
-	if (!fat16_decode_83_name(entry, entry_name, sizeof(entry_name)))
+	const fat32_EBR_t *ebr = fat32_ebr(&volume->bpb);
+	const fat16_layout_t *layout = &volume->layout;
+	if (volume->bpb.root_dir_count != 0 || ebr->version != 0)
 		return false;
 
-	for (size_t i = 0; entry_name[i] != '\0' || name[i] != '\0'; ++i) {
-		if (toupper((unsigned char)entry_name[i]) != toupper((unsigned char)name[i]))
+	if (ebr->flags & FAT32_FLAG_SINGLE_FAT) {
+		uint32_t active = ebr->flags & FAT32_FLAG_ACTIVE_FAT;
+		if (active >= volume->bpb.FAT_count)
 			return false;
+
+		volume->fat_lba = layout->fat_start_lba + active * layout->sectors_per_fat;
+		volume->fat_mirrored = false;
+	}
+
+	volume->max_cluster = fat16_max_cluster(clusters, (size_t)layout->sectors_per_fat * FAT32_ENTRIES_PER_SECTOR, FAT32_MAX_CLUSTER);
+	if (volume->max_cluster < 2 || layout->root_cluster < 2 || layout->root_cluster > volume->max_cluster)
+		return false;
+	if (ebr->fsinfo_sector == 0 || ebr->fsinfo_sector >= volume->bpb.reserved_sectors)
+		return true;
+
+	struct buffer_head *bh = bcache_get(&volume->device, ebr->fsinfo_sector);
+	if (bh == nullptr)
+		return true;
+
+	const fat32_fsinfo_t *fsinfo = (const fat32_fsinfo_t *)bh->data;
+	if (fsinfo->lead_sig == FAT32_FSINFO_LEAD_SIG && fsinfo->struct_sig == FAT32_FSINFO_STRUCT_SIG &&
+	    fsinfo->trail_sig == FAT32_FSINFO_TRAIL_SIG) {
+		volume->fsinfo_lba = ebr->fsinfo_sector;
+		if (fsinfo->free_count <= volume->max_cluster - 1)
+			volume->free_count = fsinfo->free_count;
+		if (fsinfo->next_free >= 2 && fsinfo->next_free <= volume->max_cluster)
+			volume->alloc_hint = fsinfo->next_free;
 	}
 
+	bcache_put(bh);
 	return true;
 }
 
-static bool fat16_find_in_root_dir(const uint8_t *raw, size_t raw_entries,
-				   const char *name, fat_dir_entry_t *out_entry)
+// Parse the boot sector, the FAT type follows from it
+static bool fat16_load_volume(const struct storage_device *device, fat16_volume_t *volume)
 {
-	const fat_dir_entry_t *raw_entries_ptr = (const fat_dir_entry_t *)raw;
+	fat_BS_t *bpb = read_fat_boot_section(*device);
+	if (bpb == nullptr)
+		return false;
 
-	for (size_t i = 0; i < raw_entries; ++i) {
-		const fat_dir_entry_t *entry = &raw_entries_ptr[i];
+	*volume = (fat16_volume_t){ .device = *device, .bpb = *bpb };
+	fat16_free_boot_sector(bpb);
+
+	fat16_compute_layout(&volume->bpb, &volume->layout);
+	const fat16_layout_t *layout = &volume->layout;
+	if (layout->sector_size != BCACHE_BLOCK_SIZE || layout->sectors_per_cluster == 0 || layout->sectors_per_fat == 0)
+		return false;
+
+	uint32_t total_sectors = fat16_total_sectors(&volume->bpb);
+	if (total_sectors <= layout->data_start_lba)
+		return false;
+
+	uint32_t clusters = (total_sectors - layout->data_start_lba) / layout->sectors_per_cluster;
+	if (clusters < FAT16_MIN_CLUSTERS)
+		return false;
+
+	// The layout already trusted the 16 bit FAT size, it has to agree with the type
+	volume->type = clusters < FAT32_MIN_CLUSTERS ? FAT_TYPE_16 : FAT_TYPE_32;
+	if ((volume->type == FAT_TYPE_32) != (volume->bpb.sectors_per_FAT == 0))
+		return false;
+
+	volume->fat_lba = layout->fat_start_lba;
+	volume->fat_mirrored = true;
+	volume->free_count = FAT32_FSINFO_UNKNOWN;
+	volume->alloc_hint = 2;
+
+	if (volume->type == FAT_TYPE_32)
+		return fat32_load_volume(volume, clusters);
+	return fat16_load_fat(volume, clusters);
+}
+
+fat16_volume_t *fat16_mount(const struct storage_device *device)
+{
+	if (device == nullptr)
+		return nullptr;
+
+	fat16_volume_t *volume = fat16_find_volume(device);
+	if (volume != nullptr) {
+		volume->refcount++;
+		return volume;
+	}
+
+	for (size_t i = 0; i < FAT16_MAX_VOLUMES; i++) {
+		if (fat16_volumes[i].refcount > 0)
+			continue;
+
+		volume = &fat16_volumes[i];
+		if (!fat16_load_volume(device, volume))
+			return nullptr;
+
+		volume->refcount = 1;
+		return volume;
+	}
+
+	return nullptr;
+}
+
+static void fat16_dcache_drop(const fat16_volume_t *volume);
+
+void fat16_unmount(fat16_volume_t *volume)
+{
+	if (volume == nullptr || volume->refcount == 0 || --volume->refcount > 0)
+		return;
+
+	fat16_dcache_drop(volume);
+	fat16_volume_invalidate_dir(volume);
+	if (volume->free_map != nullptr)
+		get_gpa_allocator().free((fatptr_t){ .ptr = volume->free_map, .len = ((size_t)volume->max_cluster / 32 + 1) * sizeof(uint32_t) });
+	volume->free_map = nullptr;
+	if (volume->fat != nullptr)
+		get_gpa_allocator().free((fatptr_t){ .ptr = volume->fat, .len = volume->fat_entries * sizeof(uint16_t) });
+	volume->fat = nullptr;
+	volume->fat_entries = 0;
+}
+
+// The mount of the device based calls, taken once and kept
+static fat16_volume_t *fat16_mount_once(const struct storage_device *device)
+{
+	fat16_volume_t *volume = fat16_find_volume(device);
+	return volume != nullptr ? volume : fat16_mount(device);
+}
+
+static bool fat16_cluster_valid(const fat16_volume_t *volume, uint32_t cluster)
+{
+	return cluster >= 2 && cluster <= volume->max_cluster;
+}
+
+static bool fat32_read_entry(const fat16_volume_t *volume, uint32_t cluster, uint32_t *out)
+{
+	// Chains mostly stay inside one FAT sector, it stays in the buffer cache
+	struct buffer_head *bh = bcache_get(&volume->device, volume->fat_lba + cluster / FAT32_ENTRIES_PER_SECTOR);
+	if (bh == nullptr)
+		return false;
+
+	*out = ((const uint32_t *)bh->data)[cluster % FAT32_ENTRIES_PER_SECTOR] & FAT32_ENTRY_MASK;
+	bcache_put(bh);
+	return true;
+}
+
+uint32_t fat16_next_cluster(const fat16_volume_t *volume, uint32_t cluster)
+{
+	if (volume == nullptr || !fat16_cluster_valid(volume, cluster))
+		return 0;
+
+	if (volume->type == FAT_TYPE_16) {
+		uint32_t next = volume->fat[cluster];
+		return next >= FAT16_LAST_CLUSTER_MIN ? FAT_CHAIN_END : next;
+	}
+
+	uint32_t next = 0;
+	if (!fat32_read_entry(volume, cluster, &next))
+		return 0;
+	return next >= FAT32_LAST_CLUSTER_MIN ? FAT_CHAIN_END : next;
+}
+
+uint32_t fat16_entry_cluster(const fat16_volume_t *volume, const fat_dir_entry_t *entry)
+{
+	uint32_t cluster = entry->first_cluster_low;
+	if (volume->type == FAT_TYPE_32)
+		cluster |= (uint32_t)entry->first_cluster_high << 16;
+	return cluster;
+}
+
+static void fat16_set_entry_cluster(const fat16_volume_t *volume, fat_dir_entry_t *entry, uint32_t cluster)
+{
+	entry->first_cluster_low = (uint16_t)cluster;
+	if (volume->type == FAT_TYPE_32)
+		entry->first_cluster_high = (uint16_t)(cluster >> 16);
+}
+
+// "hp1.txt" -> "HP1     TXT", false for names 8.3 cannot hold
+static bool fat16_normalize_name(const char *name, char key[FAT16_NAME_LEN])
+{
+	memset(key, ' ', FAT16_NAME_LEN);
+
+	const char *dot = nullptr;
+	for (const char *c = name; *c != '\0'; c++) {
+		if (*c == '.')
+			dot = c;
+	}
+
+	size_t base_len = dot != nullptr ? (size_t)(dot - name) : strlen(name);
+	size_t ext_len = dot != nullptr ? strlen(dot + 1) : 0;
+	if (base_len == 0 || base_len > 8 || ext_len > 3)
+		return false;
+
+	for (size_t i = 0; i < base_len; i++)
+		key[i] = toupper(name[i]);
+	for (size_t i = 0; i < ext_len; i++)
+		key[8 + i] = toupper(dot[1 + i]);
+	return true;
+}
+
+static uint32_t fat16_name_hash(const char key[FAT16_NAME_LEN])
+{
+	// FNV-1a
+	uint32_t hash = 0x811C9DC5u;
+	for (size_t i = 0; i < FAT16_NAME_LEN; i++) {
+		hash ^= (uint8_t)key[i];
+		hash *= 0x01000193u;
+	}
+
+	return hash & ((1u << FAT16_DIR_HASH_BITS) - 1);
+}
+
+static void fat16_entry_key(const fat_dir_entry_t *entry, char key[FAT16_NAME_LEN])
+{
+	for (size_t c = 0; c < FAT16_NAME_LEN; c++)
+		key[c] = toupper(c < 8 ? entry->name[c] : entry->ext[c - 8]);
+}
+
+void fat16_volume_invalidate_dir(fat16_volume_t *volume)
+{
+	if (volume == nullptr || volume->dir_nodes == nullptr)
+		return;
+
+	get_gpa_allocator().free((fatptr_t){ .ptr = volume->dir_nodes, .len = volume->dir_capacity * sizeof(struct fat16_dir_node) });
+	volume->dir_nodes = nullptr;
+	volume->dir_count = 0;
+	volume->dir_capacity = 0;
+	volume->dir_indexed = false;
+}
+
+// Nodes are linked by uint16_t indices, FAT caps a directory at 65536 entries anyway
+#define FAT16_DIR_MAX_ENTRIES UINT16_MAX
+
+// Entries the root directory has room for, a FAT32 root grows a cluster at a time
+static size_t fat16_root_capacity(const fat16_volume_t *volume)
+{
+	if (volume->type == FAT_TYPE_16)
+		return volume->bpb.root_dir_count;
+
+	const size_t per_cluster = (size_t)volume->layout.sector_size * volume->layout.sectors_per_cluster / sizeof(fat_dir_entry_t);
+	size_t clusters = 0;
+	// Bounded by the cluster count in case the chain loops
+	for (uint32_t cluster = volume->layout.root_cluster; fat16_cluster_valid(volume, cluster) && clusters < volume->max_cluster;
+	     cluster = fat16_next_cluster(volume, cluster))
+		clusters++;
+
+	size_t capacity = clusters * per_cluster;
+	return capacity < FAT16_DIR_MAX_ENTRIES ? capacity : FAT16_DIR_MAX_ENTRIES;
+}
+
+// Hash count raw entries, the first one sitting at slot base. Returns
+// false once the end of directory marker is hit.
+static bool fat16_index_entries(fat16_volume_t *volume, const fat_dir_entry_t *raw, size_t count, size_t base)
+{
+	for (size_t i = 0; i < count && base + i < volume->dir_capacity; i++) {
+		const fat_dir_entry_t *entry = &raw[i];
 		if (fat16_dir_entry_is_unused(entry))
-			break;
-		if (fat16_dir_entry_is_deleted(entry))
+			return false;
+		if (fat16_dir_entry_is_deleted(entry) || entry->attributes == FAT_ATTR_LFN)
 			continue;
-		if (fat16_name_matches(entry, name)) {
-			memcpy(out_entry, entry, sizeof(*entry));
-			return true;
+
+		struct fat16_dir_node *node = &volume->dir_nodes[volume->dir_count];
+		fat16_entry_key(entry, node->key);
+		node->entry = *entry;
+		node->slot = (uint16_t)(base + i);
+
+		uint32_t bucket = fat16_name_hash(node->key);
+		node->next = volume->dir_buckets[bucket];
+		volume->dir_buckets[bucket] = (uint16_t)++volume->dir_count;
+	}
+
+	return true;
+}
+
+// One pass over the root directory, every live entry goes in the hash. The
+// FAT16 root is read in one go, the FAT32 one a cluster of its chain at a time.
+static bool fat16_index_root_dir(fat16_volume_t *volume)
+{
+	const fat16_layout_t *layout = &volume->layout;
+	const size_t cluster_bytes = (size_t)layout->sector_size * layout->sectors_per_cluster;
+	size_t capacity = fat16_root_capacity(volume);
+	size_t raw_size = volume->type == FAT_TYPE_16 ? (size_t)layout->sector_size * layout->root_dir_sectors : cluster_bytes;
+	if (capacity == 0 || raw_size == 0)
+		return false;
+
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t raw_buf = gpa_alloc.alloc(raw_size);
+	if (raw_buf.ptr == nullptr)
+		return false;
+
+	fatptr_t nodes = gpa_alloc.alloc(capacity * sizeof(struct fat16_dir_node));
+	if (nodes.ptr == nullptr) {
+		gpa_alloc.free(raw_buf);
+		return false;
+	}
+
+	volume->dir_nodes = nodes.ptr;
+	volume->dir_count = 0;
+	volume->dir_capacity = capacity;
+	memset(volume->dir_buckets, 0, sizeof(volume->dir_buckets));
+
+	bool ok = true;
+	const size_t raw_entries = raw_size / sizeof(fat_dir_entry_t);
+	if (volume->type == FAT_TYPE_16) {
+		ok = fat16_read_root_dir_sectors(&volume->device, layout, raw_buf.ptr);
+		if (ok)
+			fat16_index_entries(volume, raw_buf.ptr, raw_entries, 0);
+	} else {
+		uint32_t cluster = layout->root_cluster;
+		for (size_t base = 0; base < capacity; base += raw_entries) {
+			ok = fat16_cluster_valid(volume, cluster) &&
+			     bcache_read(&volume->device, fat16_cluster_to_lba(layout, cluster), layout->sectors_per_cluster, raw_buf.ptr);
+			if (!ok || !fat16_index_entries(volume, raw_buf.ptr, raw_entries, base))
+				break;
+			cluster = fat16_next_cluster(volume, cluster);
 		}
 	}
 
-	return false;
+	gpa_alloc.free(raw_buf);
+	if (!ok) {
+		fat16_volume_invalidate_dir(volume);
+		return false;
+	}
+
+	volume->dir_indexed = true;
+	return true;
 }
 
 bool fat16_read_root_dir(const struct storage_device *device, const fat16_layout_t *layout,
@@ -236,115 +600,928 @@ bool fat16_read_root_dir(const struct storage_device *device, const fat16_layout
 	return ok;
 }
 
+static struct fat16_dir_node *fat16_lookup_node(fat16_volume_t *volume, const char *name)
+{
+	if (!volume->dir_indexed && !fat16_index_root_dir(volume))
+		return nullptr;
+
+	char key[FAT16_NAME_LEN];
+	if (!fat16_normalize_name(name, key))
+		return nullptr;
+
+	for (uint16_t i = volume->dir_buckets[fat16_name_hash(key)]; i != 0; i = volume->dir_nodes[i - 1].next) {
+		struct fat16_dir_node *node = &volume->dir_nodes[i - 1];
+		if (memcmp(node->key, key, FAT16_NAME_LEN) == 0)
+			return node;
+	}
+
+	return nullptr;
+}
+
+/**
+ * Subdirectory lookups go through a dentry cache keyed by (volume, first
+ * cluster of the directory, 8.3 name). Misses are remembered as negative
+ * dentries so a failing lookup does not rescan the directory either. The
+ * root directory has its own index and never lands here.
+ **/
+#define FAT16_DCACHE_HASH_BITS 8
+#define FAT16_DCACHE_HASH_SIZE (1u << FAT16_DCACHE_HASH_BITS)
+#define FAT16_DCACHE_MAX 1024u
+// Deepest path fat16_volume_lookup follows, ".." pops one level
+#define FAT16_MAX_PATH_DEPTH 32
+
+struct fat16_dentry {
+	const fat16_volume_t *volume;
+	uint32_t parent;
+	char key[FAT16_NAME_LEN];
+	bool negative;
+	uint32_t slot; // entry index in the directory
+	fat_dir_entry_t entry;
+	struct list_head hash;
+	struct list_head lru; // most recently used first
+};
+
+static slab_cache_t *fat16_dentry_cache = nullptr;
+static struct list_head fat16_dcache_hash[FAT16_DCACHE_HASH_SIZE];
+static LIST_HEAD(fat16_dcache_lru);
+static size_t fat16_dcache_count = 0;
+
+static bool fat16_dcache_init(void)
+{
+	if (fat16_dentry_cache != nullptr)
+		return true;
+
+	fat16_dentry_cache = slab_create("fat16_dentry", sizeof(struct fat16_dentry), alignof(struct fat16_dentry), 0, nullptr, nullptr);
+	if (fat16_dentry_cache == nullptr)
+		return false;
+
+	for (size_t i = 0; i < FAT16_DCACHE_HASH_SIZE; i++)
+		RESET_LIST_ITEM(&fat16_dcache_hash[i]);
+	return true;
+}
+
+static size_t fat16_dcache_bucket(uint32_t parent, const char key[FAT16_NAME_LEN])
+{
+	uint32_t hash = fat16_name_hash(key) ^ (parent * 0x9E3779B1u);
+	return (hash * 0x9E3779B1u) >> (32 - FAT16_DCACHE_HASH_BITS);
+}
+
+static void fat16_dcache_free(struct fat16_dentry *dentry)
+{
+	list_rm(&dentry->hash);
+	list_rm(&dentry->lru);
+	fat16_dcache_count--;
+	slab_free_obj(fat16_dentry_cache, (fatptr_t){ .ptr = dentry, .len = sizeof(*dentry) });
+}
+
+static void fat16_dcache_drop(const fat16_volume_t *volume)
+{
+	if (fat16_dentry_cache == nullptr)
+		return;
+
+	struct list_head *pos = fat16_dcache_lru.next;
+	while (pos != &fat16_dcache_lru) {
+		struct fat16_dentry *dentry = list_entry(pos, struct fat16_dentry, lru);
+		pos = pos->next;
+		if (dentry->volume == volume)
+			fat16_dcache_free(dentry);
+	}
+}
+
+static struct fat16_dentry *fat16_dcache_lookup(const fat16_volume_t *volume, uint32_t parent, const char key[FAT16_NAME_LEN])
+{
+	list_for_each(&fat16_dcache_hash[fat16_dcache_bucket(parent, key)]) {
+		struct fat16_dentry *dentry = list_entry(it, struct fat16_dentry, hash);
+		if (dentry->volume == volume && dentry->parent == parent && memcmp(dentry->key, key, FAT16_NAME_LEN) == 0) {
+			list_mv(&dentry->lru, &fat16_dcache_lru);
+			return dentry;
+		}
+	}
+
+	return nullptr;
+}
+
+// entry nullptr records a negative dentry, failing to cache is not an error
+static void fat16_dcache_add(const fat16_volume_t *volume, uint32_t parent, const char key[FAT16_NAME_LEN], const fat_dir_entry_t *entry,
+			     uint32_t slot)
+{
+	if (!fat16_dcache_init())
+		return;
+	if (fat16_dcache_count >= FAT16_DCACHE_MAX)
+		fat16_dcache_free(list_entry(fat16_dcache_lru.prev, struct fat16_dentry, lru));
+
+	fatptr_t obj = slab_alloc_obj(fat16_dentry_cache);
+	if (obj.ptr == nullptr)
+		return;
+
+	struct fat16_dentry *dentry = obj.ptr;
+	*dentry = (struct fat16_dentry){ .volume = volume, .parent = parent, .negative = entry == nullptr, .slot = slot };
+	memcpy(dentry->key, key, FAT16_NAME_LEN);
+	if (entry != nullptr)
+		dentry->entry = *entry;
+
+	list_add(&dentry->hash, &fat16_dcache_hash[fat16_dcache_bucket(parent, key)]);
+	list_add(&dentry->lru, &fat16_dcache_lru);
+	fat16_dcache_count++;
+}
+
+// Walk the clusters of a subdirectory for key. Returns false on I/O error
+// only, *found tells whether the name exists and *out_slot where.
+static bool fat16_scan_dir(const fat16_volume_t *volume, uint32_t dir_cluster, const char key[FAT16_NAME_LEN],
+			   fat_dir_entry_t *out_entry, uint32_t *out_slot, bool *found)
+{
+	const fat16_layout_t *layout = &volume->layout;
+	const size_t cluster_bytes = (size_t)layout->sector_size * layout->sectors_per_cluster;
+	const size_t per_cluster = cluster_bytes / sizeof(fat_dir_entry_t);
+
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t buf = gpa_alloc.alloc(cluster_bytes);
+	if (buf.ptr == nullptr)
+		return false;
+
+	bool ok = true;
+	*found = false;
+	uint32_t cluster = dir_cluster;
+	// Bounded by the cluster count in case the chain loops
+	for (size_t hops = 0; fat16_cluster_valid(volume, cluster) && hops < volume->max_cluster; hops++) {
+		if (!bcache_read(&volume->device, fat16_cluster_to_lba(layout, cluster), layout->sectors_per_cluster, buf.ptr)) {
+			ok = false;
+			break;
+		}
+
+		const fat_dir_entry_t *entries = buf.ptr;
+		bool end = false;
+		for (size_t i = 0; i < per_cluster && !*found; i++) {
+			if (fat16_dir_entry_is_unused(&entries[i])) {
+				end = true;
+				break;
+			}
+			if (fat16_dir_entry_is_deleted(&entries[i]) || entries[i].attributes == FAT_ATTR_LFN)
+				continue;
+
+			char entry_key[FAT16_NAME_LEN];
+			fat16_entry_key(&entries[i], entry_key);
+			if (memcmp(entry_key, key, FAT16_NAME_LEN) == 0) {
+				*out_entry = entries[i];
+				*out_slot = (uint32_t)(hops * per_cluster + i);
+				*found = true;
+			}
+		}
+
+		if (*found || end)
+			break;
+		cluster = fat16_next_cluster(volume, cluster);
+	}
+
+	gpa_alloc.free(buf);
+	return ok;
+}
+
+// One path component in the directory starting at parent, 0 for the root,
+// *out_slot is the index of its entry in that directory
+static bool fat16_lookup_in(fat16_volume_t *volume, uint32_t parent, const char *name, fat_dir_entry_t *out_entry, uint32_t *out_slot)
+{
+	if (parent == 0) {
+		const struct fat16_dir_node *node = fat16_lookup_node(volume, name);
+		if (node == nullptr)
+			return false;
+
+		*out_entry = node->entry;
+		*out_slot = node->slot;
+		return true;
+	}
+
+	char key[FAT16_NAME_LEN];
+	if (!fat16_normalize_name(name, key))
+		return false;
+
+	const struct fat16_dentry *dentry = fat16_dcache_lookup(volume, parent, key);
+	if (dentry != nullptr) {
+		if (!dentry->negative) {
+			*out_entry = dentry->entry;
+			*out_slot = dentry->slot;
+		}
+		return !dentry->negative;
+	}
+
+	bool found = false;
+	if (!fat16_scan_dir(volume, parent, key, out_entry, out_slot, &found))
+		return false;
+
+	fat16_dcache_add(volume, parent, key, found ? out_entry : nullptr, *out_slot);
+	return found;
+}
+
+// Also where the entry sits: the first cluster of its directory, 0 for the
+// root, and its index there. Unlike the first cluster of the file this
+// does not change as the file is written and is never shared.
+static bool fat16_volume_locate(fat16_volume_t *volume, const char *path, fat_dir_entry_t *out_entry, uint32_t *out_dir, uint32_t *out_slot)
+{
+	if (volume == nullptr || path == nullptr || out_entry == nullptr)
+		return false;
+
+	uint32_t parents[FAT16_MAX_PATH_DEPTH];
+	size_t depth = 0;
+	uint32_t dir = 0;
+	bool have_entry = false;
+
+	while (*path != '\0') {
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			break;
+
+		const char *end = path;
+		while (*end != '\0' && *end != '/')
+			end++;
+
+		size_t len = (size_t)(end - path);
+		if (len == 1 && path[0] == '.') {
+			path = end;
+			continue;
+		}
+		if (have_entry && (out_entry->attributes & FAT_ATTR_DIRECTORY) == 0)
+			return false;
+
+		if (len == 2 && path[0] == '.' && path[1] == '.') {
+			dir = depth > 0 ? parents[--depth] : 0;
+			have_entry = false;
+			path = end;
+			continue;
+		}
+
+		char name[13];
+		if (len >= sizeof(name))
+			return false;
+		memcpy(name, path, len);
+		name[len] = '\0';
+
+		if (!fat16_lookup_in(volume, dir, name, out_entry, out_slot))
+			return false;
+		*out_dir = dir;
+		have_entry = true;
+
+		if (out_entry->attributes & FAT_ATTR_DIRECTORY) {
+			if (depth == FAT16_MAX_PATH_DEPTH)
+				return false;
+			parents[depth++] = dir;
+			dir = fat16_entry_cluster(volume, out_entry);
+		}
+		path = end;
+	}
+
+	// The root itself has no directory entry
+	return have_entry;
+}
+
+bool fat16_volume_lookup(fat16_volume_t *volume, const char *path, fat_dir_entry_t *out_entry)
+{
+	uint32_t dir = 0;
+	uint32_t slot = 0;
+	return fat16_volume_locate(volume, path, out_entry, &dir, &slot);
+}
+
+bool fat16_volume_find_entry(fat16_volume_t *volume, const char *name, fat_dir_entry_t *out_entry)
+{
+	return fat16_volume_lookup(volume, name, out_entry);
+}
+
 bool fat16_find_entry_by_name(const struct storage_device *device, const char *name,
 			      fat_dir_entry_t *out_entry)
 {
-	if (device == nullptr || name == nullptr || out_entry == nullptr)
+	if (device == nullptr)
 		return false;
 
-	fat16_layout_t layout;
-	fat_BS_t *bpb = nullptr;
-	if (!fat16_load_layout(device, &layout, &bpb))
+	return fat16_volume_find_entry(fat16_mount_once(device), name, out_entry);
+}
+
+bool fat16_volume_read_file(const fat16_volume_t *volume, const fat_dir_entry_t *entry,
+			    void *buffer, size_t buffer_size, size_t *out_bytes)
+{
+	if (volume == nullptr || entry == nullptr || buffer == nullptr)
 		return false;
 
-	size_t raw_size = (size_t)layout.sector_size * layout.root_dir_sectors;
-	size_t raw_entries = raw_size / sizeof(fat_dir_entry_t);
-	allocator_t gpa_alloc = get_gpa_allocator();
-	fatptr_t raw_buf = gpa_alloc.alloc(raw_size);
-	if (raw_buf.ptr == nullptr) {
-		fat16_free_boot_sector(bpb);
+	if (out_bytes)
+		*out_bytes = 0;
+
+	size_t to_read = entry->file_size < buffer_size ? entry->file_size : buffer_size;
+	if (to_read == 0)
+		return true;
+
+	const fat16_layout_t *layout = &volume->layout;
+	const size_t cluster_bytes = (size_t)layout->sector_size * layout->sectors_per_cluster;
+	const size_t max_clusters = storage_max_sectors(&volume->device) / layout->sectors_per_cluster;
+
+	uint8_t *out = buffer;
+	uint32_t cluster = fat16_entry_cluster(volume, entry);
+	size_t total_read = 0;
+	while (fat16_cluster_valid(volume, cluster) && total_read < to_read) {
+		// Walk ahead while the chain stays physically contiguous, the run is one transfer
+		size_t wanted = to_read - total_read;
+		uint32_t first = cluster;
+		size_t clusters = 1;
+		uint32_t next = fat16_next_cluster(volume, cluster);
+		while (next == cluster + 1 && clusters * cluster_bytes < wanted && clusters < max_clusters) {
+			cluster = next;
+			clusters++;
+			next = fat16_next_cluster(volume, cluster);
+		}
+
+		size_t run_bytes = clusters * cluster_bytes < wanted ? clusters * cluster_bytes : wanted;
+		if (!fat16_read_bytes(&volume->device, fat16_cluster_to_lba(layout, first), run_bytes, out + total_read))
+			return false;
+		total_read += run_bytes;
+		cluster = next;
+	}
+
+	if (out_bytes)
+		*out_bytes = total_read;
+	return total_read == to_read;
+}
+
+bool fat16_read_file(const struct storage_device *device, const fat_dir_entry_t *entry,
+		     void *buffer, size_t buffer_size, size_t *out_bytes)
+{
+	if (device == nullptr)
+		return false;
+
+	return fat16_volume_read_file(fat16_mount_once(device), entry, buffer, buffer_size, out_bytes);
+}
+
+#define FAT16_CLUSTER_FREE 0x0000
+#define FAT16_END_OF_CHAIN 0xFFFF
+#define FAT32_END_OF_CHAIN 0x0FFFFFFFu
+#define FAT16_DIR_ENTRIES_PER_SECTOR (BCACHE_BLOCK_SIZE / sizeof(fat_dir_entry_t))
+
+static bool fat16_cluster_is_free(const fat16_volume_t *volume, uint32_t cluster)
+{
+	if (volume->type == FAT_TYPE_16)
+		return (volume->free_map[cluster / 32] & (1u << (cluster % 32))) != 0;
+
+	// A FAT sector that cannot be read counts as taken, handing its clusters out could cross link files
+	uint32_t entry = 0;
+	return fat32_read_entry(volume, cluster, &entry) && entry == FAT16_CLUSTER_FREE;
+}
+
+// Change the cached FAT sector in place. The mirrors get a copy of the
+// whole sector, they are never read so there is nothing to merge with.
+static bool fat32_write_entry(fat16_volume_t *volume, uint32_t cluster, uint32_t value, bool *was_free)
+{
+	const fat16_layout_t *layout = &volume->layout;
+	uint32_t sector = cluster / FAT32_ENTRIES_PER_SECTOR;
+	struct buffer_head *bh = bcache_get(&volume->device, volume->fat_lba + sector);
+	if (bh == nullptr)
+		return false;
+
+	uint32_t *entry = &((uint32_t *)bh->data)[cluster % FAT32_ENTRIES_PER_SECTOR];
+	*was_free = (*entry & FAT32_ENTRY_MASK) == FAT16_CLUSTER_FREE;
+	// The reserved top bits are kept as found
+	*entry = (*entry & ~FAT32_ENTRY_MASK) | (value & FAT32_ENTRY_MASK);
+	bcache_mark_dirty(bh);
+
+	bool ok = true;
+	for (uint32_t copy = 1; volume->fat_mirrored && copy < volume->bpb.FAT_count; copy++)
+		ok = bcache_write(&volume->device, layout->fat_start_lba + copy * layout->sectors_per_fat + sector, 1, bh->data) && ok;
+
+	bcache_put(bh);
+	return ok;
+}
+
+// Set the FAT entry of cluster to the next cluster, FAT16_CLUSTER_FREE or
+// FAT_CHAIN_END. FAT16 changes the resident FAT and writes the sector out
+// on the next flush, FAT32 changes the cached FAT sectors.
+static bool fat16_set_fat(fat16_volume_t *volume, uint32_t cluster, uint32_t value)
+{
+	bool was_free = false;
+	if (volume->type == FAT_TYPE_16) {
+		was_free = volume->fat[cluster] == FAT16_CLUSTER_FREE;
+		volume->fat[cluster] = value == FAT_CHAIN_END ? FAT16_END_OF_CHAIN : (uint16_t)value;
+
+		uint32_t sector = cluster / FAT16_ENTRIES_PER_SECTOR;
+		volume->fat_dirty[sector / 32] |= 1u << (sector % 32);
+
+		if (value == FAT16_CLUSTER_FREE)
+			volume->free_map[cluster / 32] |= 1u << (cluster % 32);
+		else
+			volume->free_map[cluster / 32] &= ~(1u << (cluster % 32));
+	} else if (!fat32_write_entry(volume, cluster, value == FAT_CHAIN_END ? FAT32_END_OF_CHAIN : value, &was_free)) {
 		return false;
 	}
 
-	bool ok = fat16_read_root_dir_sectors(device, &layout, raw_buf.ptr);
-	bool found = ok && fat16_find_in_root_dir(raw_buf.ptr, raw_entries, name, out_entry);
-	gpa_alloc.free(raw_buf);
-	fat16_free_boot_sector(bpb);
-	return found;
+	if (volume->free_count != FAT32_FSINFO_UNKNOWN) {
+		if (was_free && value != FAT16_CLUSTER_FREE)
+			volume->free_count--;
+		else if (!was_free && value == FAT16_CLUSTER_FREE)
+			volume->free_count++;
+	}
+	volume->fsinfo_dirty = true;
+	return true;
 }
 
-static bool fat16_read_cluster_data(const struct storage_device *device, const fat16_layout_t *layout,
-				    uint16_t cluster, uint8_t *out, size_t out_len,
-				    size_t *out_read)
+// FAT16 builds its free map from the resident FAT, FAT32 allocates
+// straight out of the FAT from the FSInfo hint on
+static bool fat16_prepare_write(fat16_volume_t *volume)
 {
-	if (cluster < 2 || layout->sectors_per_cluster > UINT16_MAX) {
-		if (out_read)
-			*out_read = 0;
+	if (volume->type == FAT_TYPE_32 || volume->free_map != nullptr)
+		return true;
+
+	const uint32_t max_cluster = volume->max_cluster;
+	size_t map_bytes = ((size_t)max_cluster / 32 + 1) * sizeof(uint32_t);
+	fatptr_t map = get_gpa_allocator().alloc(map_bytes);
+	if (map.ptr == nullptr)
 		return false;
+
+	memset(map.ptr, 0, map_bytes);
+	volume->free_map = map.ptr;
+	volume->free_count = 0;
+	for (uint32_t cluster = 2; cluster <= max_cluster; cluster++) {
+		if (volume->fat[cluster] == FAT16_CLUSTER_FREE) {
+			volume->free_map[cluster / 32] |= 1u << (cluster % 32);
+			volume->free_count++;
+		}
+	}
+
+	return true;
+}
+
+uint32_t fat16_volume_free_count(fat16_volume_t *volume)
+{
+	if (volume == nullptr || !fat16_prepare_write(volume))
+		return FAT32_FSINFO_UNKNOWN;
+
+	return volume->free_count;
+}
+
+/**
+ * First run of want free clusters from hint on, wrapping around to
+ * cluster 2. Without one the longest run seen is returned instead, its
+ * length in *len, which is 0 once the volume is full.
+ **/
+static uint32_t fat16_find_free_run(const fat16_volume_t *volume, uint32_t hint, size_t want, size_t *len)
+{
+	const uint32_t max = volume->max_cluster;
+	if (hint < 2 || hint > max)
+		hint = 2;
+
+	uint32_t best = 0, start = 0;
+	size_t best_len = 0, run = 0;
+	uint32_t cluster = hint;
+	// A known free count of 0 spares the full scan
+	for (size_t i = 0; i < (size_t)max - 1 && best_len < want && volume->free_count != 0; i++) {
+		if (fat16_cluster_is_free(volume, cluster)) {
+			if (run++ == 0)
+				start = cluster;
+			if (run > best_len) {
+				best = start;
+				best_len = run;
+			}
+		} else {
+			run = 0;
+		}
+
+		// A run cannot wrap from the last cluster back to the first
+		if (cluster == max) {
+			cluster = 2;
+			run = 0;
+		} else {
+			cluster++;
+		}
+	}
+
+	*len = best_len;
+	return best;
+}
+
+static bool fat16_free_chain(fat16_volume_t *volume, uint32_t cluster)
+{
+	bool ok = true;
+	// A loop ends at the first cluster freed already
+	while (ok && fat16_cluster_valid(volume, cluster)) {
+		uint32_t next = fat16_next_cluster(volume, cluster);
+		ok = fat16_set_fat(volume, cluster, FAT16_CLUSTER_FREE);
+		cluster = next;
+	}
+
+	return ok;
+}
+
+/**
+ * Chain count new clusters after last, 0 for an empty file. The whole
+ * extension is looked up at once so it lands in one run when the volume
+ * has one. Returns the first new cluster, or 0 with the chain as it was
+ * when the volume is too full.
+ **/
+static uint32_t fat16_alloc_clusters(fat16_volume_t *volume, uint32_t last, size_t count)
+{
+	uint32_t first = 0;
+	uint32_t prev = last;
+	size_t done = 0;
+	bool ok = true;
+
+	while (done < count && ok) {
+		size_t len = 0;
+		uint32_t hint = prev >= 2 ? prev + 1 : volume->alloc_hint;
+		uint32_t start = fat16_find_free_run(volume, hint, count - done, &len);
+		if (len == 0) {
+			ok = false;
+			break;
+		}
+		if (len > count - done)
+			len = count - done;
+
+		for (size_t i = 0; i < len && ok; i++) {
+			uint32_t cluster = start + (uint32_t)i;
+			ok = fat16_set_fat(volume, cluster, FAT_CHAIN_END);
+			if (ok && prev >= 2)
+				ok = fat16_set_fat(volume, prev, cluster);
+			if (ok && first == 0)
+				first = cluster;
+			if (ok)
+				prev = cluster;
+		}
+		done += len;
 	}
 
-	size_t cluster_bytes = (size_t)layout->sector_size * layout->sectors_per_cluster;
-	size_t to_read = cluster_bytes < out_len ? cluster_bytes : out_len;
-	if (to_read == 0) {
-		if (out_read)
-			*out_read = 0;
+	if (!ok) {
+		fat16_free_chain(volume, first);
+		if (last >= 2)
+			fat16_set_fat(volume, last, FAT_CHAIN_END);
+		return 0;
+	}
+
+	volume->alloc_hint = prev;
+	return first;
+}
+
+// FAT16 copies every changed FAT sector to all FAT_count FATs, FAT32
+// updates its FSInfo hints. Then everything the operation dirtied is
+// written back, the queue merges the adjacent blocks. A FAT can be
+// larger than the clusters need, only the sectors up to max_cluster
+// ever change and fat_dirty tracks just those.
+static bool fat16_flush(fat16_volume_t *volume)
+{
+	const fat16_layout_t *layout = &volume->layout;
+	const uint32_t sectors_per_fat = layout->sectors_per_fat;
+	bool ok = true;
+
+	if (volume->type == FAT_TYPE_16) {
+		uint32_t used_sectors = volume->max_cluster / FAT16_ENTRIES_PER_SECTOR + 1;
+		for (uint32_t sector = 0; sector < used_sectors; sector++) {
+			if ((volume->fat_dirty[sector / 32] & (1u << (sector % 32))) == 0)
+				continue;
+
+			const uint8_t *data = (const uint8_t *)volume->fat + sector * BCACHE_BLOCK_SIZE;
+			for (uint32_t copy = 0; copy < volume->bpb.FAT_count; copy++)
+				ok = bcache_write(&volume->device, layout->fat_start_lba + copy * sectors_per_fat + sector, 1, data) && ok;
+		}
+		memset(volume->fat_dirty, 0, sizeof(volume->fat_dirty));
+	} else if (volume->fsinfo_dirty && volume->fsinfo_lba != 0) {
+		struct buffer_head *bh = bcache_get(&volume->device, volume->fsinfo_lba);
+		if (bh != nullptr) {
+			fat32_fsinfo_t *fsinfo = (fat32_fsinfo_t *)bh->data;
+			fsinfo->free_count = volume->free_count;
+			fsinfo->next_free = volume->alloc_hint;
+			bcache_mark_dirty(bh);
+			bcache_put(bh);
+		} else {
+			ok = false;
+		}
+	}
+	volume->fsinfo_dirty = false;
+
+	return bcache_sync(&volume->device) && ok;
+}
+
+// Sector holding root directory entry slot, FAT32 follows the root chain to it
+static bool fat16_root_slot_lba(const fat16_volume_t *volume, uint16_t slot, uint32_t *out_lba)
+{
+	const fat16_layout_t *layout = &volume->layout;
+	if (volume->type == FAT_TYPE_16) {
+		*out_lba = layout->root_dir_lba + slot / FAT16_DIR_ENTRIES_PER_SECTOR;
 		return true;
 	}
 
-	uint32_t lba = fat16_cluster_to_lba(layout, cluster);
-	if (to_read == cluster_bytes) {
-		if (!fat16_read_sectors(device, lba, (uint16_t)layout->sectors_per_cluster, out))
+	const size_t per_cluster = FAT16_DIR_ENTRIES_PER_SECTOR * layout->sectors_per_cluster;
+	uint32_t cluster = layout->root_cluster;
+	for (size_t hops = slot / per_cluster; hops > 0 && fat16_cluster_valid(volume, cluster); hops--)
+		cluster = fat16_next_cluster(volume, cluster);
+	if (!fat16_cluster_valid(volume, cluster))
+		return false;
+
+	*out_lba = fat16_cluster_to_lba(layout, cluster) + (slot % per_cluster) / FAT16_DIR_ENTRIES_PER_SECTOR;
+	return true;
+}
+
+static bool fat16_store_dir_entry(fat16_volume_t *volume, uint16_t slot, const fat_dir_entry_t *entry)
+{
+	uint32_t lba = 0;
+	if (!fat16_root_slot_lba(volume, slot, &lba))
+		return false;
+
+	struct buffer_head *bh = bcache_get(&volume->device, lba);
+	if (bh == nullptr)
+		return false;
+
+	memcpy(bh->data + (slot % FAT16_DIR_ENTRIES_PER_SECTOR) * sizeof(fat_dir_entry_t), entry, sizeof(*entry));
+	bcache_mark_dirty(bh);
+	bcache_put(bh);
+	return true;
+}
+
+static uint64_t fat16_vnode_id(uint32_t dir, uint32_t slot)
+{
+	return (uint64_t)dir << 32 | slot;
+}
+
+static void fat16_notify_change(const fat16_volume_t *volume, uint16_t slot)
+{
+	if (volume->change_cb != nullptr)
+		volume->change_cb(fat16_vnode_id(0, slot), volume->change_ctx);
+}
+
+static bool fat16_commit(fat16_volume_t *volume, const struct fat16_dir_node *node)
+{
+	bool ok = fat16_store_dir_entry(volume, node->slot, &node->entry);
+	return fat16_flush(volume) && ok;
+}
+
+// Write len bytes at byte pos of the sectors from lba on. Whole sectors go
+// straight to the disk, a partial head or tail is merged in its cached block
+static bool fat16_write_bytes(const struct storage_device *device, uint32_t lba, size_t pos, const uint8_t *src, size_t len)
+{
+	lba += pos / BCACHE_BLOCK_SIZE;
+	pos %= BCACHE_BLOCK_SIZE;
+
+	while (len > 0) {
+		if (pos == 0 && len >= BCACHE_BLOCK_SIZE) {
+			size_t full = len / BCACHE_BLOCK_SIZE;
+			if (!bcache_write_through(device, lba, full, src))
+				return false;
+
+			lba += full;
+			src += full * BCACHE_BLOCK_SIZE;
+			len -= full * BCACHE_BLOCK_SIZE;
+			continue;
+		}
+
+		size_t chunk = BCACHE_BLOCK_SIZE - pos < len ? BCACHE_BLOCK_SIZE - pos : len;
+		struct buffer_head *bh = bcache_get(device, lba);
+		if (bh == nullptr)
 			return false;
-		if (out_read)
-			*out_read = to_read;
-		return true;
+
+		memcpy(bh->data + pos, src, chunk);
+		bcache_mark_dirty(bh);
+		bcache_put(bh);
+
+		lba++;
+		src += chunk;
+		len -= chunk;
+		pos = 0;
 	}
 
+	return true;
+}
+
+// A full FAT32 root grows by one zeroed cluster, the index is rebuilt
+// around the bigger directory and the first new entry is handed out
+static bool fat32_grow_root(fat16_volume_t *volume, uint32_t last, uint16_t *out_slot)
+{
+	const fat16_layout_t *layout = &volume->layout;
+	const size_t cluster_bytes = (size_t)layout->sector_size * layout->sectors_per_cluster;
+	size_t slot = volume->dir_capacity;
+	if (!fat16_cluster_valid(volume, last) || slot + cluster_bytes / sizeof(fat_dir_entry_t) > FAT16_DIR_MAX_ENTRIES)
+		return false;
+
 	allocator_t gpa_alloc = get_gpa_allocator();
-	fatptr_t temp_buf = gpa_alloc.alloc(cluster_bytes);
-	if (temp_buf.ptr == nullptr)
+	fatptr_t zero = gpa_alloc.alloc(cluster_bytes);
+	if (zero.ptr == nullptr)
 		return false;
 
-	bool ok = fat16_read_sectors(device, lba, (uint16_t)layout->sectors_per_cluster, temp_buf.ptr);
-	if (ok)
-		memcpy(out, temp_buf.ptr, to_read);
-	gpa_alloc.free(temp_buf);
-	if (out_read)
-		*out_read = ok ? to_read : 0;
-	return ok;
+	memset(zero.ptr, 0, cluster_bytes);
+	uint32_t cluster = fat16_alloc_clusters(volume, last, 1);
+	bool ok = cluster != 0 && bcache_write(&volume->device, fat16_cluster_to_lba(layout, cluster), layout->sectors_per_cluster, zero.ptr);
+	gpa_alloc.free(zero);
+	if (!ok)
+		return false;
+
+	// The node array is sized for the old directory
+	fat16_volume_invalidate_dir(volume);
+	if (!fat16_index_root_dir(volume))
+		return false;
+
+	*out_slot = (uint16_t)slot;
+	return true;
 }
 
-bool fat16_read_file(const struct storage_device *device, const fat_dir_entry_t *entry,
-		     void *buffer, size_t buffer_size, size_t *out_bytes)
+static bool fat16_find_free_slot(fat16_volume_t *volume, uint16_t *out_slot)
+{
+	const fat16_layout_t *layout = &volume->layout;
+	const uint32_t sectors = volume->type == FAT_TYPE_16 ? layout->root_dir_sectors : layout->sectors_per_cluster;
+	uint32_t cluster = layout->root_cluster;
+	uint32_t last = 0;
+	size_t slot = 0;
+
+	// The FAT16 root is one region, the FAT32 one is walked a cluster at a time
+	while (slot < volume->dir_capacity) {
+		uint32_t lba = layout->root_dir_lba;
+		if (volume->type == FAT_TYPE_32) {
+			if (!fat16_cluster_valid(volume, cluster))
+				break;
+			lba = fat16_cluster_to_lba(layout, cluster);
+		}
+
+		for (uint32_t sector = 0; sector < sectors && slot < volume->dir_capacity; sector++) {
+			struct buffer_head *bh = bcache_get(&volume->device, lba + sector);
+			if (bh == nullptr)
+				return false;
+
+			const fat_dir_entry_t *entries = (const fat_dir_entry_t *)bh->data;
+			for (uint32_t i = 0; i < FAT16_DIR_ENTRIES_PER_SECTOR && slot + i < volume->dir_capacity; i++) {
+				if (fat16_dir_entry_is_unused(&entries[i]) || fat16_dir_entry_is_deleted(&entries[i])) {
+					bcache_put(bh);
+					*out_slot = (uint16_t)(slot + i);
+					return true;
+				}
+			}
+			bcache_put(bh);
+			slot += FAT16_DIR_ENTRIES_PER_SECTOR;
+		}
+
+		if (volume->type == FAT_TYPE_16)
+			return false;
+		last = cluster;
+		cluster = fat16_next_cluster(volume, cluster);
+	}
+
+	return volume->type == FAT_TYPE_32 && cluster == FAT_CHAIN_END && fat32_grow_root(volume, last, out_slot);
+}
+
+bool fat16_volume_create(fat16_volume_t *volume, const char *name)
 {
-	if (device == nullptr || entry == nullptr || buffer == nullptr)
+	char key[FAT16_NAME_LEN];
+	if (volume == nullptr || name == nullptr || !fat16_normalize_name(name, key))
+		return false;
+	if (fat16_lookup_node(volume, name) != nullptr || !volume->dir_indexed)
 		return false;
 
-	if (out_bytes)
-		*out_bytes = 0;
+	uint16_t slot = 0;
+	if (!fat16_find_free_slot(volume, &slot))
+		return false;
+
+	// The node array holds dir_capacity entries, a free slot means there is room
+	struct fat16_dir_node *node = &volume->dir_nodes[volume->dir_count];
+	*node = (struct fat16_dir_node){ .slot = slot };
+	memcpy(node->key, key, FAT16_NAME_LEN);
+	memcpy(node->entry.name, key, sizeof(node->entry.name));
+	memcpy(node->entry.ext, key + 8, sizeof(node->entry.ext));
+	node->entry.attributes = FAT_ATTR_ARCHIVE;
+
+	uint32_t bucket = fat16_name_hash(key);
+	node->next = volume->dir_buckets[bucket];
+	volume->dir_buckets[bucket] = (uint16_t)++volume->dir_count;
+
+	// A vnode of a file removed from this slot before must not come back
+	fat16_notify_change(volume, slot);
+	return fat16_commit(volume, node);
+}
 
-	fat16_layout_t layout;
-	fat_BS_t *bpb = nullptr;
-	if (!fat16_load_layout(device, &layout, &bpb))
+bool fat16_volume_write(fat16_volume_t *volume, const char *name, size_t offset, const void *src, size_t len)
+{
+	if (volume == nullptr || name == nullptr || (src == nullptr && len > 0))
 		return false;
 
-	size_t to_read = entry->file_size < buffer_size ? entry->file_size : buffer_size;
-	if (to_read == 0) {
-		fat16_free_boot_sector(bpb);
+	struct fat16_dir_node *node = fat16_lookup_node(volume, name);
+	if (node == nullptr || (node->entry.attributes & FAT_ATTR_DIRECTORY) || offset > node->entry.file_size)
+		return false;
+	if (len == 0)
 		return true;
+	if (len > UINT32_MAX - offset || !fat16_prepare_write(volume))
+		return false;
+
+	fat_dir_entry_t *entry = &node->entry;
+	const fat16_layout_t *layout = &volume->layout;
+	const size_t cluster_bytes = (size_t)layout->sector_size * layout->sectors_per_cluster;
+	const size_t max_clusters = storage_max_sectors(&volume->device) / layout->sectors_per_cluster;
+	const size_t end = offset + len;
+
+	size_t have = 0;
+	uint32_t last = 0;
+	for (uint32_t cluster = fat16_entry_cluster(volume, entry); fat16_cluster_valid(volume, cluster) && have < volume->max_cluster;
+	     cluster = fat16_next_cluster(volume, cluster)) {
+		have++;
+		last = cluster;
 	}
 
-	uint8_t *out = buffer;
-	uint16_t cluster = entry->first_cluster_low;
-	size_t total_read = 0;
-	while (cluster >= 2 && total_read < to_read) {
-		size_t cluster_read = 0;
-		if (!fat16_read_cluster_data(device, &layout, cluster, out + total_read,
-					     to_read - total_read, &cluster_read)) {
-			fat16_free_boot_sector(bpb);
+	size_t need = (end + cluster_bytes - 1) / cluster_bytes;
+	if (need > have) {
+		uint32_t first = fat16_alloc_clusters(volume, last, need - have);
+		if (first == 0)
 			return false;
-		}
-		total_read += cluster_read;
-		uint16_t next = fat16_read_fat_entry(device, &layout, cluster);
-		if (fat16_is_end_of_chain(next))
+		if (last < 2)
+			fat16_set_entry_cluster(volume, entry, first);
+	}
+
+	uint32_t cluster = fat16_entry_cluster(volume, entry);
+	for (size_t skip = offset / cluster_bytes; skip > 0; skip--)
+		cluster = fat16_next_cluster(volume, cluster);
+
+	// Same run detection as the read side, one transfer per contiguous run
+	const uint8_t *in = src;
+	size_t pos = offset % cluster_bytes;
+	bool ok = true;
+	while (len > 0 && ok) {
+		if (!fat16_cluster_valid(volume, cluster)) {
+			ok = false;
 			break;
+		}
+
+		uint32_t first = cluster;
+		size_t clusters = 1;
+		uint32_t next = fat16_next_cluster(volume, cluster);
+		while (next == cluster + 1 && clusters * cluster_bytes - pos < len && clusters < max_clusters) {
+			cluster = next;
+			clusters++;
+			next = fat16_next_cluster(volume, cluster);
+		}
+
+		size_t chunk = clusters * cluster_bytes - pos < len ? clusters * cluster_bytes - pos : len;
+		ok = fat16_write_bytes(&volume->device, fat16_cluster_to_lba(layout, first), pos, in, chunk);
+		in += chunk;
+		len -= chunk;
+		pos = 0;
 		cluster = next;
 	}
 
-	fat16_free_boot_sector(bpb);
-	if (out_bytes)
-		*out_bytes = total_read;
-	return total_read == to_read;
+	if (ok && end > entry->file_size)
+		entry->file_size = (uint32_t)end;
+	fat16_notify_change(volume, node->slot);
+	return fat16_commit(volume, node) && ok;
+}
+
+bool fat16_volume_truncate(fat16_volume_t *volume, const char *name, size_t size)
+{
+	if (volume == nullptr || name == nullptr)
+		return false;
+
+	struct fat16_dir_node *node = fat16_lookup_node(volume, name);
+	if (node == nullptr || (node->entry.attributes & FAT_ATTR_DIRECTORY) || size > node->entry.file_size)
+		return false;
+	if (size == node->entry.file_size)
+		return true;
+	if (!fat16_prepare_write(volume))
+		return false;
+
+	fat_dir_entry_t *entry = &node->entry;
+	const size_t cluster_bytes = (size_t)volume->layout.sector_size * volume->layout.sectors_per_cluster;
+	size_t keep = (size + cluster_bytes - 1) / cluster_bytes;
+
+	bool ok = true;
+	if (keep == 0) {
+		ok = fat16_free_chain(volume, fat16_entry_cluster(volume, entry));
+		fat16_set_entry_cluster(volume, entry, 0);
+	} else {
+		uint32_t last = fat16_entry_cluster(volume, entry);
+		for (size_t i = 1; i < keep; i++)
+			last = fat16_next_cluster(volume, last);
+
+		if (fat16_cluster_valid(volume, last)) {
+			uint32_t next = fat16_next_cluster(volume, last);
+			ok = fat16_set_fat(volume, last, FAT_CHAIN_END) && fat16_free_chain(volume, next);
+		}
+	}
+
+	entry->file_size = (uint32_t)size;
+	fat16_notify_change(volume, node->slot);
+	return fat16_commit(volume, node) && ok;
+}
+
+bool fat16_volume_remove(fat16_volume_t *volume, const char *name)
+{
+	if (volume == nullptr || name == nullptr)
+		return false;
+
+	struct fat16_dir_node *node = fat16_lookup_node(volume, name);
+	if (node == nullptr || (node->entry.attributes & FAT_ATTR_DIRECTORY) || !fat16_prepare_write(volume))
+		return false;
+
+	bool ok = fat16_free_chain(volume, fat16_entry_cluster(volume, &node->entry));
+
+	fat_dir_entry_t deleted = node->entry;
+	deleted.name[0] = (char)0xE5;
+	ok = fat16_store_dir_entry(volume, node->slot, &deleted) && ok;
+	fat16_notify_change(volume, node->slot);
+
+	// Unlinking from a bucket would leave a hole in the node array, rebuild instead
+	fat16_volume_invalidate_dir(volume);
+	return fat16_flush(volume) && ok;
+}
+
+bool fat16_volume_sync(fat16_volume_t *volume)
+{
+	if (volume == nullptr)
+		return false;
+
+	return fat16_flush(volume);
 }
 
 bool fat16_dir_entry_is_unused(const fat_dir_entry_t *entry)
@@ -386,3 +1563,125 @@ bool fat16_decode_83_name(const fat_dir_entry_t *entry, char *out, size_t out_si
 	out[offset] = '\0';
 	return true;
 }
+
+// VFS glue. A vnode keeps its directory entry and where the last mapping
+// ended in the cluster chain, a sequential read walks the chain once.
+struct fat16_vnode {
+	fat_dir_entry_t entry;
+	uint32_t index;	  // cluster index in the file of cluster
+	uint32_t cluster; // 0 until the first mapping
+};
+
+static bool fat16_vfs_bmap(struct vnode *vnode, uint64_t offset, size_t len, uint64_t *out_lba, size_t *out_bytes)
+{
+	const fat16_volume_t *volume = vnode->mount->fs_data;
+	struct fat16_vnode *file = vnode->fs_data;
+	const fat16_layout_t *layout = &volume->layout;
+	const size_t cluster_bytes = (size_t)layout->sector_size * layout->sectors_per_cluster;
+	if (offset >= file->entry.file_size)
+		return false;
+
+	// The chain only links forward, going back starts over
+	const uint32_t index = (uint32_t)(offset / cluster_bytes);
+	if (file->cluster == 0 || file->index > index) {
+		file->index = 0;
+		file->cluster = fat16_entry_cluster(volume, &file->entry);
+	}
+	while (file->index < index) {
+		uint32_t next = fat16_next_cluster(volume, file->cluster);
+		if (!fat16_cluster_valid(volume, next))
+			return false;
+		file->cluster = next;
+		file->index++;
+	}
+	if (!fat16_cluster_valid(volume, file->cluster))
+		return false;
+
+	const size_t skip = (size_t)(offset % cluster_bytes) / layout->sector_size;
+	*out_lba = fat16_cluster_to_lba(layout, file->cluster) + skip;
+	size_t bytes = cluster_bytes - skip * layout->sector_size;
+	while (bytes < len) {
+		uint32_t next = fat16_next_cluster(volume, file->cluster);
+		if (next != file->cluster + 1 || !fat16_cluster_valid(volume, next))
+			break;
+		file->cluster = next;
+		file->index++;
+		bytes += cluster_bytes;
+	}
+
+	*out_bytes = bytes;
+	return true;
+}
+
+static void fat16_vfs_release(struct vnode *vnode)
+{
+	get_gpa_allocator().free((fatptr_t){ .ptr = vnode->fs_data, .len = sizeof(struct fat16_vnode) });
+	vnode->fs_data = nullptr;
+}
+
+static const struct vnode_ops fat16_vnode_ops = {
+	.bmap = fat16_vfs_bmap,
+	.release = fat16_vfs_release,
+};
+
+static void fat16_vfs_changed(uint64_t id, void *ctx)
+{
+	vfs_invalidate(ctx, id);
+}
+
+static bool fat16_vfs_mount(struct vfs_mount *mount)
+{
+	fat16_volume_t *volume = fat16_mount(&mount->device);
+	mount->fs_data = volume;
+	if (volume == nullptr)
+		return false;
+
+	// One mount of the volume is told about changes, a second one of the
+	// same device is refused
+	if (volume->change_cb != nullptr) {
+		fat16_unmount(volume);
+		mount->fs_data = nullptr;
+		return false;
+	}
+	volume->change_cb = fat16_vfs_changed;
+	volume->change_ctx = mount;
+	return true;
+}
+
+static void fat16_vfs_unmount(struct vfs_mount *mount)
+{
+	fat16_volume_t *volume = mount->fs_data;
+	volume->change_cb = nullptr;
+	volume->change_ctx = nullptr;
+	fat16_unmount(mount->fs_data);
+	mount->fs_data = nullptr;
+}
+
+static bool fat16_vfs_lookup(struct vfs_mount *mount, const char *path, struct vnode *out)
+{
+	fat16_volume_t *volume = mount->fs_data;
+	fat_dir_entry_t entry;
+	uint32_t dir = 0;
+	uint32_t slot = 0;
+	if (!fat16_volume_locate(volume, path, &entry, &dir, &slot))
+		return false;
+
+	fatptr_t obj = get_gpa_allocator().alloc(sizeof(struct fat16_vnode));
+	if (obj.ptr == nullptr)
+		return false;
+
+	*(struct fat16_vnode *)obj.ptr = (struct fat16_vnode){ .entry = entry };
+	out->ops = &fat16_vnode_ops;
+	out->fs_data = obj.ptr;
+	out->id = fat16_vnode_id(dir, slot);
+	out->size = entry.file_size;
+	out->is_dir = (entry.attributes & FAT_ATTR_DIRECTORY) != 0;
+	return true;
+}
+
+const struct vfs_fs_type fat16_vfs_type = {
+	.name = "fat",
+	.mount = fat16_vfs_mount,
+	.unmount = fat16_vfs_unmount,
+	.lookup = fat16_vfs_lookup,
+};
@@ -0,0 +1,394 @@
+#include <kernel/initramfs.h>
+
+#include <kernel/allocator.h>
+#include <kernel/display.h>
+#include <kernel/phy_mem.h>
+#include <kernel/vfs.h>
+#include <kernel/vir_mem.h>
+
+#include <string.h>
+
+MODULE("initramfs")
+
+#define INITRAMFS_HASH_SIZE (1u << INITRAMFS_HASH_BITS)
+#define CPIO_HEADER_SIZE 110
+#define CPIO_MODE_TYPE 0170000u
+#define CPIO_MODE_DIR 0040000u
+#define CPIO_MODE_FILE 0100000u
+#define TAR_BLOCK_SIZE 512
+
+static struct initramfs_module initramfs_modules[INITRAMFS_MAX_MODULES];
+static size_t initramfs_module_count = 0;
+// Sized by a counting pass over every module, then filled by a second one
+static struct initramfs_node *initramfs_nodes = nullptr;
+static size_t initramfs_node_count = 0;
+static size_t initramfs_node_capacity = 0;
+static uint32_t initramfs_buckets[INITRAMFS_HASH_SIZE]; // node index + 1, 0 when empty
+static bool initramfs_ready = false;
+
+void initramfs_add_module(uint32_t phys_start, uint32_t phys_end, const char *cmdline)
+{
+	if (initramfs_module_count == INITRAMFS_MAX_MODULES) {
+		mprint("too many modules, %x-%x ignored\n", phys_start, phys_end);
+		return;
+	}
+	if (phys_end < phys_start)
+		return;
+
+	struct initramfs_module *module = &initramfs_modules[initramfs_module_count++];
+	*module = (struct initramfs_module){ .phys_start = phys_start, .phys_end = phys_end };
+
+	size_t len = cmdline == nullptr ? 0 : strlen(cmdline);
+	if (len >= INITRAMFS_CMDLINE_MAX)
+		len = INITRAMFS_CMDLINE_MAX - 1;
+	memcpy(module->cmdline, cmdline, len);
+	module->cmdline[len] = '\0';
+}
+
+void initramfs_reserve(void)
+{
+	for (size_t i = 0; i < initramfs_module_count; i++) {
+		const struct initramfs_module *module = &initramfs_modules[i];
+		const size_t start = module->phys_start & ~(size_t)(PAGE_SIZE - 1);
+		phy_mem_rm_region(start, round_up_to_page(module->phys_end) - start);
+	}
+}
+
+// Map the module pages once, read only, the module need not start on a page
+static bool initramfs_map_module(struct initramfs_module *module)
+{
+	const size_t in_page = module->phys_start % PAGE_SIZE;
+	const size_t phys_base = module->phys_start - in_page;
+	const size_t page_count = (in_page + module->phys_end - module->phys_start + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (page_count == 0)
+		return false;
+
+	struct vmm_entry *range = vmm_alloc(page_count * PAGE_SIZE, VMM_PAGE_FLAG_PRESENT_BIT);
+	if (range == nullptr)
+		return false;
+
+	for (size_t i = 0; i < page_count; i++)
+		map_page((void *)(phys_base + i * PAGE_SIZE), (uint8_t *)range->ptr + i * PAGE_SIZE, range->flags);
+
+	module->data = (const uint8_t *)range->ptr + in_page;
+	return true;
+}
+
+static uint32_t initramfs_hash(const char *name, size_t len)
+{
+	// FNV-1a
+	uint32_t hash = 0x811C9DC5u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 0x01000193u;
+	}
+
+	return hash & (INITRAMFS_HASH_SIZE - 1);
+}
+
+// Drop the "./" and "/" in front and the "/" behind, "." is the root
+static const char *initramfs_clean_name(const char *name, size_t *len)
+{
+	for (;;) {
+		if (*len >= 2 && name[0] == '.' && name[1] == '/') {
+			name += 2;
+			*len -= 2;
+		} else if (*len >= 1 && name[0] == '/') {
+			name++;
+			(*len)--;
+		} else {
+			break;
+		}
+	}
+	if (*len == 1 && name[0] == '.')
+		*len = 0;
+	while (*len > 0 && name[*len - 1] == '/')
+		(*len)--;
+
+	return name;
+}
+
+// Counts the member on the first pass and indexes it on the second. A
+// later member of the same name is found first, so it wins.
+static void initramfs_add_node(const char *name, size_t name_len, const uint8_t *data, size_t size, bool is_dir)
+{
+	name = initramfs_clean_name(name, &name_len);
+	if (name_len == 0)
+		return;
+
+	if (initramfs_nodes == nullptr) {
+		initramfs_node_capacity++;
+		return;
+	}
+	if (initramfs_node_count == initramfs_node_capacity)
+		return;
+
+	struct initramfs_node *node = &initramfs_nodes[initramfs_node_count];
+	*node = (struct initramfs_node){ .name = name, .name_len = name_len, .data = data, .size = size, .is_dir = is_dir };
+
+	const uint32_t bucket = initramfs_hash(name, name_len);
+	node->next = initramfs_buckets[bucket];
+	initramfs_buckets[bucket] = (uint32_t)++initramfs_node_count;
+}
+
+static bool initramfs_parse_number(const char *field, size_t len, uint32_t base, uint32_t *out)
+{
+	uint32_t value = 0;
+	size_t i = 0;
+	while (i < len && field[i] == ' ')
+		i++;
+	for (; i < len && field[i] != '\0' && field[i] != ' '; i++) {
+		uint32_t digit;
+		if (field[i] >= '0' && field[i] <= '9')
+			digit = field[i] - '0';
+		else if (field[i] >= 'a' && field[i] <= 'f')
+			digit = field[i] - 'a' + 10;
+		else if (field[i] >= 'A' && field[i] <= 'F')
+			digit = field[i] - 'A' + 10;
+		else
+			return false;
+		if (digit >= base)
+			return false;
+
+		value = value * base + digit;
+	}
+
+	*out = value;
+	return true;
+}
+
+static size_t initramfs_align(size_t value, size_t align)
+{
+	return (value + align - 1) / align * align;
+}
+
+static bool initramfs_is_cpio(const uint8_t *data, size_t size)
+{
+	return size >= CPIO_HEADER_SIZE && memcmp(data, "07070", 5) == 0 && (data[5] == '1' || data[5] == '2');
+}
+
+static bool initramfs_is_tar(const uint8_t *data, size_t size)
+{
+	return size >= TAR_BLOCK_SIZE && memcmp(data + 257, "ustar", 5) == 0;
+}
+
+// newc headers are thirteen 8 digit hex fields after the magic, the name
+// and the data each start 4 byte aligned
+static bool initramfs_parse_cpio(const uint8_t *data, size_t size)
+{
+	size_t offset = 0;
+	while (offset + CPIO_HEADER_SIZE <= size) {
+		const char *header = (const char *)data + offset;
+		uint32_t mode = 0;
+		uint32_t file_size = 0;
+		uint32_t name_size = 0;
+		if (!initramfs_is_cpio(data + offset, size - offset) || !initramfs_parse_number(header + 14, 8, 16, &mode) ||
+		    !initramfs_parse_number(header + 54, 8, 16, &file_size) || !initramfs_parse_number(header + 94, 8, 16, &name_size))
+			return false;
+
+		const size_t data_offset = initramfs_align(offset + CPIO_HEADER_SIZE + name_size, 4);
+		if (name_size == 0 || data_offset > size || file_size > size - data_offset)
+			return false;
+
+		const char *name = header + CPIO_HEADER_SIZE;
+		if (name_size == sizeof("TRAILER!!!") && memcmp(name, "TRAILER!!!", name_size) == 0)
+			return true;
+
+		// Links, devices and the like are left out
+		if ((mode & CPIO_MODE_TYPE) == CPIO_MODE_FILE || (mode & CPIO_MODE_TYPE) == CPIO_MODE_DIR)
+			initramfs_add_node(name, name_size - 1, data + data_offset, file_size, (mode & CPIO_MODE_TYPE) == CPIO_MODE_DIR);
+
+		offset = initramfs_align(data_offset + file_size, 4);
+	}
+
+	return false;
+}
+
+// ustar, a 512 byte header per member and the data padded to 512 bytes,
+// an all zero block ends the archive
+static bool initramfs_parse_tar(const uint8_t *data, size_t size)
+{
+	size_t offset = 0;
+	while (offset + TAR_BLOCK_SIZE <= size) {
+		const char *header = (const char *)data + offset;
+		if (header[0] == '\0')
+			return true;
+
+		uint32_t file_size = 0;
+		if (!initramfs_is_tar(data + offset, size - offset) || !initramfs_parse_number(header + 124, 12, 8, &file_size))
+			return false;
+
+		const size_t data_offset = offset + TAR_BLOCK_SIZE;
+		if (file_size > size - data_offset)
+			return false;
+
+		size_t name_len = 0;
+		while (name_len < 100 && header[name_len] != '\0')
+			name_len++;
+
+		const char type = header[156];
+		// A long name is split over the prefix and name fields, it could not
+		// point into the archive, such members are left out like links are
+		if (header[345] == '\0' && (type == '0' || type == '\0' || type == '5'))
+			initramfs_add_node(header, name_len, data + data_offset, file_size, type == '5');
+
+		offset = data_offset + initramfs_align(file_size, TAR_BLOCK_SIZE);
+	}
+
+	return false;
+}
+
+// False for a truncated or corrupt archive, the members before the damage
+// are still indexed
+static bool initramfs_parse_module(const struct initramfs_module *module)
+{
+	const size_t size = module->phys_end - module->phys_start;
+	if (initramfs_is_cpio(module->data, size))
+		return initramfs_parse_cpio(module->data, size);
+	if (initramfs_is_tar(module->data, size))
+		return initramfs_parse_tar(module->data, size);
+
+	// Not an archive, the module is one file named by the last path
+	// component of the first word of its command line
+	size_t len = 0;
+	while (module->cmdline[len] != '\0' && module->cmdline[len] != ' ')
+		len++;
+	size_t start = len;
+	while (start > 0 && module->cmdline[start - 1] != '/')
+		start--;
+
+	initramfs_add_node(module->cmdline + start, len - start, module->data, size, false);
+	return true;
+}
+
+bool initramfs_init(void)
+{
+	if (initramfs_ready)
+		return true;
+
+	for (size_t i = 0; i < initramfs_module_count; i++) {
+		if (initramfs_modules[i].data == nullptr && !initramfs_map_module(&initramfs_modules[i])) {
+			mprint("failed to map module %x-%x\n", initramfs_modules[i].phys_start, initramfs_modules[i].phys_end);
+			return false;
+		}
+	}
+
+	initramfs_node_capacity = 0;
+	for (size_t i = 0; i < initramfs_module_count; i++) {
+		if (!initramfs_parse_module(&initramfs_modules[i]))
+			mprint("%s: truncated or corrupt archive\n", initramfs_modules[i].cmdline);
+	}
+
+	if (initramfs_node_capacity > 0) {
+		fatptr_t nodes = get_gpa_allocator().alloc(initramfs_node_capacity * sizeof(struct initramfs_node));
+		if (nodes.ptr == nullptr) {
+			mprint("failed to allocate %u nodes\n", (uint32_t)initramfs_node_capacity);
+			return false;
+		}
+
+		initramfs_nodes = nodes.ptr;
+		memset(initramfs_buckets, 0, sizeof(initramfs_buckets));
+		for (size_t i = 0; i < initramfs_module_count; i++)
+			initramfs_parse_module(&initramfs_modules[i]);
+	}
+
+	mprint("%u modules, %u files and directories\n", (uint32_t)initramfs_module_count, (uint32_t)initramfs_node_count);
+	initramfs_ready = true;
+	return true;
+}
+
+static const struct initramfs_node *initramfs_lookup(const char *path)
+{
+	size_t len = strlen(path);
+	path = initramfs_clean_name(path, &len);
+
+	for (uint32_t i = initramfs_buckets[initramfs_hash(path, len)]; i != 0; i = initramfs_nodes[i - 1].next) {
+		const struct initramfs_node *node = &initramfs_nodes[i - 1];
+		if (node->name_len == len && memcmp(node->name, path, len) == 0)
+			return node;
+	}
+
+	return nullptr;
+}
+
+const void *initramfs_find(const char *path, size_t *out_size)
+{
+	if (path == nullptr || !initramfs_ready)
+		return nullptr;
+
+	const struct initramfs_node *node = initramfs_lookup(path);
+	if (node == nullptr || node->is_dir)
+		return nullptr;
+
+	if (out_size)
+		*out_size = node->size;
+	return node->data;
+}
+
+// Never called, the VFS reads resident files without the page cache
+static bool initramfs_vfs_bmap(struct vnode *vnode, uint64_t offset, size_t len, uint64_t *out_lba, size_t *out_bytes)
+{
+	(void)vnode;
+	(void)offset;
+	(void)len;
+	(void)out_lba;
+	(void)out_bytes;
+	return false;
+}
+
+static void initramfs_vfs_release(struct vnode *vnode)
+{
+	(void)vnode;
+}
+
+static const struct vnode_ops initramfs_vnode_ops = {
+	.bmap = initramfs_vfs_bmap,
+	.release = initramfs_vfs_release,
+};
+
+static bool initramfs_vfs_mount(struct vfs_mount *mount)
+{
+	mount->fs_data = nullptr;
+	return initramfs_init();
+}
+
+static void initramfs_vfs_unmount(struct vfs_mount *mount)
+{
+	(void)mount;
+}
+
+static bool initramfs_vfs_lookup(struct vfs_mount *mount, const char *path, struct vnode *out)
+{
+	(void)mount;
+
+	size_t len = strlen(path);
+	initramfs_clean_name(path, &len);
+	out->ops = &initramfs_vnode_ops;
+	out->fs_data = nullptr;
+
+	// The root is not an archive member
+	if (len == 0) {
+		out->id = 0;
+		out->size = 0;
+		out->is_dir = true;
+		out->data = nullptr;
+		return true;
+	}
+
+	const struct initramfs_node *node = initramfs_lookup(path);
+	if (node == nullptr)
+		return false;
+
+	out->id = (uint64_t)(node - initramfs_nodes) + 1;
+	out->size = node->size;
+	out->is_dir = node->is_dir;
+	out->data = node->data;
+	return true;
+}
+
+const struct vfs_fs_type initramfs_vfs_type = {
+	.name = "initramfs",
+	.mount = initramfs_vfs_mount,
+	.unmount = initramfs_vfs_unmount,
+	.lookup = initramfs_vfs_lookup,
+};
@@ -12,10 +12,17 @@
 
 #include <kernel/interrupt.h>
 #include <kernel/storage.h>
+#include <kernel/bcache.h>
+#include <kernel/ext2.h>
 #include <kernel/fat16.h>
+#include <kernel/initramfs.h>
 #include <kernel/memblock.h>
+#include <kernel/pcache.h>
+#include <kernel/vfs.h>
 
 #include <string.h>
+#include "../arch/i386/ahci.h"
+#include "../arch/i386/ata_dma.h"
 #include "../arch/i386/ata_pio.h"
 #include "../arch/i386/control_register.h"
 #include "../arch/i386/cpuid.h"
@@ -26,6 +33,7 @@
 #include "../arch/i386/irq.h"
 #include "../arch/i386/smp.h"
 #include "../arch/i386/port.h"
+#include "../arch/i386/tsc.h"
 
 extern void idt_init(void);
 extern void init_kmalloc(void);
@@ -199,6 +207,1236 @@ void gpa_test(allocator_t gpa_alloc){
 	}
 }
 
+#define SLAB_BENCH_OBJ_SIZE 1536
+#define SLAB_BENCH_OBJS 128
+#define SLAB_BENCH_ROUNDS 1024
+
+// Read the first line of SLAB_BENCH_OBJS objects, without coloring every
+// slab repeats the same few page offsets and their lines fight over the
+// same cache sets. Returns the average cycles per read.
+static uint32_t slab_color_bench_run(unsigned int flags)
+{
+	slab_cache_t *cache = slab_create("color-bench", SLAB_BENCH_OBJ_SIZE, 0, flags, nullptr, nullptr);
+	if (cache == nullptr)
+		return 0;
+
+	fatptr_t objs[SLAB_BENCH_OBJS] = { 0 };
+	for (size_t i = 0; i < SLAB_BENCH_OBJS; i++) {
+		objs[i] = slab_alloc_obj(cache);
+		if (objs[i].ptr == nullptr) {
+			slab_destroy(cache);
+			return 0;
+		}
+	}
+
+	uint32_t sink = 0;
+	uint64_t start = rdtsc();
+	for (size_t round = 0; round < SLAB_BENCH_ROUNDS; round++)
+		for (size_t i = 0; i < SLAB_BENCH_OBJS; i++)
+			sink += *(volatile uint32_t *)objs[i].ptr;
+	uint64_t cycles = rdtsc() - start;
+	(void)sink;
+
+	for (size_t i = 0; i < SLAB_BENCH_OBJS; i++)
+		slab_free_obj(cache, objs[i]);
+	slab_destroy(cache);
+
+	return (uint32_t)(cycles / (SLAB_BENCH_ROUNDS * SLAB_BENCH_OBJS));
+}
+
+void slab_color_test()
+{
+	section_divisor("Testing slab coloring:\n");
+
+	if (!cpuid_get_feature_info().TSC) {
+		kprintf("No TSC, skipping\n");
+		return;
+	}
+
+	kprintf("uncolored: %u cycles per object\n", slab_color_bench_run(SLAB_NO_COLOR));
+	kprintf("colored:   %u cycles per object\n", slab_color_bench_run(0));
+}
+
+#define SLAB_FRAG_TEST_OBJS 64
+
+// Sizes just past a class boundary waste up to half of every object, the
+// report shows it while they are live and empty classes once they are freed
+void slab_frag_test()
+{
+	section_divisor("Testing slab size class fragmentation:\n");
+
+	static const size_t sizes[] = { 17, 97, 193, 257, 1025 };
+	allocator_t slab_alloc = get_slab_allocator();
+	fatptr_t objs[sizeof(sizes) / sizeof(sizes[0])][SLAB_FRAG_TEST_OBJS] = { 0 };
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+		for (size_t i = 0; i < SLAB_FRAG_TEST_OBJS; i++)
+			objs[s][i] = slab_alloc.alloc(sizes[s]);
+
+	kprintf("while allocated:\n");
+	slab_report_fragmentation();
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+		for (size_t i = 0; i < SLAB_FRAG_TEST_OBJS; i++)
+			slab_alloc.free(objs[s][i]);
+
+	kprintf("after freeing:\n");
+	slab_report_fragmentation();
+}
+
+// The PIT is left at its power on rate, about 18.2065 Hz
+#define PIT_DEFAULT_MILLIHZ 18206u
+
+// KiB/s for bytes moved in ticks PIT ticks
+static uint32_t bench_kib_per_s(uint64_t bytes, size_t ticks)
+{
+	if (ticks == 0)
+		ticks = 1;
+
+	return (uint32_t)(bytes * PIT_DEFAULT_MILLIHZ / ((uint64_t)ticks * 1024 * 1000));
+}
+
+// One line per pass, the outcome, the commands the device saw and the rate
+static void bench_report(const char *label, const struct storage_device *device, size_t bytes, size_t ticks, bool ok)
+{
+	struct storage_stats stats;
+	storage_get_stats(device, &stats);
+	kprintf("%s %s, %u commands, %u KiB/s\n", label, ok ? "ok" : "failed", stats.commands, bench_kib_per_s(bytes, ticks));
+}
+
+#define BENCH_BACKEND(backend) (1u << (backend))
+#define BENCH_ANY_BACKEND (~0u)
+#define BENCH_NEEDS_TSC 0x1u
+#define BENCH_NEEDS_IRQ 0x2u // the PIT tick or completion interrupts
+
+// Common setup of the raw device benches: the first device with a backend
+// in backends, the CPU support they time with and a buffer_bytes buffer.
+// Prints why and returns false when the bench has to be skipped, the
+// buffer goes back with bench_end().
+static bool bench_begin(const char *what, uint32_t backends, uint32_t needs, size_t buffer_bytes, struct storage_device *dev, fatptr_t *buffer)
+{
+	bool found = false;
+	for (size_t i = 0; i < storage_device_count() && !found; i++)
+		found = storage_get_device(i, dev) && (backends & BENCH_BACKEND(dev->backend));
+	if (!found) {
+		kprintf("No %s device, skipping\n", what);
+		return false;
+	}
+	if ((needs & BENCH_NEEDS_TSC) && !cpuid_get_feature_info().TSC) {
+		kprintf("No TSC, skipping\n");
+		return false;
+	}
+	if ((needs & BENCH_NEEDS_IRQ) && !irq_enabled()) {
+		kprintf("Needs interrupts enabled, skipping\n");
+		return false;
+	}
+
+	*buffer = get_gpa_allocator().alloc(buffer_bytes);
+	if (buffer->ptr == nullptr) {
+		kprintf("Failed to allocate the read buffer\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void bench_end(fatptr_t buffer)
+{
+	get_gpa_allocator().free(buffer);
+}
+
+#define STORAGE_BENCH_BYTES MIBI(1)
+#define STORAGE_BENCH_ROUNDS 16
+
+// Read STORAGE_BENCH_ROUNDS consecutive MiB, returns the average cycles per MiB
+static uint32_t storage_read_bench_run(const struct storage_device *dev, void *buffer)
+{
+	const uint16_t sectors = STORAGE_BENCH_BYTES / 512;
+
+	uint64_t start = rdtsc();
+	for (uint32_t round = 0; round < STORAGE_BENCH_ROUNDS; round++) {
+		if (!storage_read_device(dev, round * sectors, sectors, buffer))
+			return 0;
+	}
+
+	return (uint32_t)((rdtsc() - start) / STORAGE_BENCH_ROUNDS);
+}
+
+void storage_read_bench()
+{
+	section_divisor("Benchmarking sequential storage reads:\n");
+
+	struct storage_device dev = { 0 };
+	fatptr_t buffer;
+	if (!bench_begin("storage", BENCH_ANY_BACKEND, BENCH_NEEDS_TSC, STORAGE_BENCH_BYTES, &dev, &buffer))
+		return;
+
+	if (dev.backend == STORAGE_BACKEND_AHCI) {
+		ahci_zero_copy = false;
+		kprintf("bounce:    %u cycles per MiB\n", storage_read_bench_run(&dev, buffer.ptr));
+		ahci_zero_copy = true;
+	}
+	kprintf("zero copy: %u cycles per MiB\n", storage_read_bench_run(&dev, buffer.ptr));
+
+	bench_end(buffer);
+}
+
+#define AHCI_QD_BENCH_IOS 1024
+#define AHCI_QD_BENCH_SECTORS 8		 // 4 KiB reads
+#define AHCI_QD_BENCH_SPAN_SECTORS 131072 // stay inside the first 64 MiB
+
+// Random 4 KiB reads keeping qd requests in flight, returns the average cycles per read
+static uint32_t ahci_qd_bench_run(uint8_t port, uint8_t qd, uint8_t *buffers)
+{
+	struct ahci_request reqs[AHCI_CMD_SLOT_COUNT] = { 0 };
+	uint32_t seed = 0x2545F491u;
+	size_t submitted = 0;
+	size_t completed = 0;
+	bool failed = false;
+
+	uint64_t start = rdtsc();
+	while (completed < AHCI_QD_BENCH_IOS) {
+		for (uint8_t i = 0; i < qd; i++) {
+			struct ahci_request *req = &reqs[i];
+			if (req->buffer != nullptr) {
+				if (!req->done)
+					continue;
+				// Keep going so no request is left in flight on our stack
+				failed |= !req->ok;
+				completed++;
+				req->buffer = nullptr;
+			}
+
+			if (submitted == AHCI_QD_BENCH_IOS)
+				continue;
+
+			seed = seed * 1664525u + 1013904223u;
+			*req = (struct ahci_request){
+				.lba = (seed >> 8) % (AHCI_QD_BENCH_SPAN_SECTORS / AHCI_QD_BENCH_SECTORS) * AHCI_QD_BENCH_SECTORS,
+				.sector_count = AHCI_QD_BENCH_SECTORS,
+				.buffer = buffers + (size_t)i * AHCI_QD_BENCH_SECTORS * 512,
+			};
+			if (!ahci_submit(port, req)) {
+				req->buffer = nullptr;
+				continue;
+			}
+			submitted++;
+		}
+		ahci_poll(port);
+	}
+
+	uint64_t cycles = rdtsc() - start;
+	return failed ? 0 : (uint32_t)(cycles / AHCI_QD_BENCH_IOS);
+}
+
+void ahci_qd_bench()
+{
+	section_divisor("Benchmarking AHCI queue depth:\n");
+
+	struct storage_device dev = { 0 };
+	fatptr_t buffers;
+	if (!bench_begin("AHCI", BENCH_BACKEND(STORAGE_BACKEND_AHCI), BENCH_NEEDS_TSC, AHCI_CMD_SLOT_COUNT * AHCI_QD_BENCH_SECTORS * 512, &dev, &buffers))
+		return;
+
+	const uint8_t max_qd = ahci_queue_depth(dev.ahci_port);
+	for (uint8_t qd = 1; qd <= max_qd; qd *= 2)
+		kprintf("QD%u: %u cycles per read\n", qd, ahci_qd_bench_run(dev.ahci_port, qd, buffers.ptr));
+
+	bench_end(buffers);
+}
+
+#define AHCI_SUBMIT_BENCH_IOS 1024
+
+// Time ahci_submit alone, one 4 KiB read at a time, reports the average
+// and the best case in cycles
+static void ahci_submit_bench_run(uint8_t port, void *buffer, uint32_t *avg, uint32_t *best)
+{
+	uint64_t total = 0;
+	uint64_t min = UINT64_MAX;
+
+	for (uint32_t i = 0; i < AHCI_SUBMIT_BENCH_IOS; i++) {
+		struct ahci_request req = {
+			.lba = (uint64_t)i * AHCI_QD_BENCH_SECTORS,
+			.sector_count = AHCI_QD_BENCH_SECTORS,
+			.buffer = buffer,
+		};
+
+		uint64_t start = rdtsc();
+		bool ok = ahci_submit(port, &req);
+		uint64_t cycles = rdtsc() - start;
+		if (!ok || !ahci_wait(port, &req)) {
+			*avg = *best = 0;
+			return;
+		}
+
+		total += cycles;
+		if (cycles < min)
+			min = cycles;
+	}
+
+	*avg = (uint32_t)(total / AHCI_SUBMIT_BENCH_IOS);
+	*best = (uint32_t)min;
+}
+
+void ahci_submit_bench()
+{
+	section_divisor("Benchmarking AHCI command submission:\n");
+
+	struct storage_device dev = { 0 };
+	fatptr_t buffer;
+	if (!bench_begin("AHCI", BENCH_BACKEND(STORAGE_BACKEND_AHCI), BENCH_NEEDS_TSC, AHCI_QD_BENCH_SECTORS * 512, &dev, &buffer))
+		return;
+
+	uint32_t avg = 0, best = 0;
+	ahci_submit_bench_run(dev.ahci_port, buffer.ptr, &avg, &best);
+	kprintf("zero copy: %u cycles per submission (best %u)\n", avg, best);
+
+	ahci_zero_copy = false;
+	ahci_submit_bench_run(dev.ahci_port, buffer.ptr, &avg, &best);
+	ahci_zero_copy = true;
+	kprintf("bounce:    %u cycles per submission (best %u)\n", avg, best);
+
+	bench_end(buffer);
+}
+
+#define AHCI_CPU_BENCH_MIBS 16
+
+static void ahci_cpu_bench_done(struct ahci_request *req, void *ctx)
+{
+	*(size_t *)ctx += (size_t)req->sector_count * 512;
+}
+
+// Read AHCI_CPU_BENCH_MIBS MiB one request at a time, either polling the
+// port or halting until the completion interrupt. Returns the cycles per
+// MiB the CPU spent awake.
+static uint32_t ahci_cpu_bench_run(uint8_t port, void *buffer, bool use_irq)
+{
+	size_t bytes_done = 0;
+	uint64_t idle = 0;
+
+	uint64_t start = rdtsc();
+	for (uint32_t mib = 0; mib < AHCI_CPU_BENCH_MIBS; mib++) {
+		struct ahci_request req = {
+			.lba = mib * (MIBI(1) / 512),
+			.sector_count = MIBI(1) / 512,
+			.buffer = buffer,
+			.done_cb = ahci_cpu_bench_done,
+			.ctx = &bytes_done,
+		};
+		if (!ahci_submit(port, &req))
+			return 0;
+
+		while (!req.done) {
+			if (!use_irq) {
+				ahci_poll(port);
+				continue;
+			}
+
+			uint64_t halt_start = rdtsc();
+			irq_halt_unless(&req.done);
+			idle += rdtsc() - halt_start;
+		}
+		ahci_poll(port);
+
+		if (!req.ok)
+			return 0;
+	}
+	uint64_t busy = rdtsc() - start - idle;
+
+	if (bytes_done != (size_t)AHCI_CPU_BENCH_MIBS * MIBI(1))
+		return 0;
+
+	return (uint32_t)(busy / AHCI_CPU_BENCH_MIBS);
+}
+
+void ahci_cpu_bench()
+{
+	section_divisor("Benchmarking AHCI CPU cost:\n");
+
+	struct storage_device dev = { 0 };
+	fatptr_t buffer;
+	if (!bench_begin("AHCI", BENCH_BACKEND(STORAGE_BACKEND_AHCI), BENCH_NEEDS_TSC | BENCH_NEEDS_IRQ, MIBI(1), &dev, &buffer))
+		return;
+
+	kprintf("polling:   %u busy cycles per MiB\n", ahci_cpu_bench_run(dev.ahci_port, buffer.ptr, false));
+	kprintf("interrupt: %u busy cycles per MiB\n", ahci_cpu_bench_run(dev.ahci_port, buffer.ptr, true));
+
+	bench_end(buffer);
+}
+
+#define ATA_DMA_BENCH_MIBS 16
+
+// Read ATA_DMA_BENCH_MIBS MiB through the DMA engine one command at a
+// time, halting until each completion interrupt. Returns the cycles per
+// MiB the CPU spent awake.
+static uint32_t ata_dma_cpu_bench_run(const struct storage_device *dev, uint8_t *buffer)
+{
+	const uint16_t sectors = ATA_DMA_MAX_SECTORS;
+	const uint32_t commands = ATA_DMA_BENCH_MIBS * (MIBI(1) / 512 / ATA_DMA_MAX_SECTORS);
+	uint64_t idle = 0;
+
+	uint64_t start = rdtsc();
+	for (uint32_t i = 0; i < commands; i++) {
+		if (!ata_dma_submit(dev->channel, dev->drive, (uint64_t)i * sectors, sectors, buffer, false))
+			return 0;
+
+		// Bounded, ata_dma_complete() fails a command that never finishes
+		for (uint32_t spin = 0; spin < 1000000u && !ata_dma_poll(dev->channel); spin++) {
+			uint64_t halt_start = rdtsc();
+			ata_dma_halt(dev->channel);
+			idle += rdtsc() - halt_start;
+		}
+
+		if (!ata_dma_complete(dev->channel))
+			return 0;
+	}
+
+	return (uint32_t)((rdtsc() - start - idle) / ATA_DMA_BENCH_MIBS);
+}
+
+// One storage_read_bench_run() pass, cycles from the TSC and KiB/s from the PIT
+static void ata_dma_bench_pass(const char *label, const struct storage_device *dev, void *buffer)
+{
+	size_t start = GLOBAL_TICK;
+	uint32_t cycles = storage_read_bench_run(dev, buffer);
+	size_t ticks = GLOBAL_TICK - start;
+	if (cycles == 0) {
+		kprintf("%s failed\n", label);
+		return;
+	}
+
+	kprintf("%s %u cycles per MiB, %u KiB/s\n", label, cycles,
+		bench_kib_per_s((uint64_t)STORAGE_BENCH_BYTES * STORAGE_BENCH_ROUNDS, ticks));
+}
+
+void ata_dma_bench()
+{
+	section_divisor("Benchmarking IDE bus master DMA against PIO:\n");
+
+	struct storage_device dev = { 0 };
+	fatptr_t buffer;
+	if (!bench_begin("IDE DMA", BENCH_BACKEND(STORAGE_BACKEND_ATA_DMA), BENCH_NEEDS_TSC | BENCH_NEEDS_IRQ, STORAGE_BENCH_BYTES, &dev, &buffer))
+		return;
+
+	// Same drive without a queue, dispatched straight to the PIO loops
+	struct storage_device pio = { .backend = STORAGE_BACKEND_ATA_PIO, .channel = dev.channel, .drive = dev.drive };
+	struct storage_device dma = { .backend = STORAGE_BACKEND_ATA_DMA, .channel = dev.channel, .drive = dev.drive };
+
+	// PIO never sleeps, every cycle it takes is busy
+	ata_dma_bench_pass("pio:", &pio, buffer.ptr);
+	ata_dma_bench_pass("dma:", &dma, buffer.ptr);
+	kprintf("dma: %u busy cycles per MiB\n", ata_dma_cpu_bench_run(&dev, buffer.ptr));
+
+	bench_end(buffer);
+}
+
+#define ATA_PIO_BENCH_MIBS 16
+
+// Read ATA_PIO_BENCH_MIBS MiB sequentially, returns KiB/s measured with the PIT
+static uint32_t ata_pio_bench_run(const struct storage_device *dev, void *buffer)
+{
+	const uint32_t sectors = MIBI(1) / 512;
+
+	size_t start = GLOBAL_TICK;
+	for (uint32_t mib = 0; mib < ATA_PIO_BENCH_MIBS; mib++) {
+		if (!storage_read_device(dev, (uint64_t)mib * sectors, sectors, buffer))
+			return 0;
+	}
+	return bench_kib_per_s((uint64_t)MIBI(ATA_PIO_BENCH_MIBS), GLOBAL_TICK - start);
+}
+
+void ata_pio_bench()
+{
+	section_divisor("Benchmarking ATA PIO reads:\n");
+
+	const uint32_t ide = BENCH_BACKEND(STORAGE_BACKEND_ATA_PIO) | BENCH_BACKEND(STORAGE_BACKEND_ATA_DMA);
+	struct storage_device dev = { 0 };
+	fatptr_t buffer;
+	if (!bench_begin("IDE", ide, BENCH_NEEDS_IRQ, MIBI(1), &dev, &buffer))
+		return;
+
+	// Without a queue so the bench sees the driver alone
+	struct storage_device pio = { .backend = STORAGE_BACKEND_ATA_PIO, .channel = dev.channel, .drive = dev.drive };
+
+	ata_pio_multiple_enabled = false;
+	uint32_t single = ata_pio_bench_run(&pio, buffer.ptr);
+	ata_pio_multiple_enabled = true;
+	uint32_t multiple = ata_pio_bench_run(&pio, buffer.ptr);
+
+	kprintf("READ SECTORS:  %u KiB/s (%u MiB/s)\n", single, single / 1024);
+	kprintf("READ MULTIPLE: %u KiB/s (%u MiB/s)\n", multiple, multiple / 1024);
+
+	bench_end(buffer);
+}
+
+#define STORAGE_TRACE_MAX 64
+#define STORAGE_TRACE_MAX_SECTORS 4096
+
+struct storage_trace {
+	struct storage_request reqs[STORAGE_TRACE_MAX];
+	size_t count;
+	size_t sectors;
+};
+
+static void storage_trace_add(struct storage_trace *trace, uint64_t lba, size_t sector_count)
+{
+	if (trace->count >= STORAGE_TRACE_MAX || trace->sectors + sector_count > STORAGE_TRACE_MAX_SECTORS)
+		return;
+
+	trace->reqs[trace->count++] = (struct storage_request){ .lba = lba, .sector_count = sector_count };
+	trace->sectors += sector_count;
+}
+
+// The reads a cold mount and a lookup and read of name issue, in order
+static bool storage_trace_fat16(const struct storage_device *dev, const char *name, struct storage_trace *trace)
+{
+	fat16_volume_t *volume = fat16_mount(dev);
+	fat_dir_entry_t entry;
+	// A FAT32 mount reads no FAT, the trace below is the FAT16 one
+	if (volume == nullptr || volume->type != FAT_TYPE_16 || !fat16_volume_find_entry(volume, name, &entry)) {
+		fat16_unmount(volume);
+		return false;
+	}
+
+	const fat16_layout_t *layout = &volume->layout;
+	storage_trace_add(trace, 0, 1);
+	storage_trace_add(trace, layout->fat_start_lba, layout->sectors_per_fat);
+	storage_trace_add(trace, layout->root_dir_lba, layout->root_dir_sectors);
+
+	uint32_t cluster = fat16_entry_cluster(volume, &entry);
+	size_t remaining = entry.file_size;
+	while (cluster >= 2 && cluster != FAT_CHAIN_END && remaining > 0 && trace->count < STORAGE_TRACE_MAX) {
+		storage_trace_add(trace, layout->data_start_lba + (uint32_t)(cluster - 2) * layout->sectors_per_cluster,
+				  layout->sectors_per_cluster);
+
+		size_t cluster_bytes = (size_t)layout->sector_size * layout->sectors_per_cluster;
+		remaining -= remaining < cluster_bytes ? remaining : cluster_bytes;
+		cluster = fat16_next_cluster(volume, cluster);
+	}
+
+	fat16_unmount(volume);
+	return true;
+}
+
+// Replays the trace, returns the number of commands the backend saw
+static size_t storage_trace_replay(const struct storage_device *dev, struct storage_trace *trace, uint8_t *buffer, bool plugged)
+{
+	storage_reset_stats(dev);
+
+	size_t offset = 0;
+	for (size_t i = 0; i < trace->count; i++) {
+		trace->reqs[i].buffer = buffer + offset;
+		offset += trace->reqs[i].sector_count * 512;
+	}
+
+	if (plugged)
+		storage_plug(dev);
+	for (size_t i = 0; i < trace->count; i++) {
+		storage_submit(dev, &trace->reqs[i]);
+		if (!plugged && !storage_wait(dev, &trace->reqs[i]))
+			return 0;
+	}
+	if (plugged)
+		storage_unplug(dev);
+
+	for (size_t i = 0; i < trace->count; i++) {
+		if (!trace->reqs[i].ok)
+			return 0;
+	}
+
+	struct storage_stats stats;
+	storage_get_stats(dev, &stats);
+	return stats.commands;
+}
+
+void storage_queue_bench()
+{
+	section_divisor("Benchmarking block queue merging on a FAT16 trace:\n");
+
+	struct storage_trace trace = { 0 };
+	struct storage_device dev = { 0 };
+	bool found = false;
+	for (size_t i = 0; i < storage_device_count() && !found; i++)
+		found = storage_get_device(i, &dev) && storage_trace_fat16(&dev, "hp1.txt", &trace);
+	if (!found) {
+		kprintf("No FAT16 device with hp1.txt, skipping\n");
+		return;
+	}
+
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t buffer = gpa_alloc.alloc(trace.sectors * 512);
+	if (buffer.ptr == nullptr) {
+		kprintf("Failed to allocate the read buffer\n");
+		return;
+	}
+
+	kprintf("trace:    %u requests, %u sectors\n", trace.count, trace.sectors);
+	kprintf("direct:   %u commands\n", storage_trace_replay(&dev, &trace, buffer.ptr, false));
+	kprintf("plugged:  %u commands\n", storage_trace_replay(&dev, &trace, buffer.ptr, true));
+
+	gpa_alloc.free(buffer);
+}
+
+// Reads name through FAT16 and prints what the device and the buffer cache saw
+static void bcache_bench_pass(const char *label, const struct storage_device *dev, const fat_dir_entry_t *entry, void *buffer)
+{
+	storage_reset_stats(dev);
+	bcache_reset_stats();
+
+	size_t read = 0;
+	fat_dir_entry_t lookup;
+	bool ok = fat16_find_entry_by_name(dev, "hp1.txt", &lookup) && fat16_read_file(dev, entry, buffer, entry->file_size, &read);
+
+	struct storage_stats dev_stats;
+	struct bcache_stats cache_stats;
+	storage_get_stats(dev, &dev_stats);
+	bcache_get_stats(&cache_stats);
+	kprintf("%s %s, %u commands, %u hits, %u misses\n", label, ok ? "ok" : "failed", dev_stats.commands, cache_stats.hits,
+		cache_stats.misses);
+}
+
+void bcache_bench()
+{
+	section_divisor("Benchmarking the buffer cache on FAT16 reads:\n");
+
+	struct storage_device dev = { 0 };
+	fat_dir_entry_t entry;
+	bool found = false;
+	for (size_t i = 0; i < storage_device_count() && !found; i++)
+		found = storage_get_device(i, &dev) && fat16_find_entry_by_name(&dev, "hp1.txt", &entry);
+	if (!found) {
+		kprintf("No FAT16 device with hp1.txt, skipping\n");
+		return;
+	}
+
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t buffer = gpa_alloc.alloc(entry.file_size + 1);
+	if (buffer.ptr == nullptr) {
+		kprintf("Failed to allocate the read buffer\n");
+		return;
+	}
+
+	// The lookup above already warmed the boot sector and the root directory
+	bcache_bench_pass("first: ", &dev, &entry, buffer.ptr);
+	bcache_bench_pass("second:", &dev, &entry, buffer.ptr);
+
+	gpa_alloc.free(buffer);
+}
+
+// Reads entry the way fat16_read_file did before volumes were mounted:
+// every cluster hop reads its FAT sector into a fresh buffer
+static bool fat16_chain_bench_uncached(const fat16_volume_t *volume, const fat_dir_entry_t *entry, uint8_t *buffer)
+{
+	const fat16_layout_t *layout = &volume->layout;
+	const size_t cluster_bytes = (size_t)layout->sector_size * layout->sectors_per_cluster;
+	allocator_t gpa_alloc = get_gpa_allocator();
+
+	uint16_t cluster = entry->first_cluster_low;
+	size_t done = 0;
+	while (cluster >= 2 && done < entry->file_size) {
+		uint32_t lba = layout->data_start_lba + (uint32_t)(cluster - 2) * layout->sectors_per_cluster;
+		if (!storage_read_device(&volume->device, lba, layout->sectors_per_cluster, buffer + done))
+			return false;
+		done += cluster_bytes;
+
+		fatptr_t sector = gpa_alloc.alloc(512);
+		if (sector.ptr == nullptr)
+			return false;
+		bool ok = storage_read_device(&volume->device, layout->fat_start_lba + cluster * 2u / 512u, 1, sector.ptr);
+		uint16_t next = ((uint16_t *)sector.ptr)[cluster % 256u];
+		gpa_alloc.free(sector);
+		if (!ok || fat16_is_end_of_chain(next))
+			break;
+		cluster = next;
+	}
+
+	return done >= entry->file_size;
+}
+
+void fat16_chain_bench()
+{
+	section_divisor("Benchmarking FAT16 chain walks on a fragmented file:\n");
+
+	fat16_volume_t *volume = nullptr;
+	fat_dir_entry_t entry;
+	for (size_t i = 0; i < storage_device_count() && volume == nullptr; i++) {
+		struct storage_device dev;
+		if (!storage_get_device(i, &dev))
+			continue;
+
+		volume = fat16_mount(&dev);
+		// The per hop pass reads 16 bit FAT entries
+		if (volume != nullptr && (volume->type != FAT_TYPE_16 || !fat16_volume_find_entry(volume, "frag.bin", &entry))) {
+			fat16_unmount(volume);
+			volume = nullptr;
+		}
+	}
+	if (volume == nullptr) {
+		kprintf("No FAT16 device with frag.bin, skipping\n");
+		return;
+	}
+	if (!irq_enabled()) {
+		kprintf("Needs the PIT tick, skipping\n");
+		fat16_unmount(volume);
+		return;
+	}
+
+	// Room for the uncached pass to read whole clusters past the file end
+	const size_t cluster_bytes = (size_t)volume->layout.sector_size * volume->layout.sectors_per_cluster;
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t buffer = gpa_alloc.alloc(entry.file_size + cluster_bytes);
+	if (buffer.ptr == nullptr) {
+		kprintf("Failed to allocate the read buffer\n");
+		fat16_unmount(volume);
+		return;
+	}
+
+	struct storage_stats stats;
+	storage_reset_stats(&volume->device);
+	size_t start = GLOBAL_TICK;
+	bool ok = fat16_chain_bench_uncached(volume, &entry, buffer.ptr);
+	size_t ticks = GLOBAL_TICK - start;
+	storage_get_stats(&volume->device, &stats);
+	kprintf("per hop FAT reads: %s, %u ticks, %u commands\n", ok ? "ok" : "failed", ticks, stats.commands);
+
+	size_t read = 0;
+	storage_reset_stats(&volume->device);
+	start = GLOBAL_TICK;
+	ok = fat16_volume_read_file(volume, &entry, buffer.ptr, entry.file_size, &read);
+	ticks = GLOBAL_TICK - start;
+	storage_get_stats(&volume->device, &stats);
+	kprintf("resident FAT:      %s, %u ticks, %u commands\n", ok ? "ok" : "failed", ticks, stats.commands);
+
+	gpa_alloc.free(buffer);
+	fat16_unmount(volume);
+}
+
+// One storage_read_device per cluster, the way fat16_read_file read before runs were coalesced
+static bool fat16_run_bench_per_cluster(const fat16_volume_t *volume, const fat_dir_entry_t *entry, uint8_t *buffer)
+{
+	const fat16_layout_t *layout = &volume->layout;
+	const size_t cluster_bytes = (size_t)layout->sector_size * layout->sectors_per_cluster;
+
+	uint32_t cluster = fat16_entry_cluster(volume, entry);
+	for (size_t done = 0; done < entry->file_size; done += cluster_bytes) {
+		if (cluster < 2 || cluster == FAT_CHAIN_END)
+			return false;
+
+		uint32_t lba = layout->data_start_lba + (uint32_t)(cluster - 2) * layout->sectors_per_cluster;
+		if (!storage_read_device(&volume->device, lba, layout->sectors_per_cluster, buffer + done))
+			return false;
+		cluster = fat16_next_cluster(volume, cluster);
+	}
+
+	return true;
+}
+
+void fat16_run_bench()
+{
+	section_divisor("Benchmarking coalesced FAT16 cluster runs:\n");
+
+	fat16_volume_t *volume = nullptr;
+	fat_dir_entry_t entry;
+	for (size_t i = 0; i < storage_device_count() && volume == nullptr; i++) {
+		struct storage_device dev;
+		if (!storage_get_device(i, &dev))
+			continue;
+
+		volume = fat16_mount(&dev);
+		if (volume != nullptr && !fat16_volume_find_entry(volume, "hp1.txt", &entry)) {
+			fat16_unmount(volume);
+			volume = nullptr;
+		}
+	}
+	if (volume == nullptr) {
+		kprintf("No FAT16 device with hp1.txt, skipping\n");
+		return;
+	}
+	if (!irq_enabled()) {
+		kprintf("Needs the PIT tick, skipping\n");
+		fat16_unmount(volume);
+		return;
+	}
+
+	const size_t cluster_bytes = (size_t)volume->layout.sector_size * volume->layout.sectors_per_cluster;
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t buffer = gpa_alloc.alloc(entry.file_size + cluster_bytes);
+	if (buffer.ptr == nullptr) {
+		kprintf("Failed to allocate the read buffer\n");
+		fat16_unmount(volume);
+		return;
+	}
+
+	storage_reset_stats(&volume->device);
+	size_t start = GLOBAL_TICK;
+	bool ok = fat16_run_bench_per_cluster(volume, &entry, buffer.ptr);
+	bench_report("per cluster:", &volume->device, entry.file_size, GLOBAL_TICK - start, ok);
+
+	size_t read = 0;
+	storage_reset_stats(&volume->device);
+	start = GLOBAL_TICK;
+	ok = fat16_volume_read_file(volume, &entry, buffer.ptr, entry.file_size, &read);
+	bench_report("coalesced:  ", &volume->device, read, GLOBAL_TICK - start, ok);
+
+	gpa_alloc.free(buffer);
+	fat16_unmount(volume);
+}
+
+#define FAT16_DIR_BENCH_ENTRIES 512
+
+// The lookup fat16_find_entry_by_name did before the buffer cache and the
+// index: read the root directory sectors from the device and compare the
+// decoded names one by one
+static bool fat16_dir_bench_linear(fat16_volume_t *volume, fat_dir_entry_t *scratch, const char *name)
+{
+	size_t sectors = volume->layout.root_dir_sectors;
+	if (sectors > FAT16_DIR_BENCH_ENTRIES * sizeof(fat_dir_entry_t) / 512)
+		sectors = FAT16_DIR_BENCH_ENTRIES * sizeof(fat_dir_entry_t) / 512;
+	if (!storage_read_device(&volume->device, volume->layout.root_dir_lba, sectors, scratch))
+		return false;
+
+	const size_t entries = sectors * 512 / sizeof(fat_dir_entry_t);
+	for (size_t i = 0; i < entries && !fat16_dir_entry_is_unused(&scratch[i]); i++) {
+		char decoded[13];
+		if (fat16_decode_83_name(&scratch[i], decoded, sizeof(decoded)) && memcmp(decoded, name, strlen(name) + 1) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static void fat16_dir_bench_pass(const char *label, fat16_volume_t *volume, char (*names)[13], size_t count, fat_dir_entry_t *scratch)
+{
+	storage_reset_stats(&volume->device);
+	bcache_reset_stats();
+
+	size_t found = 0;
+	size_t start = GLOBAL_TICK;
+	for (size_t i = 0; i < count; i++) {
+		fat_dir_entry_t entry;
+		bool ok = scratch != nullptr ? fat16_dir_bench_linear(volume, scratch, names[i]) : fat16_volume_find_entry(volume, names[i], &entry);
+		found += ok ? 1 : 0;
+	}
+	size_t ticks = GLOBAL_TICK - start;
+
+	struct storage_stats dev_stats;
+	struct bcache_stats cache_stats;
+	storage_get_stats(&volume->device, &dev_stats);
+	bcache_get_stats(&cache_stats);
+	kprintf("%s %u/%u found, %u ticks, %u commands, %u cached blocks read\n", label, found, count, ticks, dev_stats.commands,
+		cache_stats.hits + cache_stats.misses);
+}
+
+void fat16_dir_bench()
+{
+	section_divisor("Benchmarking FAT16 root directory lookups:\n");
+
+	fat16_volume_t *volume = nullptr;
+	for (size_t i = 0; i < storage_device_count() && volume == nullptr; i++) {
+		struct storage_device dev;
+		if (storage_get_device(i, &dev))
+			volume = fat16_mount(&dev);
+		// The linear pass reads the fixed FAT16 root region
+		if (volume != nullptr && volume->type != FAT_TYPE_16) {
+			fat16_unmount(volume);
+			volume = nullptr;
+		}
+	}
+	if (volume == nullptr) {
+		kprintf("No FAT16 device, skipping\n");
+		return;
+	}
+
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t entries = gpa_alloc.alloc(FAT16_DIR_BENCH_ENTRIES * sizeof(fat_dir_entry_t));
+	fatptr_t names = gpa_alloc.alloc(FAT16_DIR_BENCH_ENTRIES * 13);
+	if (entries.ptr == nullptr || names.ptr == nullptr) {
+		kprintf("Failed to allocate the bench buffers\n");
+		goto out;
+	}
+
+	memset(entries.ptr, 0, entries.len);
+	if (!fat16_read_root_dir(&volume->device, &volume->layout, entries.ptr, FAT16_DIR_BENCH_ENTRIES)) {
+		kprintf("Failed to read the root directory\n");
+		goto out;
+	}
+
+	fat_dir_entry_t *entry = entries.ptr;
+	char (*name)[13] = names.ptr;
+	size_t count = 0;
+	for (size_t i = 0; i < FAT16_DIR_BENCH_ENTRIES && !fat16_dir_entry_is_unused(&entry[i]); i++) {
+		if (entry[i].attributes != FAT_ATTR_LFN && fat16_decode_83_name(&entry[i], name[count], 13))
+			count++;
+	}
+	kprintf("%u entries in the root directory\n", count);
+
+	fat16_dir_bench_pass("linear: ", volume, name, count, entry);
+	fat16_volume_invalidate_dir(volume);
+	fat16_dir_bench_pass("cold:   ", volume, name, count, nullptr);
+	fat16_dir_bench_pass("warm:   ", volume, name, count, nullptr);
+
+out:
+	if (entries.ptr != nullptr)
+		gpa_alloc.free(entries);
+	if (names.ptr != nullptr)
+		gpa_alloc.free(names);
+	fat16_unmount(volume);
+}
+
+#define FAT16_WRITE_BENCH_FILES 8
+#define FAT16_WRITE_BENCH_KIBS 512
+#define FAT16_WRITE_BENCH_CHUNK KIBI(64)
+
+// Creates FAT16_WRITE_BENCH_FILES files one after the other, appending a chunk at a time
+void fat16_write_bench()
+{
+	section_divisor("Benchmarking sequential FAT16 file creation:\n");
+
+	fat16_volume_t *volume = nullptr;
+	for (size_t i = 0; i < storage_device_count() && volume == nullptr; i++) {
+		struct storage_device dev;
+		if (storage_get_device(i, &dev))
+			volume = fat16_mount(&dev);
+	}
+	if (volume == nullptr) {
+		kprintf("No FAT16 device, skipping\n");
+		return;
+	}
+	if (!irq_enabled()) {
+		kprintf("Needs the PIT tick, skipping\n");
+		fat16_unmount(volume);
+		return;
+	}
+
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t chunk = gpa_alloc.alloc(FAT16_WRITE_BENCH_CHUNK);
+	if (chunk.ptr == nullptr) {
+		kprintf("Failed to allocate the write buffer\n");
+		fat16_unmount(volume);
+		return;
+	}
+	for (size_t i = 0; i < FAT16_WRITE_BENCH_CHUNK; i++)
+		((uint8_t *)chunk.ptr)[i] = (uint8_t)i;
+
+	char name[] = "WBENCH0.BIN";
+	bool ok = true;
+	storage_reset_stats(&volume->device);
+	size_t start = GLOBAL_TICK;
+	for (size_t file = 0; file < FAT16_WRITE_BENCH_FILES && ok; file++) {
+		name[6] = (char)('0' + file);
+		ok = fat16_volume_create(volume, name);
+		for (size_t offset = 0; ok && offset < KIBI(FAT16_WRITE_BENCH_KIBS); offset += FAT16_WRITE_BENCH_CHUNK)
+			ok = fat16_volume_write(volume, name, offset, chunk.ptr, FAT16_WRITE_BENCH_CHUNK);
+	}
+	size_t ticks = GLOBAL_TICK - start;
+
+	kprintf("%u x %u KiB:", FAT16_WRITE_BENCH_FILES, FAT16_WRITE_BENCH_KIBS);
+	bench_report("", &volume->device, (size_t)FAT16_WRITE_BENCH_FILES * KIBI(FAT16_WRITE_BENCH_KIBS), ticks, ok);
+
+	for (size_t file = 0; file < FAT16_WRITE_BENCH_FILES; file++) {
+		name[6] = (char)('0' + file);
+		fat16_volume_remove(volume, name);
+	}
+
+	gpa_alloc.free(chunk);
+	fat16_unmount(volume);
+}
+
+// Mounts every FAT device and prints what the mount cost. FAT16 reads its
+// whole FAT, FAT32 only the boot and FSInfo sectors whatever its size.
+void fat_mount_bench()
+{
+	section_divisor("Benchmarking FAT16 and FAT32 mounts:\n");
+
+	bool found = false;
+	for (size_t i = 0; i < storage_device_count(); i++) {
+		struct storage_device dev;
+		if (!storage_get_device(i, &dev))
+			continue;
+
+		struct storage_stats stats;
+		storage_reset_stats(&dev);
+		fat16_volume_t *volume = fat16_mount(&dev);
+		storage_get_stats(&dev, &stats);
+		if (volume == nullptr)
+			continue;
+
+		found = true;
+		kprintf("device %u: FAT%u, %u clusters, mounted with %u requests in %u commands, ", i, volume->type,
+			volume->max_cluster - 1, stats.requests, stats.commands);
+
+		uint32_t free = fat16_volume_free_count(volume);
+		if (free == FAT32_FSINFO_UNKNOWN)
+			kprintf("free count unknown\n");
+		else
+			kprintf("%u clusters free\n", free);
+		fat16_unmount(volume);
+	}
+	if (!found)
+		kprintf("No FAT device, skipping\n");
+}
+
+// One request per block, the way a block at a time ext2 read goes
+static bool ext2_read_bench_per_block(ext2_volume_t *volume, const ext2_inode_t *inode, uint8_t *buffer)
+{
+	const size_t size = ext2_inode_size(inode);
+	for (size_t done = 0; done < size; done += volume->block_size) {
+		uint32_t block = 0;
+		if (!ext2_volume_bmap(volume, inode, (uint32_t)(done / volume->block_size), &block))
+			return false;
+
+		size_t sectors = (size - done < volume->block_size ? size - done + 511 : volume->block_size) / 512;
+		if (block == 0)
+			memset(buffer + done, 0, sectors * 512);
+		else if (!storage_read_device(&volume->device, (uint64_t)block * volume->sectors_per_block, sectors, buffer + done))
+			return false;
+	}
+
+	return true;
+}
+
+// Reads /big.bin of the image the simple_ext2.raw rule builds
+void ext2_read_bench()
+{
+	section_divisor("Benchmarking ext2 reads of a large file:\n");
+
+	ext2_volume_t *volume = nullptr;
+	ext2_inode_t inode;
+	for (size_t i = 0; i < storage_device_count() && volume == nullptr; i++) {
+		struct storage_device dev;
+		if (!storage_get_device(i, &dev))
+			continue;
+
+		volume = ext2_mount(&dev);
+		uint32_t ino = 0;
+		if (volume != nullptr && (!ext2_volume_lookup(volume, "/big.bin", &ino) || !ext2_read_inode(volume, ino, &inode))) {
+			ext2_unmount(volume);
+			volume = nullptr;
+		}
+	}
+	if (volume == nullptr) {
+		kprintf("No ext2 device with /big.bin, skipping\n");
+		return;
+	}
+	if (!irq_enabled()) {
+		kprintf("Needs the PIT tick, skipping\n");
+		ext2_unmount(volume);
+		return;
+	}
+
+	const size_t size = ext2_inode_size(&inode);
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t buffer = gpa_alloc.alloc(size + volume->block_size);
+	if (buffer.ptr == nullptr) {
+		kprintf("Failed to allocate the read buffer\n");
+		ext2_unmount(volume);
+		return;
+	}
+	kprintf("%u KiB in %u byte blocks\n", size / 1024, volume->block_size);
+
+	storage_reset_stats(&volume->device);
+	size_t start = GLOBAL_TICK;
+	bool ok = ext2_read_bench_per_block(volume, &inode, buffer.ptr);
+	bench_report("per block:", &volume->device, size, GLOBAL_TICK - start, ok);
+
+	size_t read = 0;
+	storage_reset_stats(&volume->device);
+	start = GLOBAL_TICK;
+	ok = ext2_volume_read(volume, &inode, 0, buffer.ptr, size, &read);
+	bench_report("runs:     ", &volume->device, read, GLOBAL_TICK - start, ok);
+
+	gpa_alloc.free(buffer);
+	ext2_unmount(volume);
+}
+
+// Mounts the first device holding hp1.txt, or the /big.bin of the
+// simple_ext2.raw image, at /bench and opens the file
+static int vfs_bench_open(struct storage_device *out_dev)
+{
+	static const char *const names[] = { "/bench/hp1.txt", "/bench/big.bin" };
+	int fd = -1;
+	for (size_t i = 0; i < storage_device_count() && fd < 0; i++) {
+		if (!storage_get_device(i, out_dev) || !vfs_mount("/bench", out_dev))
+			continue;
+
+		for (size_t j = 0; j < sizeof(names) / sizeof(names[0]) && fd < 0; j++)
+			fd = vfs_open(names[j]);
+		if (fd < 0)
+			vfs_unmount("/bench");
+	}
+
+	return fd;
+}
+
+static bool vfs_read_bench_pass(int fd, uint8_t *chunk, size_t chunk_size, size_t *out_bytes)
+{
+	size_t total = 0;
+	size_t read = 0;
+	bool ok = vfs_seek(fd, 0, VFS_SEEK_SET, nullptr);
+	while (ok && (ok = vfs_read(fd, chunk, chunk_size, &read)) && read > 0)
+		total += read;
+
+	*out_bytes = total;
+	return ok;
+}
+
+static void vfs_read_bench_report(const char *label, const struct storage_device *device, size_t bytes, size_t ticks, bool ok)
+{
+	struct storage_stats stats;
+	struct pcache_stats cache;
+	storage_get_stats(device, &stats);
+	pcache_get_stats(&cache);
+	kprintf("%s %s, %u commands, %u hits, %u misses, %u/%u readahead pages used, %u KiB/s\n", label, ok ? "ok" : "failed",
+		stats.commands, cache.hits, cache.misses, cache.readahead_hits, cache.readahead_pages, bench_kib_per_s(bytes, ticks));
+}
+
+// Streams the bench file through the VFS in 4 KiB reads, cold and then
+// out of the page cache
+void vfs_read_bench()
+{
+	section_divisor("Benchmarking sequential VFS reads:\n");
+
+	struct storage_device dev;
+	int fd = vfs_bench_open(&dev);
+	if (fd < 0) {
+		kprintf("No device with hp1.txt or /big.bin, skipping\n");
+		return;
+	}
+	if (!irq_enabled()) {
+		kprintf("Needs the PIT tick, skipping\n");
+		vfs_close(fd);
+		vfs_unmount("/bench");
+		return;
+	}
+
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t chunk = gpa_alloc.alloc(PAGE_SIZE);
+	size_t size = 0;
+	vfs_file_size(fd, &size);
+	if (chunk.ptr == nullptr) {
+		kprintf("Failed to allocate the read buffer\n");
+		vfs_close(fd);
+		vfs_unmount("/bench");
+		return;
+	}
+	kprintf("%u KiB\n", size / 1024);
+
+	size_t read = 0;
+	storage_reset_stats(&dev);
+	pcache_reset_stats();
+	size_t start = GLOBAL_TICK;
+	bool ok = vfs_read_bench_pass(fd, chunk.ptr, PAGE_SIZE, &read);
+	vfs_read_bench_report("cold:", &dev, read, GLOBAL_TICK - start, ok && read == size);
+
+	storage_reset_stats(&dev);
+	pcache_reset_stats();
+	start = GLOBAL_TICK;
+	ok = vfs_read_bench_pass(fd, chunk.ptr, PAGE_SIZE, &read);
+	vfs_read_bench_report("warm:", &dev, read, GLOBAL_TICK - start, ok && read == size);
+
+	gpa_alloc.free(chunk);
+	vfs_close(fd);
+	vfs_unmount("/bench");
+}
+
+// Sums the bench file through vfs_mmap(), every page faults in straight
+// from the page cache, against vfs_read() into a buffer of the file size
+void vfs_mmap_bench()
+{
+	section_divisor("Benchmarking mmap against read:\n");
+
+	struct storage_device dev;
+	int fd = vfs_bench_open(&dev);
+	if (fd < 0) {
+		kprintf("No device with hp1.txt or /big.bin, skipping\n");
+		return;
+	}
+
+	size_t size = 0;
+	vfs_file_size(fd, &size);
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t buffer = gpa_alloc.alloc(size);
+	const uint8_t *map = vfs_mmap(fd, 0, size);
+	if (buffer.ptr == nullptr || map == nullptr || !irq_enabled()) {
+		kprintf("Needs the PIT tick, a %u KiB buffer and a mapping, skipping\n", size / 1024);
+		if (buffer.ptr != nullptr)
+			gpa_alloc.free(buffer);
+		if (map != nullptr)
+			vfs_munmap((void *)map);
+		vfs_close(fd);
+		vfs_unmount("/bench");
+		return;
+	}
+	kprintf("%u KiB\n", size / 1024);
+
+	// Cold, then again once both are resident
+	for (size_t pass = 0; pass < 2; pass++) {
+		uint32_t sum = 0;
+		size_t start = GLOBAL_TICK;
+		for (size_t i = 0; i < size; i++)
+			sum += map[i];
+		size_t mmap_ticks = GLOBAL_TICK - start;
+
+		size_t read = 0;
+		start = GLOBAL_TICK;
+		bool ok = vfs_seek(fd, 0, VFS_SEEK_SET, nullptr) && vfs_read(fd, buffer.ptr, size, &read) && read == size;
+		uint32_t read_sum = 0;
+		for (size_t i = 0; ok && i < size; i++)
+			read_sum += ((uint8_t *)buffer.ptr)[i];
+		size_t read_ticks = GLOBAL_TICK - start;
+
+		kprintf("%s mmap %u ticks, read %u ticks, sums %s\n", pass == 0 ? "cold:" : "warm:", mmap_ticks, read_ticks,
+			ok && sum == read_sum ? "match" : "differ");
+	}
+
+	vfs_munmap((void *)map);
+	gpa_alloc.free(buffer);
+	vfs_close(fd);
+	vfs_unmount("/bench");
+}
+
+// Reads /initrd/test.bin of the initramfs.cpio module through the VFS and
+// checks that mapping it hands back the module's own pages
+void initramfs_bench()
+{
+	section_divisor("Benchmarking initramfs reads:\n");
+
+	if (!vfs_mount_type("/initrd", &initramfs_vfs_type, nullptr)) {
+		kprintf("No initramfs, skipping\n");
+		return;
+	}
+
+	int fd = vfs_open("/initrd/test.bin");
+	size_t size = 0;
+	const void *data = initramfs_find("/test.bin", &size);
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t buffer = data != nullptr ? gpa_alloc.alloc(size) : (fatptr_t){ 0 };
+	if (fd < 0 || buffer.ptr == nullptr || !irq_enabled()) {
+		kprintf("Needs the PIT tick and /test.bin in the initramfs, skipping\n");
+		if (buffer.ptr != nullptr)
+			gpa_alloc.free(buffer);
+		if (fd >= 0)
+			vfs_close(fd);
+		vfs_unmount("/initrd");
+		return;
+	}
+	kprintf("%u KiB\n", size / 1024);
+
+	size_t read = 0;
+	size_t start = GLOBAL_TICK;
+	bool ok = vfs_read(fd, buffer.ptr, size, &read) && read == size && memcmp(buffer.ptr, data, size) == 0;
+	size_t ticks = GLOBAL_TICK - start;
+
+	void *map = vfs_mmap(fd, 0, size);
+	kprintf("read %s in %u ticks, mmap %s\n", ok ? "ok" : "failed", ticks, map == data ? "in place" : "copied");
+	if (map != nullptr)
+		vfs_munmap(map);
+
+	gpa_alloc.free(buffer);
+	vfs_close(fd);
+	vfs_unmount("/initrd");
+}
+
 struct mbi_info{
 	struct multiboot_tag_mmap *mmap_tag;
 	struct multiboot_tag_elf_sections *elf_sec_tag;
@@ -217,10 +1455,11 @@ struct mbi_info get_mbi_info(uintptr_t mbi_addr){
 		case MULTIBOOT_TAG_TYPE_BOOT_LOADER_NAME:
 			kprintf("Boot loader name = %s\n", ((struct multiboot_tag_string *)tag)->string);
 			break;
-		case MULTIBOOT_TAG_TYPE_MODULE:
-			kprintf("Module at %x-%x. Command line %s\n", ((struct multiboot_tag_module *)tag)->mod_start,
-				((struct multiboot_tag_module *)tag)->mod_end, ((struct multiboot_tag_module *)tag)->cmdline);
-			break;
+		case MULTIBOOT_TAG_TYPE_MODULE: {
+			const struct multiboot_tag_module *module = (const struct multiboot_tag_module *)tag;
+			kprintf("Module at %x-%x. Command line %s\n", module->mod_start, module->mod_end, module->cmdline);
+			initramfs_add_module(module->mod_start, module->mod_end, module->cmdline);
+		} break;
 		case MULTIBOOT_TAG_TYPE_BASIC_MEMINFO:
 			kprintf("mem_lower = %uKB, mem_upper = %uKB\n", ((struct multiboot_tag_basic_meminfo *)tag)->mem_lower,
 				((struct multiboot_tag_basic_meminfo *)tag)->mem_upper);
@@ -346,6 +1585,7 @@ void kernel_main(unsigned int magic, unsigned long mbi_addr)
 	kprintf("IDT initialized\n");
 
 	phy_mem_init(mbi_info.mmap_tag, mbi_info.elf_sec_tag);
+	initramfs_reserve();
 	/* phy_memory_test(); */
 
 	// Preserve multiboot2 info in virtual memory
@@ -392,6 +1632,8 @@ void kernel_main(unsigned int magic, unsigned long mbi_addr)
 
 	/* allocator_t gpa_alloc = get_gpa_allocator(); */
 	/* gpa_test(gpa_alloc); */
+	/* slab_color_test(); */
+	/* slab_frag_test(); */
 
 	/* section_divisor("SMP init:\n"); */
 	/* smp_init(mbi_info.acpi_tag); */
@@ -419,6 +1661,25 @@ void kernel_main(unsigned int magic, unsigned long mbi_addr)
 
 	/* __asm__ volatile("sti"); */
 
+	// The benches time themselves with the PIT tick, they need the sti above
+	/* storage_read_bench(); */
+	/* ahci_qd_bench(); */
+	/* ahci_cpu_bench(); */
+	/* ahci_submit_bench(); */
+	/* storage_queue_bench(); */
+	/* bcache_bench(); */
+	/* ata_dma_bench(); */
+	/* ata_pio_bench(); */
+	/* fat16_chain_bench(); */
+	/* fat16_run_bench(); */
+	/* fat16_dir_bench(); */
+	/* fat16_write_bench(); */
+	/* fat_mount_bench(); */
+	/* ext2_read_bench(); */
+	/* vfs_read_bench(); */
+	/* vfs_mmap_bench(); */
+	/* initramfs_bench(); */
+
 	/* struct storage_device device; */
 	/* if (!storage_get_device(1, &device)) { */
 	/* 	kprintf("No storage device available\n"); */
@@ -411,6 +411,12 @@ struct mbi_info init_memblock_from_mbi(uintptr_t mbi_addr, uintptr_t kernel_star
 			}
 		}
 			break;
+		case MULTIBOOT_TAG_TYPE_MODULE: {
+			/* GRUB modules stay where they were loaded, the initramfs is served from them */
+			const struct multiboot_tag_module *module = (const struct multiboot_tag_module *)tag;
+			memblock_remove(&block, module->mod_start, module->mod_end - module->mod_start);
+		}
+			break;
 		case MULTIBOOT_TAG_TYPE_ELF_SECTIONS: {
 			res.elf_sec_tag = (struct multiboot_tag_elf_sections *)tag;
 			const Elf32_Shdr *elf_sec = (const Elf32_Shdr *)res.elf_sec_tag->sections;
@@ -0,0 +1,341 @@
+#include <kernel/pcache.h>
+
+#include <kernel/allocator.h>
+#include <kernel/display.h>
+#include <kernel/phy_mem.h>
+#include <kernel/vfs.h>
+
+#include <list.h>
+#include <string.h>
+
+MODULE("pcache")
+
+#define PCACHE_HASH_BITS 9
+#define PCACHE_HASH_SIZE (1u << PCACHE_HASH_BITS)
+// Past this many pages, 8 MiB, the least recently used idle page is reused
+#define PCACHE_MAX_PAGES 2048u
+
+static slab_cache_t *pcache_page_cache = nullptr;
+static slab_cache_t *pcache_data_cache = nullptr;
+static struct list_head pcache_hash[PCACHE_HASH_SIZE];
+static LIST_HEAD(pcache_lru);
+static size_t pcache_count = 0;
+static struct pcache_stats pcache_stats = { 0 };
+// Set while a page is waited for, the shrinker leaves the lists alone
+static bool pcache_busy = false;
+
+static size_t pcache_bucket(const struct vnode *vnode, size_t index)
+{
+	uint32_t key = (uint32_t)((uintptr_t)vnode >> 4) ^ (uint32_t)index;
+
+	// Fibonacci hashing, the top bits are the best mixed
+	return (key * 0x9E3779B1u) >> (32 - PCACHE_HASH_BITS);
+}
+
+static struct pcache_page *pcache_lookup(const struct vnode *vnode, size_t index)
+{
+	list_for_each(&pcache_hash[pcache_bucket(vnode, index)]) {
+		struct pcache_page *page = list_entry(it, struct pcache_page, hash);
+		if (page->vnode == vnode && page->index == index)
+			return page;
+	}
+
+	return nullptr;
+}
+
+static bool pcache_page_idle(const struct pcache_page *page)
+{
+	return page->refcount == 0 && page->pending == 0;
+}
+
+static void pcache_free_page(struct pcache_page *page)
+{
+	list_rm(&page->hash);
+	list_rm(&page->lru);
+	list_rm(&page->vnode_list);
+	pcache_count--;
+
+	slab_free_obj(pcache_data_cache, (fatptr_t){ .ptr = page->data, .len = PAGE_SIZE });
+	slab_free_obj(pcache_page_cache, (fatptr_t){ .ptr = page, .len = sizeof(*page) });
+}
+
+static void pcache_evict_one(void)
+{
+	list_rev_for_each(&pcache_lru) {
+		struct pcache_page *page = list_entry(it, struct pcache_page, lru);
+		if (!pcache_page_idle(page))
+			continue;
+
+		pcache_free_page(page);
+		pcache_stats.evictions++;
+		break;
+	}
+}
+
+// A new, empty page at index, nobody references it yet
+static struct pcache_page *pcache_alloc_page(struct vnode *vnode, size_t index)
+{
+	if (pcache_count >= PCACHE_MAX_PAGES)
+		pcache_evict_one();
+
+	fatptr_t head = slab_alloc_obj(pcache_page_cache);
+	if (head.ptr == nullptr)
+		return nullptr;
+
+	fatptr_t data = slab_alloc_obj(pcache_data_cache);
+	if (data.ptr == nullptr) {
+		slab_free_obj(pcache_page_cache, head);
+		return nullptr;
+	}
+
+	struct pcache_page *page = head.ptr;
+	*page = (struct pcache_page){ .vnode = vnode, .index = index, .data = data.ptr };
+	list_add(&page->hash, &pcache_hash[pcache_bucket(vnode, index)]);
+	list_add(&page->lru, &pcache_lru);
+	list_add(&page->vnode_list, &vnode->pages);
+	pcache_count++;
+	return page;
+}
+
+static void pcache_read_done(struct storage_request *req, void *ctx)
+{
+	struct pcache_page *page = ctx;
+	if (!req->ok)
+		page->error = true;
+	if (page->pending > 0 && --page->pending == 0)
+		page->uptodate = !page->error;
+}
+
+// Map the page through the file system and queue one request per extent.
+// Holes and the part past the end of the file are zeroed right away.
+static bool pcache_start_read(struct pcache_page *page)
+{
+	struct vnode *vnode = page->vnode;
+	const uint64_t start = (uint64_t)page->index * PAGE_SIZE;
+	size_t valid = 0;
+	if (start < vnode->size)
+		valid = vnode->size - start < PAGE_SIZE ? (size_t)(vnode->size - start) : PAGE_SIZE;
+	valid = (valid + BCACHE_BLOCK_SIZE - 1) / BCACHE_BLOCK_SIZE * BCACHE_BLOCK_SIZE;
+
+	page->error = false;
+	page->uptodate = false;
+	page->req_count = 0;
+
+	// Map every extent before submitting, a failure leaves nothing queued
+	for (size_t done = 0; done < valid;) {
+		uint64_t lba = 0;
+		size_t bytes = 0;
+		if (!vnode->ops->bmap(vnode, start + done, valid - done, &lba, &bytes))
+			return false;
+
+		bytes = bytes / BCACHE_BLOCK_SIZE * BCACHE_BLOCK_SIZE;
+		if (bytes == 0)
+			return false;
+		if (bytes > valid - done)
+			bytes = valid - done;
+
+		if (lba == VFS_HOLE)
+			memset(page->data + done, 0, bytes);
+		else
+			page->reqs[page->req_count++] = (struct storage_request){
+				.lba = lba,
+				.sector_count = bytes / BCACHE_BLOCK_SIZE,
+				.buffer = page->data + done,
+				.done_cb = pcache_read_done,
+				.ctx = page,
+			};
+		done += bytes;
+	}
+	memset(page->data + valid, 0, PAGE_SIZE - valid);
+
+	if (page->req_count == 0) {
+		page->uptodate = true;
+		return true;
+	}
+
+	// Counted up front, an unplugged queue completes the requests in storage_submit()
+	page->pending = page->req_count;
+	for (size_t i = 0; i < page->req_count; i++)
+		storage_submit(&vnode->mount->device, &page->reqs[i]);
+	return true;
+}
+
+static bool pcache_wait(struct pcache_page *page)
+{
+	bool was_busy = pcache_busy;
+	pcache_busy = true;
+
+	for (size_t i = 0; i < page->req_count && page->pending > 0; i++) {
+		if (!page->reqs[i].done)
+			storage_wait(&page->vnode->mount->device, &page->reqs[i]);
+	}
+
+	pcache_busy = was_busy;
+	return page->uptodate;
+}
+
+static size_t pcache_shrink(size_t nr_pages, void *ctx)
+{
+	(void)ctx;
+
+	if (pcache_busy)
+		return 0;
+
+	struct list_head *pos = pcache_lru.prev;
+	while (pos != &pcache_lru && nr_pages > 0) {
+		struct pcache_page *page = list_entry(pos, struct pcache_page, lru);
+		pos = pos->prev;
+		if (!pcache_page_idle(page))
+			continue;
+
+		pcache_free_page(page);
+		pcache_stats.evictions++;
+		nr_pages--;
+	}
+
+	return slab_shrink_cache(pcache_data_cache) + slab_shrink_cache(pcache_page_cache);
+}
+
+static struct phy_mem_shrinker pcache_shrinker = { .name = "pcache", .shrink = pcache_shrink };
+
+bool pcache_init(void)
+{
+	if (pcache_page_cache != nullptr)
+		return pcache_data_cache != nullptr;
+
+	pcache_page_cache = slab_create("pcache_page", sizeof(struct pcache_page), alignof(struct pcache_page), 0, nullptr, nullptr);
+	pcache_data_cache = slab_create("pcache_data", PAGE_SIZE, PAGE_SIZE, SLAB_NO_COLOR, nullptr, nullptr);
+	if (pcache_page_cache == nullptr || pcache_data_cache == nullptr) {
+		mprint("failed to create the page caches\n");
+		return false;
+	}
+
+	for (size_t i = 0; i < PCACHE_HASH_SIZE; i++)
+		RESET_LIST_ITEM(&pcache_hash[i]);
+
+	phy_mem_register_shrinker(&pcache_shrinker);
+	return true;
+}
+
+static bool pcache_ready(void)
+{
+	return pcache_page_cache != nullptr && pcache_data_cache != nullptr;
+}
+
+struct pcache_page *pcache_get(struct vnode *vnode, size_t index)
+{
+	if (vnode == nullptr || !pcache_ready())
+		return nullptr;
+
+	struct pcache_page *page = pcache_lookup(vnode, index);
+	if (page != nullptr) {
+		pcache_stats.hits++;
+		if (page->readahead) {
+			pcache_stats.readahead_hits++;
+			page->readahead = false;
+		}
+		page->refcount++;
+		list_mv(&page->lru, &pcache_lru);
+
+		// An earlier read of it failed, try again
+		if (page->error && page->pending == 0 && !pcache_start_read(page))
+			page->error = true;
+	} else {
+		pcache_stats.misses++;
+		page = pcache_alloc_page(vnode, index);
+		if (page == nullptr)
+			return nullptr;
+
+		page->refcount = 1;
+		if (!pcache_start_read(page))
+			page->error = true;
+	}
+
+	if (!page->uptodate && page->pending > 0)
+		pcache_wait(page);
+	if (!page->uptodate) {
+		pcache_put(page);
+		return nullptr;
+	}
+
+	return page;
+}
+
+void pcache_put(struct pcache_page *page)
+{
+	if (page == nullptr)
+		return;
+	if (page->refcount == 0) {
+		mprint("put of unreferenced page %u\n", (uint32_t)page->index);
+		return;
+	}
+
+	// A page that failed to read is not worth keeping around
+	if (--page->refcount == 0 && !page->uptodate && page->pending == 0)
+		pcache_free_page(page);
+}
+
+bool pcache_contains(const struct vnode *vnode, size_t index)
+{
+	return pcache_ready() && pcache_lookup(vnode, index) != nullptr;
+}
+
+size_t pcache_readahead(struct vnode *vnode, size_t index, size_t count)
+{
+	if (vnode == nullptr || !pcache_ready())
+		return 0;
+
+	const size_t pages = (vnode->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	size_t submitted = 0;
+	for (size_t i = index; i < pages && i - index < count; i++) {
+		if (pcache_lookup(vnode, i) != nullptr)
+			continue;
+
+		struct pcache_page *page = pcache_alloc_page(vnode, i);
+		if (page == nullptr)
+			break;
+
+		// Referenced while its extents are mapped, bmap can allocate and the
+		// shrinker would free an idle page from under pcache_start_read()
+		page->readahead = true;
+		page->refcount = 1;
+		const bool started = pcache_start_read(page);
+		page->refcount = 0;
+		if (!started) {
+			pcache_free_page(page);
+			break;
+		}
+		submitted++;
+	}
+
+	pcache_stats.readahead_pages += submitted;
+	return submitted;
+}
+
+void pcache_drop_vnode(struct vnode *vnode)
+{
+	if (vnode == nullptr || !pcache_ready())
+		return;
+
+	while (vnode->pages.next != &vnode->pages) {
+		struct pcache_page *page = list_entry(vnode->pages.next, struct pcache_page, vnode_list);
+		// Its requests point into the page, they have to leave the queue first
+		if (page->pending > 0)
+			pcache_wait(page);
+		if (page->refcount > 0)
+			mprint("dropping referenced page %u\n", (uint32_t)page->index);
+
+		pcache_free_page(page);
+	}
+}
+
+void pcache_get_stats(struct pcache_stats *out)
+{
+	if (out != nullptr)
+		*out = pcache_stats;
+}
+
+void pcache_reset_stats(void)
+{
+	pcache_stats = (struct pcache_stats){ 0 };
+}
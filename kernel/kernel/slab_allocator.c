@@ -4,6 +4,8 @@
 #include <kernel/phy_mem.h>
 #include <kernel/vir_mem.h>
 
+#include "../arch/i386/cpuid.h"
+
 #include <list.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -18,31 +20,84 @@ typedef mem_phy_mem_tag_t phy_mem_tag_t;
 fatptr_t mem_gpa_alloc(size_t req);
 void mem_gpa_free(fatptr_t freeing);
 
+#define SLAB_MAGIC 0x51AB51ABu
+#define SLAB_MAP_WORD_BITS 32u
+#define SLAB_MAP_WORDS(objs) (((objs) + SLAB_MAP_WORD_BITS - 1) / SLAB_MAP_WORD_BITS)
+#define SLAB_BOOTSTRAP_MAX_OBJS 256u
+
+// Slabs span 2^order pages, the smallest order that leaves less than
+// 1/SLAB_WASTE_FRACTION of the slab unused is picked.
+#define SLAB_MAX_ORDER 4
+#define SLAB_WASTE_FRACTION 8
+
+// Objects of at least this size keep their header off the slab, so the
+// pages divide evenly between objects. Off-slab headers live in
+// slab_header_cache and are found through a hash on the slab base.
+#define SLAB_OFF_SLAB_MIN_SIZE (PAGE_SIZE / 8)
+#define SLAB_OFF_SLAB_MAX_OBJS ((PAGE_SIZE << SLAB_MAX_ORDER) / SLAB_OFF_SLAB_MIN_SIZE)
+#define SLAB_OFF_SLAB_HASH_BITS 6
+
+// Largest request served by the general purpose size classes
+#define SLAB_GENERAL_MAX_SIZE KIBI(16)
+
+// General purpose size classes, the 96 and 192 steps keep the common
+// 65-96 and 129-192 byte requests from wasting a third of the object.
+#define SLAB_SIZE_CLASS_COUNT 14
+#define SLAB_SMALL_CLASS_LIMIT 192
+#define SLAB_SMALL_CLASS_STEP 8
+
 struct slab_object {
 	struct slab_object *next;
 };
 
+/**
+ * Slab header. Slabs are aligned to their own size, on-slab caches keep
+ * the header at the slab base so the owner of an object is found by
+ * masking the object address. The allocation bitmap follows the header,
+ * objects start at cache->hdr_size.
+ **/
 struct slab {
+	uint32_t magic;
 	void *mem;
 	size_t len;
 	size_t in_use;
 	size_t capacity;
 	struct slab_object *free_list;
+	uint32_t *used_map; // one bit per object, set while allocated
 	malloc_tag_t *tag;
 	struct list_head list;
 	struct slab_cache *cache;
 };
 
+struct slab_off_slab {
+	struct slab slab;
+	uint32_t used_map[SLAB_MAP_WORDS(SLAB_OFF_SLAB_MAX_OBJS)];
+	struct list_head hash;
+};
+
 struct slab_cache {
 	const char *name;
 	size_t obj_size;
 	size_t align;
 	size_t objs_per_slab;
+	size_t order;
+	bool off_slab;
+	size_t hdr_size;
+	unsigned int flags;
+	// Coloring: each new slab shifts its objects by color_next * color_align
+	// bytes inside the space the objects leave unused, so objects with the
+	// same index in different slabs do not all land in the same cache sets.
+	size_t color_align;
+	size_t color_count;
+	size_t color_next;
 	size_t free_objs;
 	size_t reserve_free;
 	slab_ctor_t ctor;
 	slab_dtor_t dtor;
 	bool release_empty;
+	// Bootstrap caches carve their objects out of a shared page and keep
+	// the header outside of it, their only slab is checked by range.
+	struct slab *bootstrap;
 
 	struct list_head partial;
 	struct list_head full;
@@ -54,6 +109,38 @@ static struct list_head slab_caches = { .next = &slab_caches, .prev = &slab_cach
 static bool slab_initialized = false;
 static bool tag_caches_ready = false;
 
+struct slab_size_class {
+	size_t size;
+	const char *name;
+	slab_cache_t *cache;
+	size_t live_objs;
+	size_t live_req_bytes;
+	size_t total_allocs;
+};
+
+static struct slab_size_class slab_size_classes[SLAB_SIZE_CLASS_COUNT] = {
+	{ .size = 8, .name = "general-8" },	  { .size = 16, .name = "general-16" },	  { .size = 32, .name = "general-32" },
+	{ .size = 64, .name = "general-64" },	  { .size = 96, .name = "general-96" },	  { .size = 128, .name = "general-128" },
+	{ .size = 192, .name = "general-192" },	  { .size = 256, .name = "general-256" }, { .size = 512, .name = "general-512" },
+	{ .size = 1024, .name = "general-1024" }, { .size = 2048, .name = "general-2048" }, { .size = 4096, .name = "general-4096" },
+	{ .size = 8192, .name = "general-8192" }, { .size = 16384, .name = "general-16384" },
+};
+static_assert(SLAB_GENERAL_MAX_SIZE == 16384, "largest size class must match the general slab limit");
+
+// Class index for requests up to SLAB_SMALL_CLASS_LIMIT, indexed by (size - 1) / 8
+static const uint8_t slab_small_class_idx[SLAB_SMALL_CLASS_LIMIT / SLAB_SMALL_CLASS_STEP] = {
+	0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6,
+};
+
+static bool size_classes_ready = false;
+
+static slab_cache_t *slab_header_cache = nullptr;
+// Set while a slab is built or torn down, or a reserve is refilled. Those
+// allocate pages and touch slab_header_cache and the reserve counts
+// mid-update, so the shrinker leaves every cache alone until it clears.
+static bool slab_busy = false;
+static struct list_head slab_off_slab_hash[1 << SLAB_OFF_SLAB_HASH_BITS] = { 0 };
+
 static slab_cache_t malloc_tag_cache = { 0 };
 static slab_cache_t phy_mem_tag_cache = { 0 };
 static slab_cache_t phy_mem_link_cache = { 0 };
@@ -62,18 +149,123 @@ static struct slab malloc_tag_slab = { 0 };
 static struct slab phy_mem_tag_slab = { 0 };
 static struct slab phy_mem_link_slab = { 0 };
 
+static uint32_t malloc_tag_map[SLAB_MAP_WORDS(SLAB_BOOTSTRAP_MAX_OBJS)] = { 0 };
+static uint32_t phy_mem_tag_map[SLAB_MAP_WORDS(SLAB_BOOTSTRAP_MAX_OBJS)] = { 0 };
+static uint32_t phy_mem_link_map[SLAB_MAP_WORDS(SLAB_BOOTSTRAP_MAX_OBJS)] = { 0 };
+
 void slab_set_cache_reserve(slab_cache_t *cache, size_t reserve_free);
 
 static void *slab_take_cache_obj_no_grow(slab_cache_t *cache);
 static void slab_free_pages(malloc_tag_t *tag);
-static void slab_init_bootstrap_cache(slab_cache_t *cache, struct slab *slab, const char *name, size_t obj_size, size_t align,
-				      void *buffer, size_t obj_count, bool release_empty);
+static void slab_init_bootstrap_cache(slab_cache_t *cache, struct slab *slab, uint32_t *used_map, const char *name, size_t obj_size,
+				      size_t align, void *buffer, size_t obj_count, bool release_empty);
 
 static size_t align_up(size_t val, size_t align)
 {
 	return (val + (align - 1)) & ~(align - 1);
 }
 
+static size_t cache_line_size(void)
+{
+	static size_t line = 0;
+	if (line == 0)
+		line = cpuid_cache_line_size();
+	return line;
+}
+
+// Offset of the objects of the next slab relative to cache->hdr_size
+static size_t slab_next_color(slab_cache_t *cache)
+{
+	if (cache->color_count <= 1)
+		return 0;
+
+	size_t color = cache->color_next * cache->color_align;
+	cache->color_next = (cache->color_next + 1) % cache->color_count;
+	return color;
+}
+
+// Size of the on-slab header plus the allocation bitmap for objs objects,
+// rounded so that the first object respects the cache alignment.
+static size_t slab_header_size(size_t objs, size_t align)
+{
+	return align_up(sizeof(struct slab) + SLAB_MAP_WORDS(objs) * sizeof(uint32_t), align);
+}
+
+static size_t slab_bytes(const slab_cache_t *cache)
+{
+	return (size_t)PAGE_SIZE << cache->order;
+}
+
+// Largest object count that fits bytes together with its header, an
+// off-slab header only bounds the count through its bitmap.
+static size_t slab_objs_per_slab(size_t obj_size, size_t align, size_t bytes, bool off_slab)
+{
+	size_t objs = bytes / obj_size;
+	if (off_slab)
+		return objs > SLAB_OFF_SLAB_MAX_OBJS ? SLAB_OFF_SLAB_MAX_OBJS : objs;
+
+	while (objs > 0 && slab_header_size(objs, align) + objs * obj_size > bytes)
+		objs--;
+	return objs;
+}
+
+// Smallest order that keeps the waste under the threshold, otherwise the
+// order with the lowest waste ratio. Above SLAB_MAX_ORDER if nothing fits.
+static size_t slab_pick_order(size_t obj_size, size_t align, bool off_slab)
+{
+	size_t best_order = SLAB_MAX_ORDER + 1;
+	size_t best_waste = 0;
+
+	for (size_t order = 0; order <= SLAB_MAX_ORDER; order++) {
+		const size_t bytes = (size_t)PAGE_SIZE << order;
+		const size_t objs = slab_objs_per_slab(obj_size, align, bytes, off_slab);
+		if (objs == 0)
+			continue;
+
+		const size_t used = (off_slab ? 0 : slab_header_size(objs, align)) + objs * obj_size;
+		const size_t waste = bytes - used;
+		if (waste * SLAB_WASTE_FRACTION <= bytes)
+			return order;
+
+		const size_t best_bytes = (size_t)PAGE_SIZE << best_order;
+		if (best_order > SLAB_MAX_ORDER || (uint64_t)waste * best_bytes < (uint64_t)best_waste * bytes) {
+			best_order = order;
+			best_waste = waste;
+		}
+	}
+
+	return best_order;
+}
+
+static struct list_head *slab_off_slab_bucket(const void *base)
+{
+	const uint32_t key = (uint32_t)((uintptr_t)base / PAGE_SIZE) * 2654435761u;
+	struct list_head *bucket = &slab_off_slab_hash[key >> (32 - SLAB_OFF_SLAB_HASH_BITS)];
+	if (bucket->next == nullptr)
+		RESET_LIST_ITEM(bucket);
+	return bucket;
+}
+
+static size_t slab_obj_index(const struct slab *slab, const void *ptr)
+{
+	return (size_t)((const uint8_t *)ptr - (const uint8_t *)slab->mem) / slab->cache->obj_size;
+}
+
+static bool slab_obj_is_used(const struct slab *slab, size_t idx)
+{
+	return (slab->used_map[idx / SLAB_MAP_WORD_BITS] & (1u << (idx % SLAB_MAP_WORD_BITS))) != 0;
+}
+
+static void slab_mark_obj(struct slab *slab, size_t idx, bool used)
+{
+	const uint32_t mask = 1u << (idx % SLAB_MAP_WORD_BITS);
+	if (used)
+		slab->used_map[idx / SLAB_MAP_WORD_BITS] |= mask;
+	else
+		slab->used_map[idx / SLAB_MAP_WORD_BITS] &= ~mask;
+}
+
+// Map req bytes aligned to req, which must be a power of two pages
 static malloc_tag_t *slab_alloc_pages(size_t req)
 {
 	malloc_tag_t *tag = slab_take_cache_obj_no_grow(&malloc_tag_cache);
@@ -83,7 +275,7 @@ static malloc_tag_t *slab_alloc_pages(size_t req)
 		return nullptr;
 
 	size_t req_align = round_up_to_page(req);
-	struct vmm_entry *vir_mem = vmm_alloc(req_align, VMM_ENTRY_PRESENT_BIT | VMM_ENTRY_READ_WRITE_BIT);
+	struct vmm_entry *vir_mem = vmm_alloc_aligned(req_align, req_align, VMM_ENTRY_PRESENT_BIT | VMM_ENTRY_READ_WRITE_BIT);
 	if (vir_mem == nullptr)
 		goto fail_tag;
 
@@ -170,23 +362,32 @@ static void slab_free_pages(malloc_tag_t *tag)
 	mem_unregister_tag(tag);
 }
 
-static struct slab *slab_new_slab(slab_cache_t *cache)
+static struct slab *slab_build_slab(slab_cache_t *cache)
 {
-	if (cache == nullptr)
-		return nullptr;
-
-	malloc_tag_t *tag = slab_alloc_pages(PAGE_SIZE);
+	malloc_tag_t *tag = slab_alloc_pages(slab_bytes(cache));
 	if (tag == nullptr)
 		return nullptr;
 
-	struct slab *slab = mem_gpa_alloc(sizeof(*slab)).ptr;
-	if (slab == nullptr) {
-		slab_free_pages(tag);
-		return nullptr;
+	// Pages and headers come back zeroed, so the allocation bitmap starts out clear
+	uint8_t *base = mem_get_ptr_tag(tag);
+	struct slab *slab = (struct slab *)base;
+	if (cache->off_slab) {
+		struct slab_off_slab *off = slab_alloc_obj(slab_header_cache).ptr;
+		if (off == nullptr) {
+			slab_free_pages(tag);
+			return nullptr;
+		}
+
+		list_add(&off->hash, slab_off_slab_bucket(base));
+		slab = &off->slab;
+		slab->used_map = off->used_map;
+	} else {
+		slab->used_map = (uint32_t *)(slab + 1);
 	}
 
-	slab->mem = mem_get_ptr_tag(tag);
-	slab->len = mem_get_size_tag(tag);
+	slab->magic = SLAB_MAGIC;
+	slab->mem = base + cache->hdr_size + slab_next_color(cache);
+	slab->len = cache->objs_per_slab * cache->obj_size;
 	slab->tag = tag;
 	slab->in_use = 0;
 	slab->capacity = cache->objs_per_slab;
@@ -207,6 +408,19 @@ static struct slab *slab_new_slab(slab_cache_t *cache)
 	return slab;
 }
 
+static struct slab *slab_new_slab(slab_cache_t *cache)
+{
+	if (cache == nullptr)
+		return nullptr;
+
+	// An off-slab header comes from slab_header_cache, which can grow in turn
+	bool was_busy = slab_busy;
+	slab_busy = true;
+	struct slab *slab = slab_build_slab(cache);
+	slab_busy = was_busy;
+	return slab;
+}
+
 static void slab_release_slab(struct slab *slab)
 {
 	if (slab == nullptr)
@@ -217,40 +431,56 @@ static void slab_release_slab(struct slab *slab)
 
 	if (slab->list.next != nullptr && slab->list.prev != nullptr)
 		list_rm(&slab->list);
-	slab_free_pages(slab->tag);
-	mem_gpa_free((fatptr_t){ .ptr = slab, .len = sizeof(*slab) });
+
+	bool was_busy = slab_busy;
+	slab_busy = true;
+
+	// An on-slab header goes away with the pages, read what we need first
+	malloc_tag_t *tag = slab->tag;
+	slab->magic = 0;
+	if (slab->cache->off_slab) {
+		struct slab_off_slab *off = container_of(slab, struct slab_off_slab, slab);
+		list_rm(&off->hash);
+		slab_free_obj(slab_header_cache, (fatptr_t){ .ptr = off, .len = sizeof(*off) });
+	}
+	slab_free_pages(tag);
+
+	slab_busy = was_busy;
 }
 
-static struct slab *slab_find_for_ptr(slab_cache_t *cache, void *ptr)
+static bool slab_contains(const struct slab *slab, const void *ptr)
 {
-	list_for_each(&cache->partial) {
-		struct slab *slab = list_entry(it, struct slab, list);
-		uint8_t *base = slab->mem;
-		if ((uint8_t *)ptr >= base && (uint8_t *)ptr < base + slab->len)
-			return slab;
-	}
-	list_for_each(&cache->full) {
-		struct slab *slab = list_entry(it, struct slab, list);
-		uint8_t *base = slab->mem;
-		if ((uint8_t *)ptr >= base && (uint8_t *)ptr < base + slab->len)
-			return slab;
-	}
-	list_for_each(&cache->empty) {
-		struct slab *slab = list_entry(it, struct slab, list);
-		uint8_t *base = slab->mem;
-		if ((uint8_t *)ptr >= base && (uint8_t *)ptr < base + slab->len)
-			return slab;
-	}
-	return nullptr;
+	const uint8_t *base = slab->mem;
+	return (const uint8_t *)ptr >= base && (const uint8_t *)ptr < base + slab->len;
 }
 
-static bool slab_in_free_list(const struct slab *slab, const void *ptr)
+static struct slab *slab_find_for_ptr(slab_cache_t *cache, void *ptr)
 {
-	for (const struct slab_object *it = slab->free_list; it != nullptr; it = it->next) {
-		if (it == ptr)
-			return true;
+	if (cache->bootstrap != nullptr && slab_contains(cache->bootstrap, ptr))
+		return cache->bootstrap;
+
+	void *base = (void *)((uintptr_t)ptr & ~(uintptr_t)(slab_bytes(cache) - 1));
+	struct slab *slab = nullptr;
+	if (cache->off_slab) {
+		list_for_each(slab_off_slab_bucket(base)) {
+			struct slab_off_slab *off = list_entry(it, struct slab_off_slab, hash);
+			if (mem_get_ptr_tag(off->slab.tag) == base) {
+				slab = &off->slab;
+				break;
+			}
+		}
+		if (slab == nullptr)
+			return nullptr;
+	} else {
+		slab = base;
+		if (vmm_phy_addr(slab) == nullptr)
+			return nullptr;
 	}
-	return false;
+
+	if (slab->magic != SLAB_MAGIC || slab->cache != cache || !slab_contains(slab, ptr))
+		return nullptr;
+
+	return slab;
 }
 
 static void *slab_take_obj(struct slab *slab)
@@ -261,12 +491,14 @@ static void *slab_take_obj(struct slab *slab)
 	struct slab_object *obj = slab->free_list;
 	slab->free_list = obj->next;
 	slab->in_use += 1;
+	slab_mark_obj(slab, slab_obj_index(slab, obj), true);
 	return obj;
 }
 
 static void slab_return_obj(struct slab *slab, void *ptr)
 {
 	struct slab_object *node = ptr;
+	slab_mark_obj(slab, slab_obj_index(slab, ptr), false);
 	node->next = slab->free_list;
 	slab->free_list = node;
 	slab->in_use -= 1;
@@ -304,15 +536,33 @@ static void *slab_take_cache_obj_no_grow(slab_cache_t *cache)
 	return obj;
 }
 
-static slab_cache_t *slab_find_or_create_cache(size_t size)
+// Map a request in [1, SLAB_GENERAL_MAX_SIZE] to its size class index,
+// small sizes go through a table and the rest are powers of two.
+static size_t slab_size_to_class(size_t size)
 {
-	list_for_each(&slab_caches) {
-		slab_cache_t *cache = list_entry(it, slab_cache_t, list);
-		if (cache->obj_size == size)
-			return cache;
+	if (size <= SLAB_SMALL_CLASS_LIMIT)
+		return slab_small_class_idx[(size - 1) / SLAB_SMALL_CLASS_STEP];
+
+	const size_t fls = BIT(sizeof(unsigned int)) - __builtin_clz((unsigned int)(size - 1));
+	return 7 + (fls - 8);
+}
+
+static void slab_init_size_classes(void)
+{
+	if (size_classes_ready)
+		return;
+
+	for (size_t i = 0; i < SLAB_SIZE_CLASS_COUNT; i++) {
+		struct slab_size_class *class = &slab_size_classes[i];
+		if (class->cache != nullptr)
+			continue;
+
+		class->cache = slab_create(class->name, class->size, sizeof(void *), 0, nullptr, nullptr);
+		if (class->cache == nullptr)
+			BUG("failed to create general slab cache %s", class->name);
 	}
 
-	return slab_create("general", size, sizeof(void *), nullptr, nullptr);
+	size_classes_ready = true;
 }
 
 static void ensure_initialized(void)
@@ -323,7 +573,7 @@ static void ensure_initialized(void)
 	slab_initialized = true;
 }
 
-slab_cache_t *slab_create(const char *name, size_t obj_size, size_t align, slab_ctor_t ctor, slab_dtor_t dtor)
+slab_cache_t *slab_create(const char *name, size_t obj_size, size_t align, unsigned int flags, slab_ctor_t ctor, slab_dtor_t dtor)
 {
 	if (obj_size == 0)
 		return nullptr;
@@ -331,15 +581,27 @@ slab_cache_t *slab_create(const char *name, size_t obj_size, size_t align, slab_
 	size_t real_align = align == 0 ? sizeof(void *) : align;
 	if (real_align < sizeof(void *))
 		real_align = sizeof(void *);
+	if ((flags & SLAB_HWCACHE_ALIGN) && real_align < cache_line_size())
+		real_align = cache_line_size();
 
 	size_t aligned_size = align_up(obj_size, real_align);
 	if (aligned_size < sizeof(struct slab_object))
 		aligned_size = sizeof(struct slab_object);
 
-	size_t objs_per_slab = PAGE_SIZE / aligned_size;
-	if (objs_per_slab == 0)
+	const bool off_slab = aligned_size >= SLAB_OFF_SLAB_MIN_SIZE;
+	const size_t order = slab_pick_order(aligned_size, real_align, off_slab);
+	if (order > SLAB_MAX_ORDER)
 		return nullptr;
 
+	const size_t bytes = (size_t)PAGE_SIZE << order;
+	const size_t objs_per_slab = slab_objs_per_slab(aligned_size, real_align, bytes, off_slab);
+
+	if (off_slab && slab_header_cache == nullptr) {
+		slab_header_cache = slab_create("slab_header", sizeof(struct slab_off_slab), alignof(struct slab_off_slab), 0, nullptr, nullptr);
+		if (slab_header_cache == nullptr)
+			return nullptr;
+	}
+
 	slab_cache_t *cache = mem_gpa_alloc(sizeof(*cache)).ptr;
 	if (cache == nullptr)
 		return nullptr;
@@ -348,11 +610,21 @@ slab_cache_t *slab_create(const char *name, size_t obj_size, size_t align, slab_
 	cache->obj_size = aligned_size;
 	cache->align = real_align;
 	cache->objs_per_slab = objs_per_slab;
+	cache->order = order;
+	cache->off_slab = off_slab;
+	cache->hdr_size = off_slab ? 0 : slab_header_size(objs_per_slab, real_align);
+	cache->flags = flags;
+	cache->color_align = real_align < cache_line_size() ? cache_line_size() : real_align;
+	cache->color_count = 1;
+	if (!(flags & SLAB_NO_COLOR))
+		cache->color_count += (bytes - cache->hdr_size - objs_per_slab * aligned_size) / cache->color_align;
+	cache->color_next = 0;
 	cache->free_objs = 0;
 	cache->reserve_free = 0;
 	cache->ctor = ctor;
 	cache->dtor = dtor;
 	cache->release_empty = true;
+	cache->bootstrap = nullptr;
 
 	RESET_LIST_ITEM(&cache->partial);
 	RESET_LIST_ITEM(&cache->full);
@@ -375,14 +647,17 @@ fatptr_t slab_alloc_obj(slab_cache_t *cache)
 	struct slab *target = nullptr;
 
 	if (cache->reserve_free > 0 && cache->free_objs <= cache->reserve_free) {
+		bool was_busy = slab_busy;
+		slab_busy = true;
 		size_t save_reserve_free = cache->reserve_free;
 		cache->reserve_free = 0;
 
 		target = slab_new_slab(cache);
-		if (target == nullptr)
-			return (fatptr_t){ .ptr = nullptr, .len = 0 };
 
 		cache->reserve_free = save_reserve_free;
+		slab_busy = was_busy;
+		if (target == nullptr)
+			return (fatptr_t){ .ptr = nullptr, .len = 0 };
 	}
 
 	if (target == nullptr && cache->partial.next != &cache->partial)
@@ -431,7 +706,7 @@ bool slab_free_obj(slab_cache_t *cache, fatptr_t obj)
 		return false;
 	}
 
-	if (slab_in_free_list(slab, obj.ptr)) {
+	if (!slab_obj_is_used(slab, offset / cache->obj_size)) {
 		mprint("slab: double free detected (%x)\n", obj.ptr);
 		return false;
 	}
@@ -444,7 +719,10 @@ bool slab_free_obj(slab_cache_t *cache, fatptr_t obj)
 
 	if (slab->in_use == 0) {
 		list_mv(&slab->list, &cache->empty);
-		if (cache->release_empty && cache->free_objs - slab->capacity >= cache->reserve_free) {
+		// Keep one empty slab so alloc/free around a slab boundary does not
+		// map and unmap pages every time, the shrinker takes it back
+		const bool other_empty = slab->list.next != &cache->empty;
+		if (cache->release_empty && other_empty && cache->free_objs - slab->capacity >= cache->reserve_free) {
 			cache->free_objs -= slab->capacity;
 			slab_release_slab(slab);
 		}
@@ -480,17 +758,57 @@ void slab_destroy(slab_cache_t *cache)
 	mem_gpa_free((fatptr_t){ .ptr = cache, .len = sizeof(*cache) });
 }
 
-void init_slab_allocator(void)
+size_t slab_shrink_cache(slab_cache_t *cache)
 {
-	if (slab_initialized)
-		return;
+	if (cache == nullptr || !cache->release_empty)
+		return 0;
+
+	size_t freed = 0;
+	while (cache->empty.next != &cache->empty) {
+		struct slab *slab = list_entry(cache->empty.next, struct slab, list);
+		if (cache->free_objs - slab->capacity < cache->reserve_free)
+			break;
+
+		cache->free_objs -= slab->capacity;
+		slab_release_slab(slab);
+		freed += slab_bytes(cache) / PAGE_SIZE;
+	}
+
+	return freed;
+}
+
+static size_t slab_shrink(size_t nr_pages, void *ctx)
+{
+	(void)ctx;
+
+	if (slab_busy)
+		return 0;
+
+	size_t freed = 0;
+	list_for_each(&slab_caches) {
+		freed += slab_shrink_cache(list_entry(it, struct slab_cache, list));
+		if (freed >= nr_pages)
+			break;
+	}
 
+	return freed;
+}
+
+static struct phy_mem_shrinker slab_shrinker = { .name = "slab", .shrink = slab_shrink };
+
+void init_slab_allocator(void)
+{
 	ensure_initialized();
+	slab_init_size_classes();
+	phy_mem_register_shrinker(&slab_shrinker);
 }
 
-static void slab_init_bootstrap_cache(slab_cache_t *cache, struct slab *slab, const char *name, size_t obj_size, size_t align,
-				      void *buffer, size_t obj_count, bool release_empty)
+static void slab_init_bootstrap_cache(slab_cache_t *cache, struct slab *slab, uint32_t *used_map, const char *name, size_t obj_size,
+				      size_t align, void *buffer, size_t obj_count, bool release_empty)
 {
+	if (obj_count > SLAB_BOOTSTRAP_MAX_OBJS)
+		BUG("bootstrap slab %s has too many objects (%u)", name, obj_count);
+
 	size_t real_align = align == 0 ? sizeof(void *) : align;
 	if (real_align < sizeof(void *))
 		real_align = sizeof(void *);
@@ -502,23 +820,33 @@ static void slab_init_bootstrap_cache(slab_cache_t *cache, struct slab *slab, co
 	cache->name = name;
 	cache->obj_size = aligned_size;
 	cache->align = real_align;
-	cache->objs_per_slab = obj_count;
+	cache->objs_per_slab = slab_objs_per_slab(aligned_size, real_align, PAGE_SIZE, false);
+	cache->order = 0;
+	cache->off_slab = false;
+	cache->hdr_size = slab_header_size(cache->objs_per_slab, real_align);
+	cache->flags = SLAB_NO_COLOR;
+	cache->color_align = real_align;
+	cache->color_count = 1;
+	cache->color_next = 0;
 	cache->free_objs = obj_count;
 	cache->reserve_free = 0;
 	cache->ctor = nullptr;
 	cache->dtor = nullptr;
 	cache->release_empty = release_empty;
+	cache->bootstrap = slab;
 
 	RESET_LIST_ITEM(&cache->partial);
 	RESET_LIST_ITEM(&cache->full);
 	RESET_LIST_ITEM(&cache->empty);
 	RESET_LIST_ITEM(&cache->list);
 
+	slab->magic = SLAB_MAGIC;
 	slab->mem = buffer;
 	slab->len = aligned_size * obj_count;
 	slab->in_use = 0;
 	slab->capacity = obj_count;
 	slab->free_list = nullptr;
+	slab->used_map = used_map;
 	slab->tag = nullptr;
 	slab->cache = cache;
 	RESET_LIST_ITEM(&slab->list);
@@ -547,12 +875,12 @@ void slab_init_tag_caches(mem_malloc_tag_t *malloc_tags, size_t malloc_tag_count
 
 	slab_initialized = true;
 
-	slab_init_bootstrap_cache(&malloc_tag_cache, &malloc_tag_slab, "malloc_tag", sizeof(malloc_tag_t), _Alignof(malloc_tag_t), malloc_tags,
-				  malloc_tag_count, false);
-	slab_init_bootstrap_cache(&phy_mem_tag_cache, &phy_mem_tag_slab, "phy_mem_tag", sizeof(phy_mem_tag_t), _Alignof(phy_mem_tag_t), phy_tags,
-				  phy_tag_count, false);
-	slab_init_bootstrap_cache(&phy_mem_link_cache, &phy_mem_link_slab, "phy_mem_link", sizeof(mem_phy_mem_link_t), _Alignof(mem_phy_mem_link_t),
-				  phy_links, phy_link_count, false);
+	slab_init_bootstrap_cache(&malloc_tag_cache, &malloc_tag_slab, malloc_tag_map, "malloc_tag", sizeof(malloc_tag_t), _Alignof(malloc_tag_t),
+				  malloc_tags, malloc_tag_count, false);
+	slab_init_bootstrap_cache(&phy_mem_tag_cache, &phy_mem_tag_slab, phy_mem_tag_map, "phy_mem_tag", sizeof(phy_mem_tag_t), _Alignof(phy_mem_tag_t),
+				  phy_tags, phy_tag_count, false);
+	slab_init_bootstrap_cache(&phy_mem_link_cache, &phy_mem_link_slab, phy_mem_link_map, "phy_mem_link", sizeof(mem_phy_mem_link_t),
+				  _Alignof(mem_phy_mem_link_t), phy_links, phy_link_count, false);
 
 	slab_set_cache_reserve(&malloc_tag_cache, 10);
 	slab_set_cache_reserve(&phy_mem_tag_cache, 10);
@@ -598,11 +926,24 @@ static fatptr_t slab_general_alloc(size_t req)
 	if (req == 0)
 		return (fatptr_t){ .ptr = nullptr, .len = 0 };
 
-	if (req > PAGE_SIZE)
+	if (req > SLAB_GENERAL_MAX_SIZE)
 		return mem_gpa_alloc(req);
 
-	slab_cache_t *cache = slab_find_or_create_cache(align_up(req, sizeof(void *)));
-	return slab_alloc_obj(cache);
+	if (!size_classes_ready)
+		slab_init_size_classes();
+
+	struct slab_size_class *class = &slab_size_classes[slab_size_to_class(req)];
+	fatptr_t obj = slab_alloc_obj(class->cache);
+	if (obj.ptr == nullptr)
+		return obj;
+
+	class->live_objs += 1;
+	class->live_req_bytes += req;
+	class->total_allocs += 1;
+
+	// Like the GPA, hand back the requested length, the free path maps
+	// it to the same class again
+	return (fatptr_t){ .ptr = obj.ptr, .len = req };
 }
 
 static void slab_general_free(fatptr_t fatptr)
@@ -613,13 +954,34 @@ static void slab_general_free(fatptr_t fatptr)
 	if (fatptr.ptr == nullptr || fatptr.len == 0)
 		return;
 
-	if (fatptr.len > PAGE_SIZE) {
+	if (fatptr.len > SLAB_GENERAL_MAX_SIZE) {
 		mem_gpa_free(fatptr);
 		return;
 	}
 
-	slab_cache_t *cache = slab_find_or_create_cache(align_up(fatptr.len, sizeof(void *)));
-	slab_free_obj(cache, fatptr);
+	if (!size_classes_ready)
+		return;
+
+	struct slab_size_class *class = &slab_size_classes[slab_size_to_class(fatptr.len)];
+	if (!slab_free_obj(class->cache, fatptr))
+		return;
+
+	class->live_objs -= 1;
+	class->live_req_bytes -= fatptr.len;
+}
+
+void slab_report_fragmentation(void)
+{
+	mprint("size class | live objs | requested | wasted | waste pct | total allocs\n");
+	for (size_t i = 0; i < SLAB_SIZE_CLASS_COUNT; i++) {
+		const struct slab_size_class *class = &slab_size_classes[i];
+		const size_t reserved = class->live_objs * class->size;
+		const size_t wasted = reserved - class->live_req_bytes;
+		const size_t waste_pct = reserved == 0 ? 0 : (wasted * 100) / reserved;
+
+		mprint("%u | %u | %u | %u | %u | %u\n", class->size, class->live_objs, class->live_req_bytes, wasted, waste_pct,
+		       class->total_allocs);
+	}
 }
 
 allocator_t get_slab_allocator(void)
@@ -1,20 +1,44 @@
 #include <kernel/storage.h>
 
 #include <kernel/allocator.h>
+#include <kernel/bcache.h>
 #include <kernel/display.h>
 
 #include "../arch/i386/ahci.h"
+#include "../arch/i386/ata_dma.h"
 #include "../arch/i386/ata_pio.h"
 #include "../arch/i386/pci.h"
 
 #include <list.h>
+#include <string.h>
 
 MODULE("storage")
 
-#define STORAGE_MAX_DEVICES (AHCI_MAX_PORTS + 4u)
+#define STORAGE_MAX_DEVICES (AHCI_MAX_PORT_INDEX + 4u)
+
+// The PIO driver only speaks 28-bit LBA and a one byte sector count
+#define STORAGE_PIO_MAX_LBA (1ull << 28)
+#define STORAGE_PIO_MAX_SECTORS 256u
+
+#define STORAGE_SECTOR_SIZE 512u
+// Largest command built out of merged requests
+#define STORAGE_MERGE_MAX_SECTORS 128u
+// A plugged queue is dispatched anyway once it holds this many requests
+#define STORAGE_QUEUE_MAX_DEPTH 64u
+
+struct storage_queue {
+	const struct storage_device *device;
+	struct list_head pending; // sorted by lba
+	size_t depth;
+	size_t plugged;
+	// End of the last dispatched command, the elevator continues from here
+	uint64_t head_lba;
+	struct storage_stats stats;
+};
 
 struct storage_device_entry {
 	struct storage_device device;
+	struct storage_queue queue;
 	struct list_head list;
 };
 
@@ -49,6 +73,9 @@ static bool storage_register_device(struct storage_device device)
 
 	struct storage_device_entry *entry = entry_ptr.ptr;
 	entry->device = device;
+	entry->device.queue = &entry->queue;
+	entry->queue = (struct storage_queue){ .device = &entry->device };
+	RESET_LIST_ITEM(&entry->queue.pending);
 	RESET_LIST_ITEM(&entry->list);
 	list_add(&entry->list, &storage_devices_list);
 	storage_devices_count++;
@@ -59,7 +86,7 @@ static void storage_init_cache()
 {
 	if (storage_device_cache == nullptr) {
 		storage_device_cache = slab_create("storage_device", sizeof(struct storage_device_entry),
-						   alignof(struct storage_device_entry), nullptr, nullptr);
+						   alignof(struct storage_device_entry), SLAB_HWCACHE_ALIGN, nullptr, nullptr);
 		if (storage_device_cache == nullptr) {
 			mprint("Storage: failed to allocate device cache\n");
 			return;
@@ -74,7 +101,8 @@ static void storage_try_ahci_init()
 	}
 
 	ahci_init();
-	for (uint8_t port = 0; port < AHCI_MAX_PORTS; port++) {
+	// Every port of every HBA is its own device with its own queue
+	for (uint8_t port = 0; port < AHCI_MAX_PORT_INDEX; port++) {
 		if (!ahci_port_is_active(port))
 			continue;
 
@@ -86,7 +114,7 @@ static void storage_try_ahci_init()
 	}
 }
 
-static void storage_try_register_ide_dev()
+static void storage_try_register_ide_dev(bool dma)
 {
 	uint8_t channels[] = { 0, 0, 1, 1 };
 	uint8_t drives[] = { 0, 1, 0, 1 };
@@ -95,8 +123,14 @@ static void storage_try_register_ide_dev()
 		if (devtype == ATADEV_UNKNOWN)
 			continue;
 
+		bool is_ata = devtype == ATADEV_PATA || devtype == ATADEV_SATA;
+		if (is_ata)
+			ata_pio_setup_multiple(channels[i], drives[i]);
+
+		// PIO stays the fallback for packet devices and channels without a bus master engine
+		bool use_dma = dma && ata_dma_available(channels[i]) && is_ata;
 		struct storage_device device = {
-			.backend = STORAGE_BACKEND_ATA_PIO,
+			.backend = use_dma ? STORAGE_BACKEND_ATA_DMA : STORAGE_BACKEND_ATA_PIO,
 			.channel = channels[i],
 			.drive = drives[i],
 		};
@@ -107,6 +141,7 @@ static void storage_try_register_ide_dev()
 void storage_init(void)
 {
 	storage_init_cache();
+	bcache_init();
 
 	storage_clear_devices();
 
@@ -125,9 +160,10 @@ void storage_init(void)
 	pci_enable_bus_mastering(&ide);
 	ide_initialize(ide.bar[0], ide.bar[1], ide.bar[2], ide.bar[3], ide.bar[4]);
 
-	storage_try_register_ide_dev();
+	bool dma = ata_dma_init(&ide);
+	storage_try_register_ide_dev(dma);
 	if (storage_devices_count > 0) {
-		mprint("Storage: ATA PIO enabled (%zu drives)\n", storage_devices_count);
+		mprint("Storage: ATA %s enabled (%u drives)\n", dma ? "DMA" : "PIO", storage_devices_count);
 		return;
 	}
 
@@ -159,32 +195,315 @@ bool storage_get_device(size_t device_index, struct storage_device *out_device)
 	return false;
 }
 
-bool storage_read_device(const struct storage_device *device, uint32_t lba_addr, uint16_t sector_count, void *dest)
+bool storage_same_device(const struct storage_device *a, const struct storage_device *b)
 {
-	if (device == nullptr)
-		return false;
+	return a->backend == b->backend && a->ahci_port == b->ahci_port && a->channel == b->channel && a->drive == b->drive;
+}
 
+size_t storage_max_sectors(const struct storage_device *device)
+{
 	switch (device->backend) {
 	case STORAGE_BACKEND_AHCI:
-		return ahci_read28_port(device->ahci_port, lba_addr, sector_count, dest);
+		return AHCI_MAX_CMD_SECTORS;
 	case STORAGE_BACKEND_ATA_PIO:
-		return ata_pio_28_read(device->channel, device->drive, lba_addr, sector_count, dest);
+		return STORAGE_PIO_MAX_SECTORS;
+	case STORAGE_BACKEND_ATA_DMA:
+		return ATA_DMA_MAX_SECTORS;
 	default:
-		return false;
+		return 1;
 	}
 }
 
-bool storage_write_device(const struct storage_device *device, uint32_t lba_addr, uint16_t sector_count, const void *src)
+static bool storage_pio_transfer(const struct storage_device *device, uint64_t lba, size_t sector_count, uint8_t *buffer, bool write)
 {
-	if (device == nullptr)
+	if (lba + sector_count > STORAGE_PIO_MAX_LBA)
 		return false;
 
+	while (sector_count > 0) {
+		uint16_t count = sector_count < STORAGE_PIO_MAX_SECTORS ? (uint16_t)sector_count : STORAGE_PIO_MAX_SECTORS;
+		bool ok = write ? ata_pio_28_write(device->channel, device->drive, (uint32_t)lba, count, buffer)
+				: ata_pio_28_read(device->channel, device->drive, (uint32_t)lba, count, buffer);
+		if (!ok)
+			return false;
+
+		lba += count;
+		buffer += (size_t)count * 512;
+		sector_count -= count;
+	}
+
+	return true;
+}
+
+static bool storage_backend_transfer(const struct storage_device *device, uint64_t lba, size_t sector_count, void *buffer, bool write)
+{
 	switch (device->backend) {
 	case STORAGE_BACKEND_AHCI:
-		return ahci_write28_port(device->ahci_port, lba_addr, sector_count, src);
+		return write ? ahci_write_port(device->ahci_port, lba, sector_count, buffer)
+			     : ahci_read_port(device->ahci_port, lba, sector_count, buffer);
 	case STORAGE_BACKEND_ATA_PIO:
-		return ata_pio_28_write(device->channel, device->drive, lba_addr, sector_count, src);
+		return storage_pio_transfer(device, lba, sector_count, buffer, write);
+	case STORAGE_BACKEND_ATA_DMA:
+		return write ? ata_dma_write(device->channel, device->drive, lba, sector_count, buffer)
+			     : ata_dma_read(device->channel, device->drive, lba, sector_count, buffer);
 	default:
 		return false;
 	}
 }
+
+static uint64_t storage_request_end(const struct storage_request *req)
+{
+	return req->lba + req->sector_count;
+}
+
+static void storage_complete(struct storage_request *req, bool ok)
+{
+	req->ok = ok;
+	req->done = true;
+	if (req->done_cb != nullptr)
+		req->done_cb(req, req->ctx);
+}
+
+// Reads may overlap each other, anything involving a write has to keep its order
+static bool storage_queue_conflicts(const struct storage_queue *queue, const struct storage_request *req)
+{
+	list_for_each(&queue->pending) {
+		const struct storage_request *other = list_entry(it, struct storage_request, list);
+		if (!other->write && !req->write)
+			continue;
+		if (other->lba < storage_request_end(req) && req->lba < storage_request_end(other))
+			return true;
+	}
+
+	return false;
+}
+
+static void storage_queue_insert(struct storage_queue *queue, struct storage_request *req)
+{
+	struct list_head *pos = queue->pending.prev;
+	while (pos != &queue->pending && list_entry(pos, struct storage_request, list)->lba > req->lba)
+		pos = pos->prev;
+
+	list_add(&req->list, pos);
+	queue->depth++;
+}
+
+// C-LOOK: the first request at or past the head, wrapping to the lowest lba
+static struct storage_request *storage_queue_next(struct storage_queue *queue)
+{
+	list_for_each(&queue->pending) {
+		struct storage_request *req = list_entry(it, struct storage_request, list);
+		if (req->lba >= queue->head_lba)
+			return req;
+	}
+
+	return list_first_entry(&queue->pending, struct storage_request, list);
+}
+
+static bool storage_can_merge(const struct storage_request *req, uint64_t start, uint64_t end, bool write)
+{
+	if (req->write != write)
+		return false;
+	if (write ? req->lba != end : req->lba > end)
+		return false;
+
+	uint64_t new_end = storage_request_end(req) > end ? storage_request_end(req) : end;
+	return new_end - start <= STORAGE_MERGE_MAX_SECTORS;
+}
+
+// Every request of the run lays where the first one's buffer says it should
+static bool storage_run_is_contiguous(struct list_head *run, const struct storage_request *first)
+{
+	uint8_t *base = first->buffer;
+	list_for_each(run) {
+		const struct storage_request *req = list_entry(it, struct storage_request, list);
+		if ((uint8_t *)req->buffer != base + (size_t)(req->lba - first->lba) * STORAGE_SECTOR_SIZE)
+			return false;
+	}
+
+	return true;
+}
+
+static void storage_copy_run(struct list_head *run, uint64_t start, uint8_t *bounce, bool to_bounce)
+{
+	list_for_each(run) {
+		struct storage_request *req = list_entry(it, struct storage_request, list);
+		uint8_t *slice = bounce + (size_t)(req->lba - start) * STORAGE_SECTOR_SIZE;
+		size_t bytes = req->sector_count * STORAGE_SECTOR_SIZE;
+		if (to_bounce)
+			memcpy(slice, req->buffer, bytes);
+		else
+			memcpy(req->buffer, slice, bytes);
+	}
+}
+
+// The run is off the queue before completing, callbacks are free to submit again
+static void storage_complete_run(struct list_head *run, bool ok)
+{
+	while (run->next != run) {
+		struct storage_request *req = list_first_entry(run, struct storage_request, list);
+		list_rm(&req->list);
+		RESET_LIST_ITEM(&req->list);
+		storage_complete(req, ok);
+	}
+}
+
+static bool storage_transfer_bounced(const struct storage_device *device, struct list_head *run, uint64_t start, uint64_t end,
+				     bool write, bool *ok)
+{
+	allocator_t gpa_alloc = get_gpa_allocator();
+	fatptr_t bounce = gpa_alloc.alloc((size_t)(end - start) * STORAGE_SECTOR_SIZE);
+	if (bounce.ptr == nullptr)
+		return false;
+
+	if (write)
+		storage_copy_run(run, start, bounce.ptr, true);
+	*ok = storage_backend_transfer(device, start, end - start, bounce.ptr, write);
+	if (*ok && !write)
+		storage_copy_run(run, start, bounce.ptr, false);
+
+	gpa_alloc.free(bounce);
+	return true;
+}
+
+// Issue one command for the run of mergeable requests starting at first
+static void storage_dispatch_run(struct storage_queue *queue, struct storage_request *first)
+{
+	LIST_HEAD(run);
+	uint64_t start = first->lba;
+	uint64_t end = storage_request_end(first);
+	bool write = first->write;
+	size_t count = 0;
+
+	struct storage_request *req = first;
+	while (true) {
+		bool last = list_is_last(&req->list, &queue->pending);
+		struct storage_request *next = last ? nullptr : list_next_entry(req, list);
+
+		list_rm(&req->list);
+		list_add(&req->list, run.prev);
+		queue->depth--;
+		count++;
+		if (storage_request_end(req) > end)
+			end = storage_request_end(req);
+
+		if (next == nullptr || !storage_can_merge(next, start, end, write))
+			break;
+		req = next;
+	}
+
+	queue->head_lba = end;
+	queue->stats.commands++;
+
+	bool ok = false;
+	if (count == 1 || storage_run_is_contiguous(&run, first)) {
+		ok = storage_backend_transfer(queue->device, start, end - start, first->buffer, write);
+	} else if (!storage_transfer_bounced(queue->device, &run, start, end, write, &ok)) {
+		// No memory to gather the run, fall back to one command per request
+		queue->stats.commands += count - 1;
+		while (run.next != &run) {
+			req = list_first_entry(&run, struct storage_request, list);
+			list_rm(&req->list);
+			RESET_LIST_ITEM(&req->list);
+			storage_complete(req, storage_backend_transfer(queue->device, req->lba, req->sector_count, req->buffer, write));
+		}
+		return;
+	}
+
+	queue->stats.merges += count - 1;
+	storage_complete_run(&run, ok);
+}
+
+static void storage_queue_run(struct storage_queue *queue)
+{
+	while (queue->depth > 0)
+		storage_dispatch_run(queue, storage_queue_next(queue));
+}
+
+void storage_submit(const struct storage_device *device, struct storage_request *req)
+{
+	req->done = false;
+	req->ok = false;
+	RESET_LIST_ITEM(&req->list);
+
+	if (device == nullptr) {
+		storage_complete(req, false);
+		return;
+	}
+	if (req->sector_count == 0) {
+		storage_complete(req, true);
+		return;
+	}
+
+	struct storage_queue *queue = device->queue;
+	if (queue == nullptr) {
+		storage_complete(req, storage_backend_transfer(device, req->lba, req->sector_count, req->buffer, req->write));
+		return;
+	}
+
+	if (storage_queue_conflicts(queue, req))
+		storage_queue_run(queue);
+
+	storage_queue_insert(queue, req);
+	queue->stats.requests++;
+
+	if (queue->plugged == 0 || queue->depth >= STORAGE_QUEUE_MAX_DEPTH)
+		storage_queue_run(queue);
+}
+
+bool storage_wait(const struct storage_device *device, struct storage_request *req)
+{
+	if (!req->done && device != nullptr && device->queue != nullptr)
+		storage_queue_run(device->queue);
+
+	return req->ok;
+}
+
+void storage_plug(const struct storage_device *device)
+{
+	if (device != nullptr && device->queue != nullptr)
+		device->queue->plugged++;
+}
+
+void storage_unplug(const struct storage_device *device)
+{
+	if (device == nullptr || device->queue == nullptr || device->queue->plugged == 0)
+		return;
+
+	if (--device->queue->plugged == 0)
+		storage_queue_run(device->queue);
+}
+
+void storage_get_stats(const struct storage_device *device, struct storage_stats *out)
+{
+	if (out == nullptr)
+		return;
+
+	if (device == nullptr || device->queue == nullptr) {
+		*out = (struct storage_stats){ 0 };
+		return;
+	}
+
+	*out = device->queue->stats;
+}
+
+void storage_reset_stats(const struct storage_device *device)
+{
+	if (device != nullptr && device->queue != nullptr)
+		device->queue->stats = (struct storage_stats){ 0 };
+}
+
+bool storage_read_device(const struct storage_device *device, uint64_t lba, size_t sector_count, void *dest)
+{
+	struct storage_request req = { .lba = lba, .sector_count = sector_count, .buffer = dest };
+
+	storage_submit(device, &req);
+	return storage_wait(device, &req);
+}
+
+bool storage_write_device(const struct storage_device *device, uint64_t lba, size_t sector_count, const void *src)
+{
+	struct storage_request req = { .lba = lba, .sector_count = sector_count, .buffer = (void *)src, .write = true };
+
+	storage_submit(device, &req);
+	return storage_wait(device, &req);
+}
@@ -0,0 +1,561 @@
+#include <kernel/vfs.h>
+
+#include <kernel/allocator.h>
+#include <kernel/display.h>
+#include <kernel/ext2.h>
+#include <kernel/fat16.h>
+#include <kernel/pcache.h>
+
+#include <list.h>
+#include <string.h>
+
+MODULE("vfs")
+
+// Readahead windows, in pages. The first one follows a sequential miss,
+// every window after it doubles up to the cap, 128 KiB or two merged
+// commands of the storage queue.
+#define VFS_RA_INIT_PAGES 4u
+#define VFS_RA_MAX_PAGES 32u
+
+struct vfs_file {
+	struct vnode *vnode;
+	size_t pos;
+	struct vfs_readahead ra;
+	// The device queue is held plugged from the first readahead until the
+	// file is closed, the windows stay queued, sorted and merged, until a
+	// read has to wait for one of their pages
+	bool plugged;
+	bool used;
+};
+
+static struct vfs_mount vfs_mounts[VFS_MAX_MOUNTS];
+static struct vfs_file vfs_files[VFS_MAX_FILES];
+static slab_cache_t *vfs_vnode_cache = nullptr;
+
+// Probed in order, ext2 first, its superblock magic is the stricter test
+static const struct vfs_fs_type *const vfs_fs_types[] = { &ext2_vfs_type, &fat16_vfs_type };
+
+void vfs_init(void)
+{
+	if (vfs_vnode_cache != nullptr)
+		return;
+
+	vfs_vnode_cache = slab_create("vnode", sizeof(struct vnode), alignof(struct vnode), 0, nullptr, nullptr);
+	if (vfs_vnode_cache == nullptr || !pcache_init())
+		mprint("failed to create the vnode and page caches\n");
+}
+
+// Copy path without its trailing slashes, "/" becomes ""
+static bool vfs_mount_path(const char *path, char out[VFS_MOUNT_PATH_MAX], size_t *out_len)
+{
+	if (path == nullptr || path[0] != '/')
+		return false;
+
+	size_t len = strlen(path);
+	while (len > 0 && path[len - 1] == '/')
+		len--;
+	if (len >= VFS_MOUNT_PATH_MAX)
+		return false;
+
+	memcpy(out, path, len);
+	out[len] = '\0';
+	*out_len = len;
+	return true;
+}
+
+static struct vfs_mount *vfs_find_mount_exact(const char *path, size_t len)
+{
+	for (size_t i = 0; i < VFS_MAX_MOUNTS; i++) {
+		struct vfs_mount *mount = &vfs_mounts[i];
+		if (mount->used && mount->path_len == len && memcmp(mount->path, path, len) == 0)
+			return mount;
+	}
+
+	return nullptr;
+}
+
+// The mount with the longest path that is a prefix of path, *out_rest is
+// what is left of path inside it
+static struct vfs_mount *vfs_find_mount(const char *path, const char **out_rest)
+{
+	struct vfs_mount *best = nullptr;
+	for (size_t i = 0; i < VFS_MAX_MOUNTS; i++) {
+		struct vfs_mount *mount = &vfs_mounts[i];
+		if (!mount->used || (best != nullptr && mount->path_len <= best->path_len))
+			continue;
+		if (memcmp(mount->path, path, mount->path_len) != 0)
+			continue;
+		if (path[mount->path_len] != '/' && path[mount->path_len] != '\0')
+			continue;
+
+		best = mount;
+	}
+
+	if (best != nullptr)
+		*out_rest = path[best->path_len] == '\0' ? "/" : path + best->path_len;
+	return best;
+}
+
+// Attach at path with the first of types that recognises device
+static bool vfs_attach(const char *path, const struct storage_device *device, const struct vfs_fs_type *const *types, size_t type_count)
+{
+	char mount_path[VFS_MOUNT_PATH_MAX];
+	size_t len = 0;
+	if (!vfs_mount_path(path, mount_path, &len))
+		return false;
+
+	vfs_init();
+	if (vfs_vnode_cache == nullptr || vfs_find_mount_exact(mount_path, len) != nullptr)
+		return false;
+
+	struct vfs_mount *mount = nullptr;
+	for (size_t i = 0; i < VFS_MAX_MOUNTS && mount == nullptr; i++) {
+		if (!vfs_mounts[i].used)
+			mount = &vfs_mounts[i];
+	}
+	if (mount == nullptr)
+		return false;
+
+	*mount = (struct vfs_mount){ .path_len = len };
+	if (device != nullptr)
+		mount->device = *device;
+	memcpy(mount->path, mount_path, len + 1);
+	RESET_LIST_ITEM(&mount->vnodes);
+
+	for (size_t i = 0; i < type_count; i++) {
+		mount->type = types[i];
+		if (mount->type->mount(mount)) {
+			mount->used = true;
+			mprint("%s mounted at %s\n", mount->type->name, len == 0 ? "/" : mount->path);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool vfs_mount(const char *path, const struct storage_device *device)
+{
+	return device != nullptr && vfs_attach(path, device, vfs_fs_types, sizeof(vfs_fs_types) / sizeof(vfs_fs_types[0]));
+}
+
+bool vfs_mount_type(const char *path, const struct vfs_fs_type *type, const struct storage_device *device)
+{
+	return type != nullptr && vfs_attach(path, device, &type, 1);
+}
+
+static void vfs_free_vnode(struct vnode *vnode)
+{
+	pcache_drop_vnode(vnode);
+	vnode->ops->release(vnode);
+	list_rm(&vnode->list);
+	vnode->mount->vnode_count--;
+	slab_free_obj(vfs_vnode_cache, (fatptr_t){ .ptr = vnode, .len = sizeof(*vnode) });
+}
+
+bool vfs_unmount(const char *path)
+{
+	char mount_path[VFS_MOUNT_PATH_MAX];
+	size_t len = 0;
+	if (!vfs_mount_path(path, mount_path, &len))
+		return false;
+
+	struct vfs_mount *mount = vfs_find_mount_exact(mount_path, len);
+	if (mount == nullptr)
+		return false;
+
+	list_for_each(&mount->vnodes) {
+		if (list_entry(it, struct vnode, list)->refcount > 0)
+			return false;
+	}
+
+	while (mount->vnodes.next != &mount->vnodes)
+		vfs_free_vnode(list_entry(mount->vnodes.next, struct vnode, list));
+
+	mount->type->unmount(mount);
+	mount->used = false;
+	return true;
+}
+
+// Drop the least recently opened vnode nobody has open, with its pages
+static void vfs_evict_vnode(struct vfs_mount *mount)
+{
+	list_rev_for_each(&mount->vnodes) {
+		struct vnode *vnode = list_entry(it, struct vnode, list);
+		if (vnode->refcount == 0) {
+			vfs_free_vnode(vnode);
+			return;
+		}
+	}
+}
+
+void vfs_invalidate(struct vfs_mount *mount, uint64_t id)
+{
+	struct list_head *pos = mount->vnodes.next;
+	while (pos != &mount->vnodes) {
+		struct vnode *vnode = list_entry(pos, struct vnode, list);
+		pos = pos->next;
+		if (vnode->id != id)
+			continue;
+
+		if (vnode->refcount == 0)
+			vfs_free_vnode(vnode);
+		else
+			vnode->stale = true;
+	}
+}
+
+// Drop an open file's or a mapping's hold on vnode
+static void vfs_put_vnode(struct vnode *vnode)
+{
+	if (--vnode->refcount == 0 && vnode->stale)
+		vfs_free_vnode(vnode);
+}
+
+// The vnode of path, the cached one if the file was opened before
+static struct vnode *vfs_get_vnode(struct vfs_mount *mount, const char *path)
+{
+	struct vnode found = { .mount = mount };
+	if (!mount->type->lookup(mount, path, &found))
+		return nullptr;
+
+	list_for_each(&mount->vnodes) {
+		struct vnode *vnode = list_entry(it, struct vnode, list);
+		if (vnode->id != found.id || vnode->is_dir != found.is_dir || vnode->stale)
+			continue;
+
+		found.ops->release(&found);
+		list_mv(&vnode->list, &mount->vnodes);
+		return vnode;
+	}
+
+	if (mount->vnode_count >= VFS_MAX_VNODES)
+		vfs_evict_vnode(mount);
+
+	fatptr_t obj = slab_alloc_obj(vfs_vnode_cache);
+	if (obj.ptr == nullptr) {
+		found.ops->release(&found);
+		return nullptr;
+	}
+
+	struct vnode *vnode = obj.ptr;
+	*vnode = found;
+	RESET_LIST_ITEM(&vnode->pages);
+	list_add(&vnode->list, &mount->vnodes);
+	mount->vnode_count++;
+	return vnode;
+}
+
+static struct vfs_file *vfs_get_file(int fd)
+{
+	if (fd < 0 || fd >= VFS_MAX_FILES || !vfs_files[fd].used)
+		return nullptr;
+
+	return &vfs_files[fd];
+}
+
+int vfs_open(const char *path)
+{
+	if (path == nullptr || path[0] != '/')
+		return -1;
+
+	const char *rest = nullptr;
+	struct vfs_mount *mount = vfs_find_mount(path, &rest);
+	if (mount == nullptr)
+		return -1;
+
+	int fd = 0;
+	while (fd < VFS_MAX_FILES && vfs_files[fd].used)
+		fd++;
+	if (fd == VFS_MAX_FILES)
+		return -1;
+
+	struct vnode *vnode = vfs_get_vnode(mount, rest);
+	if (vnode == nullptr || vnode->is_dir)
+		return -1;
+
+	vnode->refcount++;
+	vfs_files[fd] = (struct vfs_file){ .vnode = vnode, .ra = { .prev_page = SIZE_MAX, .async_page = SIZE_MAX }, .used = true };
+	return fd;
+}
+
+bool vfs_close(int fd)
+{
+	struct vfs_file *file = vfs_get_file(fd);
+	if (file == nullptr)
+		return false;
+
+	// Readahead still queued goes out now, its pages stay cached
+	if (file->plugged)
+		storage_unplug(&file->vnode->mount->device);
+
+	vfs_put_vnode(file->vnode);
+	*file = (struct vfs_file){ 0 };
+	return true;
+}
+
+// Called before page index is read. A miss that continues the previous
+// read starts a window at it, reaching the marker page of a window queues
+// the next one, twice as large. Random reads only read what they ask for.
+// The device queue is held plugged from the first window on, *plugged
+// tells the caller to unplug it when done.
+static void vfs_readahead(struct vnode *vnode, struct vfs_readahead *ra, bool *plugged, size_t index)
+{
+	const bool cached = pcache_contains(vnode, index);
+	if (cached && index != ra->async_page)
+		return;
+
+	if (index != ra->prev_page + 1 && index != ra->prev_page) {
+		ra->size = 0;
+		ra->async_page = SIZE_MAX;
+		return;
+	}
+
+	size_t size = ra->size == 0 ? VFS_RA_INIT_PAGES : ra->size * 2;
+	if (size > VFS_RA_MAX_PAGES)
+		size = VFS_RA_MAX_PAGES;
+	const size_t start = cached ? ra->start + ra->size : index;
+
+	ra->async_page = SIZE_MAX;
+	if (start >= (vnode->size + PAGE_SIZE - 1) / PAGE_SIZE)
+		return;
+
+	ra->start = start;
+	ra->size = size;
+	// A window from a miss is already being read, the next one is queued a
+	// page in; later windows are queued as the reader reaches them
+	ra->async_page = cached ? start : index + 1;
+
+	if (!*plugged) {
+		storage_plug(&vnode->mount->device);
+		*plugged = true;
+	}
+	pcache_readahead(vnode, start, size);
+}
+
+bool vfs_read(int fd, void *buffer, size_t len, size_t *out_bytes)
+{
+	struct vfs_file *file = vfs_get_file(fd);
+	if (file == nullptr || (buffer == nullptr && len > 0))
+		return false;
+
+	if (out_bytes)
+		*out_bytes = 0;
+
+	struct vnode *vnode = file->vnode;
+	uint8_t *out = buffer;
+	size_t done = 0;
+	// A memory resident file is copied in one go, without the page cache
+	if (vnode->data != nullptr && file->pos < vnode->size) {
+		done = vnode->size - file->pos < len ? vnode->size - file->pos : len;
+		memcpy(out, vnode->data + file->pos, done);
+		file->pos += done;
+	}
+
+	while (vnode->data == nullptr && done < len && file->pos < vnode->size) {
+		const size_t index = file->pos / PAGE_SIZE;
+		const size_t in_page = file->pos % PAGE_SIZE;
+		size_t chunk = PAGE_SIZE - in_page;
+		if (chunk > len - done)
+			chunk = len - done;
+		if (chunk > vnode->size - file->pos)
+			chunk = vnode->size - file->pos;
+
+		vfs_readahead(vnode, &file->ra, &file->plugged, index);
+		struct pcache_page *page = pcache_get(vnode, index);
+		if (page == nullptr)
+			break;
+
+		memcpy(out + done, page->data + in_page, chunk);
+		pcache_put(page);
+
+		file->ra.prev_page = index;
+		file->pos += chunk;
+		done += chunk;
+	}
+
+	if (out_bytes)
+		*out_bytes = done;
+	return done == len || file->pos >= vnode->size;
+}
+
+bool vfs_seek(int fd, int64_t offset, enum vfs_whence whence, size_t *out_pos)
+{
+	struct vfs_file *file = vfs_get_file(fd);
+	if (file == nullptr)
+		return false;
+
+	int64_t base = 0;
+	switch (whence) {
+	case VFS_SEEK_SET:
+		base = 0;
+		break;
+	case VFS_SEEK_CUR:
+		base = (int64_t)file->pos;
+		break;
+	case VFS_SEEK_END:
+		base = (int64_t)file->vnode->size;
+		break;
+	default:
+		return false;
+	}
+
+	// Past the end is fine, reads there return nothing
+	int64_t pos = base + offset;
+	if (pos < 0 || (uint64_t)pos > SIZE_MAX)
+		return false;
+
+	file->pos = (size_t)pos;
+	if (out_pos)
+		*out_pos = file->pos;
+	return true;
+}
+
+bool vfs_file_size(int fd, size_t *out_size)
+{
+	struct vfs_file *file = vfs_get_file(fd);
+	if (file == nullptr || out_size == nullptr)
+		return false;
+
+	*out_size = file->vnode->size;
+	return true;
+}
+
+// A vfs_mmap() range. Each present page of it is a page cache page, kept
+// referenced so it cannot be evicted while mapped.
+struct vfs_mapping {
+	struct vnode *vnode;
+	void *addr;
+	struct vmm_entry *range; // nullptr for a memory resident file, mapped already
+	size_t first_page; // file page index at range->ptr
+	size_t page_count;
+	struct pcache_page **pages; // nullptr until the page is faulted in
+	struct vfs_readahead ra;
+	bool plugged;
+	struct vmm_fault_handler fault;
+	struct list_head list;
+};
+
+static LIST_HEAD(vfs_mappings);
+
+static bool vfs_mmap_fault(void *addr, uint32_t error, void *ctx)
+{
+	struct vfs_mapping *map = ctx;
+	// Read only, and a present page never faults for a read
+	if (error & (VMM_FAULT_WRITE | VMM_FAULT_PRESENT))
+		return false;
+
+	const size_t slot = (size_t)((uint8_t *)addr - (uint8_t *)map->range->ptr) / PAGE_SIZE;
+	const size_t index = map->first_page + slot;
+	if (slot >= map->page_count || map->pages[slot] != nullptr || (uint64_t)index * PAGE_SIZE >= map->vnode->size)
+		return false;
+
+	vfs_readahead(map->vnode, &map->ra, &map->plugged, index);
+	struct pcache_page *page = pcache_get(map->vnode, index);
+	if (page == nullptr)
+		return false;
+
+	map->ra.prev_page = index;
+	map->pages[slot] = page;
+	map_page(vmm_phy_addr(page->data), (uint8_t *)map->range->ptr + slot * PAGE_SIZE, map->range->flags);
+	return true;
+}
+
+void *vfs_mmap(int fd, size_t offset, size_t len)
+{
+	struct vfs_file *file = vfs_get_file(fd);
+	if (file == nullptr || len == 0 || offset % PAGE_SIZE != 0 || offset >= file->vnode->size)
+		return nullptr;
+
+	allocator_t gpa_alloc = get_gpa_allocator();
+	if (file->vnode->data != nullptr) {
+		if (len > file->vnode->size - offset)
+			return nullptr;
+
+		fatptr_t obj = gpa_alloc.alloc(sizeof(struct vfs_mapping));
+		if (obj.ptr == nullptr)
+			return nullptr;
+
+		struct vfs_mapping *map = obj.ptr;
+		*map = (struct vfs_mapping){ .vnode = file->vnode, .addr = (void *)(file->vnode->data + offset) };
+		map->vnode->refcount++;
+		list_add(&map->list, &vfs_mappings);
+		return map->addr;
+	}
+
+	const size_t page_count = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	fatptr_t obj = gpa_alloc.alloc(sizeof(struct vfs_mapping));
+	fatptr_t pages = gpa_alloc.alloc(page_count * sizeof(struct pcache_page *));
+	struct vmm_entry *range = vmm_alloc(page_count * PAGE_SIZE, VMM_PAGE_FLAG_PRESENT_BIT);
+	if (obj.ptr == nullptr || pages.ptr == nullptr || range == nullptr) {
+		if (obj.ptr != nullptr)
+			gpa_alloc.free(obj);
+		if (pages.ptr != nullptr)
+			gpa_alloc.free(pages);
+		if (range != nullptr)
+			vmm_free(range->ptr);
+		return nullptr;
+	}
+
+	struct vfs_mapping *map = obj.ptr;
+	*map = (struct vfs_mapping){
+		.vnode = file->vnode,
+		.addr = range->ptr,
+		.range = range,
+		.first_page = offset / PAGE_SIZE,
+		.page_count = page_count,
+		.pages = pages.ptr,
+		.ra = { .prev_page = SIZE_MAX, .async_page = SIZE_MAX },
+		.fault = { .start = range->ptr, .size = range->size, .fault = vfs_mmap_fault },
+	};
+	map->fault.ctx = map;
+	memset(map->pages, 0, page_count * sizeof(struct pcache_page *));
+
+	// The mapping keeps the vnode, and so the mount, busy past the close of fd
+	map->vnode->refcount++;
+	list_add(&map->list, &vfs_mappings);
+	vmm_register_fault_handler(&map->fault);
+	return range->ptr;
+}
+
+bool vfs_munmap(void *addr)
+{
+	struct vfs_mapping *map = nullptr;
+	list_for_each(&vfs_mappings) {
+		struct vfs_mapping *cur = list_entry(it, struct vfs_mapping, list);
+		if (cur->addr == addr) {
+			map = cur;
+			break;
+		}
+	}
+	if (map == nullptr)
+		return false;
+
+	list_rm(&map->list);
+	allocator_t gpa_alloc = get_gpa_allocator();
+	if (map->range == nullptr) {
+		vfs_put_vnode(map->vnode);
+		gpa_alloc.free((fatptr_t){ .ptr = map, .len = sizeof(*map) });
+		return true;
+	}
+
+	vmm_unregister_fault_handler(&map->fault);
+
+	// Only the mapping goes, the pages stay in the cache
+	for (size_t slot = 0; slot < map->page_count; slot++) {
+		if (map->pages[slot] == nullptr)
+			continue;
+
+		unmap_page(nullptr, (uint8_t *)map->range->ptr + slot * PAGE_SIZE);
+		pcache_put(map->pages[slot]);
+	}
+
+	if (map->plugged)
+		storage_unplug(&map->vnode->mount->device);
+	vfs_put_vnode(map->vnode);
+	vmm_free(map->range->ptr);
+
+	gpa_alloc.free((fatptr_t){ .ptr = map->pages, .len = map->page_count * sizeof(struct pcache_page *) });
+	gpa_alloc.free((fatptr_t){ .ptr = map, .len = sizeof(*map) });
+	return true;
+}
@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+# Build a FAT16 image holding FRAG.BIN, a file split into many short
+# cluster runs, for fat16_chain_bench() and fat16_run_bench(). FILL.BIN
+# takes the clusters in between, so the layout stays put whatever is
+# written to the volume later. The contents are deterministic: word i of
+# FRAG.BIN is i, little endian.
+import array
+import struct
+import sys
+
+SECTOR = 512
+TOTAL_SECTORS = 131072  # 64 MiB
+SECTORS_PER_CLUSTER = 4  # 2 KiB clusters
+RESERVED = 1
+FATS = 2
+ROOT_ENTRIES = 512
+FRAG_BYTES = 10 * 1024 * 1024
+RUN_CLUSTERS = 8  # 16 KiB runs, 640 of them
+
+CLUSTER = SECTOR * SECTORS_PER_CLUSTER
+ROOT_SECTORS = ROOT_ENTRIES * 32 // SECTOR
+
+
+def fat_sectors():
+    spf = 1
+    while True:
+        clusters = (TOTAL_SECTORS - RESERVED - FATS * spf - ROOT_SECTORS) // SECTORS_PER_CLUSTER
+        need = ((clusters + 2) * 2 + SECTOR - 1) // SECTOR
+        if need <= spf:
+            return spf, clusters
+        spf = need
+
+
+def boot_sector(spf):
+    bs = bytearray(SECTOR)
+    bs[0:3] = b"\xEB\x3C\x90"
+    bs[3:11] = b"JANOS   "
+    struct.pack_into("<HBHBHHBHHHII", bs, 11, SECTOR, SECTORS_PER_CLUSTER, RESERVED, FATS, ROOT_ENTRIES, 0, 0xF8, spf,
+                     32, 64, 0, TOTAL_SECTORS)
+    struct.pack_into("<BBBI11s8s", bs, 36, 0x80, 0, 0x29, 0x4A414E4F, b"FRAGFAT16  ", b"FAT16   ")
+    bs[510:512] = b"\x55\xAA"
+    return bs
+
+
+def dir_entry(name, cluster, size):
+    return struct.pack("<11sBBBHHHHHHHI", name, 0x20, 0, 0, 0, 0x21, 0x21, 0, 0, 0x21, cluster, size)
+
+
+def chain(fat, clusters):
+    for a, b in zip(clusters, clusters[1:]):
+        fat[a] = b
+    fat[clusters[-1]] = 0xFFFF
+
+
+def main(path):
+    spf, data_clusters = fat_sectors()
+    if not 4085 <= data_clusters < 65525:
+        sys.exit("not a FAT16 geometry: %u clusters" % data_clusters)
+
+    frag_clusters = FRAG_BYTES // CLUSTER
+    runs = frag_clusters // RUN_CLUSTERS
+    frag, fill = [], []
+    cluster = 2
+    for run in range(runs):
+        frag += range(cluster, cluster + RUN_CLUSTERS)
+        cluster += RUN_CLUSTERS
+        if run != runs - 1:
+            fill += range(cluster, cluster + RUN_CLUSTERS)
+            cluster += RUN_CLUSTERS
+
+    fat = array.array("H", [0] * (spf * SECTOR // 2))
+    fat[0], fat[1] = 0xFFF8, 0xFFFF
+    chain(fat, frag)
+    chain(fat, fill)
+
+    root = bytearray(ROOT_SECTORS * SECTOR)
+    root[0:32] = struct.pack("<11sB20x", b"FRAGFAT16  ", 0x08)
+    root[32:64] = dir_entry(b"FRAG    BIN", frag[0], FRAG_BYTES)
+    root[64:96] = dir_entry(b"FILL    BIN", fill[0], len(fill) * CLUSTER)
+
+    data_lba = RESERVED + FATS * spf + ROOT_SECTORS
+    frag_data = array.array("I", range(FRAG_BYTES // 4))
+    if sys.byteorder != "little":
+        frag_data.byteswap()
+    frag_data = frag_data.tobytes()
+
+    with open(path, "wb") as out:
+        out.truncate(TOTAL_SECTORS * SECTOR)
+        out.write(boot_sector(spf))
+        for i in range(FATS):
+            out.seek((RESERVED + i * spf) * SECTOR)
+            out.write(fat.tobytes())
+        out.seek((RESERVED + FATS * spf) * SECTOR)
+        out.write(root)
+        for i, c in enumerate(frag):
+            out.seek((data_lba + (c - 2) * SECTORS_PER_CLUSTER) * SECTOR)
+            out.write(frag_data[i * CLUSTER:(i + 1) * CLUSTER])
+        # FILL.BIN reads back as zeros, the sparse file already holds them
+
+    print("%s: %u clusters, FRAG.BIN in %u runs" % (path, data_clusters, runs))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 2:
+        sys.exit("usage: mkfragfat16.py IMAGE")
+    main(sys.argv[1])